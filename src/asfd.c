@@ -1,3 +1,5 @@
+#include <math.h>
+
 #include "include.h"
 #include "cmd.h"
 
@@ -6,6 +8,8 @@
 #include <ws2tcpip.h>
 #else
 #include <netinet/ip.h>
+#include <sys/uio.h>
+#include <poll.h>
 #endif
 
 #ifdef HAVE_NCURSES_H
@@ -14,97 +18,247 @@
 
 #include "burp2/blist.h"
 
+// Whether file data can be handed to the kernel to send, once it is doing
+// the TLS encryption for the connection.
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) \
+  && !defined(HAVE_WIN32)
+#define ASFD_ZERO_COPY
+#endif
+
 static size_t bufmaxsize=(ASYNC_BUF_LEN*2)+32;
 
+#define FRAME_HDR_LEN		5
+#define EXT_FRAME_HDR_LEN	10
+#define ZFRAME_HDR_LEN		18
+
+// Data frames shorter than this are not worth compressing.
+#define ZFRAME_MIN		512
+// How many data frames to send before deciding whether to change the
+// compression level.
+#define ZFRAME_WINDOW		32
+// How many bytes of a frame to sample when guessing whether it will
+// compress, and the number of bits of entropy per byte above which it is
+// sent as it is.
+#define ZFRAME_PROBE		4096
+#define ZFRAME_ENTROPY_MAX	7.5
+
 static void truncate_readbuf(struct asfd *asfd)
 {
 	asfd->readbuf[0]='\0';
 	asfd->readbuflen=0;
+	asfd->readbufstart=0;
+}
+
+// Unparsed data runs from readbuf+readbufstart to readbuf+readbuflen.
+static char *readbuf_data(struct asfd *asfd)
+{
+	return asfd->readbuf+asfd->readbufstart;
 }
 
-static int asfd_alloc_buf(char **buf)
+static size_t readbuf_avail(struct asfd *asfd)
 {
-	if(!*buf && !(*buf=(char *)calloc_w(1, bufmaxsize, __func__)))
+	return asfd->readbuflen-asfd->readbufstart;
+}
+
+// Move the unparsed data back to the start of readbuf, so that there is
+// room to read more after it. Only done when the space at the end runs
+// low, rather than after every frame.
+static void compact_readbuf(struct asfd *asfd)
+{
+	size_t avail;
+	if(!asfd->readbufstart
+	  || asfd->bufmaxsize-asfd->readbuflen>=asfd->bufmaxsize/2)
+		return;
+	avail=readbuf_avail(asfd);
+	memmove(asfd->readbuf, readbuf_data(asfd), avail);
+	asfd->readbufstart=0;
+	asfd->readbuflen=avail;
+}
+
+static int asfd_alloc_buf(struct asfd *asfd, char **buf)
+{
+	// Leave room for a terminating '\0' after a full buffer.
+	if(!*buf && !(*buf=(char *)calloc_w(1, asfd->bufmaxsize+1, __func__)))
 		return -1;
 	return 0;
 }
 
+static void readbuf_consume(struct asfd *asfd, size_t len)
+{
+	asfd->readbufstart+=len;
+	// If everything has been used up, start again at the beginning.
+	if(asfd->readbufstart==asfd->readbuflen)
+		asfd->readbufstart=asfd->readbuflen=0;
+}
+
 static int extract_buf(struct asfd *asfd,
 	unsigned int len, unsigned int offset)
 {
 	if(!(asfd->rbuf->buf=(char *)malloc_w(len+1, __func__)))
 		return -1;
-	if(!(memcpy(asfd->rbuf->buf, asfd->readbuf+offset, len)))
+	memcpy(asfd->rbuf->buf, readbuf_data(asfd)+offset, len);
+	asfd->rbuf->buf[len]='\0';
+	asfd->rbuf->len=len;
+	readbuf_consume(asfd, len+offset);
+	return 0;
+}
+
+// Like extract_buf(), but the frame data is compressed, and olen long once
+// it has been inflated.
+static int extract_zbuf(struct asfd *asfd,
+	unsigned int len, unsigned int offset, unsigned int olen)
+{
+	z_stream *zs;
+	if(olen>asfd->bufmaxsize)
 	{
-		logp("%s: memcpy failed in %s\n", asfd->desc, __func__);
+		logp("%s: compressed frame of %u bytes is too big in %s\n",
+			asfd->desc, olen, __func__);
 		return -1;
 	}
-	asfd->rbuf->buf[len]='\0';
-	if(!(memmove(asfd->readbuf,
-		asfd->readbuf+len+offset, asfd->readbuflen-len-offset)))
+	if(!(zs=asfd->zinf))
 	{
-		logp("%s: memmove failed in %s\n", asfd->desc, __func__);
+		if(!(zs=(z_stream *)calloc_w(1, sizeof(z_stream), __func__)))
+			return -1;
+		if(inflateInit2(zs, -15)!=Z_OK)
+		{
+			logp("%s: inflateInit2 failed in %s\n",
+				asfd->desc, __func__);
+			free_v((void **)&zs);
+			return -1;
+		}
+		asfd->zinf=zs;
+	}
+	else
+		inflateReset(zs);
+	if(!(asfd->rbuf->buf=(char *)malloc_w(olen+1, __func__)))
+		return -1;
+	zs->next_in=(Bytef *)readbuf_data(asfd)+offset;
+	zs->avail_in=len;
+	zs->next_out=(Bytef *)asfd->rbuf->buf;
+	zs->avail_out=olen;
+	if(inflate(zs, Z_FINISH)!=Z_STREAM_END || zs->total_out!=olen)
+	{
+		logp("%s: could not decompress frame in %s\n",
+			asfd->desc, __func__);
+		free_w(&asfd->rbuf->buf);
 		return -1;
 	}
-	asfd->readbuflen-=len+offset;
-	asfd->rbuf->len=len;
+	asfd->rbuf->buf[olen]='\0';
+	asfd->rbuf->len=olen;
+	readbuf_consume(asfd, len+offset);
 	return 0;
 }
 
 #ifdef HAVE_NCURSES_H
 static int parse_readbuf_ncurses(struct asfd *asfd)
 {
-	if(!asfd->readbuflen) return 0;
+	if(!readbuf_avail(asfd)) return 0;
 	// This is reading ints, and will be cast back to an int when it comes
 	// to be processed later.
-	if(extract_buf(asfd, asfd->readbuflen, 0)) return -1;
+	if(extract_buf(asfd, readbuf_avail(asfd), 0)) return -1;
 	return 0;
 }
 #endif
 
 static int parse_readbuf_line_buf(struct asfd *asfd)
 {
-	static char *cp=NULL;
-	static char *dp=NULL;
-	static size_t len=0;
-	if(!cp)
-	{
-		// Only start from the beginning if we previously got something
-		// to extract.
-		cp=asfd->readbuf;
-		len=0;
-	}
-	for(; len<asfd->readbuflen; cp++, len++)
-	{
-		if(*cp!='\n') continue;
-		len++;
-		if(extract_buf(asfd, len, 0)) return -1;
-		// Strip trailing white space, like '\r\n'.
-		dp=asfd->rbuf->buf;
-		for(cp=&(dp[len-1]); cp>=dp && isspace(*cp); cp--, len--)
-			*cp='\0';
-		asfd->rbuf->len=len;
-		break;
+	char *cp;
+	char *dp;
+	size_t len;
+	if(!(cp=(char *)memchr(readbuf_data(asfd), '\n', readbuf_avail(asfd))))
+		return 0;
+	len=cp-readbuf_data(asfd)+1;
+	if(extract_buf(asfd, len, 0)) return -1;
+	// Strip trailing white space, like '\r\n'.
+	dp=asfd->rbuf->buf;
+	for(cp=&(dp[len-1]); cp>=dp && isspace(*cp); cp--, len--)
+		*cp='\0';
+	asfd->rbuf->len=len;
+	return 0;
+}
+
+static int hexval(char c)
+{
+	if(c>='0' && c<='9') return c-'0';
+	if(c>='A' && c<='F') return c-'A'+10;
+	if(c>='a' && c<='f') return c-'a'+10;
+	return -1;
+}
+
+static int parse_hex(const char *buf, int digits, unsigned int *len)
+{
+	int i;
+	int v;
+	*len=0;
+	for(i=0; i<digits; i++)
+	{
+		if((v=hexval(buf[i]))<0) return -1;
+		*len=(*len<<4)|v;
 	}
-	cp=NULL;
 	return 0;
 }
 
+// Frame headers are a command character followed by four hex digits giving
+// the length of the data.
+// Extended frame headers are CMD_EXT_FRAME, then the command character, then
+// eight hex digits of length.
+// Compressed frame headers are CMD_ZFRAME, then the command character, then
+// eight hex digits of compressed length, then eight of the length once it
+// is decompressed, which is returned in olen.
+static int parse_header(const char *buf, size_t avail,
+	enum cmd *cmd, unsigned int *len, size_t *hlen, unsigned int *olen)
+{
+	*olen=0;
+	if(*buf==CMD_ZFRAME)
+	{
+		*hlen=ZFRAME_HDR_LEN;
+		if(avail<*hlen) return 0;
+		*cmd=(enum cmd)buf[1];
+		return parse_hex(buf+2, 8, len)
+		  || parse_hex(buf+10, 8, olen)?-1:1;
+	}
+	if(*buf==CMD_EXT_FRAME)
+	{
+		*hlen=EXT_FRAME_HDR_LEN;
+		if(avail<*hlen) return 0;
+		*cmd=(enum cmd)buf[1];
+		return parse_hex(buf+2, 8, len)?-1:1;
+	}
+	*hlen=FRAME_HDR_LEN;
+	if(avail<*hlen) return 0;
+	*cmd=(enum cmd)buf[0];
+	return parse_hex(buf+1, 4, len)?-1:1;
+}
+
 static int parse_readbuf_standard(struct asfd *asfd)
 {
 	enum cmd cmdtmp=CMD_ERROR;
 	unsigned int s=0;
-	if(asfd->readbuflen<5) return 0;
-	if((sscanf(asfd->readbuf, "%c%04X", (char *)&cmdtmp, &s))!=2)
+	unsigned int olen=0;
+	size_t hlen=0;
+	switch(parse_header(readbuf_data(asfd), readbuf_avail(asfd),
+		&cmdtmp, &s, &hlen, &olen))
 	{
-		logp("%s: sscanf of '%s' failed in %s\n",
-			asfd->desc, asfd->readbuf, __func__);
+		case 0:
+			return 0;
+		case -1:
+			logp("%s: could not parse header '%.*s' in %s\n",
+				asfd->desc, (int)hlen,
+				readbuf_data(asfd), __func__);
+			return -1;
+	}
+	if(s+hlen>asfd->bufmaxsize)
+	{
+		logp("%s: frame of %u bytes is too big in %s\n",
+			asfd->desc, s, __func__);
 		return -1;
 	}
-	if(asfd->readbuflen>=s+5)
+	if(readbuf_avail(asfd)>=s+hlen)
 	{
 		asfd->rbuf->cmd=cmdtmp;
-		if(extract_buf(asfd, s, 5))
+		if(olen)
+			return extract_zbuf(asfd, s, hlen, olen);
+		if(extract_buf(asfd, s, hlen))
 			return -1;
 	}
 	return 0;
@@ -128,6 +282,7 @@ static int asfd_do_read_ncurses(struct asfd *asfd)
 {
 	static int i;
 	i=getch();
+	asfd->readbufstart=0;
 	asfd->readbuflen=sizeof(int);
 	memcpy(asfd->readbuf, &i, asfd->readbuflen);
 	return 0;
@@ -143,8 +298,9 @@ static int asfd_do_write_ncurses(struct asfd *asfd)
 static int asfd_do_read(struct asfd *asfd)
 {
 	ssize_t r;
+	compact_readbuf(asfd);
 	r=read(asfd->fd,
-		asfd->readbuf+asfd->readbuflen, bufmaxsize-asfd->readbuflen);
+		asfd->readbuf+asfd->readbuflen, asfd->bufmaxsize-asfd->readbuflen);
 	if(r<0)
 	{
 		if(errno==EAGAIN || errno==EINTR)
@@ -174,9 +330,10 @@ static int asfd_do_read_ssl(struct asfd *asfd)
 
 	asfd->read_blocked_on_write=0;
 
+	compact_readbuf(asfd);
 	ERR_clear_error();
 	r=SSL_read(asfd->ssl,
-		asfd->readbuf+asfd->readbuflen, bufmaxsize-asfd->readbuflen);
+		asfd->readbuf+asfd->readbuflen, asfd->bufmaxsize-asfd->readbuflen);
 
 	switch((e=SSL_get_error(asfd->ssl, r)))
 	{
@@ -213,48 +370,178 @@ error:
 	return -1;
 }
 
-// Return 0 for OK to write, non-zero for not OK to write.
-static int check_ratelimit(struct asfd *asfd)
+// Returns 0 if the rate limits allow writing now, otherwise how many
+// microseconds until they will. The async loop uses this to hold back the
+// write without holding up anything else.
+long asfd_write_wait(struct asfd *asfd)
 {
-	float f;
-	time_t diff;
-	if(!asfd->rlstart) asfd->rlstart=time(NULL);
-	if((diff=asfd->as->now-asfd->rlstart)<0)
+	long w=0;
+	long g=0;
+	if(asfd->tb) w=tbucket_wait(asfd->tb);
+	if(asfd->gtb) g=tbucket_wait(asfd->gtb);
+	return w>g?w:g;
+}
+
+// How many bytes the rate limits allow to be written now.
+static int64_t write_allowance(struct asfd *asfd)
+{
+	int64_t a=INT64_MAX;
+	int64_t t;
+	if(asfd->tb && (t=tbucket_tokens(asfd->tb))<a) a=t;
+	if(asfd->gtb && (t=tbucket_tokens(asfd->gtb))<a) a=t;
+	return a;
+}
+
+int asfd_set_ratelimit(struct asfd *asfd, float ratelimit)
+{
+	if(!ratelimit)
+	{
+		tbucket_free(&asfd->tb);
+		return 0;
+	}
+	if(asfd->tb)
 	{
-		// It is possible that the clock changed. Reset ourselves.
-		asfd->as->now=asfd->rlstart;
-		asfd->rlbytes=0;
-		logp("Looks like the clock went back in time since starting. "
-			"Resetting ratelimit\n");
+		tbucket_set_rate(asfd->tb, ratelimit);
 		return 0;
 	}
-	if(!diff) return 0; // Need to get started somehow.
-	f=(asfd->rlbytes)/diff; // Bytes per second.
+	if(!(asfd->tb=tbucket_alloc(ratelimit)))
+		return -1;
+	return 0;
+}
+
+// The write queue is a chain of chunks. Each chunk holds up to one TLS
+// record worth of data, so that an SSL_write() of a full chunk goes out as
+// one full record, and plain sockets can hand the whole chain to writev().
+#define WCHUNK_LEN	16384
+// How many emptied chunks to keep around for reuse.
+#define WCHUNK_SPARE	4
+// How many chunks to give to writev() in one go.
+#define WCHUNK_IOV	64
 
-	if(f>=asfd->ratelimit)
+struct wchunk
+{
+	struct wchunk *next;
+	size_t start;
+	size_t len;
+	char buf[WCHUNK_LEN];
+};
+
+static struct wchunk *wchunk_get(struct asfd *asfd)
+{
+	struct wchunk *c;
+	if((c=asfd->wspare))
 	{
-#ifdef HAVE_WIN32
-		// Windows Sleep is milliseconds, usleep is microseconds.
-		// Do some conversion.
-		Sleep(asfd->rlsleeptime/1000);
-#else
-		usleep(asfd->rlsleeptime);
-#endif
-		// If sleeping, increase the sleep time.
-		if((asfd->rlsleeptime*=2)>=500000) asfd->rlsleeptime=500000;
-		return 1;
+		asfd->wspare=c->next;
+		asfd->wsparecnt--;
+	}
+	else if(!(c=(struct wchunk *)malloc_w(sizeof(struct wchunk),
+		__func__)))
+			return NULL;
+	c->next=NULL;
+	c->start=0;
+	c->len=0;
+	return c;
+}
+
+static void wchunk_put(struct asfd *asfd, struct wchunk *c)
+{
+	if(asfd->wsparecnt>=WCHUNK_SPARE)
+	{
+		free_v((void **)&c);
+		return;
+	}
+	c->next=asfd->wspare;
+	asfd->wspare=c;
+	asfd->wsparecnt++;
+}
+
+static void wchunk_free_list(struct wchunk **list)
+{
+	struct wchunk *c;
+	while((c=*list))
+	{
+		*list=c->next;
+		free_v((void **)&c);
+	}
+}
+
+// Drop w bytes from the front of the write queue, after they have been
+// written.
+static void write_queue_consume(struct asfd *asfd, size_t w)
+{
+	struct wchunk *c;
+	asfd->writebuflen-=w;
+	asfd->write_calls++;
+	asfd->write_bytes+=w;
+	if(asfd->tb) tbucket_take(asfd->tb, w);
+	if(asfd->gtb) tbucket_take(asfd->gtb, w);
+	while(w && (c=asfd->whead))
+	{
+		size_t n=c->len-c->start;
+		if(w<n)
+		{
+			c->start+=w;
+			break;
+		}
+		w-=n;
+		if(!(asfd->whead=c->next)) asfd->wtail=NULL;
+		wchunk_put(asfd, c);
 	}
-	// If not sleeping, decrease the sleep time.
-	if((asfd->rlsleeptime/=2)<=9999) asfd->rlsleeptime=10000;
+	if(asfd->write_full && asfd->writebuflen<=asfd->write_low)
+		asfd->write_full=0;
+}
+
+static int append_to_write_buffer(struct asfd *asfd,
+	const char *buf, size_t len)
+{
+	size_t n;
+	struct wchunk *c;
+	while(len)
+	{
+		if(!(c=asfd->wtail) || c->len==WCHUNK_LEN)
+		{
+			if(!(c=wchunk_get(asfd))) return -1;
+			if(asfd->wtail) asfd->wtail->next=c;
+			else asfd->whead=c;
+			asfd->wtail=c;
+		}
+		if((n=WCHUNK_LEN-c->len)>len) n=len;
+		memcpy(c->buf+c->len, buf, n);
+		c->len+=n;
+		asfd->writebuflen+=n;
+		buf+=n;
+		len-=n;
+	}
+	if(asfd->writebuflen>asfd->writebuf_peak)
+		asfd->writebuf_peak=asfd->writebuflen;
 	return 0;
 }
 
 static int asfd_do_write(struct asfd *asfd)
 {
 	ssize_t w;
-	if(asfd->ratelimit && check_ratelimit(asfd)) return 0;
 
-	w=write(asfd->fd, asfd->writebuf, asfd->writebuflen);
+#ifdef HAVE_WIN32
+	w=write(asfd->fd, asfd->whead->buf+asfd->whead->start,
+		asfd->whead->len-asfd->whead->start);
+#else
+	{
+		int i;
+		struct wchunk *c;
+		struct iovec iov[WCHUNK_IOV];
+		// When rate limited, stop after the chunk that uses up what
+		// is allowed.
+		int64_t allow=write_allowance(asfd);
+		for(i=0, c=asfd->whead; c && i<WCHUNK_IOV; c=c->next, i++)
+		{
+			if(i && allow<=0) break;
+			iov[i].iov_base=c->buf+c->start;
+			iov[i].iov_len=c->len-c->start;
+			allow-=iov[i].iov_len;
+		}
+		w=writev(asfd->fd, iov, i);
+	}
+#endif
 	if(w<0)
 	{
 		if(errno==EAGAIN || errno==EINTR)
@@ -268,17 +555,7 @@ static int asfd_do_write(struct asfd *asfd)
 		logp("%s: Wrote nothing in %s\n", asfd->desc, __func__);
 		return -1;
 	}
-	if(asfd->ratelimit) asfd->rlbytes+=w;
-/*
-{
-char buf[100000]="";
-snprintf(buf, w+1, "%s", asfd->writebuf);
-printf("wrote %d: %s\n", w, buf);
-}
-*/
-
-	memmove(asfd->writebuf, asfd->writebuf+w, asfd->writebuflen-w);
-	asfd->writebuflen-=w;
+	write_queue_consume(asfd, w);
 	return 0;
 }
 
@@ -286,27 +563,19 @@ static int asfd_do_write_ssl(struct asfd *asfd)
 {
 	int e;
 	ssize_t w;
+	struct wchunk *c=asfd->whead;
 
 	asfd->write_blocked_on_read=0;
 
-	if(asfd->ratelimit && check_ratelimit(asfd)) return 0;
 	ERR_clear_error();
-	w=SSL_write(asfd->ssl, asfd->writebuf, asfd->writebuflen);
+	// If SSL_write() has to be retried, it is retried with the same
+	// chunk, which can only have grown in the meantime.
+	w=SSL_write(asfd->ssl, c->buf+c->start, c->len-c->start);
 
 	switch((e=SSL_get_error(asfd->ssl, w)))
 	{
 		case SSL_ERROR_NONE:
-/*
-{
-char buf[100000]="";
-snprintf(buf, w+1, "%s", asfd->writebuf);
-printf("wrote %d: %s\n", w, buf);
-}
-*/
-			if(asfd->ratelimit) asfd->rlbytes+=w;
-			memmove(asfd->writebuf,
-				asfd->writebuf+w, asfd->writebuflen-w);
-			asfd->writebuflen-=w;
+			write_queue_consume(asfd, w);
 			break;
 		case SSL_ERROR_WANT_WRITE:
 			break;
@@ -329,15 +598,208 @@ printf("wrote %d: %s\n", w, buf);
 	return 0;
 }
 
-static int append_to_write_buffer(struct asfd *asfd,
-	const char *buf, size_t len)
+// Once the write queue reaches the high watermark, appends are blocked until
+// it has drained down to the low watermark.
+static int write_queue_full(struct asfd *asfd)
+{
+	if(!asfd->write_full && asfd->writebuflen>=asfd->write_high)
+		asfd->write_full=1;
+	return asfd->write_full;
+}
+
+// The other end has to fit a whole frame in its readbuf.
+static int frame_too_big(struct asfd *asfd, size_t len, const char *func)
 {
-	memcpy(asfd->writebuf+asfd->writebuflen, buf, len);
-	asfd->writebuflen+=len;
-	asfd->writebuf[asfd->writebuflen]='\0';
+	size_t hlen=FRAME_HDR_LEN;
+	if(len>0xFFFF) hlen=EXT_FRAME_HDR_LEN;
+	if(len+hlen>asfd->bufmaxsize
+	  || (hlen==EXT_FRAME_HDR_LEN && !asfd->ext_frames))
+	{
+		logp("%s: frame of %lu bytes is too big in %s\n",
+			asfd->desc, (unsigned long)len, func);
+		return 1;
+	}
 	return 0;
 }
 
+static enum append_ret append_frame_header(struct asfd *asfd,
+	enum cmd cmd, size_t len)
+{
+	char sbuf[16]="";
+	size_t hlen=FRAME_HDR_LEN;
+	if(len>0xFFFF) hlen=EXT_FRAME_HDR_LEN;
+	if(frame_too_big(asfd, len, __func__))
+		return APPEND_ERROR;
+	if(write_queue_full(asfd))
+		return APPEND_BLOCKED;
+
+	if(hlen==EXT_FRAME_HDR_LEN)
+		snprintf(sbuf, sizeof(sbuf), "%c%c%08X",
+			CMD_EXT_FRAME, cmd, (unsigned int)len);
+	else
+		snprintf(sbuf, sizeof(sbuf), "%c%04X",
+			cmd, (unsigned int)len);
+	if(append_to_write_buffer(asfd, sbuf, hlen))
+		return APPEND_ERROR;
+	return APPEND_OK;
+}
+
+static int zframe_cmd(enum cmd cmd)
+{
+	return cmd==CMD_APPEND || cmd==CMD_DATA;
+}
+
+// Guess from the entropy of a sample of the bytes whether deflate is going
+// to get anywhere with them. Data that is already compressed or encrypted
+// is close to 8 bits per byte.
+static int zframe_probe(const char *buf, size_t len)
+{
+	size_t i;
+	size_t n=0;
+	size_t step=1;
+	double e=0;
+	unsigned int count[256];
+
+	memset(count, 0, sizeof(count));
+	if(len>ZFRAME_PROBE) step=len/ZFRAME_PROBE;
+	for(i=0; i<len; i+=step, n++)
+		count[(uint8_t)buf[i]]++;
+	for(i=0; i<256; i++)
+	{
+		double p;
+		if(!count[i]) continue;
+		p=(double)count[i]/n;
+		e-=p*log2(p);
+	}
+	return e<=ZFRAME_ENTROPY_MAX;
+}
+
+// Every ZFRAME_WINDOW data frames, move the level up if the connection has
+// mostly been full, because then compressing harder costs nothing, or down
+// if everything queued has mostly been sent by the time the next frame is
+// ready, because then the compression may be what is holding it up.
+static void zframe_adapt(struct asfd *asfd)
+{
+	if(++asfd->zwin_frames<ZFRAME_WINDOW) return;
+	if(asfd->zwin_blocked*2>asfd->zwin_frames)
+	{
+		if(asfd->zlevel<asfd->zlevel_max) asfd->zlevel++;
+	}
+	else if(asfd->zwin_starved*2>asfd->zwin_frames)
+	{
+		if(asfd->zlevel>0) asfd->zlevel--;
+	}
+	asfd->zwin_frames=0;
+	asfd->zwin_blocked=0;
+	asfd->zwin_starved=0;
+}
+
+// Returns the compressed length, or 0 if it is not worth sending it
+// compressed.
+static size_t zframe_deflate(struct asfd *asfd, const char *buf, size_t len)
+{
+	size_t bound;
+	struct timeval start;
+	struct timeval end;
+	z_stream *zs=asfd->zdef;
+
+	if(!zs)
+	{
+		if(!(zs=(z_stream *)calloc_w(1, sizeof(z_stream), __func__)))
+			return 0;
+		if(deflateInit2(zs, asfd->zlevel, Z_DEFLATED, -15,
+			8, Z_DEFAULT_STRATEGY)!=Z_OK)
+		{
+			free_v((void **)&zs);
+			return 0;
+		}
+		asfd->zdef=zs;
+		asfd->zdef_level=asfd->zlevel;
+	}
+	else
+	{
+		deflateReset(zs);
+		if(asfd->zdef_level!=asfd->zlevel)
+		{
+			deflateParams(zs, asfd->zlevel, Z_DEFAULT_STRATEGY);
+			asfd->zdef_level=asfd->zlevel;
+		}
+	}
+	bound=deflateBound(zs, len);
+	if(asfd->zbuflen<bound)
+	{
+		char *tmp;
+		if(!(tmp=(char *)realloc_w(asfd->zbuf, bound, __func__)))
+			return 0;
+		asfd->zbuf=tmp;
+		asfd->zbuflen=bound;
+	}
+
+	gettimeofday(&start, NULL);
+	zs->next_in=(Bytef *)buf;
+	zs->avail_in=len;
+	zs->next_out=(Bytef *)asfd->zbuf;
+	zs->avail_out=asfd->zbuflen;
+	if(deflate(zs, Z_FINISH)!=Z_STREAM_END)
+		return 0;
+	gettimeofday(&end, NULL);
+	asfd->zusec+=(end.tv_sec-start.tv_sec)*1000000ULL
+		+end.tv_usec-start.tv_usec;
+	asfd->zin_bytes+=len;
+	asfd->zout_bytes+=zs->total_out;
+
+	if(zs->total_out+ZFRAME_HDR_LEN>=len) return 0;
+	return zs->total_out;
+}
+
+// Data frames on a connection that has negotiated compression.
+static enum append_ret append_data_frame(struct asfd *asfd,
+	struct iobuf *wbuf)
+{
+	char sbuf[32]="";
+	size_t zlen=0;
+
+	if(frame_too_big(asfd, wbuf->len, __func__))
+		return APPEND_ERROR;
+	if(write_queue_full(asfd))
+	{
+		asfd->zframe_waited=1;
+		return APPEND_BLOCKED;
+	}
+	if(asfd->zframe_waited)
+		asfd->zwin_blocked++;
+	else if(!asfd->writebuflen)
+		asfd->zwin_starved++;
+	asfd->zframe_waited=0;
+	zframe_adapt(asfd);
+
+	asfd->zraw_bytes+=wbuf->len;
+	if(asfd->zlevel)
+	{
+		if(!zframe_probe(wbuf->buf, wbuf->len))
+			asfd->zskipped++;
+		else
+			zlen=zframe_deflate(asfd, wbuf->buf, wbuf->len);
+	}
+	if(!zlen)
+	{
+		if(append_frame_header(asfd, wbuf->cmd, wbuf->len)!=APPEND_OK
+		  || append_to_write_buffer(asfd, wbuf->buf, wbuf->len))
+			return APPEND_ERROR;
+	}
+	else
+	{
+		snprintf(sbuf, sizeof(sbuf), "%c%c%08X%08X",
+			CMD_ZFRAME, wbuf->cmd,
+			(unsigned int)zlen, (unsigned int)wbuf->len);
+		if(append_to_write_buffer(asfd, sbuf, ZFRAME_HDR_LEN)
+		  || append_to_write_buffer(asfd, asfd->zbuf, zlen))
+			return APPEND_ERROR;
+	}
+	wbuf->len=0;
+	return APPEND_OK;
+}
+
 static enum append_ret asfd_append_all_to_write_buffer(struct asfd *asfd,
 	struct iobuf *wbuf)
 {
@@ -345,19 +807,18 @@ static enum append_ret asfd_append_all_to_write_buffer(struct asfd *asfd,
 	{
 		case ASFD_STREAM_STANDARD:
 		{
-			size_t sblen=0;
-			char sbuf[10]="";
-			if(asfd->writebuflen+6+(wbuf->len) >= bufmaxsize-1)
-				return APPEND_BLOCKED;
-
-			snprintf(sbuf, sizeof(sbuf), "%c%04X",
-				wbuf->cmd, (unsigned int)wbuf->len);
-			sblen=strlen(sbuf);
-			append_to_write_buffer(asfd, sbuf, sblen);
+			enum append_ret ar;
+			if(asfd->zframes
+			  && wbuf->len>=ZFRAME_MIN
+			  && zframe_cmd(wbuf->cmd))
+				return append_data_frame(asfd, wbuf);
+			if((ar=append_frame_header(asfd,
+				wbuf->cmd, wbuf->len))!=APPEND_OK)
+					return ar;
 			break;
 		}
 		case ASFD_STREAM_LINEBUF:
-			if(asfd->writebuflen+wbuf->len >= bufmaxsize-1)
+			if(write_queue_full(asfd))
 				return APPEND_BLOCKED;
 			break;
 		case ASFD_STREAM_NCURSES_STDIN:
@@ -366,7 +827,8 @@ static enum append_ret asfd_append_all_to_write_buffer(struct asfd *asfd,
 				asfd->desc, __func__, asfd->streamtype);
 			return APPEND_ERROR;
 	}
-	append_to_write_buffer(asfd, wbuf->buf, wbuf->len);
+	if(append_to_write_buffer(asfd, wbuf->buf, wbuf->len))
+		return APPEND_ERROR;
 //printf("append %d: %c:%s\n", wbuf->len, wbuf->cmd, wbuf->buf);
 	wbuf->len=0;
 	return APPEND_OK;
@@ -446,6 +908,109 @@ static int asfd_write_str(struct asfd *asfd, enum cmd wcmd, const char *wsrc)
 	return asfd_write_strn(asfd, wcmd, wsrc, strlen(wsrc));
 }
 
+#ifdef ASFD_ZERO_COPY
+// Whether asfd_write_file() can have the kernel send file data for this
+// connection.
+static int zero_copy_ok(struct asfd *asfd)
+{
+	// Rate limited connections go through the write queue, which
+	// paces them.
+	return asfd->zero_copy
+	  && !asfd->tb
+	  && !asfd->gtb
+	  && !asfd->as->doing_estimate;
+}
+
+static int wait_for_write(struct asfd *asfd)
+{
+	int s;
+	struct pollfd pfd;
+
+	pfd.fd=asfd->fd;
+	pfd.events=POLLOUT;
+	while(1)
+	{
+		pfd.revents=0;
+		if((s=poll(&pfd, 1, asfd->max_network_timeout>0?
+			asfd->max_network_timeout*1000:-1))>0)
+				return 0;
+		if(s<0 && errno==EINTR) continue;
+		if(!s)
+			logp("%s: no activity for %d seconds.\n",
+				asfd->desc, asfd->max_network_timeout);
+		else
+			logp("%s: poll error in %s: %s\n",
+				asfd->desc, __func__, strerror(errno));
+		return -1;
+	}
+}
+
+// Send the data with sendfile(), so that the kernel copies it straight from
+// the page cache into TLS records. The frame header and anything queued
+// before it go first, through the normal route.
+static int write_file_zero_copy(struct asfd *asfd, enum cmd cmd,
+	const char *buf, size_t len, int fd, off_t offset)
+{
+	size_t done=0;
+	enum append_ret ar;
+
+	while((ar=append_frame_header(asfd, cmd, len))!=APPEND_OK)
+		if(ar==APPEND_ERROR || asfd->as->write(asfd->as))
+			return -1;
+	while(asfd->writebuflen)
+		if(asfd->as->write(asfd->as)) return -1;
+
+	while(done<len)
+	{
+		int e;
+		ossl_ssize_t w;
+		ERR_clear_error();
+		if((w=SSL_sendfile(asfd->ssl, fd,
+			offset+done, len-done, 0))>0)
+		{
+			done+=w;
+			asfd->write_calls++;
+			asfd->write_bytes+=w;
+			asfd->zero_copy_bytes+=w;
+			continue;
+		}
+		e=SSL_get_error(asfd->ssl, w);
+		if(e==SSL_ERROR_WANT_WRITE
+		  || (e==SSL_ERROR_SYSCALL
+			&& (errno==EAGAIN || errno==EINTR)))
+		{
+			if(wait_for_write(asfd)) return -1;
+			continue;
+		}
+		// The rest of the frame can still go the normal way.
+		logp_ssl_err("%s: sendfile failed, not using it any more\n",
+			asfd->desc);
+		asfd->zero_copy=0;
+		if(append_to_write_buffer(asfd, buf+done, len-done))
+			return -1;
+		while(asfd->writebuflen)
+			if(asfd->as->write(asfd->as)) return -1;
+		break;
+	}
+	return 0;
+}
+#endif
+
+// Send a frame of data that was read from fd at offset. When the kernel is
+// doing TLS for the connection, it sends the data from the file itself.
+// Otherwise, or if that fails, buf is sent in the usual way.
+int asfd_write_file(struct asfd *asfd, enum cmd cmd,
+	const char *buf, size_t len, int fd, off_t offset)
+{
+#ifdef ASFD_ZERO_COPY
+	// Compressing it, if it will compress, comes first.
+	if(fd>=0 && len && zero_copy_ok(asfd)
+	  && !(asfd->zlevel && zframe_probe(buf, len)))
+		return write_file_zero_copy(asfd, cmd, buf, len, fd, offset);
+#endif
+	return asfd->write_strn(asfd, cmd, buf, len);
+}
+
 static int asfd_simple_loop(struct asfd *asfd,
 	struct conf *conf, void *param, const char *caller,
   enum asl_ret callback(struct asfd *asfd, struct conf *conf, void *param))
@@ -503,8 +1068,26 @@ static int asfd_init(struct asfd *asfd, const char *desc,
 	asfd->streamtype=streamtype;
 	asfd->max_network_timeout=conf->network_timeout;
 	asfd->network_timeout=asfd->max_network_timeout;
-	asfd->ratelimit=conf->ratelimit;
-	asfd->rlsleeptime=10000;
+	if(asfd_set_ratelimit(asfd, conf->ratelimit))
+		return -1;
+	// Only network connections count towards the server-wide limit.
+	if(asfd->ssl) asfd->gtb=tbucket_global;
+#ifdef ASFD_ZERO_COPY
+	// The data is checksummed from the buffer that was read, but sendfile
+	// reads the file again. Only the server does it, because the files
+	// that it sends are never changed in place. A file on a client can
+	// change in between, and then the checksum would not match.
+	if(asfd->ssl && conf->mode==MODE_SERVER
+	  && BIO_get_ktls_send(SSL_get_wbio(asfd->ssl)))
+		asfd->zero_copy=1;
+#endif
+	asfd->bufmaxsize=bufmaxsize;
+	asfd->frame_len=ASYNC_BUF_LEN;
+	asfd->write_high=conf->network_write_high;
+	asfd->write_low=conf->network_write_low;
+	if(asfd->write_high<bufmaxsize) asfd->write_high=bufmaxsize;
+	if(asfd->write_low>=asfd->write_high)
+		asfd->write_low=asfd->write_high/2;
 	asfd->pid=-1;
 
 	asfd->parse_readbuf=asfd_parse_readbuf;
@@ -554,13 +1137,40 @@ static int asfd_init(struct asfd *asfd, const char *desc,
 	}
 
 	if(!(asfd->rbuf=iobuf_alloc())
-	  || asfd_alloc_buf(&asfd->readbuf)
-	  || asfd_alloc_buf(&asfd->writebuf)
+	  || asfd_alloc_buf(asfd, &asfd->readbuf)
 	  || !(asfd->desc=strdup_w(desc, __func__)))
 		return -1;
 	return 0;
 }
 
+// Allow data frames sent on this connection to be compressed, with the level
+// going up and down between 0 and level. Compressed frames that arrive are
+// always decompressed.
+int asfd_set_zframes(struct asfd *asfd, int level)
+{
+	if(level<0) level=0;
+	if(level>9) level=9;
+	asfd->zframes=1;
+	asfd->zlevel_max=level;
+	// Start fast, and let the connection decide whether it is worth more.
+	asfd->zlevel=level?1:0;
+	return 0;
+}
+
+int asfd_set_ext_frames(struct asfd *asfd)
+{
+	char *tmp;
+	size_t len=(ASFD_EXT_FRAME_LEN*2)+32;
+	if(asfd->ext_frames) return 0;
+	if(!(tmp=(char *)realloc_w(asfd->readbuf, len+1, __func__)))
+		return -1;
+	asfd->readbuf=tmp;
+	asfd->bufmaxsize=len;
+	asfd->frame_len=ASFD_EXT_FRAME_LEN;
+	asfd->ext_frames=1;
+	return 0;
+}
+
 struct asfd *asfd_alloc(void)
 {
 	struct asfd *asfd;
@@ -593,16 +1203,56 @@ void asfd_close(struct asfd *asfd)
 		SSL_free(asfd->ssl);
 		asfd->ssl=NULL;
 	}
+	async_asfd_unwatch(asfd);
 	close_fd(&asfd->fd);
 }
 
+static void asfd_log_write_stats(struct asfd *asfd)
+{
+	// Only bother for network connections.
+	if(!asfd->ssl || !asfd->write_calls) return;
+	logp("%s: wrote %" PRIu64 " bytes in %" PRIu64
+		" calls, %" PRIu64 " per call, queue peak %lu\n",
+		asfd->desc, asfd->write_bytes, asfd->write_calls,
+		asfd->write_bytes/asfd->write_calls,
+		(unsigned long)asfd->writebuf_peak);
+	if(asfd->zero_copy_bytes)
+		logp("%s: %" PRIu64 " of those bytes were sent with sendfile\n",
+			asfd->desc, asfd->zero_copy_bytes);
+	if(asfd->zframes && asfd->zraw_bytes)
+		logp("%s: compressed %" PRIu64 " of %" PRIu64
+			" data bytes to %" PRIu64 " (%.1f%%) in %.2fs,"
+			" %" PRIu64 " frames looked incompressible,"
+			" level ended at %d of %d\n",
+			asfd->desc, asfd->zin_bytes, asfd->zraw_bytes,
+			asfd->zout_bytes,
+			asfd->zin_bytes?
+			  asfd->zout_bytes*100.0/asfd->zin_bytes:0,
+			asfd->zusec/1000000.0, asfd->zskipped,
+			asfd->zlevel, asfd->zlevel_max);
+}
+
 void asfd_free(struct asfd **asfd)
 {
 	if(!asfd || !*asfd) return;
+	asfd_log_write_stats(*asfd);
 	asfd_close(*asfd);
 	iobuf_free(&((*asfd)->rbuf));
 	free_w(&((*asfd)->readbuf));
-	free_w(&((*asfd)->writebuf));
+	wchunk_free_list(&((*asfd)->whead));
+	wchunk_free_list(&((*asfd)->wspare));
+	tbucket_free(&((*asfd)->tb));
+	if((*asfd)->zdef)
+	{
+		deflateEnd((*asfd)->zdef);
+		free_v((void **)&((*asfd)->zdef));
+	}
+	if((*asfd)->zinf)
+	{
+		inflateEnd((*asfd)->zinf);
+		free_v((void **)&((*asfd)->zinf));
+	}
+	free_w(&((*asfd)->zbuf));
 	free_w(&((*asfd)->desc));
 	// FIX THIS: free incoming?
 	blist_free(&((*asfd)->blist));
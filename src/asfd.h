@@ -3,6 +3,10 @@
 
 #include "ssl.h"
 
+struct wchunk;
+
+#define ASFD_EXT_FRAME_LEN	(256*1024)
+
 // Return values for simple_loop().
 enum asl_ret
 {
@@ -26,6 +30,7 @@ enum asfd_fdtype
 	ASFD_FD_SERVER_LISTEN_STATUS,
 	ASFD_FD_SERVER_PIPE_READ,
 	ASFD_FD_SERVER_PIPE_WRITE,
+	ASFD_FD_SERVER_WORKER,
 	ASFD_FD_SERVER_CHILD_MAIN,
 	ASFD_FD_SERVER_TO_CHAMP_CHOOSER,
 	ASFD_FD_CHILD_MAIN,
@@ -55,22 +60,74 @@ struct asfd
 	int network_timeout;
 	int max_network_timeout;
 
-	float ratelimit;
-	time_t rlstart;
-	int rlsleeptime;
-	unsigned long long rlbytes;
+	// Rate limits for this connection, and for all of them together.
+	struct tbucket *tb;
+	struct tbucket *gtb;
 
 	struct iobuf *rbuf;
 
 	int doread;
 	char *readbuf;
+	size_t bufmaxsize;
+	size_t readbufstart; // Where the unparsed data starts.
 	size_t readbuflen;
 	int read_blocked_on_write;
 
+	// Once extended frames have been negotiated, frames can be up to
+	// ASFD_EXT_FRAME_LEN long. Bulk data should be sent in frames of
+	// frame_len.
+	uint8_t ext_frames;
+	size_t frame_len;
+
 	int dowrite;
-	char *writebuf;
+	// Queue of data waiting to be written, writebuflen bytes in total.
+	struct wchunk *whead;
+	struct wchunk *wtail;
+	struct wchunk *wspare;
+	int wsparecnt;
 	size_t writebuflen;
+	size_t write_high;
+	size_t write_low;
+	uint8_t write_full;
 	int write_blocked_on_read;
+	// Write counters.
+	uint64_t write_calls;
+	uint64_t write_bytes;
+	size_t writebuf_peak;
+	// Set when the kernel is doing the TLS encryption, so file data can
+	// be sent with sendfile().
+	uint8_t zero_copy;
+	uint64_t zero_copy_bytes;
+
+	// Compression of data frames, once it has been negotiated. The level
+	// moves between 0 and zlevel_max, depending on whether the connection
+	// or the compression is holding things up.
+	uint8_t zframes;
+	int zlevel;
+	int zlevel_max;
+	int zdef_level;
+	struct z_stream_s *zdef;
+	struct z_stream_s *zinf;
+	char *zbuf;
+	size_t zbuflen;
+	int zwin_frames;
+	int zwin_blocked;
+	int zwin_starved;
+	uint8_t zframe_waited;
+	// Compression counters.
+	uint64_t zraw_bytes;
+	uint64_t zin_bytes;
+	uint64_t zout_bytes;
+	uint64_t zskipped;
+	uint64_t zusec;
+
+	// Set by the async backend for each call.
+	uint8_t can_read;
+	uint8_t can_write;
+	uint8_t had_exception;
+	// What is currently registered with epoll.
+	uint8_t epoll_added;
+	uint32_t epoll_events;
 
 	struct asfd *next;
 
@@ -113,6 +170,12 @@ struct asfd
 extern struct asfd *asfd_alloc(void);
 extern void asfd_close(struct asfd *asfd); // Maybe should be in the struct.
 extern void asfd_free(struct asfd **asfd);
+extern int asfd_set_ext_frames(struct asfd *asfd);
+extern int asfd_set_zframes(struct asfd *asfd, int level);
+extern int asfd_set_ratelimit(struct asfd *asfd, float ratelimit);
+extern long asfd_write_wait(struct asfd *asfd);
+extern int asfd_write_file(struct asfd *asfd, enum cmd cmd,
+	const char *buf, size_t len, int fd, off_t offset);
 
 extern struct asfd *setup_asfd(struct async *as,
 	const char *desc, int *fd, SSL *ssl,
@@ -1,8 +1,162 @@
 #include "include.h"
 
+#ifdef HAVE_LINUX_OS
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+
+// Maximum number of events to collect from one epoll_wait(). Any others
+// will be picked up on the next call, because the fds are level triggered.
+#define ASYNC_EPOLL_EVENTS	256
+
+static void async_epoll_off(struct async *as)
+{
+	struct asfd *asfd;
+	close_fd(&as->epfd);
+	for(asfd=as->asfd; asfd; asfd=asfd->next)
+	{
+		asfd->epoll_added=0;
+		asfd->epoll_events=0;
+	}
+}
+
+static void async_epoll_on(struct async *as)
+{
+	if((as->epfd=epoll_create(ASYNC_EPOLL_EVENTS))<0)
+		return; // Will use select() instead.
+	fcntl(as->epfd, F_SETFD, FD_CLOEXEC);
+	as->epoll_pid=getpid();
+}
+
+// The epoll instance is shared with any child forked since it was created,
+// so only the process that created it may change it. A child gets its own
+// the first time that it uses the async.
+static int async_epoll_ours(struct async *as)
+{
+	return as->epfd>=0 && as->epoll_pid==getpid();
+}
+
+// Stop watching the fd of an asfd. Needs to happen before the fd is closed,
+// otherwise epoll keeps watching it for as long as some other process has
+// a copy of it.
+void async_asfd_unwatch(struct asfd *asfd)
+{
+	struct async *as=asfd->as;
+	if(!asfd->epoll_added) return;
+	if(async_epoll_ours(as))
+		epoll_ctl(as->epfd, EPOLL_CTL_DEL, asfd->fd, NULL);
+	asfd->epoll_added=0;
+	asfd->epoll_events=0;
+}
+
+// Bring the events registered for an asfd in line with what it currently
+// wants to do. An asfd that wants nothing is removed altogether, otherwise
+// a hang up would keep waking us up.
+static int async_epoll_update(struct async *as, struct asfd *asfd)
+{
+	struct epoll_event ev;
+	uint32_t events=0;
+
+	if(asfd->doread) events|=EPOLLIN;
+	if(asfd->dowrite) events|=EPOLLOUT;
+	if(asfd->epoll_added && events==asfd->epoll_events) return 0;
+
+	if(!events)
+	{
+		async_asfd_unwatch(asfd);
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events=events;
+	ev.data.ptr=asfd;
+	if(epoll_ctl(as->epfd, asfd->epoll_added?EPOLL_CTL_MOD:EPOLL_CTL_ADD,
+		asfd->fd, &ev))
+			return -1;
+	asfd->epoll_added=1;
+	asfd->epoll_events=events;
+	return 0;
+}
+
+static int async_wait_epoll(struct async *as, long usec)
+{
+	int i;
+	int n;
+	int timeout;
+	struct asfd *asfd;
+	struct epoll_event evs[ASYNC_EPOLL_EVENTS];
+
+	timeout=(usec+999)/1000;
+	if((n=epoll_wait(as->epfd, evs, ASYNC_EPOLL_EVENTS, timeout))<=0)
+		return n;
+	for(i=0; i<n; i++)
+	{
+		asfd=(struct asfd *)evs[i].data.ptr;
+		// Let errors and hang ups get found by the read or write.
+		if(evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+			asfd->can_read=asfd->doread;
+		if(evs[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+			asfd->can_write=asfd->dowrite;
+	}
+	return n;
+}
+#else
+void async_asfd_unwatch(struct asfd *asfd)
+{
+}
+#endif
+
+static int async_wait_select(struct async *as, long usec)
+{
+	int s;
+	int mfd=-1;
+	fd_set fsr;
+	fd_set fsw;
+	fd_set fse;
+	struct timeval tval;
+	struct asfd *asfd;
+
+	FD_ZERO(&fsr);
+	FD_ZERO(&fsw);
+	FD_ZERO(&fse);
+
+	tval.tv_sec=usec/1000000;
+	tval.tv_usec=usec%1000000;
+
+	for(asfd=as->asfd; asfd; asfd=asfd->next)
+	{
+		if(!asfd->doread && !asfd->dowrite) continue;
+		add_fd_to_sets(asfd->fd, asfd->doread?&fsr:NULL,
+			asfd->dowrite?&fsw:NULL, &fse, &mfd);
+	}
+
+#ifdef HAVE_WIN32
+	// Windows select() will not just wait, which is what is wanted when
+	// the only thing to do is a rate limited write.
+	if(mfd<0)
+	{
+		Sleep(usec/1000);
+		return 0;
+	}
+#endif
+	if((s=select(mfd+1, &fsr, &fsw, &fse, &tval))<=0)
+		return s;
+
+	for(asfd=as->asfd; asfd; asfd=asfd->next)
+	{
+		if(!asfd->doread && !asfd->dowrite) continue;
+		asfd->had_exception=FD_ISSET(asfd->fd, &fse);
+		asfd->can_read=asfd->doread && FD_ISSET(asfd->fd, &fsr);
+		asfd->can_write=asfd->dowrite && FD_ISSET(asfd->fd, &fsw);
+	}
+	return s;
+}
+
 void async_free(struct async **as)
 {
 	if(!*as) return;
+#ifdef HAVE_EPOLL
+	async_epoll_off(*as);
+#endif
 	free_v((void **)as);
 }
 
@@ -24,12 +178,9 @@ static int asfd_problem(struct asfd *asfd)
 
 static int async_io(struct async *as, int doread)
 {
-	int mfd=-1;
-	fd_set fsr;
-	fd_set fsw;
-	fd_set fse;
 	int dosomething=0;
-	struct timeval tval;
+	long usec;
+	long pace=0;
 	struct asfd *asfd;
 	static int s=0;
 
@@ -38,12 +189,14 @@ static int async_io(struct async *as, int doread)
 
 	if(as->doing_estimate) goto end;
 
-	FD_ZERO(&fsr);
-	FD_ZERO(&fsw);
-	FD_ZERO(&fse);
-
-	tval.tv_sec=as->setsec;
-	tval.tv_usec=as->setusec;
+#ifdef HAVE_EPOLL
+	if(as->epfd>=0 && !async_epoll_ours(as))
+	{
+		// Forked since the epoll instance was created.
+		async_epoll_off(as);
+		async_epoll_on(as);
+	}
+#endif
 
 	for(asfd=as->asfd; asfd; asfd=asfd->next)
 	{
@@ -54,6 +207,9 @@ static int async_io(struct async *as, int doread)
 		else
 			asfd->doread=doread;
 		asfd->dowrite=0;
+		asfd->can_read=0;
+		asfd->can_write=0;
+		asfd->had_exception=0;
 
 		if(doread)
 		{
@@ -64,16 +220,35 @@ static int async_io(struct async *as, int doread)
 		}
 
 		if(asfd->writebuflen && !asfd->write_blocked_on_read)
-			asfd->dowrite++; // The write buffer is not yet empty.
+		{
+			// The write buffer is not yet empty. If the rate limit
+			// says to wait, do not wait any longer than that.
+			long wait;
+			if(!(wait=asfd_write_wait(asfd)))
+				asfd->dowrite++;
+			else if(!pace || wait<pace)
+				pace=wait;
+		}
 
-		if(!asfd->doread && !asfd->dowrite) continue;
+#ifdef HAVE_EPOLL
+		if(as->epfd>=0 && async_epoll_update(as, asfd))
+		{
+			// EPERM means an fd that epoll cannot do, like a
+			// regular file. Go back to select() for everything.
+			if(errno!=EPERM)
+				logp("%s: epoll_ctl failed, using select: %s\n",
+					asfd->desc, strerror(errno));
+			async_epoll_off(as);
+		}
+#endif
 
-		add_fd_to_sets(asfd->fd, asfd->doread?&fsr:NULL,
-			asfd->dowrite?&fsw:NULL, &fse, &mfd);
+		if(!asfd->doread && !asfd->dowrite) continue;
 
 		dosomething++;
 	}
-	if(!dosomething) goto end;
+	// Even with nothing else to wait for, a rate limited write needs to
+	// wait for its turn.
+	if(!dosomething && !pace) goto end;
 /*
 	for(asfd=as->asfd; asfd; asfd=asfd->next)
 	{
@@ -83,8 +258,16 @@ static int async_io(struct async *as, int doread)
 	}
 */
 
+	usec=as->setsec*1000000L+as->setusec;
+	if(pace && pace<usec) usec=pace;
+
 	errno=0;
-	s=select(mfd+1, &fsr, &fsw, &fse, &tval);
+#ifdef HAVE_EPOLL
+	if(as->epfd>=0)
+		s=async_wait_epoll(as, usec);
+	else
+#endif
+		s=async_wait_select(as, usec);
 	if(errno==EAGAIN || errno==EINTR) goto end;
 
 	if(s<0)
@@ -97,7 +280,7 @@ static int async_io(struct async *as, int doread)
 
 	for(asfd=as->asfd; asfd; asfd=asfd->next)
 	{
-		if(FD_ISSET(asfd->fd, &fse))
+		if(asfd->had_exception)
 		{
 			switch(asfd->fdtype)
 			{
@@ -112,7 +295,7 @@ static int async_io(struct async *as, int doread)
 			}
 		}
 
-		if(asfd->doread && FD_ISSET(asfd->fd, &fsr)) // Able to read.
+		if(asfd->can_read) // Able to read.
 		{
 			asfd->network_timeout=asfd->max_network_timeout;
 			switch(asfd->fdtype)
@@ -131,15 +314,14 @@ static int async_io(struct async *as, int doread)
 			}
 		}
 
-		if(asfd->dowrite && FD_ISSET(asfd->fd, &fsw)) // Able to write.
+		if(asfd->can_write) // Able to write.
 		{
 			asfd->network_timeout=asfd->max_network_timeout;
 			if(asfd->do_write(asfd))
 				return asfd_problem(asfd);
 		}
 	
-		if((!asfd->doread || !FD_ISSET(asfd->fd, &fsr))
-		  && (!asfd->dowrite || !FD_ISSET(asfd->fd, &fsw)))
+		if(!asfd->can_read && !asfd->can_write)
 		{
 			// Be careful to avoid 'read quick' mode.
 			if((as->setsec || as->setusec)
@@ -202,6 +384,7 @@ static void async_asfd_remove(struct async *as, struct asfd *asfd)
 {
 	struct asfd *l;
 	if(!asfd) return;
+	async_asfd_unwatch(asfd);
 	if(as->asfd==asfd)
 	{
 		as->asfd=as->asfd->next;
@@ -234,6 +417,10 @@ static int async_init(struct async *as, int estimate)
 	as->setusec=0;
 	as->last_time=0;
 	as->doing_estimate=estimate;
+	as->epfd=-1;
+#ifdef HAVE_EPOLL
+	async_epoll_on(as);
+#endif
 
 	as->read_write=async_read_write;
 	as->write=async_write;
@@ -251,6 +438,7 @@ struct async *async_alloc(void)
 	struct async *as;
 	if(!(as=(struct async *)calloc_w(1, sizeof(struct async), __func__)))
 		return NULL;
+	as->epfd=-1;
 	as->init=async_init;
 	return as;
 }
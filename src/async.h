@@ -16,6 +16,10 @@ struct async
 	time_t now;
 	time_t last_time;
 
+	// epoll instance, or -1 to use select().
+	int epfd;
+	pid_t epoll_pid;
+
 	// Let us try using function pointers.
 	int (*init)(struct async *, int);
 
@@ -33,5 +37,6 @@ struct async
 extern struct async *async_alloc(void);
 extern void async_free(struct async **as);
 extern void async_asfd_free_all(struct async **as);
+extern void async_asfd_unwatch(struct asfd *asfd);
 
 #endif
@@ -422,9 +422,29 @@ static int bfile_close(BFILE *bfd, struct asfd *asfd)
 {
 	if(!bfd || bfd->mode==BF_CLOSED) return 0;
 
+	free_w(&bfd->rabuf);
+	// A hole at the end needs the file size setting, or it is lost.
+	if(bfd->mode==BF_WRITE && bfd->zeroes
+	  && ftruncate(bfd->fd, bfd->offset+bfd->zeroes))
+	{
+		logp("Could not set size of %s: %s\n",
+			bfd->path, strerror(errno));
+		close(bfd->fd);
+		bfd->mode=BF_CLOSED;
+		bfd->fd=-1;
+		free_w(&bfd->path);
+		return -1;
+	}
+	if(bfd->fd<0 && bfd->mode==BF_READ)
+	{
+		// Everything was read ahead, and the file already closed.
+		bfd->mode=BF_CLOSED;
+		free_w(&bfd->path);
+		return 0;
+	}
 	if(!close(bfd->fd))
 	{
-		if(bfd->mode==BF_WRITE)
+		if(bfd->mode==BF_WRITE && !bfd->no_attribs)
 			attribs_set(asfd, bfd->path,
 				&bfd->statp, bfd->winattr, bfd->conf);
 		bfd->mode=BF_CLOSED;
@@ -444,6 +464,8 @@ static int bfile_open(BFILE *bfd,
 		return -1;
 	if(!(bfd->fd=open(fname, flags, mode))<0)
 		return -1;
+	bfd->offset=0;
+	bfd->zeroes=0;
 	if(flags & O_CREAT || flags & O_WRONLY)
 		bfd->mode=BF_WRITE;
 	else
@@ -455,14 +477,204 @@ static int bfile_open(BFILE *bfd,
 
 static ssize_t bfile_read(BFILE *bfd, void *buf, size_t count)
 {
+	if(bfd->rabuf)
+	{
+		size_t len=bfd->ralen-bfd->rapos;
+		if(len)
+		{
+			if(len>count) len=count;
+			memcpy(buf, bfd->rabuf+bfd->rapos, len);
+			bfd->rapos+=len;
+			return (ssize_t)len;
+		}
+		if(bfd->fd<0) return 0;
+	}
 	return read(bfd->fd, buf, count);
 }
 
+// Hand over a file that has already been opened for reading, along with
+// the first len bytes of it, which have already been read into buf. buf
+// then belongs to bfd. If fd is -1, buf is the whole of the file.
+int bfile_set_read_ahead(BFILE *bfd, const char *fname,
+	int fd, char *buf, size_t len)
+{
+	bfd->fd=fd;
+	bfd->mode=BF_READ;
+	bfd->rabuf=buf;
+	bfd->ralen=len;
+	bfd->rapos=0;
+	if(fd>=0 && len && lseek(fd, (off_t)len, SEEK_SET)<0)
+	{
+		logp("Could not seek in %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+	if(!(bfd->path=strdup_w(fname, __func__)))
+		return -1;
+	return 0;
+}
+
+#define SPARSE_BLOCK	4096
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t w;
+	while(len)
+	{
+		if((w=write(fd, buf, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+static const char zero_block[SPARSE_BLOCK]={0};
+
+// Writes out the zeroes that have been held back, leaving a hole for any
+// whole blocks of them.
+static int flush_zeroes(BFILE *bfd)
+{
+	off_t start=bfd->offset;
+	off_t end=bfd->offset+bfd->zeroes;
+	off_t hole_start=(start+SPARSE_BLOCK-1)/SPARSE_BLOCK*SPARSE_BLOCK;
+	off_t hole_end=end/SPARSE_BLOCK*SPARSE_BLOCK;
+
+	if(hole_start>=hole_end)
+	{
+		// Too short for a hole.
+		hole_start=end;
+		hole_end=end;
+	}
+	while(start<hole_start)
+	{
+		size_t len=SPARSE_BLOCK;
+		if(len>(size_t)(hole_start-start)) len=hole_start-start;
+		if(write_all(bfd->fd, zero_block, len)) return -1;
+		start+=len;
+	}
+	if(hole_end>hole_start
+	  && lseek(bfd->fd, hole_end-hole_start, SEEK_CUR)<0)
+		return -1;
+	if(end>hole_end
+	  && write_all(bfd->fd, zero_block, end-hole_end))
+		return -1;
+	bfd->offset=end;
+	bfd->zeroes=0;
+	return 0;
+}
+
+static int write_data(BFILE *bfd, const char *buf, size_t len)
+{
+	if(bfd->zeroes && flush_zeroes(bfd))
+		return -1;
+	if(write_all(bfd->fd, buf, len))
+		return -1;
+	bfd->offset+=len;
+	return 0;
+}
+
+// Runs of zeroes long enough to cover a whole block are held back instead
+// of being written, even across calls, so that they can become holes in
+// the file. Shorter runs are written along with the data around them.
+static ssize_t bfile_write_sparse(BFILE *bfd, const char *buf, size_t count)
+{
+	const char *cp=buf;
+	const char *end=buf+count;
+	const char *data=buf; // Start of the data not yet written.
+	const char *z;
+
+	while(cp<end)
+	{
+		if(*cp)
+		{
+			cp++;
+			continue;
+		}
+		for(z=cp; z<end && !*z; z++) { }
+		// A short run in the middle of data is just data.
+		if(z<end && z-cp<SPARSE_BLOCK
+		  && (cp>data || !bfd->zeroes))
+		{
+			cp=z;
+			continue;
+		}
+		if(cp>data && write_data(bfd, data, cp-data))
+			return -1;
+		bfd->zeroes+=z-cp;
+		cp=z;
+		data=z;
+	}
+	if(cp>data && write_data(bfd, data, cp-data))
+		return -1;
+	return (ssize_t)count;
+}
+
 static ssize_t bfile_write(BFILE *bfd, void *buf, size_t count)
 {
+	if(bfd->sparse)
+		return bfile_write_sparse(bfd, (const char *)buf, count);
 	return write(bfd->fd, buf, count);
 }
 
+// Finds the first hole at or after offset. Returns 0 and sets start and
+// end if there is one, 1 if there is not, or if the file system cannot
+// tell, and -1 on error. The position that the file is being read from
+// does not change.
+int bfile_next_hole(BFILE *bfd, off_t offset, off_t *start, off_t *end)
+{
+#ifdef SEEK_HOLE
+	off_t cur;
+	struct stat statp;
+	int ret=1;
+
+	if(bfd->fd<0
+	  || (cur=lseek(bfd->fd, 0, SEEK_CUR))<0)
+		return 1;
+	// Files without holes still have one at the end.
+	if((*start=lseek(bfd->fd, offset, SEEK_HOLE))>=0)
+	{
+		if((*end=lseek(bfd->fd, *start, SEEK_DATA))<0
+		  && errno==ENXIO
+		  && !fstat(bfd->fd, &statp))
+			*end=statp.st_size;
+		if(*end>*start) ret=0;
+	}
+	if(lseek(bfd->fd, cur, SEEK_SET)<0)
+	{
+		logp("Could not seek in %s: %s\n", bfd->path, strerror(errno));
+		return -1;
+	}
+	return ret;
+#else
+	return 1;
+#endif
+}
+
+// Carries on reading from offset, instead of from where reading got to.
+int bfile_seek(BFILE *bfd, off_t offset)
+{
+	if(bfd->rabuf)
+	{
+		if(offset<(off_t)bfd->ralen)
+		{
+			bfd->rapos=offset;
+			offset=bfd->ralen;
+		}
+		else
+			bfd->rapos=bfd->ralen;
+		if(bfd->fd<0) return 0;
+	}
+	if(lseek(bfd->fd, offset, SEEK_SET)<0)
+	{
+		logp("Could not seek in %s: %s\n", bfd->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 #endif
 
 static int bfile_open_for_send(BFILE *bfd, struct asfd *asfd,
@@ -29,6 +29,19 @@ struct BFILE
 	int berrno;          /* errno */
 #else
 	int fd;
+	// File data that was read ahead before the file was handed over.
+	// It is returned before anything more is read from fd, which is -1
+	// if there is nothing more.
+	char *rabuf;
+	size_t ralen;
+	size_t rapos;
+	// When writing sparse, offset is where the data written so far ends,
+	// and zeroes is how many zeroes after that are being held back.
+	uint8_t sparse;
+	// Set when whoever closes it sets the attributes afterwards.
+	uint8_t no_attribs;
+	off_t offset;
+	off_t zeroes;
 #endif
 
 	// Let us try using function pointers.
@@ -51,6 +64,13 @@ extern void bfile_free(BFILE **bfd);
 // Need to sort out the bfd in sbuf.
 extern void bfile_init(BFILE *bfd, int64_t winattr, struct conf *conf);
 extern void bfile_setup_funcs(BFILE *bfd);
+#ifndef HAVE_WIN32
+extern int bfile_set_read_ahead(BFILE *bfd, const char *fname,
+	int fd, char *buf, size_t len);
+extern int bfile_next_hole(BFILE *bfd, off_t offset,
+	off_t *start, off_t *end);
+extern int bfile_seek(BFILE *bfd, off_t offset);
+#endif
 
 #ifdef HAVE_WIN32
 extern int have_win32_api(void);
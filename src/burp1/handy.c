@@ -106,11 +106,13 @@ int send_whole_file_gzl(struct asfd *asfd,
 	int have;
 	z_stream strm;
 	int flush=Z_NO_FLUSH;
-	uint8_t in[ZCHUNK];
-	uint8_t out[ZCHUNK];
+	// Work in pieces the size of the frames that will be sent.
+	size_t chunk=asfd->frame_len;
+	uint8_t *in=NULL;
+	uint8_t *out=NULL;
 
 	int eoutlen;
-	uint8_t eoutbuf[ZCHUNK+EVP_MAX_BLOCK_LENGTH];
+	uint8_t *eoutbuf=NULL;
 
 	EVP_CIPHER_CTX *enc_ctx=NULL;
 #ifdef HAVE_WIN32
@@ -146,12 +148,21 @@ int send_whole_file_gzl(struct asfd *asfd,
 		return -1;
 	}
 
+	if(!(in=(uint8_t *)malloc_w(chunk, __func__))
+	  || !(out=(uint8_t *)malloc_w(chunk, __func__))
+	  || !(eoutbuf=(uint8_t *)malloc_w(chunk+EVP_MAX_BLOCK_LENGTH,
+		__func__)))
+	{
+		ret=-1;
+		goto cleanup;
+	}
+
 	do
 	{
 		if(metadata)
 		{
-			if(metalen>ZCHUNK)
-				strm.avail_in=ZCHUNK;
+			if(metalen>chunk)
+				strm.avail_in=chunk;
 			else
 				strm.avail_in=metalen;
 			memcpy(in, metadata, strm.avail_in);
@@ -168,13 +179,13 @@ int send_whole_file_gzl(struct asfd *asfd,
 				if(datalen<=0) strm.avail_in=0;
 				else strm.avail_in=
 					(uint32_t)bfd->read(bfd, in,
-						min((size_t)ZCHUNK, datalen));
+						min(chunk, datalen));
 				datalen-=strm.avail_in;
 			}
 			else
 #endif
 				strm.avail_in=
-					(uint32_t)bfd->read(bfd, in, ZCHUNK);
+					(uint32_t)bfd->read(bfd, in, chunk);
 		}
 		if(!compression && !strm.avail_in) break;
 
@@ -206,7 +217,7 @@ int send_whole_file_gzl(struct asfd *asfd,
 		{
 			if(compression)
 			{
-				strm.avail_out = ZCHUNK;
+				strm.avail_out = chunk;
 				strm.next_out = out;
 				zret = deflate(&strm, flush); /* no bad return value */
 				if(zret==Z_STREAM_ERROR) /* state not clobbered */
@@ -215,7 +226,7 @@ int send_whole_file_gzl(struct asfd *asfd,
 					ret=-1;
 					break;
 				}
-				have = ZCHUNK-strm.avail_out;
+				have = chunk-strm.avail_out;
 			}
 			else
 			{
@@ -299,6 +310,9 @@ int send_whole_file_gzl(struct asfd *asfd,
 
 cleanup:
 	deflateEnd(&strm);
+	free_v((void **)&in);
+	free_v((void **)&out);
+	free_v((void **)&eoutbuf);
 
 	if(enc_ctx)
 	{
@@ -368,7 +382,11 @@ int send_whole_filel(struct asfd *asfd,
 	int ret=0;
 	size_t s=0;
 	MD5_CTX md5;
-	char buf[4096]="";
+	size_t chunk=asfd->frame_len;
+	char *buf=NULL;
+#ifndef HAVE_WIN32
+	off_t offset=0;
+#endif
 
 	if(!MD5_Init(&md5))
 	{
@@ -387,7 +405,7 @@ int send_whole_filel(struct asfd *asfd,
 		// Send metadata in chunks, rather than all at once.
 		while(metalen>0)
 		{
-			if(metalen>ZCHUNK) s=ZCHUNK;
+			if(metalen>chunk) s=chunk;
 			else s=metalen;
 
 			if(!MD5_Update(&md5, metadata, s))
@@ -431,6 +449,9 @@ int send_whole_filel(struct asfd *asfd,
 		}
 #endif
 
+		if(!ret && cmd!=CMD_EFS_FILE
+		  && !(buf=(char *)malloc_w(chunk, __func__)))
+			ret=-1;
 		if(!ret && cmd!=CMD_EFS_FILE)
 		{
 #ifdef HAVE_WIN32
@@ -444,13 +465,13 @@ int send_whole_filel(struct asfd *asfd,
 			if(do_known_byte_count)
 			{
 				s=(uint32_t)bfd->read(bfd,
-					buf, min((size_t)4096, datalen));
+					buf, min(chunk, datalen));
 				datalen-=s;
 			}
 			else
 			{
 #endif
-				s=(uint32_t)bfd->read(bfd, buf, 4096);
+				s=(uint32_t)bfd->read(bfd, buf, chunk);
 #ifdef HAVE_WIN32
 			}
 #endif
@@ -463,11 +484,20 @@ int send_whole_filel(struct asfd *asfd,
 				ret=-1;
 				break;
 			}
+#ifdef HAVE_WIN32
 			if(asfd->write_strn(asfd, CMD_APPEND, buf, s))
+#else
+			// The kernel may be able to send it from the file.
+			if(asfd_write_file(asfd, CMD_APPEND, buf, s,
+				bfd->fd, offset))
+#endif
 			{
 				ret=-1;
 				break;
 			}
+#ifndef HAVE_WIN32
+			offset+=s;
+#endif
 			if(quick_read)
 			{
 				int qr;
@@ -490,6 +520,7 @@ int send_whole_filel(struct asfd *asfd,
 		  }
 		}
 	}
+	free_w(&buf);
 	if(!ret)
 	{
 		uint8_t checksum[MD5_DIGEST_LENGTH];
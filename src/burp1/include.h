@@ -5,6 +5,7 @@
 
 #include "handy.h"
 #include "msg.h"
+#include "sgz.h"
 #include "rs_buf.h"
 #include "sbuf_burp1.h"
 #include "sbufl.h"
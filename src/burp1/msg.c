@@ -65,6 +65,15 @@ static int do_inflate(struct asfd *asfd,
 			  logp("zstrm inflate error: %d\n", zret);
 			  return -1;
 			  break;
+			case Z_STREAM_END:
+			  // Seekable gzip files are several gzip members
+			  // one after the other. Get ready for the next one.
+			  if(inflateReset(zstrm)!=Z_OK)
+			  {
+				logp("zstrm inflate reset error\n");
+				return -1;
+			  }
+			  break;
 		}
 		have=ZCHUNK-zstrm->avail_out;
 		if(!have) continue;
@@ -81,7 +90,8 @@ static int do_inflate(struct asfd *asfd,
 			}
 		}
 */
-	} while(!zstrm->avail_out);
+	} while(!zstrm->avail_out
+	  || (zret==Z_STREAM_END && zstrm->avail_in));
 	return 0;
 }
 
@@ -161,8 +171,9 @@ int transfer_gzfile_inl(struct asfd *asfd,
 	int ret=-1;
 	uint8_t out[ZCHUNK];
 	int doutlen=0;
-	//uint8_t doutbuf[1000+EVP_MAX_BLOCK_LENGTH];
-	uint8_t doutbuf[ZCHUNK-EVP_MAX_BLOCK_LENGTH];
+	// Grown to fit the decrypted contents of the biggest frame so far.
+	uint8_t *doutbuf=NULL;
+	size_t doutbuflen=0;
 	struct iobuf *rbuf=asfd->rbuf;
 
 	z_stream zstrm;
@@ -213,6 +224,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 				free(enc_ctx);
 			}
 			inflateEnd(&zstrm);
+			free_v((void **)&doutbuf);
 			return -1;
 		}
 		(*rcvd)+=rbuf->len;
@@ -255,6 +267,21 @@ int transfer_gzfile_inl(struct asfd *asfd,
 					  }
 					  else 
 */
+					  if(doutbuflen<rbuf->len
+						+EVP_MAX_BLOCK_LENGTH+1)
+					  {
+						uint8_t *tmp;
+						size_t len=rbuf->len
+							+EVP_MAX_BLOCK_LENGTH+1;
+						if(!(tmp=(uint8_t *)realloc_w(
+							doutbuf, len, __func__)))
+						{
+							quit++; ret=-1;
+							break;
+						}
+						doutbuf=tmp;
+						doutbuflen=len;
+					  }
 					  if(!EVP_CipherUpdate(enc_ctx,
 						doutbuf, &doutlen,
 						(uint8_t *)rbuf->buf,
@@ -287,6 +314,18 @@ int transfer_gzfile_inl(struct asfd *asfd,
 				}
 				break;
 			case CMD_END_FILE: // finish up
+				if(enc_ctx && doutbuflen<EVP_MAX_BLOCK_LENGTH+1)
+				{
+					uint8_t *tmp;
+					if(!(tmp=(uint8_t *)realloc_w(doutbuf,
+						EVP_MAX_BLOCK_LENGTH+1, __func__)))
+					{
+						ret=-1; quit++;
+						break;
+					}
+					doutbuf=tmp;
+					doutbuflen=EVP_MAX_BLOCK_LENGTH+1;
+				}
 				if(enc_ctx)
 				{
 					if(!EVP_CipherFinal_ex(enc_ctx,
@@ -347,6 +386,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 		free(enc_ctx);
 	}
 
+	free_v((void **)&doutbuf);
 	iobuf_free_content(rbuf);
 	if(ret) logp("transfer file returning: %d\n", ret);
 	return ret;
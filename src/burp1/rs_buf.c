@@ -41,11 +41,70 @@
 #define fseek fseeko
 #endif
 
+// Totals for this process, added to as each rs_filebuf is freed.
+static unsigned long long rs_io_reads=0;
+static unsigned long long rs_io_read_bytes=0;
+static unsigned long long rs_io_writes=0;
+static unsigned long long rs_io_write_bytes=0;
+
 void *rs_alloc(size_t size)
 {
 	return calloc_w(1, size, __func__);
 }
 
+static int rs_filebuf_fileno(FILE *fp, BFILE *bfd)
+{
+	if(fp) return fileno(fp);
+#ifndef HAVE_WIN32
+	if(bfd) return bfd->fd;
+#endif
+	return -1;
+}
+
+// Big files get big buffers, so that they need fewer reads, writes and
+// librsync iterations. Anything going to or from the network is sized to
+// the frame length of the asfd instead.
+static size_t rs_filebuf_len_for_size(uint64_t size)
+{
+	uint64_t len=size/RS_BUF_LEN_DIVISOR;
+	// Round up to a whole number of ASYNC_BUF_LEN, and at least one.
+	len=(len+ASYNC_BUF_LEN-1)/ASYNC_BUF_LEN;
+	if(!len) len=1;
+	len*=ASYNC_BUF_LEN;
+	if(len>RS_BUF_LEN_MAX) return RS_BUF_LEN_MAX;
+	return len;
+}
+
+size_t rs_filebuf_len(FILE *fp, BFILE *bfd)
+{
+	int fd;
+	struct stat statp;
+
+	if((fd=rs_filebuf_fileno(fp, bfd))<0
+	  || fstat(fd, &statp)
+	  || !S_ISREG(statp.st_mode))
+		return ASYNC_BUF_LEN;
+	return rs_filebuf_len_for_size(statp.st_size);
+}
+
+static void rs_filebuf_fadvise(rs_filebuf_t *fb, int advice)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	int fd;
+	if((fd=rs_filebuf_fileno(fb->fp, fb->bfd))<0) return;
+	posix_fadvise(fd, 0, 0, advice);
+#endif
+}
+
+void rs_filebuf_log_stats(void)
+{
+	if(!rs_io_reads && !rs_io_writes) return;
+	logp("librsync file reads: %llu, average %llu bytes\n",
+		rs_io_reads, rs_io_reads?rs_io_read_bytes/rs_io_reads:0);
+	logp("librsync file writes: %llu, average %llu bytes\n",
+		rs_io_writes, rs_io_writes?rs_io_write_bytes/rs_io_writes:0);
+}
+
 rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
 	BFILE *bfd, FILE *fp, gzFile zp, int fd,
 	size_t buf_len, size_t data_len, struct cntr *cntr)
@@ -84,6 +143,14 @@ rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
 
 void rs_filebuf_free(rs_filebuf_t *fb) 
 {
+	rs_io_reads+=fb->reads;
+	rs_io_read_bytes+=fb->read_bytes;
+	rs_io_writes+=fb->writes;
+	rs_io_write_bytes+=fb->write_bytes;
+#ifdef POSIX_FADV_DONTNEED
+	// Whatever was read is not going to be needed again soon.
+	if(fb->reads) rs_filebuf_fadvise(fb, POSIX_FADV_DONTNEED);
+#endif
 	if(fb->buf) free(fb->buf);
 	memset(fb, 0, sizeof(*fb));
         free(fb);
@@ -148,6 +215,10 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 		   anyhow? */
 		return RS_DONE;
 
+#ifdef POSIX_FADV_SEQUENTIAL
+	if(!fb->reads) rs_filebuf_fadvise(fb, POSIX_FADV_SEQUENTIAL);
+#endif
+
 	if(fd>=0)
 	{
 		static struct iobuf *rbuf=NULL;
@@ -158,6 +229,14 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 		{
 			//logp("got '%c' in fd infilebuf: %d\n",
 			//	CMD_APPEND, rbuf->len);
+			if(rbuf->len>fb->buf_len)
+			{
+				logp("%c of %lu bytes is too big for buffer of %lu in %s\n",
+					rbuf->cmd, (unsigned long)rbuf->len,
+					(unsigned long)fb->buf_len, __func__);
+				iobuf_free_content(rbuf);
+				return RS_IO_ERROR;
+			}
 			memcpy(fb->buf, rbuf->buf, rbuf->len);
 			len=rbuf->len;
 			iobuf_free_content(rbuf);
@@ -203,6 +282,7 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 		}
 		else
 			len=fb->bfd->read(fb->bfd, fb->buf, fb->buf_len);
+		fb->reads++;
 		if(len==0)
 		{
 			//logp("bread: eof\n");
@@ -225,6 +305,7 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 	else if(fp)
 	{
 		len = fread(fb->buf, 1, fb->buf_len, fp);
+		fb->reads++;
 		//logp("fread: %d\n", len);
 		if(len <= 0)
 		{
@@ -252,6 +333,7 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 	else if(zp)
 	{
 		len=gzread(zp, fb->buf, fb->buf_len);
+		fb->reads++;
 		//logp("gzread: %d\n", len);
 		if(len <= 0)
 		{
@@ -276,6 +358,7 @@ rs_result rs_infilebuf_fill(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 		}
 	}
 
+	if(fd<0) fb->read_bytes+=len;
 	buf->avail_in = len;
 	buf->next_in = fb->buf;
 
@@ -357,12 +440,16 @@ rs_result rs_outfilebuf_drain(rs_job_t *job, rs_buffers_t *buf, void *opaque)
 			size_t result=0;
 			if(fp) result=fwrite(fb->buf, 1, wlen, fp);
 			else if(zp) result=gzwrite(zp, fb->buf, wlen);
+			else if(fb->sgz && !sgz_write(fb->sgz, fb->buf, wlen))
+				result=wlen;
 			if(wlen!=result)
 			{
 				logp("error draining buf to file: %s",
 						strerror(errno));
 				return RS_IO_ERROR;
 			}
+			fb->writes++;
+			fb->write_bytes+=wlen;
 		}
 	}
 
@@ -395,11 +482,15 @@ rs_result do_rs_run(struct asfd *asfd,
 
 	if((bfd || in_file || in_zfile || infd>=0)
 	 && !(in_fb=rs_filebuf_new(asfd, bfd,
-		in_file, in_zfile, infd, ASYNC_BUF_LEN, -1, cntr)))
+		in_file, in_zfile, infd,
+		infd>=0?asfd->frame_len:rs_filebuf_len(in_file, bfd),
+		-1, cntr)))
 			return RS_MEM_ERROR;
 	if((out_file || out_zfile || outfd>=0)
 	 && !(out_fb=rs_filebuf_new(asfd, NULL,
-		out_file, out_zfile, outfd, ASYNC_BUF_LEN, -1, cntr)))
+		out_file, out_zfile, outfd,
+		outfd>=0?asfd->frame_len:rs_filebuf_len(in_file, bfd),
+		-1, cntr)))
 	{
 		if(in_fb) rs_filebuf_free(in_fb);
 		return RS_MEM_ERROR;
@@ -454,7 +545,8 @@ rs_result rs_async(rs_job_t *job, rs_buffers_t *rsbuf,
 
 static rs_result rs_whole_gzrun(struct asfd *asfd,
 	rs_job_t *job, FILE *in_file, gzFile in_zfile,
-	FILE *out_file, gzFile out_zfile, struct cntr *cntr)
+	FILE *out_file, gzFile out_zfile, struct sgz *out_sgz,
+	size_t buf_len, struct cntr *cntr)
 {
 	rs_buffers_t buf;
 	rs_result result;
@@ -463,11 +555,14 @@ static rs_result rs_whole_gzrun(struct asfd *asfd,
 
 	if(in_file || in_zfile)
 		in_fb=rs_filebuf_new(asfd, NULL,
-			in_file, in_zfile, -1, ASYNC_BUF_LEN, -1, cntr);
+			in_file, in_zfile, -1, buf_len, -1, cntr);
 
-	if(out_file || out_zfile)
-	out_fb=rs_filebuf_new(asfd, NULL,
-		out_file, out_zfile, -1, ASYNC_BUF_LEN, -1, cntr);
+	if(out_file || out_zfile || out_sgz)
+	{
+		if((out_fb=rs_filebuf_new(asfd, NULL,
+			out_file, out_zfile, -1, buf_len, -1, cntr)))
+				out_fb->sgz=out_sgz;
+	}
 	result=rs_job_drive(job, &buf,
 		in_fb ? rs_infilebuf_fill : NULL, in_fb,
 		out_fb ? rs_outfilebuf_drain : NULL, out_fb);
@@ -478,16 +573,29 @@ static rs_result rs_whole_gzrun(struct asfd *asfd,
 	return result;
 }
 
-rs_result rs_patch_gzfile(struct asfd *asfd, FILE *basis_file, FILE *delta_file,
+rs_result rs_patch_gzfile(struct asfd *asfd,
+	FILE *basis_file, struct sgz *basis_sgz, FILE *delta_file,
 	gzFile delta_zfile, FILE *new_file, gzFile new_zfile,
-	rs_stats_t *stats, struct cntr *cntr)
+	struct sgz *new_sgz, rs_stats_t *stats, struct cntr *cntr)
 {
 	rs_job_t *job;
 	rs_result r;
+	size_t buf_len;
 
-	job=rs_patch_begin(rs_file_copy_cb, basis_file);
-	r=rs_whole_gzrun(asfd, job,
-		delta_file, delta_zfile, new_file, new_zfile, cntr);
+	// A seekable gzip basis can be read directly, without inflating it
+	// to a temporary file first.
+	if(basis_sgz)
+	{
+		job=rs_patch_begin(sgz_copy_cb, basis_sgz);
+		buf_len=rs_filebuf_len_for_size(basis_sgz->usize);
+	}
+	else
+	{
+		job=rs_patch_begin(rs_file_copy_cb, basis_file);
+		buf_len=rs_filebuf_len(basis_file, NULL);
+	}
+	r=rs_whole_gzrun(asfd, job, delta_file, delta_zfile,
+		new_file, new_zfile, new_sgz, buf_len, cntr);
 	rs_job_free(job);
 
 	return r;
@@ -502,7 +610,8 @@ rs_result rs_sig_gzfile(struct asfd *asfd,
 	rs_result r;
 
 	job=rs_sig_begin(new_block_len, strong_len);
-	r=rs_whole_gzrun(asfd, job, old_file, old_zfile, sig_file, NULL, cntr);
+	r=rs_whole_gzrun(asfd, job, old_file, old_zfile, sig_file, NULL, NULL,
+		rs_filebuf_len(old_file, NULL), cntr);
 	rs_job_free(job);
 
 	return r;
@@ -517,8 +626,8 @@ rs_result rs_delta_gzfile(struct asfd *asfd,
 	rs_result r;
 
 	job=rs_delta_begin(sig);
-	r=rs_whole_gzrun(asfd, job,
-		new_file, new_zfile, delta_file, delta_zfile, cntr);
+	r=rs_whole_gzrun(asfd, job, new_file, new_zfile, delta_file, delta_zfile,
+		NULL, rs_filebuf_len(new_file, NULL), cntr);
 	rs_job_free(job);
 
 	return r;
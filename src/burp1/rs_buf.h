@@ -32,6 +32,10 @@
 extern size_t block_len;
 extern size_t strong_len;
 
+// Limits for rs_filebuf_len().
+#define RS_BUF_LEN_MAX		(4*1024*1024)
+#define RS_BUF_LEN_DIVISOR	16
+
 typedef struct rs_filebuf rs_filebuf_t;
 struct rs_filebuf
 {
@@ -47,6 +51,12 @@ struct rs_filebuf
 	struct cntr *cntr;
 	MD5_CTX md5;
 	struct asfd *asfd;
+	struct sgz *sgz;
+	// For working out the average number of bytes per call.
+	unsigned long long reads;
+	unsigned long long read_bytes;
+	unsigned long long writes;
+	unsigned long long write_bytes;
 };
 
 // FIX THIS: Now that struct asfd is getting passed, probably do not need
@@ -55,6 +65,8 @@ rs_filebuf_t *rs_filebuf_new(struct asfd *asfd,
 	BFILE *bfd, FILE *fp, gzFile zp,
 	int fd, size_t buf_len, size_t data_len, struct cntr *cntr);
 void rs_filebuf_free(rs_filebuf_t *fb);
+size_t rs_filebuf_len(FILE *fp, BFILE *bfd);
+void rs_filebuf_log_stats(void);
 rs_result rs_infilebuf_fill(rs_job_t *, rs_buffers_t *buf, void *fb);
 rs_result rs_outfilebuf_drain(rs_job_t *, rs_buffers_t *, void *fb);
 rs_result do_rs_run(struct asfd *asfd,
@@ -66,9 +78,9 @@ rs_result rs_async(rs_job_t *job,
 	rs_buffers_t *rsbuf, rs_filebuf_t *infb, rs_filebuf_t *outfb);
 
 rs_result rs_patch_gzfile(struct asfd *asfd,
-	FILE *basis_file, FILE *delta_file,
+	FILE *basis_file, struct sgz *basis_sgz, FILE *delta_file,
 	gzFile delta_zfile, FILE *new_file, gzFile new_zfile,
-	rs_stats_t *stats, struct cntr *cntr);
+	struct sgz *new_sgz, rs_stats_t *stats, struct cntr *cntr);
 rs_result rs_sig_gzfile(struct asfd *asfd,
 	FILE *old_file, gzFile old_zfile, FILE *sig_file,
 	size_t new_block_len, size_t strong_len, rs_stats_t *stats,
@@ -111,6 +111,14 @@ static int read_stat(struct asfd *asfd, struct iobuf *rbuf, FILE *fp,
 
 			return 0;
 		}
+		else if(rbuf->cmd==CMD_UNCHANGED && asfd)
+		{
+			// The caller fills the run in from the previous
+			// manifest.
+			iobuf_copy(&sb->attr, rbuf);
+			rbuf->buf=NULL;
+			return 0;
+		}
 		else if((rbuf->cmd==CMD_GEN && !strcmp(rbuf->buf, "backupend"))
 		  || (rbuf->cmd==CMD_GEN && !strcmp(rbuf->buf, "restoreend"))
 		  || (rbuf->cmd==CMD_GEN && !strcmp(rbuf->buf, "phase1end"))
@@ -138,6 +146,14 @@ static int do_sbufl_fill_from_net(struct sbuf *sb, struct asfd *asfd,
 	  || (ars=asfd->read(asfd))) return ars;
 	iobuf_copy(&sb->path, rbuf);
 	rbuf->buf=NULL;
+	if(sb->attr.cmd==CMD_UNCHANGED)
+	{
+		// The last entry of the run goes in link.
+		if((ars=asfd->read(asfd))) return ars;
+		iobuf_copy(&sb->link, rbuf);
+		rbuf->buf=NULL;
+		return 0;
+	}
 	if(sbuf_is_link(sb))
 	{
 		if((ars=asfd->read(asfd))) return ars;
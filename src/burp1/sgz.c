@@ -0,0 +1,351 @@
+#include "include.h"
+
+/* use fseeko instead of fseek for long file support if we have it */
+#ifdef HAVE_FSEEKO
+#define fseek fseeko
+#endif
+
+// Gzip member header with the extra field, and the trailer.
+#define SGZ_HEADER_LEN	24
+#define SGZ_TRAILER_LEN	8
+#define SGZ_XLEN	12
+#define SGZ_SI1		'B'
+#define SGZ_SI2		'P'
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0]=v&0xFF;
+	p[1]=(v>>8)&0xFF;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0]=v&0xFF;
+	p[1]=(v>>8)&0xFF;
+	p[2]=(v>>16)&0xFF;
+	p[3]=(v>>24)&0xFF;
+}
+
+static uint16_t get_le16(const uint8_t *p)
+{
+	return p[0]|(p[1]<<8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static struct sgz *sgz_alloc(void)
+{
+	struct sgz *sgz;
+	if(!(sgz=(struct sgz *)calloc_w(1, sizeof(struct sgz), __func__))
+	  || !(sgz->ubuf=(uint8_t *)malloc_w(SGZ_CHUNK, __func__)))
+	{
+		free_v((void **)&sgz);
+		return NULL;
+	}
+	sgz->cached=-1;
+	return sgz;
+}
+
+static void sgz_free(struct sgz **sgz)
+{
+	if(!sgz || !*sgz) return;
+	free_v((void **)&(*sgz)->ubuf);
+	free_v((void **)&(*sgz)->zbuf);
+	free_v((void **)&(*sgz)->coffs);
+	free_v((void **)&(*sgz)->clens);
+	free_v((void **)&(*sgz)->uoffs);
+	free_v((void **)&(*sgz)->ulens);
+	free_v((void **)sgz);
+}
+
+// Returns 1 and fills in the lengths if the header is one of ours.
+static int parse_header(const uint8_t *h, uint32_t *clen, uint32_t *ulen)
+{
+	if(h[0]!=0x1F || h[1]!=0x8B || h[2]!=Z_DEFLATED
+	  || h[3]!=0x04 // FEXTRA only.
+	  || get_le16(h+10)!=SGZ_XLEN
+	  || h[12]!=SGZ_SI1 || h[13]!=SGZ_SI2
+	  || get_le16(h+14)!=8)
+		return 0;
+	*clen=get_le32(h+16);
+	*ulen=get_le32(h+20);
+	if(*clen<SGZ_HEADER_LEN+SGZ_TRAILER_LEN || *ulen>SGZ_CHUNK)
+		return 0;
+	return 1;
+}
+
+struct sgz *sgz_open_w(const char *path, int level)
+{
+	struct sgz *sgz=NULL;
+	if(!(sgz=sgz_alloc())) return NULL;
+	sgz->level=level;
+	sgz->zbuf_len=deflateBound(NULL, SGZ_CHUNK)
+		+SGZ_HEADER_LEN+SGZ_TRAILER_LEN;
+	if(!(sgz->zbuf=(uint8_t *)malloc_w(sgz->zbuf_len, __func__)))
+		goto error;
+	// Raw deflate - the gzip wrapping is done here.
+	if(deflateInit2(&sgz->zs, level, Z_DEFLATED, -15, 8,
+		Z_DEFAULT_STRATEGY)!=Z_OK)
+	{
+		logp("deflateInit2 failed in %s\n", __func__);
+		goto error;
+	}
+	sgz->zs_init=1;
+	if(!(sgz->fp=open_file(path, "wb")))
+		goto error;
+	return sgz;
+error:
+	sgz_close(&sgz);
+	return NULL;
+}
+
+static int write_member(struct sgz *sgz)
+{
+	uint8_t *h=sgz->zbuf;
+	size_t clen=0;
+
+	if(deflateReset(&sgz->zs)!=Z_OK)
+	{
+		logp("deflateReset failed in %s\n", __func__);
+		return -1;
+	}
+	sgz->zs.next_in=sgz->ubuf;
+	sgz->zs.avail_in=sgz->ulen;
+	sgz->zs.next_out=sgz->zbuf+SGZ_HEADER_LEN;
+	sgz->zs.avail_out=sgz->zbuf_len-SGZ_HEADER_LEN-SGZ_TRAILER_LEN;
+	if(deflate(&sgz->zs, Z_FINISH)!=Z_STREAM_END)
+	{
+		logp("deflate failed in %s\n", __func__);
+		return -1;
+	}
+	clen=SGZ_HEADER_LEN+sgz->zs.total_out+SGZ_TRAILER_LEN;
+
+	memset(h, 0, SGZ_HEADER_LEN);
+	h[0]=0x1F;
+	h[1]=0x8B;
+	h[2]=Z_DEFLATED;
+	h[3]=0x04; // FEXTRA
+	h[9]=0xFF; // Unknown OS.
+	put_le16(h+10, SGZ_XLEN);
+	h[12]=SGZ_SI1;
+	h[13]=SGZ_SI2;
+	put_le16(h+14, 8);
+	put_le32(h+16, clen);
+	put_le32(h+20, sgz->ulen);
+
+	put_le32(sgz->zs.next_out, crc32(crc32(0L, Z_NULL, 0),
+		sgz->ubuf, sgz->ulen));
+	put_le32(sgz->zs.next_out+4, sgz->ulen);
+
+	if(fwrite(sgz->zbuf, 1, clen, sgz->fp)!=clen)
+	{
+		logp("error writing member in %s: %s\n",
+			__func__, strerror(errno));
+		return -1;
+	}
+	sgz->members++;
+	sgz->ulen=0;
+	return 0;
+}
+
+int sgz_write(struct sgz *sgz, const void *buf, size_t len)
+{
+	const uint8_t *cp=(const uint8_t *)buf;
+	while(len)
+	{
+		size_t n=SGZ_CHUNK-sgz->ulen;
+		if(n>len) n=len;
+		memcpy(sgz->ubuf+sgz->ulen, cp, n);
+		sgz->ulen+=n;
+		cp+=n;
+		len-=n;
+		if(sgz->ulen==SGZ_CHUNK && write_member(sgz))
+			return -1;
+	}
+	return 0;
+}
+
+static int add_member(struct sgz *sgz, size_t *alloc,
+	uint64_t coff, uint32_t clen, uint32_t ulen)
+{
+	if(sgz->members==*alloc)
+	{
+		*alloc=*alloc?(*alloc)*2:64;
+		if(!(sgz->coffs=(uint64_t *)realloc_w(sgz->coffs,
+			*alloc*sizeof(uint64_t), __func__))
+		  || !(sgz->clens=(uint32_t *)realloc_w(sgz->clens,
+			*alloc*sizeof(uint32_t), __func__))
+		  || !(sgz->uoffs=(uint64_t *)realloc_w(sgz->uoffs,
+			*alloc*sizeof(uint64_t), __func__))
+		  || !(sgz->ulens=(uint32_t *)realloc_w(sgz->ulens,
+			*alloc*sizeof(uint32_t), __func__)))
+				return -1;
+	}
+	sgz->coffs[sgz->members]=coff;
+	sgz->clens[sgz->members]=clen;
+	sgz->uoffs[sgz->members]=sgz->usize;
+	sgz->ulens[sgz->members]=ulen;
+	sgz->usize+=ulen;
+	sgz->members++;
+	return 0;
+}
+
+// Walk the member headers to build the offset index.
+static int build_index(struct sgz *sgz, const char *path)
+{
+	size_t alloc=0;
+	uint64_t coff=0;
+	uint32_t clen=0;
+	uint32_t ulen=0;
+	uint8_t h[SGZ_HEADER_LEN];
+
+	while(1)
+	{
+		size_t got;
+		if(fseek(sgz->fp, coff, SEEK_SET))
+		{
+			logp("could not seek in %s: %s\n",
+				path, strerror(errno));
+			return -1;
+		}
+		if(!(got=fread(h, 1, sizeof(h), sgz->fp)) && feof(sgz->fp))
+			break;
+		if(got!=sizeof(h) || !parse_header(h, &clen, &ulen))
+		{
+			logp("%s is not seekable gzip at offset %llu\n",
+				path, (unsigned long long)coff);
+			return -1;
+		}
+		if(add_member(sgz, &alloc, coff, clen, ulen))
+			return -1;
+		coff+=clen;
+	}
+	return 0;
+}
+
+struct sgz *sgz_open_r(const char *path)
+{
+	struct sgz *sgz=NULL;
+	if(!(sgz=sgz_alloc())) return NULL;
+	if(inflateInit2(&sgz->zs, -15)!=Z_OK)
+	{
+		logp("inflateInit2 failed in %s\n", __func__);
+		goto error;
+	}
+	sgz->zs_init=1;
+	if(!(sgz->fp=open_file(path, "rb"))
+	  || build_index(sgz, path))
+		goto error;
+	return sgz;
+error:
+	sgz_close(&sgz);
+	return NULL;
+}
+
+int sgz_close(struct sgz **sgz)
+{
+	int ret=0;
+	if(!sgz || !*sgz) return 0;
+	if((*sgz)->zbuf && (*sgz)->fp)
+	{
+		// Writing. Flush what is left. Always write at least one
+		// member so that an empty file is still valid gzip.
+		if(((*sgz)->ulen || !(*sgz)->members)
+		  && write_member(*sgz))
+			ret=-1;
+		if(close_fp(&(*sgz)->fp)) ret=-1;
+		if((*sgz)->zs_init) deflateEnd(&(*sgz)->zs);
+	}
+	else
+	{
+		close_fp(&(*sgz)->fp);
+		if((*sgz)->zs_init) inflateEnd(&(*sgz)->zs);
+	}
+	sgz_free(sgz);
+	return ret;
+}
+
+int sgz_is_seekable(const char *path)
+{
+	int ret=0;
+	FILE *fp=NULL;
+	uint32_t clen=0;
+	uint32_t ulen=0;
+	uint8_t h[SGZ_HEADER_LEN];
+	if(!(fp=fopen(path, "rb"))) return 0;
+	if(fread(h, 1, sizeof(h), fp)==sizeof(h)
+	  && parse_header(h, &clen, &ulen))
+		ret=1;
+	close_fp(&fp);
+	return ret;
+}
+
+static int load_member(struct sgz *sgz, size_t m)
+{
+	uint8_t *cbuf=NULL;
+	uint32_t clen=sgz->clens[m];
+	int ret=-1;
+
+	if(!(cbuf=(uint8_t *)malloc_w(clen, __func__)))
+		return -1;
+	if(fseek(sgz->fp, sgz->coffs[m], SEEK_SET)
+	  || fread(cbuf, 1, clen, sgz->fp)!=clen)
+	{
+		logp("could not read member %lu in %s\n",
+			(unsigned long)m, __func__);
+		goto end;
+	}
+	if(inflateReset(&sgz->zs)!=Z_OK)
+		goto end;
+	sgz->zs.next_in=cbuf+SGZ_HEADER_LEN;
+	sgz->zs.avail_in=clen-SGZ_HEADER_LEN-SGZ_TRAILER_LEN;
+	sgz->zs.next_out=sgz->ubuf;
+	sgz->zs.avail_out=SGZ_CHUNK;
+	if(inflate(&sgz->zs, Z_FINISH)!=Z_STREAM_END
+	  || sgz->zs.total_out!=sgz->ulens[m]
+	  || crc32(crc32(0L, Z_NULL, 0), sgz->ubuf, sgz->ulens[m])
+		!=get_le32(cbuf+clen-SGZ_TRAILER_LEN))
+	{
+		logp("corrupt member %lu in %s\n", (unsigned long)m, __func__);
+		sgz->cached=-1;
+		goto end;
+	}
+	sgz->cached=m;
+	ret=0;
+end:
+	free_v((void **)&cbuf);
+	return ret;
+}
+
+rs_result sgz_copy_cb(void *opaque, rs_long_t pos, size_t *len, void **buf)
+{
+	size_t lo=0;
+	size_t hi=0;
+	size_t off=0;
+	struct sgz *sgz=(struct sgz *)opaque;
+
+	if(pos<0 || (uint64_t)pos>=sgz->usize)
+	{
+		logp("unexpected eof in %s\n", __func__);
+		return RS_INPUT_ENDED;
+	}
+
+	// Binary search for the member holding pos.
+	hi=sgz->members;
+	while(hi-lo>1)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(sgz->uoffs[mid]<=(uint64_t)pos) lo=mid;
+		else hi=mid;
+	}
+	if(sgz->cached!=(ssize_t)lo && load_member(sgz, lo))
+		return RS_IO_ERROR;
+
+	off=pos-sgz->uoffs[lo];
+	if(*len>sgz->ulens[lo]-off) *len=sgz->ulens[lo]-off;
+	memcpy(*buf, sgz->ubuf+off, *len);
+	return RS_DONE;
+}
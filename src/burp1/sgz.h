@@ -0,0 +1,51 @@
+#ifndef _SGZ_H
+#define _SGZ_H
+
+#include <librsync.h>
+
+// Seekable gzip.
+// A normal gzip file made up of independently compressed members, each
+// holding up to SGZ_CHUNK bytes of uncompressed data. The gzip header of
+// each member has an extra field giving its compressed and uncompressed
+// sizes, so a reader can find any offset by walking the headers instead of
+// inflating everything before it. Ordinary gzip readers see one stream.
+
+#define SGZ_CHUNK	(1024*1024)
+
+struct sgz
+{
+	FILE *fp;
+	int level;
+	z_stream zs;
+	uint8_t zs_init;
+
+	// Uncompressed data of the current member.
+	uint8_t *ubuf;
+	size_t ulen;
+	// Compressed data of the current member, including header and
+	// trailer.
+	uint8_t *zbuf;
+	size_t zbuf_len;
+
+	// Reading only.
+	size_t members;
+	uint64_t *coffs; // Offset of each member in the file.
+	uint32_t *clens; // Compressed length of each member.
+	uint64_t *uoffs; // Uncompressed offset of each member.
+	uint32_t *ulens; // Uncompressed length of each member.
+	uint64_t usize; // Total uncompressed size.
+	ssize_t cached; // Which member is in ubuf, or -1.
+};
+
+extern struct sgz *sgz_open_w(const char *path, int level);
+extern int sgz_write(struct sgz *sgz, const void *buf, size_t len);
+extern struct sgz *sgz_open_r(const char *path);
+extern int sgz_close(struct sgz **sgz);
+
+extern int sgz_is_seekable(const char *path);
+
+// Use with rs_patch_begin() to read a basis file directly.
+extern rs_result sgz_copy_cb(void *opaque, rs_long_t pos,
+	size_t *len, void **buf);
+
+#endif
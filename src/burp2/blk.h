@@ -36,7 +36,7 @@ struct blk
 	uint8_t got;				// 1
 	uint8_t requested;			// 1
 	uint8_t got_save_path;			// 1
-	uint8_t pad;				// 1
+	uint8_t hole;				// 1
 	uint32_t length;			// 4
 	uint64_t fingerprint;			// 8
 	uint8_t md5sum[MD5_DIGEST_LENGTH];	// 16
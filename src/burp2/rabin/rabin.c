@@ -7,15 +7,48 @@ static char *gbuf_end=NULL;
 
 static int first=0;
 
+#ifndef HAVE_WIN32
+// The hole in the file being read that is next, or that the chunker is in.
+// If hole_end is -1, there are no more.
+static off_t hole_start=-1;
+static off_t hole_end=-1;
+static uint8_t need_seek=0;
+static uint8_t zero_md5[MD5_DIGEST_LENGTH];
+#endif
+
 int blks_generate_init(struct conf *conf)
 {
 	if(!(gbuf=(char *)malloc_w(conf->rconf.blk_max, __func__)))
 		return -1;
 	gbuf_end=gbuf;
 	gcp=gbuf;
+#ifndef HAVE_WIN32
+	// The checksum of a whole block made up from a hole.
+	memset(gbuf, 0, conf->rconf.blk_max);
+	if(!MD5((unsigned char *)gbuf, conf->rconf.blk_max, zero_md5))
+	{
+		logp("MD5 failed.\n");
+		return -1;
+	}
+#endif
 	return 0;
 }
 
+static void blk_add(struct sbuf *sb, struct blist *blist)
+{
+	if(first)
+	{
+		sb->burp2->bstart=blk;
+		first=0;
+	}
+	if(!sb->burp2->bsighead)
+	{
+		sb->burp2->bsighead=blk;
+	}
+	blist_add_blk(blist, blk);
+	blk=NULL;
+}
+
 // This is where the magic happens.
 // Return 1 for got a block, 0 for no block got.
 static int blk_read(struct rconf *rconf, struct win *win, struct sbuf *sb, struct blist *blist)
@@ -41,18 +74,7 @@ static int blk_read(struct rconf *rconf, struct win *win, struct sbuf *sb, struc
 		 && (blk->length == rconf->blk_max
 		  || (win->checksum % rconf->blk_avg) == rconf->prime))
 		{
-			if(first)
-			{
-				sb->burp2->bstart=blk;
-				first=0;
-			}
-			if(!sb->burp2->bsighead)
-			{
-				sb->burp2->bsighead=blk;
-			}
-			blist_add_blk(blist, blk);
-			blk=NULL;
-
+			blk_add(sb, blist);
 			gcp++;
 			return 1;
 		}
@@ -60,6 +82,52 @@ static int blk_read(struct rconf *rconf, struct win *win, struct sbuf *sb, struc
 	return 0;
 }
 
+#ifndef HAVE_WIN32
+// Once the window is all zeroes, the checksum stays at zero, so blk_read()
+// only ends blocks at blk_max. So in a hole, after the first few bytes,
+// the blocks are all blk_max zeroes, and can be made up without reading or
+// looking at anything.
+// Return 1 for got a block, 0 for no block got.
+static int hole_blk(struct rconf *rconf, struct win *win,
+	struct sbuf *sb, struct blist *blist)
+{
+	off_t pos;
+	unsigned int i;
+
+	if(blk->length || win->checksum || hole_end<0)
+		return 0;
+	// Where the chunker has got to in the file.
+	pos=sb->burp2->bytes_read-(gbuf_end-gcp);
+	if(pos>=hole_end)
+	{
+		switch(bfile_next_hole(&sb->burp2->bfd,
+			pos, &hole_start, &hole_end))
+		{
+			case 0: break;
+			case 1: hole_end=-1; return 0;
+			default: return -1;
+		}
+	}
+	if(pos<hole_start || pos+(off_t)rconf->blk_max>hole_end)
+		return 0;
+	for(i=0; i<rconf->win; i++)
+		if(win->data[i]) return 0;
+
+	// The data is already zeroes, from when it was allocated.
+	blk->length=rconf->blk_max;
+	memcpy(blk->md5sum, zero_md5, MD5_DIGEST_LENGTH);
+	blk->hole=1;
+	win->pos=(win->pos+rconf->blk_max)%rconf->win;
+	win->total_bytes+=rconf->blk_max;
+	// Anything left in gbuf is in the hole too.
+	gcp=gbuf_end;
+	sb->burp2->bytes_read=pos+rconf->blk_max;
+	need_seek=1;
+	blk_add(sb, blist);
+	return 1;
+}
+#endif
+
 int blks_generate(struct asfd *asfd, struct conf *conf,
 	struct sbuf *sb, struct blist *blist, struct win *win)
 {
@@ -69,11 +137,37 @@ int blks_generate(struct asfd *asfd, struct conf *conf,
 	{
 		if(sbuf_open_file(sb, asfd, conf)) return -1;
 		first=1;
+#ifndef HAVE_WIN32
+		// Only files with fewer blocks than their size have holes
+		// worth asking about.
+		hole_start=-1;
+		hole_end=-1;
+		need_seek=0;
+		if((off_t)sb->statp.st_blocks*512<sb->statp.st_size)
+			hole_end=0;
+#endif
 	}
 
 	if(!blk && !(blk=blk_alloc_with_data(conf->rconf.blk_max)))
 		return -1;
 
+#ifndef HAVE_WIN32
+	switch(hole_blk(&conf->rconf, win, sb, blist))
+	{
+		case 0: break;
+		case 1: return 0; // Got a block.
+		default: return -1;
+	}
+	if(need_seek)
+	{
+		// Carry on reading from after the blocks made up from a hole.
+		need_seek=0;
+		if(gcp>=gbuf_end && bfile_seek(&sb->burp2->bfd,
+			sb->burp2->bytes_read))
+				return -1;
+	}
+#endif
+
 	if(gcp<gbuf_end)
 	{
 		// Could have got a fill before buf ran out -
@@ -108,19 +202,7 @@ int blks_generate(struct asfd *asfd, struct conf *conf,
 	}
 	else if(blk)
 	{
-		if(blk->length)
-		{
-			if(first)
-			{
-				sb->burp2->bstart=blk;
-				first=0;
-			}
-			if(!sb->burp2->bsighead)
-			{
-				sb->burp2->bsighead=blk;
-			}
-			blist_add_blk(blist, blk);
-		}
+		if(blk->length) blk_add(sb, blist);
 		else blk_free(&blk);
 		blk=NULL;
 	}
@@ -76,6 +76,13 @@ int do_backup_client(struct asfd *asfd, struct conf *conf, enum action action,
 					conf, resume);
 			break;
 	}
+	// Only keep the new phase1 cache if the server has everything in it.
+	if(ret) p1cache_abort();
+	else if(p1cache_commit(conf))
+		logp("Could not save phase1 cache\n");
+	else if(journal_commit(conf))
+		logp("Could not save change journal position\n");
+	journal_free();
 
 #if defined(HAVE_WIN32)
 	if(action==ACTION_BACKUP_TIMED) unset_low_priority();
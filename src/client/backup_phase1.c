@@ -46,6 +46,13 @@ static int usual_stuff(struct asfd *asfd,
 	struct conf *conf, const char *path, const char *link,
 	struct sbuf *sb, enum cmd cmd)
 {
+	if(cmd!=CMD_HARD_LINK && cmd!=CMD_SOFT_LINK) link=NULL;
+	switch(p1cache_entry(asfd, conf, sb, cmd, path, link))
+	{
+		case 0: break;
+		case 1: cntr_add_phase1(conf->cntr, cmd, 1); return 0;
+		default: return -1;
+	}
 	if(asfd->write_str(asfd, CMD_ATTRIBS, sb->attr.buf)
 	  || asfd->write_str(asfd, cmd, path)
 	  || ((cmd==CMD_HARD_LINK || cmd==CMD_SOFT_LINK)
@@ -186,11 +193,16 @@ int backup_phase1_client(struct asfd *asfd, struct conf *conf, int estimate)
 	dirsymbol=filesymbol;
 #endif
 
-	if(!(ff=find_files_init())) goto end;
+	if(!(ff=find_files_init())
+	  || (!estimate && (p1cache_open(conf)
+		|| journal_begin(conf, p1cache_usable()))))
+		goto end;
 	for(l=conf->startdir; l; l=l->next) if(l->flag)
 		if(find_files_begin(asfd, ff, conf, l->path)) goto end;
+	if(p1cache_end(asfd)) goto end;
 	ret=0;
 end:
+	if(ret) p1cache_abort();
 	cntr_print_end_phase1(conf->cntr);
 	if(ret) logp("Error in phase 1\n");
 	logp("Phase 1 end (file system scan)\n");
@@ -41,10 +41,10 @@ static int load_signature_and_send_delta(struct asfd *asfd,
 		return RS_IO_ERROR;
 	}
 
-	if(!(infb=rs_filebuf_new(asfd, bfd,
-		NULL, NULL, -1, ASYNC_BUF_LEN, bfd->datalen, conf->cntr))
+	if(!(infb=rs_filebuf_new(asfd, bfd, NULL, NULL, -1,
+		rs_filebuf_len(NULL, bfd), bfd->datalen, conf->cntr))
 	  || !(outfb=rs_filebuf_new(asfd, NULL, NULL,
-		NULL, asfd->fd, ASYNC_BUF_LEN, -1, conf->cntr)))
+		NULL, asfd->fd, asfd->frame_len, -1, conf->cntr)))
 	{
 		logp("could not rs_filebuf_new for delta\n");
 		if(infb) rs_filebuf_free(infb);
@@ -98,6 +98,57 @@ static int load_signature_and_send_delta(struct asfd *asfd,
 	return r;
 }
 
+#define DELTA_WORKERS_MAX	64
+
+// A delta being generated by a child process. The child writes a delta_hdr
+// to the start of fp, followed by the delta itself.
+// If stream is not -1, this is instead a new file being sent over one of the
+// extra streams, and datapth is the name that the server spools it under.
+struct delta_job
+{
+	pid_t pid;
+	FILE *fp;
+	int stream;
+	struct iobuf datapth;
+	struct iobuf attr;
+	struct iobuf path;
+};
+
+struct delta_hdr
+{
+	unsigned long long bytes;
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+};
+
+// Finished deltas are sent in the order that the server asked for them,
+// because the server writes them straight into its changed manifest, which
+// needs to stay sorted.
+struct delta_pool
+{
+	struct delta_job jobs[DELTA_WORKERS_MAX];
+	int head;
+	int count;
+	int workers;
+#ifndef HAVE_WIN32
+	struct streams streams;
+#endif
+};
+
+static void delta_pool_init(struct delta_pool *dpool, struct conf *conf)
+{
+	memset(dpool, 0, sizeof(struct delta_pool));
+	dpool->workers=conf->delta_workers;
+#ifdef HAVE_WIN32
+	dpool->workers=1;
+#endif
+	if(dpool->workers<1) dpool->workers=1;
+	if(dpool->workers>DELTA_WORKERS_MAX)
+		dpool->workers=DELTA_WORKERS_MAX;
+#ifndef HAVE_WIN32
+	streams_init(&dpool->streams, conf);
+#endif
+}
+
 static int send_whole_file_w(struct asfd *asfd,
 	struct sbuf *sb, const char *datapth,
 	int quick_read, unsigned long long *bytes, const char *encpassword,
@@ -114,6 +165,409 @@ static int send_whole_file_w(struct asfd *asfd,
 		  conf, bfd, extrameta, elen);
 }
 
+#ifndef HAVE_WIN32
+static void delta_job_free_content(struct delta_job *job)
+{
+	close_fp(&job->fp);
+	iobuf_free_content(&job->datapth);
+	iobuf_free_content(&job->attr);
+	iobuf_free_content(&job->path);
+}
+
+static int delta_child(BFILE *bfd, rs_signature_t *sumset, FILE *fp,
+	struct conf *conf)
+{
+	int ret=-1;
+	rs_result r;
+	size_t buf_len;
+	rs_job_t *job=NULL;
+	rs_buffers_t rsbuf;
+	rs_filebuf_t *infb=NULL;
+	rs_filebuf_t *outfb=NULL;
+	struct delta_hdr hdr;
+	memset(&rsbuf, 0, sizeof(rsbuf));
+	memset(&hdr, 0, sizeof(hdr));
+
+	// Leave room for the header, which is filled in at the end.
+	if(fwrite(&hdr, sizeof(hdr), 1, fp)!=1)
+	{
+		logp("could not write delta header\n");
+		goto end;
+	}
+	if(!(job=rs_delta_begin(sumset)))
+	{
+		logp("could not start delta job.\n");
+		goto end;
+	}
+	buf_len=rs_filebuf_len(NULL, bfd);
+	if(!(infb=rs_filebuf_new(NULL, bfd,
+		NULL, NULL, -1, buf_len, bfd->datalen, conf->cntr))
+	  || !(outfb=rs_filebuf_new(NULL, NULL,
+		fp, NULL, -1, buf_len, -1, conf->cntr)))
+	{
+		logp("could not rs_filebuf_new for delta\n");
+		goto end;
+	}
+	if((r=rs_job_drive(job, &rsbuf,
+		rs_infilebuf_fill, infb, rs_outfilebuf_drain, outfb))!=RS_DONE)
+	{
+		logp("delta job returned: %d\n", r);
+		goto end;
+	}
+	hdr.bytes=infb->bytes;
+	if(!MD5_Final(hdr.checksum, &(infb->md5)))
+	{
+		logp("MD5_Final() failed\n");
+		goto end;
+	}
+	if(fseek(fp, 0, SEEK_SET)
+	  || fwrite(&hdr, sizeof(hdr), 1, fp)!=1
+	  || fflush(fp))
+	{
+		logp("could not write delta header\n");
+		goto end;
+	}
+	ret=0;
+end:
+	if(infb) rs_filebuf_free(infb);
+	if(outfb) rs_filebuf_free(outfb);
+	if(job) rs_job_free(job);
+	return ret;
+}
+
+static int delta_job_send(struct asfd *asfd,
+	struct delta_job *job, struct conf *conf)
+{
+	int ret=-1;
+	size_t len;
+	struct delta_hdr hdr;
+	char *buf=NULL;
+	unsigned long long sentbytes=0;
+
+	if(fseek(job->fp, 0, SEEK_SET)
+	  || fread(&hdr, sizeof(hdr), 1, job->fp)!=1)
+	{
+		logp("could not read delta header for %s\n", job->path.buf);
+		goto end;
+	}
+
+	if(!(buf=(char *)malloc_w(asfd->frame_len, __func__))
+	  || asfd->write(asfd, &job->datapth)
+	  || asfd->write(asfd, &job->attr)
+	  || asfd->write(asfd, &job->path))
+		goto end;
+	while((len=fread(buf, 1, asfd->frame_len, job->fp))>0)
+	{
+		if(asfd->write_strn(asfd, CMD_APPEND, buf, len))
+			goto end;
+		sentbytes+=len;
+	}
+	if(ferror(job->fp))
+	{
+		logp("could not read delta for %s\n", job->path.buf);
+		goto end;
+	}
+	if(write_endfile(asfd, hdr.bytes, hdr.checksum))
+		goto end;
+
+	cntr_add(conf->cntr, CMD_FILE_CHANGED, 1);
+	cntr_add_bytes(conf->cntr, hdr.bytes);
+	cntr_add_sentbytes(conf->cntr, sentbytes);
+	ret=0;
+end:
+	free_w(&buf);
+	return ret;
+}
+
+// The extra stream gave up on the file, so send the whole thing over the
+// main connection instead.
+static int stream_job_resend(struct asfd *asfd,
+	struct delta_job *job, struct conf *conf)
+{
+	int ret=-1;
+	BFILE *bfd=NULL;
+	struct sbuf *sb=NULL;
+	unsigned long long bytes=0;
+
+	if(!(bfd=bfile_alloc())
+	  || !(sb=sbuf_alloc(conf)))
+		goto end;
+	bfile_init(bfd, 0, conf);
+	iobuf_copy(&sb->attr, &job->attr);
+	iobuf_init(&job->attr);
+	iobuf_copy(&sb->path, &job->path);
+	iobuf_init(&job->path);
+	attribs_decode(sb);
+
+	if(bfd->open_for_send(bfd, asfd,
+		sb->path.buf, sb->winattr, conf->atime, conf))
+	{
+		logw(asfd, conf, "Could not resend %s after extra stream failed",
+			sb->path.buf);
+		// Tell the server to forget about it.
+		if(asfd->write_str(asfd, CMD_INTERRUPT, sb->path.buf)
+		  || p1cache_forget(sb->path.buf))
+			goto end;
+		ret=0;
+		goto end;
+	}
+	if(asfd->write(asfd, &sb->attr)
+	  || asfd->write(asfd, &sb->path)
+	  || send_whole_file_w(asfd, sb, NULL, 0, &bytes,
+		conf->encryption_password, conf, sb->compression,
+		bfd, NULL, 0))
+			goto end;
+	cntr_add(conf->cntr, sb->path.cmd, 1);
+	cntr_add_bytes(conf->cntr, bytes);
+	cntr_add_sentbytes(conf->cntr, bytes);
+	ret=0;
+end:
+	if(bfd)
+	{
+		bfd->close(bfd, asfd);
+		bfile_free(&bfd);
+	}
+	sbuf_free(&sb);
+	return ret;
+}
+
+// The data of the file is already on the server, so just tell the main
+// connection where to find it.
+static int stream_job_send(struct delta_pool *dpool,
+	struct asfd *asfd, struct delta_job *job, int block, struct conf *conf)
+{
+	int ret=-1;
+	char *endfile=NULL;
+	char msg[64]="";
+	unsigned long long bytes;
+
+	switch(streams_result(&dpool->streams, job->stream, block, &endfile))
+	{
+		case 0:
+			break;
+		case 1:
+			return 1;
+		default:
+			logp("could not send %s on extra stream\n",
+				job->path.buf);
+			// It is still this file's turn, so send it here.
+			return stream_job_resend(asfd, job, conf);
+	}
+
+	snprintf(msg, sizeof(msg), "spooled:%s", job->datapth.buf);
+	if(asfd->write(asfd, &job->attr)
+	  || asfd->write(asfd, &job->path)
+	  || asfd->write_str(asfd, CMD_GEN, msg)
+	  || asfd->write_str(asfd, CMD_END_FILE, endfile))
+		goto end;
+
+	bytes=strtoull(endfile, NULL, 10);
+	cntr_add(conf->cntr, job->path.cmd, 1);
+	cntr_add_bytes(conf->cntr, bytes);
+	cntr_add_sentbytes(conf->cntr, bytes);
+	ret=0;
+end:
+	free_w(&endfile);
+	return ret;
+}
+
+// Send the oldest delta if its child has finished. If block is set, wait
+// for it to finish.
+// Returns 1 if the oldest delta is still being generated.
+static int delta_pool_send_head(struct delta_pool *dpool,
+	struct asfd *asfd, int block, struct conf *conf)
+{
+	int ret=-1;
+	int status;
+	pid_t pid;
+	struct delta_job *job=&dpool->jobs[dpool->head];
+
+	if(job->stream>=0)
+	{
+		if((ret=stream_job_send(dpool, asfd, job, block, conf))==1)
+			return 1;
+		goto end;
+	}
+
+	if((pid=waitpid(job->pid, &status, block?0:WNOHANG))<0)
+	{
+		logp("waitpid for delta of %s failed: %s\n",
+			job->path.buf, strerror(errno));
+		goto end;
+	}
+	if(!pid) return 1;
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		logp("error in sig/delta for %s (%s)\n",
+			job->path.buf, job->datapth.buf);
+		// Tell the server to forget about it.
+		if(asfd->write_str(asfd, CMD_INTERRUPT, job->path.buf)
+		  || p1cache_forget(job->path.buf))
+			goto end;
+	}
+	else if(delta_job_send(asfd, job, conf))
+		goto end;
+
+	ret=0;
+end:
+	delta_job_free_content(job);
+	dpool->head=(dpool->head+1)%DELTA_WORKERS_MAX;
+	dpool->count--;
+	return ret;
+}
+
+// Send whatever deltas are finished, in order. If block is set, wait for
+// all of them.
+static int delta_pool_flush(struct delta_pool *dpool,
+	struct asfd *asfd, int block, struct conf *conf)
+{
+	while(dpool->count)
+	{
+		switch(delta_pool_send_head(dpool, asfd, block, conf))
+		{
+			case 0: continue;
+			case 1: return 0;
+			default: return -1;
+		}
+	}
+	return 0;
+}
+
+static int delta_pool_add(struct delta_pool *dpool,
+	struct asfd *asfd, struct sbuf *sb, BFILE *bfd, struct conf *conf)
+{
+	pid_t pid;
+	FILE *fp=NULL;
+	struct delta_job *job;
+	rs_signature_t *sumset=NULL;
+
+	if(load_signature(asfd, &sumset, conf)) return -1;
+
+	if(!(fp=tmpfile()))
+	{
+		logp("could not open temporary file for delta of %s: %s\n",
+			sb->path.buf, strerror(errno));
+		goto error;
+	}
+
+	// Make room for another one.
+	if(dpool->count>=dpool->workers
+	  && delta_pool_send_head(dpool, asfd, 1 /* block */, conf))
+		goto error;
+
+	// Otherwise, both processes would write out anything still buffered.
+	fflush(NULL);
+	switch((pid=fork()))
+	{
+		case -1:
+			logp("could not fork for delta of %s: %s\n",
+				sb->path.buf, strerror(errno));
+			goto error;
+		case 0:
+			exit(delta_child(bfd, sumset, fp, conf)?1:0);
+		default:
+			break;
+	}
+	rs_free_sumset(sumset);
+
+	job=&dpool->jobs[(dpool->head+dpool->count)%DELTA_WORKERS_MAX];
+	job->pid=pid;
+	job->fp=fp;
+	job->stream=-1;
+	iobuf_copy(&job->datapth, &sb->burp1->datapth);
+	iobuf_init(&sb->burp1->datapth);
+	iobuf_copy(&job->attr, &sb->attr);
+	iobuf_init(&sb->attr);
+	iobuf_copy(&job->path, &sb->path);
+	iobuf_init(&sb->path);
+	dpool->count++;
+	return 0;
+error:
+	close_fp(&fp);
+	rs_free_sumset(sumset);
+	return -1;
+}
+
+// Hand a new file to one of the extra streams.
+// Returns 1 if there was no stream to take it.
+static int stream_job_add(struct delta_pool *dpool,
+	struct asfd *asfd, struct sbuf *sb, struct conf *conf)
+{
+	int s;
+	char *spool=NULL;
+	struct delta_job *job;
+
+	streams_start(&dpool->streams, asfd, conf);
+
+	// Every busy stream has a job in the pool, so this will not wait
+	// forever.
+	while((s=streams_idle(&dpool->streams))<0
+	  || dpool->count>=DELTA_WORKERS_MAX)
+	{
+		if(!dpool->count) return 1;
+		if(delta_pool_send_head(dpool, asfd, 1 /* block */, conf))
+			return -1;
+	}
+	if(streams_send(&dpool->streams, s, sb, &spool))
+		return 1;
+
+	job=&dpool->jobs[(dpool->head+dpool->count)%DELTA_WORKERS_MAX];
+	job->pid=0;
+	job->fp=NULL;
+	job->stream=s;
+	iobuf_from_str(&job->datapth, CMD_DATAPTH, spool);
+	iobuf_copy(&job->attr, &sb->attr);
+	iobuf_init(&sb->attr);
+	iobuf_copy(&job->path, &sb->path);
+	iobuf_init(&sb->path);
+	dpool->count++;
+	return 0;
+}
+
+// Used on error, so nothing gets sent.
+static void delta_pool_free_content(struct delta_pool *dpool)
+{
+	while(dpool->count)
+	{
+		struct delta_job *job=&dpool->jobs[dpool->head];
+		if(job->stream<0)
+		{
+			kill(job->pid, SIGTERM);
+			waitpid(job->pid, NULL, 0);
+		}
+		delta_job_free_content(job);
+		dpool->head=(dpool->head+1)%DELTA_WORKERS_MAX;
+		dpool->count--;
+	}
+	streams_free_content(&dpool->streams);
+}
+
+static int delta_pool_end(struct delta_pool *dpool,
+	struct asfd *asfd, struct conf *conf)
+{
+	if(delta_pool_flush(dpool, asfd, 1 /* block */, conf))
+		return -1;
+	return streams_stop(&dpool->streams);
+}
+#else
+static int delta_pool_flush(struct delta_pool *dpool,
+	struct asfd *asfd, int block, struct conf *conf)
+{
+	return 0;
+}
+
+static int delta_pool_end(struct delta_pool *dpool,
+	struct asfd *asfd, struct conf *conf)
+{
+	return 0;
+}
+
+static void delta_pool_free_content(struct delta_pool *dpool)
+{
+}
+#endif
+
 static int forget_file(struct asfd *asfd, struct sbuf *sb, struct conf *conf)
 {
 	// Tell the server to forget about this
@@ -121,6 +575,7 @@ static int forget_file(struct asfd *asfd, struct sbuf *sb, struct conf *conf)
 	// on a select waiting for it to arrive.
 	if(asfd->write_str(asfd, CMD_INTERRUPT, sb->path.buf))
 		return 0;
+	if(p1cache_forget(sb->path.buf)) return -1;
 
 	if(sb->path.cmd==CMD_FILE && sb->burp1->datapth.buf)
 	{
@@ -155,10 +610,12 @@ static int size_checks(struct asfd *asfd, struct sbuf *sb, struct conf *conf)
 }
 
 static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
-	BFILE *bfd, struct conf *conf)
+	BFILE *bfd, struct delta_pool *dpool, struct conf *conf)
 {
 	int ret=-1;
 	int forget=0;
+	int pipelined=0;
+	int streamed=0;
 	size_t elen=0;
 	char *extrameta=NULL;
 	unsigned long long bytes=0;
@@ -168,6 +625,21 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 	iobuf_copy(&sb->path, asfd->rbuf);
 	iobuf_init(asfd->rbuf);
 
+	pipelined=(dpool->workers>1
+	  && sb->path.cmd==CMD_FILE
+	  && sb->burp1->datapth.buf);
+#ifndef HAVE_WIN32
+	streamed=(dpool->streams.wanted
+	  && (sb->path.cmd==CMD_FILE || sb->path.cmd==CMD_ENC_FILE)
+	  && !sb->burp1->datapth.buf);
+#endif
+
+	// Anything else needs to go after the deltas and files that are
+	// already on their way.
+	if(!pipelined && !streamed
+	  && delta_pool_flush(dpool, asfd, 1 /* block */, conf))
+		goto error;
+
 #ifdef HAVE_WIN32
 	if(win32_lstat(sb->path.buf, &sb->statp, &sb->winattr))
 #else
@@ -195,6 +667,9 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 
 	if(forget)
 	{
+		if((pipelined || streamed)
+		  && delta_pool_flush(dpool, asfd, 1 /* block */, conf))
+			goto error;
 		if(forget_file(asfd, sb, conf)) goto error;
 		goto end;
 	}
@@ -212,6 +687,7 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 			sb, &extrameta, &elen, conf))
 		{
 			logw(asfd, conf, "Meta data error for %s", sb->path.buf);
+			if(p1cache_forget(sb->path.buf)) goto error;
 			goto end;
 		}
 		if(extrameta)
@@ -229,10 +705,34 @@ static int deal_with_data(struct asfd *asfd, struct sbuf *sb,
 		{
 			logw(asfd, conf,
 				"No meta data after all: %s", sb->path.buf);
+			if(p1cache_forget(sb->path.buf)) goto error;
 			goto end;
 		}
 	}
 
+#ifndef HAVE_WIN32
+	if(streamed)
+	{
+		// Send the data over an extra stream, and tell the main
+		// connection about it later.
+		switch(stream_job_add(dpool, asfd, sb, conf))
+		{
+			case 0: goto end;
+			case 1: break;
+			default: goto error;
+		}
+		// Nothing could take it, so send it here, in its turn.
+		if(delta_pool_flush(dpool, asfd, 1 /* block */, conf))
+			goto error;
+	}
+	if(pipelined)
+	{
+		// Generate the delta in a child process, and send it later.
+		if(delta_pool_add(dpool, asfd, sb, bfd, conf))
+			goto error;
+	}
+	else
+#endif
 	if(sb->path.cmd==CMD_FILE
 	  && sb->burp1->datapth.buf)
 	{
@@ -292,7 +792,7 @@ error:
 }
 
 static int parse_rbuf(struct asfd *asfd, struct sbuf *sb,
-	BFILE *bfd, struct conf *conf)
+	BFILE *bfd, struct delta_pool *dpool, struct conf *conf)
 {
 	static struct iobuf *rbuf;
 	rbuf=asfd->rbuf;
@@ -319,7 +819,7 @@ static int parse_rbuf(struct asfd *asfd, struct sbuf *sb,
 	  || rbuf->cmd==CMD_ENC_VSS_T
 	  || rbuf->cmd==CMD_EFS_FILE)
 	{
-		if(deal_with_data(asfd, sb, bfd, conf))
+		if(deal_with_data(asfd, sb, bfd, dpool, conf))
 			return -1;
 	}
 	else if(rbuf->cmd==CMD_WARNING)
@@ -345,6 +845,9 @@ static int do_backup_phase2_client(struct asfd *asfd,
 	BFILE *bfd=NULL;
 	struct sbuf *sb=NULL;
 	struct iobuf *rbuf=asfd->rbuf;
+	struct delta_pool dpool;
+
+	delta_pool_init(&dpool, conf);
 
 	if(!(bfd=bfile_alloc())
 	  || !(sb=sbuf_alloc(conf)))
@@ -372,17 +875,20 @@ static int do_backup_phase2_client(struct asfd *asfd,
 
 		if(rbuf->cmd==CMD_GEN && !strcmp(rbuf->buf, "backupphase2end"))
 		{
-			if(asfd->write_str(asfd, CMD_GEN, "okbackupphase2end"))
+			if(delta_pool_end(&dpool, asfd, conf)
+			  || asfd->write_str(asfd, CMD_GEN, "okbackupphase2end"))
 				goto end;
 			ret=0;
 			break;
 		}
 
-		if(parse_rbuf(asfd, sb, bfd, conf))
+		if(parse_rbuf(asfd, sb, bfd, &dpool, conf)
+		  || delta_pool_flush(&dpool, asfd, 0 /* no block */, conf))
 			goto end;
 	}
 
 end:
+	delta_pool_free_content(&dpool);
 	// It is possible for a bfd to still be open.
 	bfd->close(bfd, asfd);
 	bfile_free(&bfd);
@@ -401,6 +907,7 @@ int backup_phase2_client_burp1(struct asfd *asfd, struct conf *conf, int resume)
 
 	cntr_print_end(conf->cntr);
 	cntr_print(conf->cntr, ACTION_BACKUP);
+	rs_filebuf_log_stats();
 
 	if(ret) logp("Error in phase 2\n");
 	logp("Phase 2 end (send file data)\n");
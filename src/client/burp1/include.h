@@ -10,5 +10,6 @@
 #include "backup_phase2.h"
 #include "include.h"
 #include "restore.h"
+#include "streams.h"
 
 #endif
@@ -77,6 +77,9 @@ static int restore_file_or_get_meta(struct asfd *asfd, BFILE *bfd,
 			ret=transfer_gzfile_inl(asfd, sb, fname, bfd,
 				&rcvdbytes, &sentbytes,
 				encpassword, enccompressed, conf->cntr, NULL);
+			// So that a worker does not count it.
+			if(ret && restore_writer_took(bfd))
+				restore_writer_abort(bfd);
 #ifndef HAVE_WIN32
 			if(bfd->close(bfd, asfd))
 			{
@@ -85,8 +88,10 @@ static int restore_file_or_get_meta(struct asfd *asfd, BFILE *bfd,
 				ret=-1;
 			}
 #endif
-			if(!ret) attribs_set(asfd, rpath,
-				&(sb->statp), sb->winattr, conf);
+			// A restore worker sets them, if it has the file.
+			if(!ret && !restore_writer_took(bfd))
+				attribs_set(asfd, rpath,
+					&(sb->statp), sb->winattr, conf);
 		}
 		if(ret)
 		{
@@ -98,7 +103,9 @@ static int restore_file_or_get_meta(struct asfd *asfd, BFILE *bfd,
 			goto end;
 		}
 	}
-	if(!ret) cntr_add(conf->cntr, sb->path.cmd, 1);
+	// A restore worker counts it, if it has the file.
+	if(!ret && !restore_writer_took(bfd))
+		cntr_add(conf->cntr, sb->path.cmd, 1);
 end:
 	if(rpath) free(rpath);
 	return ret;
@@ -132,7 +139,12 @@ static int restore_metadata(struct asfd *asfd, BFILE *bfd, struct sbuf *sb,
 			return -1;
 	if(metadata)
 	{
-		
+		// A restore worker might still have the file.
+		if(restore_writer_sync(asfd, fname, conf))
+		{
+			free(metadata);
+			return -1;
+		}
 		if(set_extrameta(asfd, bfd,
 			fname, sb, metadata, metalen, conf))
 		{
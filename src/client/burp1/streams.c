@@ -0,0 +1,438 @@
+#include "include.h"
+#include "../../cmd.h"
+
+#ifndef HAVE_WIN32
+
+#include <poll.h>
+
+// What the main process sends to a worker. The path follows it.
+// A pathlen of zero tells the worker to finish.
+struct stream_job
+{
+	char cmd;
+	int compression;
+	size_t pathlen;
+	char spool[32];
+};
+
+// What a worker sends back when it has finished with a file.
+struct stream_result
+{
+	int ok;
+	char endfile[128];
+};
+
+// Like extra_comms(), but only sets up the things that matter for sending
+// file data.
+static int stream_extra_comms(struct asfd *asfd, struct conf *conf)
+{
+	int ret=-1;
+	char *feat=NULL;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	if(asfd->write_str(asfd, CMD_GEN, "extra_comms_begin")
+	  || asfd->read(asfd))
+		goto end;
+	feat=rbuf->buf;
+	rbuf->buf=NULL;
+	if(rbuf->cmd!=CMD_GEN
+	  || strncmp_w(feat, "extra_comms_begin ok"))
+	{
+		logp("unexpected response to extra_comms_begin: %s\n",
+			feat?feat:"");
+		goto end;
+	}
+	if(strstr(feat, ":extframes:")
+	  && conf->network_ext_frames
+	  && (asfd->write_str(asfd, CMD_GEN, "extframes")
+		|| asfd_set_ext_frames(asfd)))
+			goto end;
+	// Same as the main connection, so that the compression setting
+	// covers file data sent this way too.
+	if(strstr(feat, ":zframes:")
+	  && conf->network_compression>0)
+	{
+		char msg[32]="";
+		snprintf(msg, sizeof(msg), "zframes=%d",
+			conf->network_compression);
+		if(asfd->write_str(asfd, CMD_GEN, msg)
+		  || asfd_set_zframes(asfd, conf->network_compression))
+			goto end;
+	}
+	// The extra streams only carry protocol 1 file data.
+	if(strstr(feat, ":csetproto:")
+	  && asfd->write_str(asfd, CMD_GEN, "protocol=1"))
+		goto end;
+	if(asfd->write_str(asfd, CMD_GEN, "extra_comms_end")
+	  || asfd->read_expect(asfd, CMD_GEN, "extra_comms_end ok"))
+		goto end;
+	ret=0;
+end:
+	free_w(&feat);
+	return ret;
+}
+
+static int stream_connect(struct async **as, SSL_CTX **ctx,
+	struct conf *conf)
+{
+	int rfd=-1;
+	SSL *ssl=NULL;
+	struct asfd *asfd=NULL;
+	char *server_version=NULL;
+
+	if(ssl_setup(&rfd, &ssl, ctx, ACTION_BACKUP, conf))
+		goto error;
+	if(!(*as=async_alloc())
+	  || !(asfd=asfd_alloc())
+	  || (*as)->init(*as, 0)
+	  || asfd->init(asfd, "stream socket", *as, rfd, ssl,
+		ASFD_STREAM_STANDARD, conf))
+			goto error;
+	(*as)->asfd_add(*as, asfd);
+	asfd->set_bulk_packets(asfd);
+	// Use only the bucket that is shared with the main connection.
+	if(tbucket_global && asfd_set_ratelimit(asfd, 0))
+		goto error;
+
+	// The main connection has already dealt with any certificate
+	// signing, so this should always get 'nocsr'.
+	if(authorise_client(asfd, conf, &server_version)
+	  || ca_client_setup(asfd, conf))
+		goto error;
+	set_non_blocking(asfd->fd);
+	if(ssl_check_cert(asfd->ssl, conf)
+	  || stream_extra_comms(asfd, conf)
+	  || asfd->write_str(asfd, CMD_GEN, "stream")
+	  || asfd->read_expect(asfd, CMD_GEN, "stream ok"))
+		goto error;
+	free_w(&server_version);
+	return 0;
+error:
+	free_w(&server_version);
+	if(!asfd && rfd>=0) close(rfd);
+	return -1;
+}
+
+// Returns -1 if the connection cannot be used any more.
+static int stream_send_file(struct asfd *asfd, BFILE *bfd,
+	struct stream_job *job, const char *path, struct stream_result *res,
+	struct conf *conf)
+{
+	int ret=-1;
+	unsigned long long bytes=0;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	if(bfd->open_for_send(bfd, asfd, path, 0, conf->atime, conf))
+		return 0;
+	if(asfd->write_str(asfd, CMD_DATAPTH, job->spool))
+		goto end;
+	if((job->compression || conf->encryption_password)
+	  && job->cmd!=CMD_EFS_FILE)
+		ret=send_whole_file_gzl(asfd, path, NULL, 0, &bytes,
+			conf->encryption_password, conf, job->compression,
+			bfd, NULL, 0);
+	else
+		ret=send_whole_filel(asfd, (enum cmd)job->cmd, path, NULL, 0,
+			&bytes, conf, bfd, NULL, 0);
+	if(ret)
+	{
+		// Tell the server to throw away what it has got.
+		ret=asfd->write_str(asfd, CMD_INTERRUPT, job->spool);
+		goto end;
+	}
+
+	// The server echoes the end of the file back once it has the whole
+	// thing, so that the main connection can safely refer to it.
+	if(asfd->read(asfd)) goto end;
+	if(rbuf->cmd!=CMD_END_FILE)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		goto end;
+	}
+	snprintf(res->endfile, sizeof(res->endfile), "%s", rbuf->buf);
+	res->ok=1;
+	ret=0;
+end:
+	bfd->close(bfd, asfd);
+	iobuf_free_content(rbuf);
+	return ret;
+}
+
+static int stream_worker(int fd, struct conf *conf)
+{
+	int ret=-1;
+	char *path=NULL;
+	SSL_CTX *ctx=NULL;
+	BFILE *bfd=NULL;
+	struct async *as=NULL;
+	struct asfd *asfd=NULL;
+	struct stream_job job;
+	struct stream_result res;
+
+	memset(&res, 0, sizeof(res));
+	if(!(bfd=bfile_alloc())
+	  || stream_connect(&as, &ctx, conf))
+	{
+		// Let the main process know that we are no use.
+		fd_write_full(fd, &res, sizeof(res));
+		goto end;
+	}
+	bfile_init(bfd, 0, conf);
+	asfd=as->asfd;
+	res.ok=1;
+	if(fd_write_full(fd, &res, sizeof(res)))
+		goto end;
+
+	while(1)
+	{
+		if(fd_read_full(fd, &job, sizeof(job)))
+			goto end;
+		if(!job.pathlen)
+		{
+			if(asfd->write_str(asfd, CMD_GEN, "streamend")
+			  || asfd->read_expect(asfd, CMD_GEN, "streamend ok"))
+				goto end;
+			break;
+		}
+		if(!(path=(char *)malloc_w(job.pathlen+1, __func__))
+		  || fd_read_full(fd, path, job.pathlen))
+			goto end;
+		path[job.pathlen]='\0';
+		job.spool[sizeof(job.spool)-1]='\0';
+
+		memset(&res, 0, sizeof(res));
+		if(stream_send_file(asfd, bfd, &job, path, &res, conf))
+			goto end;
+		if(fd_write_full(fd, &res, sizeof(res)))
+			goto end;
+		free_w(&path);
+	}
+	ret=0;
+end:
+	free_w(&path);
+	bfile_free(&bfd);
+	async_asfd_free_all(&as);
+	if(ctx) ssl_destroy_ctx(ctx);
+	close(fd);
+	return ret;
+}
+
+static void stream_drop(struct streams *streams, int s)
+{
+	struct stream *stream=&streams->s[s];
+	if(stream->fd<0) return;
+	close(stream->fd);
+	stream->fd=-1;
+	stream->busy=0;
+	if(stream->pid>0)
+	{
+		kill(stream->pid, SIGTERM);
+		waitpid(stream->pid, NULL, 0);
+		stream->pid=0;
+	}
+	streams->count--;
+}
+
+static int stream_fork(struct streams *streams, int s,
+	struct asfd *asfd, struct conf *conf)
+{
+	int i;
+	pid_t pid;
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		logp("could not socketpair for extra stream: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	switch((pid=fork()))
+	{
+		case -1:
+			logp("could not fork for extra stream: %s\n",
+				strerror(errno));
+			close(sv[0]);
+			close(sv[1]);
+			return -1;
+		case 0:
+			// Leave the main connection and the other workers
+			// alone.
+			close(sv[0]);
+			close(asfd->fd);
+			for(i=0; i<s; i++)
+				if(streams->s[i].fd>=0)
+					close(streams->s[i].fd);
+			exit(stream_worker(sv[1], conf)?1:0);
+		default:
+			break;
+	}
+	close(sv[1]);
+	streams->s[s].pid=pid;
+	streams->s[s].fd=sv[0];
+	streams->count++;
+	return 0;
+}
+
+void streams_init(struct streams *streams, struct conf *conf)
+{
+	int s;
+	memset(streams, 0, sizeof(struct streams));
+	for(s=0; s<STREAMS_MAX; s++)
+		streams->s[s].fd=-1;
+	streams->wanted=conf->network_streams;
+	if(streams->wanted<0) streams->wanted=0;
+	if(streams->wanted>STREAMS_MAX) streams->wanted=STREAMS_MAX;
+}
+
+// Connect the workers the first time that there is something for them to
+// do, so that backups with no new files do not pay for it.
+void streams_start(struct streams *streams,
+	struct asfd *asfd, struct conf *conf)
+{
+	int s;
+	struct stream_result res;
+
+	if(streams->started) return;
+	streams->started=1;
+
+	// The ratelimit is for the whole backup, so the main connection and
+	// the extra ones all take from one bucket in shared memory.
+	if(conf->ratelimit)
+	{
+		if(tbucket_global_set(conf->ratelimit)
+		  || asfd_set_ratelimit(asfd, 0))
+		{
+			logp("Not using extra streams\n");
+			return;
+		}
+		asfd->gtb=tbucket_global;
+	}
+
+	// Otherwise, both processes would write out anything still buffered.
+	fflush(NULL);
+	for(s=0; s<streams->wanted; s++)
+		if(stream_fork(streams, s, asfd, conf))
+			break;
+	// The workers connect in parallel, then each says whether it made
+	// it.
+	for(s=0; s<streams->wanted; s++)
+	{
+		if(streams->s[s].fd<0) continue;
+		if(fd_read_full(streams->s[s].fd, &res, sizeof(res))
+		  || !res.ok)
+		{
+			logp("extra stream %d could not connect\n", s);
+			stream_drop(streams, s);
+		}
+	}
+	logp("Using %d extra stream%s\n",
+		streams->count, streams->count==1?"":"s");
+}
+
+// Returns a worker that is not busy, or -1 if there are none.
+int streams_idle(struct streams *streams)
+{
+	int s;
+	for(s=0; s<streams->wanted; s++)
+		if(streams->s[s].fd>=0 && !streams->s[s].busy)
+			return s;
+	return -1;
+}
+
+// Give a new file to a worker. The name that the server will spool it under
+// is returned in spool.
+int streams_send(struct streams *streams, int s,
+	struct sbuf *sb, char **spool)
+{
+	struct stream_job job;
+	struct stream *stream=&streams->s[s];
+
+	memset(&job, 0, sizeof(job));
+	job.cmd=sb->path.cmd;
+	job.compression=sb->compression;
+	job.pathlen=sb->path.len;
+	snprintf(job.spool, sizeof(job.spool), "%llu", ++streams->seq);
+
+	if(!(*spool=strdup_w(job.spool, __func__)))
+		return -1;
+	if(fd_write_full(stream->fd, &job, sizeof(job))
+	  || fd_write_full(stream->fd, sb->path.buf, sb->path.len))
+	{
+		logp("extra stream %d went away\n", s);
+		stream_drop(streams, s);
+		free_w(spool);
+		return -1;
+	}
+	stream->busy=1;
+	return 0;
+}
+
+// Get the result of the file that a worker was given. On success, endfile
+// is set to what needs to go in the manifest.
+// Returns 1 if the worker is not finished and block is not set, and -1 if
+// the file was not sent.
+int streams_result(struct streams *streams, int s, int block,
+	char **endfile)
+{
+	struct pollfd pfd;
+	struct stream_result res;
+	struct stream *stream=&streams->s[s];
+
+	if(stream->fd<0) return -1;
+	if(!block)
+	{
+		pfd.fd=stream->fd;
+		pfd.events=POLLIN;
+		pfd.revents=0;
+		if(poll(&pfd, 1, 0)<=0) return 1;
+	}
+	stream->busy=0;
+	if(fd_read_full(stream->fd, &res, sizeof(res)))
+	{
+		logp("extra stream %d went away\n", s);
+		stream_drop(streams, s);
+		return -1;
+	}
+	if(!res.ok) return -1;
+	res.endfile[sizeof(res.endfile)-1]='\0';
+	if(!(*endfile=strdup_w(res.endfile, __func__)))
+		return -1;
+	return 0;
+}
+
+// Tell the workers to finish, and wait for them.
+int streams_stop(struct streams *streams)
+{
+	int s;
+	int ret=0;
+	int status;
+	struct stream_job job;
+
+	memset(&job, 0, sizeof(job));
+	for(s=0; s<streams->wanted; s++)
+	{
+		struct stream *stream=&streams->s[s];
+		if(stream->fd<0) continue;
+		if(fd_write_full(stream->fd, &job, sizeof(job))
+		  || waitpid(stream->pid, &status, 0)<0
+		  || !WIFEXITED(status) || WEXITSTATUS(status))
+		{
+			logp("extra stream %d did not finish cleanly\n", s);
+			ret=-1;
+		}
+		else
+			stream->pid=0;
+		stream_drop(streams, s);
+	}
+	return ret;
+}
+
+// Used on error.
+void streams_free_content(struct streams *streams)
+{
+	int s;
+	for(s=0; s<streams->wanted; s++)
+		stream_drop(streams, s);
+}
+
+#endif
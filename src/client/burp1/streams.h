@@ -0,0 +1,35 @@
+#ifndef _STREAMS_CLIENT_BURP1_H
+#define _STREAMS_CLIENT_BURP1_H
+
+#define STREAMS_MAX	16
+
+// A worker process with its own connection to the server, which sends the
+// new files that it is given. It talks to the main process over fd.
+struct stream
+{
+	pid_t pid;
+	int fd;
+	uint8_t busy;
+};
+
+struct streams
+{
+	struct stream s[STREAMS_MAX];
+	int wanted;
+	int count; // Workers that are still usable.
+	uint8_t started;
+	unsigned long long seq;
+};
+
+extern void streams_init(struct streams *streams, struct conf *conf);
+extern void streams_start(struct streams *streams,
+	struct asfd *asfd, struct conf *conf);
+extern int streams_idle(struct streams *streams);
+extern int streams_send(struct streams *streams, int s,
+	struct sbuf *sb, char **spool);
+extern int streams_result(struct streams *streams, int s, int block,
+	char **endfile);
+extern int streams_stop(struct streams *streams);
+extern void streams_free_content(struct streams *streams);
+
+#endif
@@ -39,6 +39,8 @@ static int add_to_file_requests(struct slist *slist, struct iobuf *rbuf,
 	rbuf->buf=NULL;
 	// Give it a number to simplify tracking.
 	sb->burp2->index=file_no++;
+	if(conf->prefetch_files>0)
+		sb->burp2->bfd.open_for_send=prefetch_open_for_send;
 	slist_add_sbuf(slist, sb);
 
 	return 0;
@@ -142,7 +144,8 @@ static int add_to_blks_list(struct asfd *asfd, struct conf *conf,
 {
 	struct sbuf *sb=slist->last_requested;
 	if(!sb) return 0;
-	if(blks_generate(asfd, conf, sb, blist, win)) return -1;
+	if(prefetch_fill(sb)
+	  || blks_generate(asfd, conf, sb, blist, win)) return -1;
 
 	// If it closed the file, move to the next one.
 	if(sb->burp2->bfd.mode==BF_CLOSED) slist->last_requested=sb->next;
@@ -212,7 +215,8 @@ static void get_wbuf_from_data(struct conf *conf,
 static int iobuf_from_blk_data(struct iobuf *wbuf, struct blk *blk)
 {
 	static char buf[CHECKSUM_LEN];
-	if(blk_md5_update(blk)) return -1;
+	// Blocks made up from holes already have it.
+	if(!blk->hole && blk_md5_update(blk)) return -1;
 
 	// FIX THIS: consider endian-ness.
 	memcpy(buf, &blk->fingerprint, FINGERPRINT_LEN);
@@ -315,6 +319,7 @@ int backup_phase2_client_burp2(struct asfd *asfd, struct conf *conf, int resume)
 	  || !(blist=blist_alloc())
 	  || !(wbuf=iobuf_alloc())
 	  || blks_generate_init(conf)
+	  || prefetch_init(conf)
 	  || !(win=win_alloc(&conf->rconf)))
 		goto end;
 	rbuf=asfd->rbuf;
@@ -398,6 +403,7 @@ int backup_phase2_client_burp2(struct asfd *asfd, struct conf *conf, int resume)
 end:
 blk_print_alloc_stats();
 //sbuf_print_alloc_stats();
+	prefetch_free();
 	win_free(win);
 	slist_free(&slist);
 	blist_free(&blist);
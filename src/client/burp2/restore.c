@@ -38,7 +38,9 @@ static int start_restore_file(struct asfd *asfd,
 		default: goto error;
 	}
 
-	cntr_add(conf->cntr, sb->path.cmd, 1);
+	// A restore worker counts it, if it has the file.
+	if(!restore_writer_took(bfd))
+		cntr_add(conf->cntr, sb->path.cmd, 1);
 
 end:
 	ret=0;
@@ -0,0 +1,152 @@
+#include "include.h"
+#include "../pathcmp.h"
+
+#ifdef HAVE_LINUX_OS
+#include <sys/syscall.h>
+
+// What getdents64 fills its buffer with.
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#define GETDENTS_BUFSIZE	(256*1024)
+#endif
+
+// Opens a directory for dirlist_read(), or returns -1 with errno set.
+int dirlist_open(const char *path, struct conf *conf)
+{
+	int dfd=-1;
+#ifdef O_NOATIME
+	if(!conf->atime)
+		dfd=open(path, O_RDONLY|O_DIRECTORY|O_NOATIME);
+	// O_NOATIME is only allowed on things that we own.
+	if(dfd<0)
+#endif
+		dfd=open(path, O_RDONLY|O_DIRECTORY);
+	return dfd;
+}
+
+int dirlist_add(struct dirlist *d, const char *name, size_t len)
+{
+	if(d->count==d->off_alloc)
+	{
+		size_t *tmp;
+		int want=d->off_alloc?d->off_alloc*2:64;
+		if(!(tmp=(size_t *)realloc_w(d->off,
+			want*sizeof(*tmp), __func__)))
+				return -1;
+		d->off=tmp;
+		d->off_alloc=want;
+	}
+	if(d->len+len+1>d->alloc)
+	{
+		char *tmp;
+		size_t want=d->alloc?d->alloc:4096;
+		while(want<d->len+len+1) want*=2;
+		if(!(tmp=(char *)realloc_w(d->arena, want, __func__)))
+			return -1;
+		d->arena=tmp;
+		d->alloc=want;
+	}
+	memcpy(d->arena+d->len, name, len);
+	d->arena[d->len+len]='\0';
+	d->off[d->count++]=d->len;
+	d->len+=len+1;
+	return 0;
+}
+
+static int skip_name(const char *name)
+{
+	return name[0]=='.'
+	  && (!name[1] || (name[1]=='.' && !name[2]));
+}
+
+// qsort() has no way to pass the arena to the comparison function, but
+// there is only ever one sort going on in a process.
+static const char *sort_arena=NULL;
+
+static int off_cmp(const void *a, const void *b)
+{
+	return pathcmp(sort_arena+*(const size_t *)a,
+		sort_arena+*(const size_t *)b);
+}
+
+// Sort into the order in which find_files() goes through them.
+void dirlist_sort(struct dirlist *d)
+{
+	if(d->count<2) return;
+	sort_arena=d->arena;
+	qsort(d->off, d->count, sizeof(*d->off), off_cmp);
+	sort_arena=NULL;
+}
+
+#ifdef HAVE_LINUX_OS
+// Reads all of the names in a directory in big batches, straight into the
+// arena, and sorts them. dfd stays open, so that the caller can fstatat()
+// relative to it.
+int dirlist_read(struct dirlist *d, int dfd)
+{
+	long n;
+	long pos;
+	char *buf;
+
+	if(!(buf=(char *)malloc_w(GETDENTS_BUFSIZE, __func__)))
+		return -1;
+	while((n=syscall(SYS_getdents64, dfd, buf, GETDENTS_BUFSIZE))>0)
+	{
+		for(pos=0; pos<n; )
+		{
+			struct linux_dirent64 *ent=
+				(struct linux_dirent64 *)(buf+pos);
+			pos+=ent->d_reclen;
+			if(skip_name(ent->d_name)) continue;
+			if(dirlist_add(d, ent->d_name, strlen(ent->d_name)))
+			{
+				free_w(&buf);
+				return -1;
+			}
+		}
+	}
+	// Like readdir(), a failure part way through just ends the list.
+	if(n<0) logp("getdents64 failed: %s\n", strerror(errno));
+	free_w(&buf);
+	dirlist_sort(d);
+	return 0;
+}
+#endif
+
+// For where there is no getdents64. Uses the one dirent for every entry.
+int dirlist_read_dir(struct dirlist *d, DIR *directory)
+{
+	struct dirent *entry=NULL;
+	struct dirent *result=NULL;
+
+	if(!(entry=(struct dirent *)malloc_w(
+		sizeof(struct dirent)+fs_name_max+100, __func__)))
+			return -1;
+	while(!readdir_r(directory, entry, &result) && result)
+	{
+		if(skip_name(entry->d_name)) continue;
+		if(dirlist_add(d, entry->d_name, strlen(entry->d_name)))
+		{
+			free_v((void **)&entry);
+			return -1;
+		}
+	}
+	free_v((void **)&entry);
+	dirlist_sort(d);
+	return 0;
+}
+
+void dirlist_free_content(struct dirlist *d)
+{
+	free_w(&d->arena);
+	free_v((void **)&d->off);
+	free_v((void **)&d->entries);
+	memset(d, 0, sizeof(*d));
+}
@@ -0,0 +1,30 @@
+#ifndef _DIRLIST_CLIENT_H
+#define _DIRLIST_CLIENT_H
+
+// The names in a directory, packed one after another into a single block
+// of memory, so that a huge directory costs little more than the length of
+// its names, and can be freed in one go.
+struct dirlist
+{
+	char *arena;
+	size_t len;
+	size_t alloc;
+	size_t *off; // Start of each name in the arena, sorted.
+	int count;
+	int off_alloc;
+	// What a scan worker found out about each entry, or NULL.
+	struct scan_entry *entries;
+};
+
+#define DIRLIST_NAME(d, i)	((d)->arena+(d)->off[(i)])
+
+extern int dirlist_open(const char *path, struct conf *conf);
+#ifdef HAVE_LINUX_OS
+extern int dirlist_read(struct dirlist *d, int dfd);
+#endif
+extern int dirlist_read_dir(struct dirlist *d, DIR *directory);
+extern int dirlist_add(struct dirlist *d, const char *name, size_t len);
+extern void dirlist_sort(struct dirlist *d);
+extern void dirlist_free_content(struct dirlist *d);
+
+#endif
@@ -23,6 +23,7 @@ int extra_comms(struct async *as, struct conf *conf,
 {
 	int ret=-1;
 	char *feat=NULL;
+	const char *cp=NULL;
 	struct asfd *asfd;
 	struct iobuf *rbuf;
 	asfd=as->asfd;
@@ -155,6 +156,78 @@ int extra_comms(struct async *as, struct conf *conf,
 		}
 	}
 
+	// :extframes: means that the server can take frames that are too
+	// long for the normal header, so that bulk data can go in bigger
+	// pieces. The server only sends them once it has read this, so we
+	// can be ready for them straight away.
+	if(server_supports(feat, ":extframes:")
+	  && conf->network_ext_frames)
+	{
+		if(asfd->write_str(asfd, CMD_GEN, "extframes")
+		  || asfd_set_ext_frames(asfd))
+			goto end;
+		logp("Using extended frames\n");
+	}
+
+	// :gzmembers: means that the server can send protocol 1 files that
+	// are stored as several gzip members one after the other, instead of
+	// inflating and compressing them again first.
+	if(server_supports(feat, ":gzmembers:")
+	  && asfd->write_str(asfd, CMD_GEN, "gzmembers"))
+		goto end;
+
+	// :phase1cache=token: means that the server can fill in runs of
+	// unchanged phase1 entries from its current backup, which it has
+	// labelled with the token that the client gave it last time.
+	if(conf->phase1_cache
+	  && (cp=server_supports(feat, ":phase1cache=")))
+	{
+		char *x;
+		char msg[128]="";
+		struct timeval tv;
+		free_w(&conf->phase1_cache_cur);
+		free_w(&conf->phase1_cache_new);
+		if(!(conf->phase1_cache_cur=strdup_w(
+			cp+strlen(":phase1cache="), __func__)))
+				goto end;
+		if((x=strchr(conf->phase1_cache_cur, ':'))) *x='\0';
+		gettimeofday(&tv, NULL);
+		snprintf(msg, sizeof(msg), "%lx%lx%lx",
+			(unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec,
+			(unsigned long)getpid());
+		if(!(conf->phase1_cache_new=strdup_w(msg, __func__)))
+			goto end;
+		snprintf(msg, sizeof(msg), "phase1cache=%s",
+			conf->phase1_cache_new);
+		if(asfd->write_str(asfd, CMD_GEN, msg)) goto end;
+	}
+
+	// :zframes: means that the server can take compressed data frames.
+	// Once it has read this, it will compress the ones it sends too.
+	if(server_supports(feat, ":zframes:")
+	  && conf->network_compression>0)
+	{
+		char msg[32]="";
+		snprintf(msg, sizeof(msg), "zframes=%d",
+			conf->network_compression);
+		if(asfd->write_str(asfd, CMD_GEN, msg)
+		  || asfd_set_zframes(asfd, conf->network_compression))
+			goto end;
+		logp("Using compressed frames, up to level %d\n",
+			asfd->zlevel_max);
+	}
+
+	// :streams=n: means that the server will take new files over up to
+	// n extra connections during a backup.
+	if((cp=server_supports(feat, ":streams=")))
+	{
+		int max=atoi(cp+strlen(":streams="));
+		if(conf->network_streams>max)
+			conf->network_streams=max;
+	}
+	else
+		conf->network_streams=0;
+
 	if(server_supports(feat, ":csetproto:"))
 	{
 		char msg[128]="";
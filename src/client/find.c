@@ -51,27 +51,20 @@
 #include <sys/statfs.h>
 #endif
 
-/*
- * Structure for keeping track of hard linked files, we
- *   keep an entry for each hardlinked file that we save,
- *   which is the first one found. For all the other files that
- *   are linked to this one, we save only the directory
- *   entry so we can link it.
- */
-struct f_link
-{
-	struct f_link *next;
-	dev_t dev;
-	ino_t ino;		// Inode with device is unique.
-	char *name;
-};
+// Hard linked files found, so that the data of each is only sent once.
+static struct linktable *linktable=NULL;
 
-// List of all hard linked files found.
-static struct f_link **linkhash=NULL;
+#ifdef HAVE_LINUX_OS
+// Directories kept open by found_directory() while it goes through them.
+#define DFDS_OPEN_MAX	64
+static int dfds_open=0;
+#endif
 
-#define LINK_HASHTABLE_BITS 16
-#define LINK_HASHTABLE_SIZE (1<<LINK_HASHTABLE_BITS)
-#define LINK_HASHTABLE_MASK (LINK_HASHTABLE_SIZE-1)
+#ifndef HAVE_WIN32
+// Workers that read directories ahead of us, if there are any.
+static struct scan *scan=NULL;
+static uint8_t scan_started=0;
+#endif
 
 // Initialize the find files "global" variables
 FF_PKT *find_files_init(void)
@@ -79,8 +72,7 @@ FF_PKT *find_files_init(void)
 	FF_PKT *ff;
 
 	if(!(ff=(FF_PKT *)calloc_w(1, sizeof(FF_PKT), __func__))
-	  || !(linkhash=(f_link **)
-		calloc_w(1, LINK_HASHTABLE_SIZE*sizeof(f_link *), __func__)))
+	  || !(linktable=linktable_alloc()))
 			return NULL;
 
 	// Get system path and filename maximum lengths.
@@ -91,61 +83,16 @@ FF_PKT *find_files_init(void)
 	return ff;
 }
 
-static inline int LINKHASH(const struct stat &info)
-{
-	int hash=info.st_dev;
-	unsigned long long i=info.st_ino;
-	hash ^= i;
-	i >>= 16;
-	hash ^= i;
-	i >>= 16;
-	hash ^= i;
-	i >>= 16;
-	hash ^= i;
-	return hash & LINK_HASHTABLE_MASK;
-}
-
-static int free_linkhash(void)
-{
-	int i;
-	int count=0;
-	struct f_link *lp;
-	struct f_link *lc;
-
-	if(!linkhash) return 0;
-
-	for(i=0; i<LINK_HASHTABLE_SIZE; i++)
-	{
-		// Free up list of hard linked files.
-		lp=linkhash[i];
-		while(lp)
-		{
-			lc=lp;
-			lp=lp->next;
-			if(lc)
-			{
-				free_w(&lc->name);
-				free_v((void **)&lc);
-				count++;
-			}
-		}
-		linkhash[i]=NULL;
-	}
-	free_v((void **)&linkhash);
-	return count;
-}
-
 void find_files_free(FF_PKT *ff)
 {
-	free_linkhash();
+	linktable_free(&linktable);
+#ifndef HAVE_WIN32
+	scan_free(&scan);
+	scan_started=0;
+#endif
 	free_v((void **)&ff);
 }
 
-static int myalphasort(const struct dirent **a, const struct dirent **b)
-{
-	return pathcmp((*a)->d_name, (*b)->d_name);
-}
-
 // Return 1 to include the file, 0 to exclude it.
 static int in_include_ext(struct strlist *incext, const char *fname)
 {
@@ -422,94 +369,58 @@ static void windows_reparse_point_fiddling(FF_PKT *ff_pkt)
 }
 #endif
 
-static int get_files_in_directory(DIR *directory, struct dirent ***nl, int *count)
-{
-	int status;
-	int allocated=0;
-	struct dirent **ntmp=NULL;
-	struct dirent *entry=NULL;
-	struct dirent *result=NULL;
-
-	/* Graham says: this here is doing a funky kind of scandir/alphasort
-	   that can also run on Windows.
-	*/
-	while(1)
-	{
-		char *p;
-		if(!(entry=(struct dirent *)malloc_w(
-			sizeof(struct dirent)+fs_name_max+100, __func__)))
-				return -1;
-		status=readdir_r(directory, entry, &result);
-		if(status || !result)
-		{
-			free_v((void **)&entry);
-			break;
-		}
-
-		p=entry->d_name;
-		ASSERT(fs_name_max+1 > (int)sizeof(struct dirent)+strlen(p));
-
-		/* Skip `.', `..', and excluded file names.  */
-		if(!p || !strcmp(p, ".") || !strcmp(p, ".."))
-		{
-			free_v((void **)&entry);
-			continue;
-		}
-
-		if(*count==allocated)
-		{
-			if(!allocated) allocated=10;
-			else allocated*=2;
-
-			if(!(ntmp=(struct dirent **)
-			  realloc_w(*nl, allocated*sizeof(**nl), __func__)))
-			{
-				free_v((void **)&entry);
-				return -1;
-			}
-			*nl=ntmp;
-		}
-		(*nl)[(*count)++]=entry;
-	}
-	if(*nl) qsort(*nl, *count, sizeof(**nl),
-		(int (*)(const void *, const void *))myalphasort);
-	return 0;
-}
-
 // Prototype because process_files_in_directory() recurses using find_files().
 static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
-	char *fname, dev_t parent_device, bool top_level);
+	char *fname, dev_t parent_device, bool top_level,
+	struct scan_entry *entry);
 
-static int process_files_in_directory(struct asfd *asfd, struct dirent **nl,
-	int count, int *rtn_stat, char **link, size_t len, size_t *link_len,
+// dfd is the directory that the entries are in, if it is still open.
+static int process_files_in_directory(struct asfd *asfd, struct dirlist *dl,
+	int dfd, int *rtn_stat, char **link, size_t len, size_t *link_len,
 	struct conf *conf, FF_PKT *ff_pkt, dev_t our_device)
 {
 	int m=0;
-	for(m=0; m<count; m++)
+	for(m=0; m<dl->count; m++)
 	{
-		size_t i;
-		char *p=NULL;
-		char *q=NULL;
+		size_t nlen;
+		const char *p;
 
-		p=nl[m]->d_name;
+#ifndef HAVE_WIN32
+		// Keep the scan workers busy while files are being sent.
+		if(scan && !(m%32)) scan_poll(scan);
+#endif
+
+		p=DIRLIST_NAME(dl, m);
+		nlen=strlen(p);
 
-		if(strlen(p)+len>=*link_len)
+		if(nlen+len>=*link_len)
 		{
-			*link_len=len+strlen(p)+1;
+			*link_len=len+nlen+1;
 			if(!(*link=(char *)
 			  realloc_w(*link, (*link_len)+1, __func__)))
 				return -1;
 		}
-		q=(*link)+len;
-		for(i=0; i<strlen(nl[m]->d_name); i++)
-			*q++=*p++;
-		*q=0;
-		ff_pkt->flen=i;
+		memcpy((*link)+len, p, nlen+1);
+		ff_pkt->flen=nlen;
 
 		if(file_is_included_no_incext(conf, *link))
 		{
+			struct scan_entry e;
+			struct scan_entry *entry=NULL;
+			if(dl->entries)
+				entry=&dl->entries[m];
+#ifndef HAVE_WIN32
+			else if(dfd>=0)
+			{
+				// Relative to the directory, which saves the
+				// kernel from walking the whole path again.
+				e.stat_ok=!fstatat(dfd, p, &e.statp,
+					AT_SYMLINK_NOFOLLOW);
+				entry=&e;
+			}
+#endif
 			*rtn_stat=find_files(asfd, ff_pkt,
-				conf, *link, our_device, false);
+				conf, *link, our_device, false, entry);
 		}
 		else
 		{
@@ -524,7 +435,7 @@ static int process_files_in_directory(struct asfd *asfd, struct dirent **nl,
 					struct strlist *y;
 					if((*rtn_stat=find_files(asfd, ff_pkt,
 						conf, x->path,
-						our_device, false)))
+						our_device, false, NULL)))
 							break;
 					// Now need to skip subdirectories of
 					// the thing that we just stuck in
@@ -536,26 +447,61 @@ static int process_files_in_directory(struct asfd *asfd, struct dirent **nl,
 				}
 			}
 		}
-		free_v((void **)&(nl[m]));
 		if(*rtn_stat) break;
 	}
 	return 0;
 }
 
+#ifndef HAVE_WIN32
+static int queue_subdirs(struct dirlist *dl,
+	char **link, size_t len, size_t *link_len, struct conf *conf)
+{
+	int m;
+	// Backwards, so that the first one is the first to be read.
+	for(m=dl->count-1; m>=0; m--)
+	{
+		size_t nlen;
+		if(!dl->entries[m].stat_ok
+		  || !S_ISDIR(dl->entries[m].statp.st_mode))
+			continue;
+		nlen=strlen(DIRLIST_NAME(dl, m));
+		if(len+nlen>=*link_len)
+		{
+			*link_len=len+nlen+1;
+			if(!(*link=(char *)
+			  realloc_w(*link, (*link_len)+1, __func__)))
+				return -1;
+		}
+		memcpy((*link)+len, DIRLIST_NAME(dl, m), nlen+1);
+		if(!file_is_included_no_incext(conf, *link)
+		  || journal_subtree_clean(*link))
+			continue;
+		if(scan_want(scan, *link))
+			return -1;
+	}
+	(*link)[len]='\0';
+	return 0;
+}
+#endif
+
 static int found_directory(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
 	char *fname, dev_t parent_device, bool top_level)
 {
+	int ret;
 	int rtn_stat;
-	DIR *directory;
+	int dfd=-1;
 	char *link=NULL;
 	size_t link_len;
 	size_t len;
 	int nbret=0;
-	int count=0;
 	bool recurse;
 	dev_t our_device;
-	struct dirent **nl=NULL;
+	struct dirlist dl;
+#ifndef HAVE_LINUX_OS
+	DIR *directory;
+#endif
 
+	memset(&dl, 0, sizeof(dl));
 	recurse=true;
 	our_device=ff_pkt->statp.st_dev;
 
@@ -633,24 +579,42 @@ static int found_directory(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
 	/* reset "link" */
 	ff_pkt->link=ff_pkt->fname;
 
+	// Nothing in here has changed since the last backup, according to
+	// the change journal, so the phase1 cache has it all already. Unless
+	// the cache does not have this directory, in which case scan it.
+	if(journal_subtree_clean(fname) && p1cache_has_dir(fname))
+	{
+		free_w(&link);
+		return p1cache_replay(asfd, conf, fname);
+	}
+
+#ifndef HAVE_WIN32
+	if(scan)
+	{
+		switch(scan_dir(scan, fname, &dl))
+		{
+			case 0:
+				goto got_files;
+			case 1:
+				break;
+			default:
+				free_w(&link);
+				return -1;
+		}
+	}
+#endif
+
 	/*
 	* Descend into or "recurse" into the directory to read
 	*   all the files in it.
 	*/
 	errno = 0;
-#if defined(O_DIRECTORY) && defined(O_NOATIME)
-	int dfd=-1;
-	if((dfd=open(fname, O_RDONLY|O_DIRECTORY|conf->atime?0:O_NOATIME))<0
-	  || !(directory=fdopendir(dfd)))
+#ifdef HAVE_LINUX_OS
+	if((dfd=dirlist_open(fname, conf))<0)
 #else
-// Mac OS X appears to have no O_NOATIME and no fdopendir(), so it should
-// end up using opendir() here.
 	if(!(directory=opendir(fname)))
 #endif
 	{
-#if defined(O_DIRECTORY) && defined(O_NOATIME)
-		if(dfd>=0) close(dfd);
-#endif
 		ff_pkt->type=FT_NOOPEN;
 		rtn_stat=send_file(asfd, ff_pkt, top_level, conf);
 		free_w(&link);
@@ -662,28 +626,57 @@ static int found_directory(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
 	*    This would possibly run faster if we chdir to the directory
 	*    before traversing it.
 	*/
-	if(get_files_in_directory(directory, &nl, &count))
+#ifdef HAVE_LINUX_OS
+	if(dirlist_read(&dl, dfd))
+	{
+		close_fd(&dfd);
+		free_w(&link);
+		return -1;
+	}
+	// Keep it open to fstatat() what is in it, unless there are already
+	// a lot open further up the tree.
+	if(dfds_open<DFDS_OPEN_MAX) dfds_open++;
+	else close_fd(&dfd);
+#else
+	if(dirlist_read_dir(&dl, directory))
 	{
 		closedir(directory);
 		free_w(&link);
 		return -1;
 	}
 	closedir(directory);
+#endif
+
+#ifndef HAVE_WIN32
+got_files:
+	// Ask for the subdirectories, so that the workers can read them
+	// before we get to them.
+	if(scan && dl.entries && queue_subdirs(&dl,
+		&link, len, &link_len, conf))
+	{
+		free_w(&link);
+		dirlist_free_content(&dl);
+		return -1;
+	}
+#endif
 
 	rtn_stat=0;
-	if(nl)
+	ret=process_files_in_directory(asfd, &dl, dfd,
+		&rtn_stat, &link, len, &link_len, conf,
+		ff_pkt, our_device);
+#ifdef HAVE_LINUX_OS
+	if(dfd>=0)
 	{
-		if(process_files_in_directory(asfd, nl, count,
-			&rtn_stat, &link, len, &link_len, conf,
-			ff_pkt, our_device))
-		{
-			free_w(&link);
-			free(nl);
-			return -1;
-		}
+		close_fd(&dfd);
+		dfds_open--;
 	}
+#endif
 	free_w(&link);
-	if(nl) free(nl);
+	dirlist_free_content(&dl);
+	if(ret) return -1;
+#ifndef HAVE_WIN32
+	if(scan) scan_done(scan, fname);
+#endif
 
 	return rtn_stat;
 }
@@ -730,15 +723,19 @@ static int found_other(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
  *  descending into a directory.
  */
 static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
-	char *fname, dev_t parent_device, bool top_level)
+	char *fname, dev_t parent_device, bool top_level,
+	struct scan_entry *entry)
 {
 	ff_pkt->fname=fname;
 	ff_pkt->link=fname;
 
+	// A scan worker may have already done the lstat.
+	if(entry && entry->stat_ok)
+		memcpy(&ff_pkt->statp, &entry->statp, sizeof(struct stat));
 #ifdef HAVE_WIN32
-	if(win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr))
+	else if(win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr))
 #else
-	if(lstat(fname, &ff_pkt->statp))
+	else if(lstat(fname, &ff_pkt->statp))
 #endif
 	{
 		ff_pkt->type=FT_NOSTAT;
@@ -758,32 +755,29 @@ static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
 		|| S_ISFIFO(ff_pkt->statp.st_mode)
 		|| S_ISSOCK(ff_pkt->statp.st_mode)))
 	{
-		struct f_link *lp;
-		const int linkhash_ind=LINKHASH(ff_pkt->statp);
+		struct link_ent *ent;
 
-		/* Search link list of hard linked files */
-		for(lp=linkhash[linkhash_ind]; lp; lp=lp->next)
+		if((ent=linktable_find(linktable, &ff_pkt->statp)))
 		{
-			if(lp->ino==(ino_t)ff_pkt->statp.st_ino
-			  && lp->dev==(dev_t)ff_pkt->statp.st_dev)
-			{
-				if(!strcmp(lp->name, fname)) return 0;
-				ff_pkt->link=lp->name;
-				/* Handle link, file already saved */
-				ff_pkt->type=FT_LNK_H;
-				return send_file(asfd, ff_pkt, top_level, conf);
-			}
+			int ret;
+			if(!strcmp(ent->name, fname)) return 0;
+			ff_pkt->link=ent->name;
+			/* Handle link, file already saved */
+			ff_pkt->type=FT_LNK_H;
+			ret=send_file(asfd, ff_pkt, top_level, conf);
+			// Once every link has been seen, there is no need
+			// to remember it any more.
+			linktable_seen(linktable, ent);
+			return ret;
 		}
 
-		// File not previously dumped. Chain it into our list.
-		if(!(lp=(struct f_link *)
-			malloc_w(sizeof(struct f_link), __func__))
-		  || !(lp->name=strdup_w(fname, __func__)))
+		// File not previously dumped. Remember it until all of its
+		// links have been seen.
+		if(linktable_add(linktable, &ff_pkt->statp, fname))
 			return -1;
-		lp->ino=ff_pkt->statp.st_ino;
-		lp->dev=ff_pkt->statp.st_dev;
-		lp->next=linkhash[linkhash_ind];
-		linkhash[linkhash_ind]=lp;
+		if(conf->cntr)
+			cntr_set_val(conf->cntr,
+				CMD_LINK_TABLE, linktable->peak);
 	}
 
 	/* This is not a link to a previously dumped file, so dump it.  */
@@ -820,6 +814,13 @@ static int find_files(struct asfd *asfd, FF_PKT *ff_pkt, struct conf *conf,
 int find_files_begin(struct asfd *asfd,
 	FF_PKT *ff_pkt, struct conf *conf, char *fname)
 {
+#ifndef HAVE_WIN32
+	if(!scan_started)
+	{
+		scan_started=1;
+		scan=scan_alloc(asfd, conf);
+	}
+#endif
 	return find_files(asfd, ff_pkt,
-		conf, fname, (dev_t)-1, 1 /* top_level */);
+		conf, fname, (dev_t)-1, 1 /* top_level */, NULL);
 }
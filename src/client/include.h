@@ -12,14 +12,21 @@
 #include "cvss.h"
 #include "delete.h"
 #include "diff.h"
+#include "dirlist.h"
 #include "extra_comms.h"
 #include "extrameta.h"
 #include "find.h"
 #include "glob_windows.h"
+#include "journal.h"
+#include "linktable.h"
 #include "list.h"
 #include "main.h"
 #include "monitor.h"
+#include "p1cache.h"
+#include "prefetch.h"
 #include "restore.h"
+#include "restore_writer.h"
+#include "scan.h"
 #include "xattr.h"
 
 #endif
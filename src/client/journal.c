@@ -0,0 +1,1256 @@
+#include "include.h"
+#include "../hexmap.h"
+#include "../pathcmp.h"
+
+#include <uthash.h>
+#ifdef HAVE_LINUX_OS
+#include <mntent.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#endif
+
+// The change journal is a file of directories in which something has
+// changed, one per line, written by a long running 'burp -a j' process.
+// A line for a directory that was made or moved in starts with '*', because
+// nothing below it can be in the phase1 cache either.
+// It begins with a line giving its generation, followed by a line for each
+// directory tree that is being watched. Whenever changes might have been
+// missed, for example when the kernel event queue overflows or the helper
+// restarts, the journal is started again with a new generation.
+// Before it scans, a backup asks the helper for a mark, through a fifo next
+// to the journal. The helper writes out everything that happened before it
+// was asked, and then the mark. When the backup has worked, the generation
+// and the position of the mark are saved alongside the phase1 cache. The
+// next backup only needs to look in directories that were written after
+// that position, and sends the rest straight from the phase1 cache.
+
+#define JOURNAL_HEADER		"burp_change_journal "
+#define JOURNAL_ROOT		'+'
+#define JOURNAL_TREE		'*'
+#define JOURNAL_MARK		"-mark "
+#define JOURNAL_MAX_SIZE	(64*1024*1024)
+#define JOURNAL_SEEN_MAX	1000000
+// How long a backup waits for the helper to write its mark, in
+// milliseconds.
+#define JOURNAL_MARK_WAIT	10000
+
+static char *get_journal_path(struct conf *conf, const char *ext)
+{
+	char *path=NULL;
+	if(!(path=strdup_w(conf->change_journal, __func__))
+	  || astrcat(&path, ext, __func__))
+		free_w(&path);
+	return path;
+}
+
+#ifdef HAVE_LINUX_OS
+
+// Like prepend_s(), but does not double the slash when dir is '/'.
+static char *join_path(const char *dir, const char *name)
+{
+	size_t len=strlen(dir);
+	while(len && dir[len-1]=='/') len--;
+	return prepend_len(dir, len, name, strlen(name), "/", 1, NULL);
+}
+
+#define INOTIFY_MASK	(IN_ATTRIB|IN_CREATE|IN_DELETE|IN_DELETE_SELF \
+			|IN_MODIFY|IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO \
+			|IN_DONT_FOLLOW|IN_ONLYDIR)
+
+#ifdef FAN_REPORT_DFID_NAME
+#define FANOTIFY_MASK	(FAN_ATTRIB|FAN_CREATE|FAN_DELETE|FAN_DELETE_SELF \
+			|FAN_MODIFY|FAN_MOVE_SELF|FAN_MOVED_FROM|FAN_MOVED_TO \
+			|FAN_ONDIR)
+#define FANOTIFY_FS_MAX	64
+
+// A file system marked with fanotify, and something open on it, so that
+// directory handles can be turned back into paths.
+struct fanotify_fs
+{
+	fsid_t fsid;
+	int fd;
+};
+#endif
+
+// Directories already written since the last mark.
+struct seen
+{
+	char *path;
+	UT_hash_handle hh;
+};
+
+// An inotify watch.
+struct watch
+{
+	int wd;
+	char *path;
+	UT_hash_handle hh;
+};
+
+struct jhelper
+{
+	int fd; // The journal.
+	int cfd; // The fifo that backups ask for marks on.
+	off_t expected; // Where the end of the journal should be.
+	struct seen *seen;
+	int seen_count;
+	char *buf; // Lines waiting to be written.
+	size_t len;
+	size_t alloc;
+	uint8_t rotate; // Set when changes may have been missed.
+	int nfd; // inotify or fanotify.
+	struct watch *watches;
+#ifdef FAN_REPORT_DFID_NAME
+	uint8_t fanotify;
+	struct fanotify_fs fs[FANOTIFY_FS_MAX];
+	int fs_count;
+#endif
+};
+
+static void seen_clear(struct jhelper *h)
+{
+	struct seen *s;
+	struct seen *tmp;
+	HASH_ITER(hh, h->seen, s, tmp)
+	{
+		HASH_DEL(h->seen, s);
+		free_w(&s->path);
+		free_v((void **)&s);
+	}
+	h->seen_count=0;
+}
+
+static void watches_free(struct jhelper *h)
+{
+	struct watch *w;
+	struct watch *tmp;
+	HASH_ITER(hh, h->watches, w, tmp)
+	{
+		HASH_DEL(h->watches, w);
+		free_w(&w->path);
+		free_v((void **)&w);
+	}
+}
+
+static int record_line(struct jhelper *h, const char *line)
+{
+	size_t plen;
+	struct seen *s=NULL;
+
+	if(strchr(line, '\n'))
+	{
+		// Cannot be written on a line of its own.
+		h->rotate=1;
+		return 0;
+	}
+	HASH_FIND_STR(h->seen, line, s);
+	if(s) return 0;
+	if(h->seen_count>=JOURNAL_SEEN_MAX) seen_clear(h);
+	if(!(s=(struct seen *)calloc_w(1, sizeof(struct seen), __func__))
+	  || !(s->path=strdup_w(line, __func__)))
+	{
+		free_v((void **)&s);
+		return -1;
+	}
+	HASH_ADD_KEYPTR(hh, h->seen, s->path, strlen(s->path), s);
+	h->seen_count++;
+
+	plen=strlen(line);
+	if(h->len+plen+1>h->alloc)
+	{
+		h->alloc=(h->len+plen+1)*2;
+		if(!(h->buf=(char *)realloc_w(h->buf, h->alloc, __func__)))
+			return -1;
+	}
+	memcpy(h->buf+h->len, line, plen);
+	h->buf[h->len+plen]='\n';
+	h->len+=plen+1;
+	return 0;
+}
+
+static int record(struct jhelper *h, const char *path)
+{
+	return record_line(h, path);
+}
+
+// A directory that was made or moved in, so everything below it has to be
+// looked at, including anything made in it before it was watched.
+static int record_tree(struct jhelper *h, const char *path)
+{
+	int ret;
+	char *line;
+	char tree[2]={JOURNAL_TREE, '\0'};
+	if(!(line=prepend_len(tree, 1, path, strlen(path), "", 0, NULL)))
+		return -1;
+	ret=record_line(h, line);
+	free_w(&line);
+	return ret;
+}
+
+static int record_parent(struct jhelper *h, const char *path)
+{
+	int ret;
+	char *cp;
+	char *parent;
+	if(!(parent=strdup_w(path, __func__))) return -1;
+	if((cp=strrchr(parent, '/'))) *(cp==parent?cp+1:cp)='\0';
+	ret=record(h, parent);
+	free_w(&parent);
+	return ret;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t w;
+	while(len)
+	{
+		if((w=write(fd, buf, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		buf+=w;
+		len-=w;
+	}
+	return 0;
+}
+
+// Start the journal again, because backups can no longer trust it.
+static int rotate(struct jhelper *h, struct conf *conf)
+{
+	char gen[64]="";
+	struct timeval tv;
+	struct strlist *l;
+
+	gettimeofday(&tv, NULL);
+	snprintf(gen, sizeof(gen), "%lx%lx%lx",
+		(unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec,
+		(unsigned long)getpid());
+	h->len=0;
+	seen_clear(h);
+	if(ftruncate(h->fd, 0)
+	  || write_all(h->fd, JOURNAL_HEADER, strlen(JOURNAL_HEADER))
+	  || write_all(h->fd, gen, strlen(gen))
+	  || write_all(h->fd, "\n", 1))
+		goto error;
+	for(l=conf->startdir; l; l=l->next)
+	{
+		if(!l->flag) continue;
+		if(write_all(h->fd, "+", 1)
+		  || write_all(h->fd, l->path, strlen(l->path))
+		  || write_all(h->fd, "\n", 1))
+			goto error;
+	}
+	if((h->expected=lseek(h->fd, 0, SEEK_END))<0)
+		goto error;
+	h->rotate=0;
+	logp("Started change journal generation %s\n", gen);
+	return 0;
+error:
+	logp("Could not start change journal %s: %s\n",
+		conf->change_journal, strerror(errno));
+	return -1;
+}
+
+// Called after reading events and before recording them. If something else
+// has written to the journal since last time, directories that were already
+// written need to be written again.
+static void batch_begin(struct jhelper *h)
+{
+	struct stat statp;
+	if(fstat(h->fd, &statp) || statp.st_size==h->expected)
+		return;
+	seen_clear(h);
+	h->expected=statp.st_size;
+}
+
+static int batch_end(struct jhelper *h, struct conf *conf)
+{
+	if(h->rotate || h->expected>JOURNAL_MAX_SIZE)
+		return rotate(h, conf);
+	if(!h->len) return 0;
+	if(write_all(h->fd, h->buf, h->len))
+	{
+		logp("Could not write to change journal %s: %s\n",
+			conf->change_journal, strerror(errno));
+		return -1;
+	}
+	h->expected+=h->len;
+	h->len=0;
+	return 0;
+}
+
+static int watch_tree(struct jhelper *h, const char *path)
+{
+	int wd;
+	DIR *dir;
+	struct dirent *d;
+	struct watch *w=NULL;
+
+	if((wd=inotify_add_watch(h->nfd, path, INOTIFY_MASK))<0)
+	{
+		// It may have gone already, or not be a directory.
+		if(errno==ENOENT || errno==ENOTDIR || errno==EACCES)
+			return 0;
+		if(errno==ENOSPC)
+			logp("Try raising fs.inotify.max_user_watches\n");
+		logp("Could not watch %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	HASH_FIND_INT(h->watches, &wd, w);
+	if(w)
+	{
+		// Moved, so it is already watched under a different path.
+		free_w(&w->path);
+		if(!(w->path=strdup_w(path, __func__))) return -1;
+	}
+	else
+	{
+		if(!(w=(struct watch *)calloc_w(1,
+			sizeof(struct watch), __func__))
+		  || !(w->path=strdup_w(path, __func__)))
+		{
+			free_v((void **)&w);
+			return -1;
+		}
+		w->wd=wd;
+		HASH_ADD_INT(h->watches, wd, w);
+	}
+
+	if(!(dir=opendir(path))) return 0;
+	while((d=readdir(dir)))
+	{
+		int ret;
+		char *sub;
+		struct stat statp;
+		if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if(d->d_type!=DT_DIR && d->d_type!=DT_UNKNOWN)
+			continue;
+		if(!(sub=join_path(path, d->d_name)))
+		{
+			closedir(dir);
+			return -1;
+		}
+		ret=0;
+		if(d->d_type==DT_DIR
+		  || (!lstat(sub, &statp) && S_ISDIR(statp.st_mode)))
+			ret=watch_tree(h, sub);
+		free_w(&sub);
+		if(ret)
+		{
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int inotify_event(struct jhelper *h, struct inotify_event *ev)
+{
+	int ret=0;
+	char *sub=NULL;
+	struct watch *w=NULL;
+
+	if(ev->mask & IN_Q_OVERFLOW)
+	{
+		logp("Change journal event queue overflowed\n");
+		h->rotate=1;
+		return 0;
+	}
+	HASH_FIND_INT(h->watches, &ev->wd, w);
+	if(!w) return 0;
+	if(ev->mask & IN_IGNORED)
+	{
+		HASH_DEL(h->watches, w);
+		free_w(&w->path);
+		free_v((void **)&w);
+		return 0;
+	}
+	if(record(h, w->path)) return -1;
+	if(!ev->len)
+	{
+		// Something happened to the directory itself, so the entry
+		// for it in its parent has changed.
+		if(ev->mask & IN_ATTRIB) return record_parent(h, w->path);
+		return 0;
+	}
+	if(!(ev->mask & IN_ISDIR)) return 0;
+	if(!(sub=join_path(w->path, ev->name)))
+		return -1;
+	if(ev->mask & (IN_CREATE|IN_MOVED_TO))
+	{
+		// A new or moved directory needs to be looked through
+		// completely.
+		if(record_tree(h, sub)
+		  || watch_tree(h, sub))
+			ret=-1;
+	}
+	else if(record(h, sub))
+		ret=-1;
+	free_w(&sub);
+	return ret;
+}
+
+static int inotify_setup(struct jhelper *h, struct conf *conf)
+{
+	struct strlist *l;
+	if((h->nfd=inotify_init())<0)
+	{
+		logp("inotify_init failed: %s\n", strerror(errno));
+		return -1;
+	}
+	for(l=conf->startdir; l; l=l->next)
+		if(l->flag && watch_tree(h, l->path))
+			return -1;
+	logp("Watching %d directories with inotify\n",
+		HASH_COUNT(h->watches));
+	return 0;
+}
+
+static int inotify_read(struct jhelper *h, struct conf *conf)
+{
+	ssize_t r;
+	char *p;
+	char buf[65536]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	if((r=read(h->nfd, buf, sizeof(buf)))<0)
+	{
+		if(errno==EINTR) return 0;
+		logp("inotify read failed: %s\n", strerror(errno));
+		return -1;
+	}
+	batch_begin(h);
+	for(p=buf; p<buf+r; )
+	{
+		struct inotify_event *ev=(struct inotify_event *)p;
+		if(inotify_event(h, ev)) return -1;
+		p+=sizeof(struct inotify_event)+ev->len;
+	}
+	return batch_end(h, conf);
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+static int under_startdir(struct conf *conf, const char *path)
+{
+	struct strlist *l;
+	for(l=conf->startdir; l; l=l->next)
+		if(l->flag && (!strcmp(l->path, path) || is_subdir(l->path, path)))
+			return 1;
+	return 0;
+}
+
+static int fanotify_add_fs(struct jhelper *h, const char *path)
+{
+	int i;
+	int fd;
+	struct statfs sfs;
+
+	if(fanotify_mark(h->nfd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+		FANOTIFY_MASK, AT_FDCWD, path))
+	{
+		logp("Could not mark %s with fanotify: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+	if((fd=open(path, O_RDONLY|O_DIRECTORY))<0
+	  || fstatfs(fd, &sfs))
+	{
+		if(fd>=0) close(fd);
+		return -1;
+	}
+	for(i=0; i<h->fs_count; i++)
+	{
+		if(memcmp(&h->fs[i].fsid, &sfs.f_fsid, sizeof(fsid_t)))
+			continue;
+		close(fd);
+		return 0;
+	}
+	if(h->fs_count>=FANOTIFY_FS_MAX)
+	{
+		close(fd);
+		logp("Too many file systems to mark with fanotify\n");
+		return -1;
+	}
+	h->fs[h->fs_count].fsid=sfs.f_fsid;
+	h->fs[h->fs_count++].fd=fd;
+	return 0;
+}
+
+static void fanotify_close(struct jhelper *h)
+{
+	int i;
+	for(i=0; i<h->fs_count; i++) close(h->fs[i].fd);
+	h->fs_count=0;
+	close_fd(&h->nfd);
+	h->fanotify=0;
+}
+
+// Marks the file systems of the startdirs, and of anything mounted below
+// them. Needs CAP_SYS_ADMIN and Linux 5.9 or later.
+static int fanotify_setup(struct jhelper *h, struct conf *conf)
+{
+	FILE *mfp;
+	struct mntent *m;
+	struct strlist *l;
+
+	if((h->nfd=fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME,
+		O_RDONLY|O_LARGEFILE))<0)
+			return -1;
+	h->fanotify=1;
+	for(l=conf->startdir; l; l=l->next)
+		if(l->flag && fanotify_add_fs(h, l->path))
+			goto error;
+	if(!(mfp=setmntent("/proc/self/mounts", "r")))
+		goto error;
+	while((m=getmntent(mfp)))
+	{
+		if(!under_startdir(conf, m->mnt_dir)) continue;
+		if(fanotify_add_fs(h, m->mnt_dir))
+		{
+			endmntent(mfp);
+			goto error;
+		}
+	}
+	endmntent(mfp);
+	logp("Watching %d file systems with fanotify\n", h->fs_count);
+	return 0;
+error:
+	fanotify_close(h);
+	return -1;
+}
+
+static char *fanotify_dir_path(struct jhelper *h,
+	struct fanotify_event_info_fid *fid)
+{
+	int i;
+	int dfd;
+	ssize_t l;
+	char proc[64]="";
+	char path[PATH_MAX]="";
+	struct file_handle *handle=(struct file_handle *)fid->handle;
+
+	for(i=0; i<h->fs_count; i++)
+		if(!memcmp(&h->fs[i].fsid, &fid->fsid, sizeof(fsid_t)))
+			break;
+	if(i==h->fs_count) return NULL;
+	// Fails once the directory has gone, which is fine, because its
+	// parent will get an event too.
+	if((dfd=open_by_handle_at(h->fs[i].fd, handle, O_RDONLY|O_PATH))<0)
+		return NULL;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dfd);
+	l=readlink(proc, path, sizeof(path)-1);
+	close(dfd);
+	if(l<=0) return NULL;
+	path[l]='\0';
+	return strdup_w(path, __func__);
+}
+
+static int fanotify_event(struct jhelper *h, struct conf *conf,
+	struct fanotify_event_metadata *meta)
+{
+	int ret=0;
+	char *dir=NULL;
+	char *sub=NULL;
+	const char *name=NULL;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *handle;
+
+	if(meta->mask & FAN_Q_OVERFLOW)
+	{
+		logp("Change journal event queue overflowed\n");
+		h->rotate=1;
+		return 0;
+	}
+	if(meta->event_len<meta->metadata_len+sizeof(*fid))
+		return 0;
+	fid=(struct fanotify_event_info_fid *)
+		((char *)meta+meta->metadata_len);
+	if(fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID_NAME
+	  && fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID)
+		return 0;
+	handle=(struct file_handle *)fid->handle;
+	if(fid->hdr.info_type==FAN_EVENT_INFO_TYPE_DFID_NAME)
+		name=(const char *)handle->f_handle+handle->handle_bytes;
+
+	if(!(dir=fanotify_dir_path(h, fid))) return 0;
+	if(!under_startdir(conf, dir)) goto end;
+	if(record(h, dir)) goto error;
+	if(!name || !strcmp(name, "."))
+	{
+		// Something happened to the directory itself.
+		if((meta->mask & FAN_ATTRIB) && record_parent(h, dir))
+			goto error;
+		goto end;
+	}
+	if(!(meta->mask & FAN_ONDIR)) goto end;
+	if(!(sub=join_path(dir, name)))
+		goto error;
+	if(meta->mask & (FAN_CREATE|FAN_MOVED_TO))
+	{
+		// A new or moved directory needs to be looked through
+		// completely.
+		if(record_tree(h, sub)) goto error;
+	}
+	else if(record(h, sub))
+		goto error;
+	goto end;
+error:
+	ret=-1;
+end:
+	free_w(&dir);
+	free_w(&sub);
+	return ret;
+}
+
+static int fanotify_read(struct jhelper *h, struct conf *conf)
+{
+	ssize_t r;
+	struct fanotify_event_metadata *meta;
+	char buf[65536]
+		__attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+
+	if((r=read(h->nfd, buf, sizeof(buf)))<0)
+	{
+		if(errno==EINTR) return 0;
+		logp("fanotify read failed: %s\n", strerror(errno));
+		return -1;
+	}
+	batch_begin(h);
+	for(meta=(struct fanotify_event_metadata *)buf;
+		FAN_EVENT_OK(meta, r); meta=FAN_EVENT_NEXT(meta, r))
+	{
+		if(meta->fd>=0) close(meta->fd);
+		if(fanotify_event(h, conf, meta)) return -1;
+	}
+	return batch_end(h, conf);
+}
+#endif
+
+static int events_read(struct jhelper *h, struct conf *conf)
+{
+#ifdef FAN_REPORT_DFID_NAME
+	if(h->fanotify) return fanotify_read(h, conf);
+#endif
+	return inotify_read(h, conf);
+}
+
+// A backup has asked for a mark. Everything that happened before it asked
+// is already in the event queue, so write all of that out first.
+static int ctl_read(struct jhelper *h, struct conf *conf)
+{
+	ssize_t r;
+	char *cp;
+	char *nl;
+	char buf[512];
+	struct pollfd p;
+
+	if((r=read(h->cfd, buf, sizeof(buf)-1))<=0)
+		return 0;
+	buf[r]='\0';
+
+	p.fd=h->nfd;
+	p.events=POLLIN;
+	while(poll(&p, 1, 0)>0 && (p.revents & POLLIN))
+		if(events_read(h, conf)) return -1;
+
+	for(cp=buf; (nl=strchr(cp, '\n')); cp=nl+1)
+	{
+		const char *nonce;
+		*nl='\0';
+		if(strncmp(cp, JOURNAL_MARK, strlen(JOURNAL_MARK)))
+			continue;
+		nonce=cp+strlen(JOURNAL_MARK);
+		if(!*nonce || strlen(nonce)>64
+		  || strspn(nonce, "0123456789abcdef")!=strlen(nonce))
+			continue;
+		*nl='\n';
+		if(write_all(h->fd, cp, nl-cp+1))
+		{
+			logp("Could not write to change journal %s: %s\n",
+				conf->change_journal, strerror(errno));
+			return -1;
+		}
+		h->expected+=nl-cp+1;
+	}
+	// Directories already written go before the mark, so they need to
+	// be written again.
+	seen_clear(h);
+	return 0;
+}
+
+static int ctl_open(struct jhelper *h, const char *ctlpath)
+{
+	unlink(ctlpath);
+	if(mkfifo(ctlpath, 0600))
+	{
+		logp("Could not make fifo %s: %s\n", ctlpath, strerror(errno));
+		return -1;
+	}
+	// Open for writing too, so that it does not keep reading as the end
+	// of the file when no backup has it open.
+	if((h->cfd=open(ctlpath, O_RDWR|O_NONBLOCK))<0)
+	{
+		logp("Could not open %s: %s\n", ctlpath, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int journal_watch(struct conf *conf)
+{
+	int ret=-1;
+	char *lockpath=NULL;
+	char *ctlpath=NULL;
+	struct lock *lock=NULL;
+	struct jhelper h;
+
+	memset(&h, 0, sizeof(h));
+	h.fd=-1;
+	h.cfd=-1;
+	h.nfd=-1;
+
+	if(!conf->change_journal)
+	{
+		logp("change_journal is not set in %s\n", conf->conffile);
+		return -1;
+	}
+	if(!(lockpath=get_journal_path(conf, ".lock"))
+	  || !(lock=lock_alloc_and_init(lockpath)))
+		goto end;
+	lock_get(lock);
+	if(lock->status!=GET_LOCK_GOT)
+	{
+		logp("Could not get %s - is another journal process running?\n",
+			lockpath);
+		goto end;
+	}
+	if((h.fd=open(conf->change_journal,
+		O_WRONLY|O_CREAT|O_APPEND, 0600))<0)
+	{
+		logp("Could not open %s: %s\n",
+			conf->change_journal, strerror(errno));
+		goto end;
+	}
+
+	// Watch before starting the journal, so that nothing is missed
+	// in between.
+#ifdef FAN_REPORT_DFID_NAME
+	if(fanotify_setup(&h, conf))
+#endif
+	{
+		logp("Using inotify for the change journal\n");
+		if(inotify_setup(&h, conf)) goto end;
+	}
+	if(rotate(&h, conf)) goto end;
+	if(!(ctlpath=get_journal_path(conf, ".ctl"))
+	  || ctl_open(&h, ctlpath))
+		goto end;
+
+	while(1)
+	{
+		struct pollfd p[2];
+		p[0].fd=h.nfd;
+		p[0].events=POLLIN;
+		p[1].fd=h.cfd;
+		p[1].events=POLLIN;
+		if(poll(p, 2, -1)<0)
+		{
+			if(errno==EINTR) continue;
+			logp("poll failed in %s: %s\n",
+				__func__, strerror(errno));
+			goto end;
+		}
+		if((p[0].revents & POLLIN) && events_read(&h, conf))
+			goto end;
+		if((p[1].revents & POLLIN) && ctl_read(&h, conf))
+			goto end;
+	}
+end:
+#ifdef FAN_REPORT_DFID_NAME
+	if(h.fanotify) fanotify_close(&h);
+#endif
+	close_fd(&h.nfd);
+	close_fd(&h.fd);
+	if(h.cfd>=0)
+	{
+		close_fd(&h.cfd);
+		unlink(ctlpath);
+	}
+	free_w(&ctlpath);
+	seen_clear(&h);
+	watches_free(&h);
+	free_w(&h.buf);
+	free_w(&lockpath);
+	lock_release(lock);
+	lock_free(&lock);
+	return ret;
+}
+
+#else
+
+int journal_watch(struct conf *conf)
+{
+	logp("The change journal is only available on Linux\n");
+	return -1;
+}
+
+#endif
+
+// A sorted list of directories from the journal.
+struct jpaths
+{
+	char **paths;
+	int count;
+	int alloc;
+};
+
+// What the backup knows about the journal.
+static struct jstate
+{
+	char *gen; // NULL if the position of the mark cannot be trusted.
+	off_t offset;
+	char *fingerprint;
+	struct jpaths dirty; // Directories that changed.
+	struct jpaths trees; // Directories that changed all the way down.
+	uint8_t active;
+} js;
+
+static void jpaths_free(struct jpaths *jp)
+{
+	int i;
+	for(i=0; i<jp->count; i++) free_w(&jp->paths[i]);
+	free_v((void **)&jp->paths);
+}
+
+void journal_free(void)
+{
+	jpaths_free(&js.dirty);
+	jpaths_free(&js.trees);
+	free_w(&js.gen);
+	free_w(&js.fingerprint);
+	memset(&js, 0, sizeof(js));
+}
+
+static void md5_str(MD5_CTX *md5, const char *str)
+{
+	if(!str) str="";
+	MD5_Update(md5, str, strlen(str)+1);
+}
+
+static void md5_strlist(MD5_CTX *md5, struct strlist *list)
+{
+	struct strlist *l;
+	char buf[32]="";
+	for(l=list; l; l=l->next)
+	{
+		snprintf(buf, sizeof(buf), "%ld", l->flag);
+		md5_str(md5, buf);
+		md5_str(md5, l->path);
+	}
+	md5_str(md5, "-");
+}
+
+// Sending a directory from the phase1 cache skips all of the include and
+// exclude logic, so it is only safe to do if the settings are the same as
+// when the cache was made.
+static char *get_fingerprint(struct conf *conf)
+{
+	MD5_CTX md5;
+	char buf[256]="";
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+
+	MD5_Init(&md5);
+	md5_strlist(&md5, conf->startdir);
+	md5_strlist(&md5, conf->incexcdir);
+	md5_strlist(&md5, conf->fschgdir);
+	md5_strlist(&md5, conf->nobackup);
+	md5_strlist(&md5, conf->incext);
+	md5_strlist(&md5, conf->excext);
+	md5_strlist(&md5, conf->increg);
+	md5_strlist(&md5, conf->excreg);
+	md5_strlist(&md5, conf->excfs);
+	md5_strlist(&md5, conf->excom);
+	md5_strlist(&md5, conf->incglob);
+	md5_strlist(&md5, conf->fifos);
+	md5_strlist(&md5, conf->blockdevs);
+	snprintf(buf, sizeof(buf), "%d %d %d %lld %lld %d %d %d %d %d",
+		conf->cross_all_filesystems,
+		conf->read_all_fifos,
+		conf->read_all_blockdevs,
+		(long long)conf->min_file_size,
+		(long long)conf->max_file_size,
+		conf->split_vss,
+		conf->strip_vss,
+		conf->compression,
+		conf->encryption_password?1:0,
+		conf->protocol);
+	md5_str(&md5, buf);
+	MD5_Final(checksum, &md5);
+	return strdup_w(bytes_to_md5str(checksum), __func__);
+}
+
+// Reads the generation and the watched directory trees.
+static char *read_header(const char *path, struct strlist **roots)
+{
+	FILE *fp;
+	char *gen=NULL;
+	char buf[4096]="";
+
+	if(!(fp=fopen(path, "rb"))) return NULL;
+	if(!fgets(buf, sizeof(buf), fp)
+	  || strncmp(buf, JOURNAL_HEADER, strlen(JOURNAL_HEADER)))
+		goto end;
+	buf[strcspn(buf, "\n")]='\0';
+	if(!(gen=strdup_w(buf+strlen(JOURNAL_HEADER), __func__)))
+		goto end;
+	while(roots && fgets(buf, sizeof(buf), fp) && *buf==JOURNAL_ROOT)
+	{
+		buf[strcspn(buf, "\n")]='\0';
+		if(strlist_add(roots, buf+1, 1))
+		{
+			free_w(&gen);
+			goto end;
+		}
+	}
+end:
+	fclose(fp);
+	return gen;
+}
+
+// Every startdir needs to be inside something that the helper watches.
+static int roots_cover(struct conf *conf, struct strlist *roots)
+{
+	struct strlist *l;
+	struct strlist *r;
+	for(l=conf->startdir; l; l=l->next)
+	{
+		if(!l->flag) continue;
+		for(r=roots; r; r=r->next)
+			if(!strcmp(r->path, l->path)
+			  || is_subdir(r->path, l->path))
+				break;
+		if(!r) return 0;
+	}
+	return 1;
+}
+
+static int jpaths_add(struct jpaths *jp, const char *path)
+{
+	if(jp->count>=jp->alloc)
+	{
+		jp->alloc=jp->alloc?jp->alloc*2:1024;
+		if(!(jp->paths=(char **)realloc_w(jp->paths,
+			jp->alloc*sizeof(char *), __func__)))
+				return -1;
+	}
+	if(!(jp->paths[jp->count]=strdup_w(path, __func__)))
+		return -1;
+	jp->count++;
+	return 0;
+}
+
+static int jpaths_cmp(const void *a, const void *b)
+{
+	return pathcmp(*(const char **)a, *(const char **)b);
+}
+
+static void jpaths_sort(struct jpaths *jp)
+{
+	qsort(jp->paths, jp->count, sizeof(char *), jpaths_cmp);
+}
+
+// The first path that does not sort before path.
+static int jpaths_find(struct jpaths *jp, const char *path)
+{
+	int lo=0;
+	int hi=jp->count;
+	while(lo<hi)
+	{
+		int mid=(lo+hi)/2;
+		if(pathcmp(jp->paths[mid], path)<0) lo=mid+1;
+		else hi=mid;
+	}
+	return lo;
+}
+
+// Whether there is anything at or below path. Anything below path sorts
+// straight after it.
+static int jpaths_at_or_below(struct jpaths *jp, const char *path)
+{
+	int i=jpaths_find(jp, path);
+	return i<jp->count
+	  && (!strcmp(jp->paths[i], path) || is_subdir(path, jp->paths[i]));
+}
+
+// Whether path is below something in the list.
+static int jpaths_above(struct jpaths *jp, const char *path)
+{
+	int i;
+	int ret=0;
+	char *cp;
+	char *copy;
+	if(!jp->count || !(copy=strdup_w(path, __func__)))
+		return jp->count>0;
+	while((cp=strrchr(copy, '/')) && cp>copy)
+	{
+		*cp='\0';
+		i=jpaths_find(jp, copy);
+		if(i<jp->count && !strcmp(jp->paths[i], copy))
+		{
+			ret=1;
+			break;
+		}
+	}
+	free_w(&copy);
+	return ret;
+}
+
+// Reads the directories written between the last backup's mark and ours.
+static int read_dirty(struct conf *conf, off_t from, off_t to)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *line=NULL;
+	size_t alloc=0;
+	ssize_t len;
+	off_t pos=from;
+
+	if(!(fp=fopen(conf->change_journal, "rb"))
+	  || fseeko(fp, from, SEEK_SET))
+		goto end;
+	while(pos<to && (len=getline(&line, &alloc, fp))>0)
+	{
+		pos+=len;
+		// Only whole lines before the mark.
+		if(pos>to || line[len-1]!='\n') break;
+		line[len-1]='\0';
+		if(*line==JOURNAL_TREE && line[1]=='/')
+		{
+			if(jpaths_add(&js.trees, line+1)) goto end;
+			continue;
+		}
+		if(*line!='/') continue;
+		if(jpaths_add(&js.dirty, line)) goto end;
+	}
+	ret=0;
+end:
+	if(fp) fclose(fp);
+	free_v((void **)&line);
+	return ret;
+}
+
+// Whether the last backup was made from the same journal, cache and
+// settings. Returns the position of its mark, or -1.
+static off_t load_base(struct conf *conf)
+{
+	FILE *fp=NULL;
+	char *path=NULL;
+	off_t ret=-1;
+	long long offset;
+	char gen[64]="";
+	char token[128]="";
+	char fingerprint[64]="";
+
+	if(!(path=get_journal_path(conf, ".base"))
+	  || !(fp=fopen(path, "rb")))
+		goto end;
+	if(fscanf(fp, "%63s %lld %127s %63s",
+		gen, &offset, token, fingerprint)!=4)
+			goto end;
+	if(strcmp(gen, js.gen)
+	  || !conf->phase1_cache_cur
+	  || strcmp(token, conf->phase1_cache_cur)
+	  || strcmp(fingerprint, js.fingerprint)
+	  || offset<0 || offset>js.offset)
+		goto end;
+	ret=(off_t)offset;
+end:
+	if(fp) fclose(fp);
+	free_w(&path);
+	return ret;
+}
+
+#ifdef HAVE_LINUX_OS
+// Asks the helper for a mark, and waits for it to turn up in the journal.
+// Returns the position just after it, or -1.
+static off_t request_mark(struct conf *conf)
+{
+	int i;
+	int cfd=-1;
+	off_t pos;
+	off_t ret=-1;
+	ssize_t len;
+	size_t alloc=0;
+	FILE *fp=NULL;
+	char *line=NULL;
+	char *ctlpath=NULL;
+	char req[128]="";
+	struct stat statp;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	snprintf(req, sizeof(req), "%s%lx%lx%lx\n", JOURNAL_MARK,
+		(unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec,
+		(unsigned long)getpid());
+	if(!(ctlpath=get_journal_path(conf, ".ctl"))
+	  || !(fp=fopen(conf->change_journal, "rb"))
+	  || fstat(fileno(fp), &statp))
+		goto end;
+	pos=statp.st_size;
+	// Fails straight away if the helper does not have the fifo open.
+	if((cfd=open(ctlpath, O_WRONLY|O_NONBLOCK))<0
+	  || write(cfd, req, strlen(req))!=(ssize_t)strlen(req))
+		goto end;
+	for(i=0; i<JOURNAL_MARK_WAIT/10; i++)
+	{
+		// If it got smaller, the journal was started again.
+		if(fstat(fileno(fp), &statp)
+		  || statp.st_size<pos
+		  || fseeko(fp, pos, SEEK_SET))
+			goto end;
+		while((len=getline(&line, &alloc, fp))>0)
+		{
+			// Only whole lines.
+			if(line[len-1]!='\n') break;
+			pos+=len;
+			if(strcmp(line, req)) continue;
+			ret=pos;
+			goto end;
+		}
+		clearerr(fp);
+		usleep(10000);
+	}
+	logp("Timed out waiting for the change journal process\n");
+end:
+	if(cfd>=0) close(cfd);
+	if(fp) fclose(fp);
+	free_v((void **)&line);
+	free_w(&ctlpath);
+	return ret;
+}
+#else
+static off_t request_mark(struct conf *conf)
+{
+	return -1;
+}
+#endif
+
+int journal_begin(struct conf *conf, int cache_usable)
+{
+	int ret=-1;
+	off_t base=-1;
+	char *gen=NULL;
+	char *lockpath=NULL;
+	struct strlist *roots=NULL;
+
+	journal_free();
+	if(!conf->change_journal) return 0;
+
+	if(!(lockpath=get_journal_path(conf, ".lock")))
+		goto end;
+	if(!lock_test(lockpath))
+	{
+		logp("Change journal process is not running\n");
+		ret=0;
+		goto end;
+	}
+	if(!(js.gen=read_header(conf->change_journal, &roots))
+	  || (js.offset=request_mark(conf))<0)
+	{
+		logp("Could not mark change journal %s\n",
+			conf->change_journal);
+		free_w(&js.gen);
+		ret=0;
+		goto end;
+	}
+	if(!(js.fingerprint=get_fingerprint(conf)))
+		goto end;
+
+	if(!cache_usable)
+		logp("Change journal needs a usable phase1 cache\n");
+	else if(!roots_cover(conf, roots))
+		logp("Change journal does not cover all of the startdirs\n");
+	else if((base=load_base(conf))<0)
+		logp("Change journal does not go with the last backup\n");
+	else if(read_dirty(conf, base, js.offset))
+		goto end;
+
+	// If the journal was started again while we were looking at it,
+	// the position of the mark means nothing.
+	if(!(gen=read_header(conf->change_journal, NULL))
+	  || strcmp(gen, js.gen))
+	{
+		logp("Change journal was restarted\n");
+		free_w(&js.gen);
+		base=-1;
+	}
+
+	if(base>=0)
+	{
+		jpaths_sort(&js.dirty);
+		jpaths_sort(&js.trees);
+		js.active=1;
+		logp("Using change journal: %d changed directories, "
+			"%d new directory trees\n",
+			js.dirty.count, js.trees.count);
+	}
+	else
+		logp("Scanning everything\n");
+	ret=0;
+end:
+	free_w(&gen);
+	free_w(&lockpath);
+	strlists_free(&roots);
+	if(ret) journal_free();
+	return ret;
+}
+
+// Whether nothing at or below path has changed since the last backup.
+int journal_subtree_clean(const char *path)
+{
+	if(!js.active
+	  || jpaths_at_or_below(&js.dirty, path)
+	  || jpaths_at_or_below(&js.trees, path)
+	  || jpaths_above(&js.trees, path))
+		return 0;
+	return 1;
+}
+
+// Called once the new phase1 cache has been saved.
+int journal_commit(struct conf *conf)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *path=NULL;
+	char *tmp=NULL;
+
+	if(!js.gen || !conf->phase1_cache_new)
+	{
+		journal_free();
+		return 0;
+	}
+	if(!(path=get_journal_path(conf, ".base"))
+	  || !(tmp=get_tmp_filename(path))
+	  || !(fp=open_file(tmp, "wb")))
+		goto end;
+	fprintf(fp, "%s %lld %s %s\n", js.gen, (long long)js.offset,
+		conf->phase1_cache_new, js.fingerprint);
+	if(close_fp(&fp))
+	{
+		logp("Error closing %s\n", tmp);
+		goto end;
+	}
+	if(do_rename(tmp, path)) goto end;
+	ret=0;
+end:
+	close_fp(&fp);
+	free_w(&path);
+	free_w(&tmp);
+	journal_free();
+	return ret;
+}
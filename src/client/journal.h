@@ -0,0 +1,13 @@
+#ifndef _JOURNAL_CLIENT_H
+#define _JOURNAL_CLIENT_H
+
+// Long running helper that records changed directories.
+extern int journal_watch(struct conf *conf);
+
+// Used by the backup.
+extern int journal_begin(struct conf *conf, int cache_usable);
+extern int journal_subtree_clean(const char *path);
+extern int journal_commit(struct conf *conf);
+extern void journal_free(void);
+
+#endif
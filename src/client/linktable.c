@@ -0,0 +1,127 @@
+#include "include.h"
+
+#define LINKTABLE_SIZE_MIN	1024
+
+static size_t link_hash(struct linktable *lt, dev_t dev, ino_t ino)
+{
+	uint64_t h=(uint64_t)ino*0x9E3779B97F4A7C15ULL;
+	h^=(uint64_t)dev*0xC2B2AE3D27D4EB4FULL;
+	h^=h>>29;
+	return (size_t)h & (lt->size-1);
+}
+
+struct linktable *linktable_alloc(void)
+{
+	struct linktable *lt;
+	if(!(lt=(struct linktable *)
+		calloc_w(1, sizeof(struct linktable), __func__)))
+			return NULL;
+	lt->size=LINKTABLE_SIZE_MIN;
+	if(!(lt->ent=(struct link_ent *)
+		calloc_w(lt->size, sizeof(struct link_ent), __func__)))
+			free_v((void **)&lt);
+	return lt;
+}
+
+void linktable_free(struct linktable **lt)
+{
+	size_t i;
+	if(!lt || !*lt) return;
+	for(i=0; i<(*lt)->size; i++)
+		free_w(&(*lt)->ent[i].name);
+	free_v((void **)&(*lt)->ent);
+	free_v((void **)lt);
+}
+
+struct link_ent *linktable_find(struct linktable *lt, struct stat *statp)
+{
+	size_t i=link_hash(lt, statp->st_dev, statp->st_ino);
+	while(lt->ent[i].name)
+	{
+		if(lt->ent[i].ino==statp->st_ino
+		  && lt->ent[i].dev==statp->st_dev)
+			return &lt->ent[i];
+		i=(i+1) & (lt->size-1);
+	}
+	return NULL;
+}
+
+static void put(struct linktable *lt, struct link_ent *e)
+{
+	size_t i=link_hash(lt, e->dev, e->ino);
+	while(lt->ent[i].name)
+		i=(i+1) & (lt->size-1);
+	lt->ent[i]=*e;
+}
+
+static int grow(struct linktable *lt)
+{
+	size_t i;
+	size_t oldsize=lt->size;
+	struct link_ent *old=lt->ent;
+
+	if(!(lt->ent=(struct link_ent *)
+		calloc_w(oldsize*2, sizeof(struct link_ent), __func__)))
+	{
+		lt->ent=old;
+		return -1;
+	}
+	lt->size=oldsize*2;
+	for(i=0; i<oldsize; i++)
+		if(old[i].name) put(lt, &old[i]);
+	free_v((void **)&old);
+	return 0;
+}
+
+int linktable_add(struct linktable *lt, struct stat *statp, const char *name)
+{
+	struct link_ent e;
+
+	// Keep it no more than three quarters full, so that runs stay short.
+	if((lt->count+1)*4>lt->size*3 && grow(lt))
+		return -1;
+	e.dev=statp->st_dev;
+	e.ino=statp->st_ino;
+	e.left=statp->st_nlink-1;
+	if(!(e.name=strdup_w(name, __func__)))
+		return -1;
+	put(lt, &e);
+	if(++lt->count>lt->peak) lt->peak=lt->count;
+	return 0;
+}
+
+// Removes a slot, moving back any later entries in the same run that would
+// otherwise no longer be found.
+static void linktable_remove(struct linktable *lt, size_t i)
+{
+	size_t j=i;
+	size_t mask=lt->size-1;
+
+	free_w(&lt->ent[i].name);
+	while(1)
+	{
+		size_t home;
+		j=(j+1) & mask;
+		if(!lt->ent[j].name) break;
+		home=link_hash(lt, lt->ent[j].dev, lt->ent[j].ino);
+		// Only move it if the gap is between where it wanted to go
+		// and where it is.
+		if(((j-home) & mask)<((j-i) & mask)) continue;
+		lt->ent[i]=lt->ent[j];
+		lt->ent[j].name=NULL;
+		i=j;
+	}
+	lt->count--;
+}
+
+// Another link to ent has been backed up. Once all of them have been, the
+// entry is not needed any more.
+void linktable_seen(struct linktable *lt, struct link_ent *ent)
+{
+	if(ent->left>1)
+	{
+		ent->left--;
+		return;
+	}
+	linktable_remove(lt, ent-lt->ent);
+}
@@ -0,0 +1,32 @@
+#ifndef _LINKTABLE_CLIENT_H
+#define _LINKTABLE_CLIENT_H
+
+// A file with more than one link, and the path that it was first backed up
+// as. Empty slots have no name.
+struct link_ent
+{
+	dev_t dev;
+	ino_t ino;
+	nlink_t left; // Links that have not been seen yet.
+	char *name;
+};
+
+// Open addressing table of the hard linked files that have been seen, so
+// that later links to them are sent as links instead of the data again.
+struct linktable
+{
+	struct link_ent *ent;
+	size_t size; // Always a power of two.
+	size_t count;
+	size_t peak;
+};
+
+extern struct linktable *linktable_alloc(void);
+extern void linktable_free(struct linktable **lt);
+extern struct link_ent *linktable_find(struct linktable *lt,
+	struct stat *statp);
+extern int linktable_add(struct linktable *lt,
+	struct stat *statp, const char *name);
+extern void linktable_seen(struct linktable *lt, struct link_ent *ent);
+
+#endif
@@ -166,9 +166,7 @@ timer_not_met:
 	return CLIENT_SERVER_TIMER_NOT_MET;
 }
 
-static int s_server_session_id_context=1;
-
-static int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
+int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
 	enum action action, struct conf *conf)
 {
 	BIO *sbio=NULL;
@@ -179,10 +177,6 @@ static int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
 		return -1;
 	}
 
-	SSL_CTX_set_session_id_context(*ctx,
-		(const uint8_t *)&s_server_session_id_context,
-		sizeof(s_server_session_id_context));
-
 	if((*rfd=init_client_socket(conf->server,
 		action==ACTION_MONITOR?conf->status_port:conf->port))<0)
 			return -1;
@@ -195,6 +189,7 @@ static int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
 		return -1;
 	}
 	SSL_set_bio(*ssl, sbio, sbio);
+	ssl_client_sessions(*ctx, *ssl, conf);
 	if(SSL_connect(*ssl)<=0)
 	{
 		logp_ssl_err("SSL connect error\n");
@@ -330,6 +325,13 @@ static enum cliret do_client(struct conf *conf,
 //	logp("begin client\n");
 //	logp("action %d\n", action);
 
+	// The change journal helper only looks at the local file system.
+	if(action==ACTION_JOURNAL)
+	{
+		if(journal_watch(conf)) ret=CLIENT_ERROR;
+		goto end;
+	}
+
 	// Status monitor forks a child process instead of connecting to
 	// the server directly.
 	if(action==ACTION_STATUS
@@ -3,5 +3,7 @@
 
 extern int client(struct conf *conf, enum action act, int vss_restore,
 	int json);
+extern int ssl_setup(int *rfd, SSL **ssl, SSL_CTX **ctx,
+	enum action action, struct conf *conf);
 
 #endif
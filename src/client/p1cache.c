@@ -0,0 +1,482 @@
+#include "include.h"
+#include "../cmd.h"
+#include "../burp1/sbufl.h"
+#include "../pathcmp.h"
+
+// Everything that the client sent in phase1 of the last backup, in the same
+// format as the phase1 file on the server. While scanning, runs of entries
+// that are the same as in the cache are not sent. Instead, a CMD_UNCHANGED
+// with the length of the run and its first and last entries is sent, and
+// the server fills the run in from its current manifest.
+// The cache is only used when the token saved with it matches the one that
+// the server has for its current backup, so it always describes that
+// backup.
+struct p1cache
+{
+	gzFile rzp; // The cache from the last backup, if it can be used.
+	gzFile wzp; // The cache being built for this backup.
+	char *tmppath;
+	struct sbuf *cb; // The next entry from rzp.
+	uint8_t ceof;
+	uint8_t cerr;
+	uint8_t built;
+	char *lastdir; // The last directory that was found in rzp.
+	// Paths that phase2 left out of the backup, which must not be in
+	// the new cache, because the server will not have them.
+	char **forgot;
+	int nforgot;
+	int forgot_alloc;
+	// The run of unchanged entries that has not been sent yet.
+	unsigned long long run;
+	struct iobuf first;
+	struct iobuf last;
+	unsigned long long unchanged;
+	unsigned long long runs;
+};
+
+static struct p1cache p1c;
+
+static void p1cache_free_content(void)
+{
+	int i;
+	for(i=0; i<p1c.nforgot; i++) free_w(&p1c.forgot[i]);
+	free_v((void **)&p1c.forgot);
+	gzclose_fp(&p1c.rzp);
+	gzclose_fp(&p1c.wzp);
+	free_w(&p1c.tmppath);
+	free_w(&p1c.lastdir);
+	sbuf_free(&p1c.cb);
+	iobuf_free_content(&p1c.first);
+	iobuf_free_content(&p1c.last);
+}
+
+static char *get_token_path(struct conf *conf)
+{
+	char *path=NULL;
+	if(!(path=strdup_w(conf->phase1_cache, __func__))
+	  || astrcat(&path, ".token", __func__))
+		free_w(&path);
+	return path;
+}
+
+// Whether the cache on disk goes with the current backup on the server.
+static int cache_matches_server(struct conf *conf)
+{
+	int ret=0;
+	FILE *fp=NULL;
+	char *path=NULL;
+	char buf[128]="";
+
+	if(!conf->phase1_cache_cur || !strcmp(conf->phase1_cache_cur, "0"))
+		return 0;
+	if(!(path=get_token_path(conf))) return 0;
+	if((fp=fopen(path, "rb")))
+	{
+		if(fgets(buf, sizeof(buf), fp))
+		{
+			buf[strcspn(buf, "\r\n")]='\0';
+			ret=!strcmp(buf, conf->phase1_cache_cur);
+		}
+		fclose(fp);
+	}
+	free_w(&path);
+	return ret;
+}
+
+int p1cache_open(struct conf *conf)
+{
+	memset(&p1c, 0, sizeof(p1c));
+	if(!conf->phase1_cache
+	  || !conf->phase1_cache_new
+	  || conf->protocol!=PROTO_BURP1)
+		return 0;
+
+	if(!(p1c.tmppath=get_tmp_filename(conf->phase1_cache))
+	  || !(p1c.wzp=gzopen_file(p1c.tmppath, "wb1")))
+		goto error;
+	if(cache_matches_server(conf))
+	{
+		if(!(p1c.cb=sbuf_alloc(conf)))
+			goto error;
+		if(!(p1c.rzp=gzopen_file(conf->phase1_cache, "rb")))
+			logp("Could not open phase1 cache %s\n",
+				conf->phase1_cache);
+		else
+			logp("Using phase1 cache %s\n", conf->phase1_cache);
+	}
+	else
+		logp("Building new phase1 cache %s\n", conf->phase1_cache);
+	return 0;
+error:
+	p1cache_abort();
+	return -1;
+}
+
+// Whether the cache from the last backup has an entry exactly the same as
+// this one. Entries come in the same order as the cache was written.
+static int cache_has(struct conf *conf, struct sbuf *sb,
+	enum cmd cmd, const char *path, const char *link)
+{
+	int c;
+	int ars;
+	int same;
+	struct sbuf *cb=p1c.cb;
+
+	while(1)
+	{
+		if(!cb->path.buf)
+		{
+			if(p1c.ceof) return 0;
+			if((ars=sbufl_fill_phase1(cb, NULL, p1c.rzp, NULL)))
+			{
+				if(ars<0)
+				{
+					logp("Error reading phase1 cache\n");
+					p1c.cerr=1;
+				}
+				p1c.ceof=1;
+				return 0;
+			}
+		}
+		if((c=pathcmp(cb->path.buf, path))>0) return 0;
+		if(!c && cb->path.cmd==cmd) break;
+		sbuf_free_content(cb);
+	}
+	same=!strcmp(cb->attr.buf, sb->attr.buf)
+	  && (!link || (cb->link.buf && !strcmp(cb->link.buf, link)));
+	sbuf_free_content(cb);
+	return same;
+}
+
+static int run_entry_set(struct iobuf *iobuf, enum cmd cmd, const char *str)
+{
+	char *tmp;
+	if(!(tmp=strdup_w(str, __func__))) return -1;
+	iobuf_free_content(iobuf);
+	iobuf_from_str(iobuf, cmd, tmp);
+	return 0;
+}
+
+static int add_to_run(enum cmd cmd, const char *path)
+{
+	if(!p1c.run && run_entry_set(&p1c.first, cmd, path))
+		return -1;
+	if(run_entry_set(&p1c.last, cmd, path))
+		return -1;
+	p1c.run++;
+	return 0;
+}
+
+static int send_run(struct asfd *asfd)
+{
+	char msg[32]="";
+	if(!p1c.run) return 0;
+	snprintf(msg, sizeof(msg), "%llu", p1c.run);
+	if(asfd->write_str(asfd, CMD_UNCHANGED, msg)
+	  || asfd->write(asfd, &p1c.first)
+	  || asfd->write(asfd, &p1c.last))
+		return -1;
+	p1c.unchanged+=p1c.run;
+	p1c.runs++;
+	p1c.run=0;
+	return 0;
+}
+
+// Returns 1 if the entry is covered by a run and should not be sent.
+int p1cache_entry(struct asfd *asfd, struct conf *conf,
+	struct sbuf *sb, enum cmd cmd, const char *path, const char *link)
+{
+	if(!p1c.wzp) return 0;
+
+	if(send_msg_zp(p1c.wzp, CMD_ATTRIBS, sb->attr.buf, sb->attr.len)
+	  || send_msg_zp(p1c.wzp, cmd, path, strlen(path))
+	  || (link && send_msg_zp(p1c.wzp, cmd, link, strlen(link))))
+	{
+		logp("Could not write to phase1 cache %s\n", p1c.tmppath);
+		return -1;
+	}
+
+	if(cmd==CMD_DIRECTORY) free_w(&p1c.lastdir);
+	if(p1c.rzp && cache_has(conf, sb, cmd, path, link))
+	{
+		if(cmd==CMD_DIRECTORY
+		  && !(p1c.lastdir=strdup_w(path, __func__)))
+			return -1;
+		return add_to_run(cmd, path)?-1:1;
+	}
+	return send_run(asfd);
+}
+
+int p1cache_usable(void)
+{
+	return p1c.rzp!=NULL;
+}
+
+// Whether dir has just been found in the cache, unchanged, so that the
+// cache has what was below it last time.
+int p1cache_has_dir(const char *dir)
+{
+	return p1c.rzp && !p1c.cerr
+	  && p1c.lastdir && !strcmp(p1c.lastdir, dir);
+}
+
+// A file with other hard links can be changed through a link in another
+// directory, which the journal does not see. So lstat it again, and put
+// what is there now in cb.
+// Returns 1 if it is not the same as in the cache, and -1 on error.
+static int relink_changed(struct sbuf *cb)
+{
+	int same;
+	char *cached;
+
+	attribs_decode(cb);
+	if(S_ISDIR(cb->statp.st_mode) || cb->statp.st_nlink<2)
+		return 0;
+	if(lstat(cb->path.buf, &cb->statp))
+	{
+		// Gone, so leave it out.
+		sbuf_free_content(cb);
+		return 1;
+	}
+	cached=cb->attr.buf;
+	cb->attr.buf=NULL;
+	if(attribs_encode(cb))
+	{
+		cb->attr.buf=cached;
+		return -1;
+	}
+	same=!strcmp(cached, cb->attr.buf);
+	free_w(&cached);
+	return !same;
+}
+
+// Everything below dir is known not to have changed, so add it to the run
+// straight from the cache, without looking at the file system. Except for
+// files with more than one link, which are checked again.
+int p1cache_replay(struct asfd *asfd, struct conf *conf, const char *dir)
+{
+	int ars;
+	int changed;
+	struct sbuf *cb=p1c.cb;
+
+	if(!p1c.rzp || p1c.cerr)
+	{
+		logp("No phase1 cache to send %s from\n", dir);
+		return -1;
+	}
+	while(1)
+	{
+		if(!cb->path.buf)
+		{
+			if(p1c.ceof) return 0;
+			if((ars=sbufl_fill_phase1(cb, NULL, p1c.rzp, NULL)))
+			{
+				if(ars<0)
+				{
+					// Cannot carry on, because the server
+					// would think that the rest was deleted.
+					logp("Error reading phase1 cache\n");
+					return -1;
+				}
+				p1c.ceof=1;
+				return 0;
+			}
+		}
+		if(pathcmp(cb->path.buf, dir)<=0)
+		{
+			sbuf_free_content(cb);
+			continue;
+		}
+		if(!is_subdir(dir, cb->path.buf))
+			return 0;
+		if((changed=relink_changed(cb))<0)
+			return -1;
+		if(changed)
+		{
+			// The server cannot fill this in from its manifest,
+			// so end the run before it.
+			if(send_run(asfd))
+				return -1;
+			if(!cb->path.buf)
+				continue;
+		}
+		if(send_msg_zp(p1c.wzp, CMD_ATTRIBS,
+			cb->attr.buf, cb->attr.len)
+		  || send_msg_zp(p1c.wzp, cb->path.cmd,
+			cb->path.buf, cb->path.len)
+		  || (cb->link.buf && send_msg_zp(p1c.wzp, cb->link.cmd,
+			cb->link.buf, cb->link.len)))
+		{
+			logp("Could not write to phase1 cache %s\n",
+				p1c.tmppath);
+			return -1;
+		}
+		if(changed)
+		{
+			if(asfd->write(asfd, &cb->attr)
+			  || asfd->write(asfd, &cb->path)
+			  || (cb->link.buf && asfd->write(asfd, &cb->link)))
+				return -1;
+		}
+		else if(add_to_run(cb->path.cmd, cb->path.buf))
+			return -1;
+		cntr_add_phase1(conf->cntr, cb->path.cmd, 1);
+		sbuf_free_content(cb);
+	}
+}
+
+// Send anything left over at the end of phase1, and finish the new cache.
+int p1cache_end(struct asfd *asfd)
+{
+	if(!p1c.wzp) return 0;
+	if(send_run(asfd)
+	  || send_msg_zp(p1c.wzp, CMD_GEN,
+		"phase1end", strlen("phase1end")))
+			goto error;
+	if(gzclose_fp(&p1c.wzp))
+	{
+		logp("Error closing %s\n", p1c.tmppath);
+		goto error;
+	}
+	if(p1c.rzp)
+		logp("Phase1 cache: %llu unchanged entries sent as %llu runs\n",
+			p1c.unchanged, p1c.runs);
+	gzclose_fp(&p1c.rzp);
+	p1c.built=1;
+	return 0;
+error:
+	p1cache_abort();
+	return -1;
+}
+
+void p1cache_abort(void)
+{
+	if(p1c.tmppath) unlink(p1c.tmppath);
+	p1cache_free_content();
+	memset(&p1c, 0, sizeof(p1c));
+}
+
+// Phase2 did not send path, so the server will not have it.
+int p1cache_forget(const char *path)
+{
+	if(!p1c.tmppath) return 0;
+	if(p1c.nforgot>=p1c.forgot_alloc)
+	{
+		char **tmp;
+		int want=p1c.forgot_alloc?p1c.forgot_alloc*2:64;
+		if(!(tmp=(char **)realloc_w(p1c.forgot,
+			want*sizeof(char *), __func__)))
+				return -1;
+		p1c.forgot=tmp;
+		p1c.forgot_alloc=want;
+	}
+	if(!(p1c.forgot[p1c.nforgot]=strdup_w(path, __func__)))
+		return -1;
+	p1c.nforgot++;
+	return 0;
+}
+
+static int forgot_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Copies the new cache without the paths that phase2 left out. Otherwise,
+// the next backup would send a run with them in, which would not match
+// what the server has.
+static int drop_forgotten(struct conf *conf)
+{
+	int ars;
+	int ret=-1;
+	char *newpath=NULL;
+	gzFile rzp=NULL;
+	gzFile wzp=NULL;
+	struct sbuf *sb=NULL;
+
+	if(!p1c.nforgot) return 0;
+	qsort(p1c.forgot, p1c.nforgot, sizeof(char *), forgot_cmp);
+	if(!(newpath=get_tmp_filename(p1c.tmppath))
+	  || !(sb=sbuf_alloc(conf))
+	  || !(rzp=gzopen_file(p1c.tmppath, "rb"))
+	  || !(wzp=gzopen_file(newpath, "wb1")))
+		goto end;
+	while(!(ars=sbufl_fill_phase1(sb, NULL, rzp, NULL)))
+	{
+		const char *path=sb->path.buf;
+		if(!bsearch(&path, p1c.forgot, p1c.nforgot,
+			sizeof(char *), forgot_cmp)
+		  && (send_msg_zp(wzp, CMD_ATTRIBS,
+			sb->attr.buf, sb->attr.len)
+		  || send_msg_zp(wzp, sb->path.cmd,
+			sb->path.buf, sb->path.len)
+		  || (sb->link.buf && send_msg_zp(wzp, sb->link.cmd,
+			sb->link.buf, sb->link.len))))
+		{
+			logp("Could not write to phase1 cache %s\n", newpath);
+			goto end;
+		}
+		sbuf_free_content(sb);
+	}
+	if(ars<0
+	  || send_msg_zp(wzp, CMD_GEN, "phase1end", strlen("phase1end")))
+		goto end;
+	if(gzclose_fp(&wzp))
+	{
+		logp("Error closing %s\n", newpath);
+		goto end;
+	}
+	if(do_rename(newpath, p1c.tmppath))
+		goto end;
+	logp("Left %d paths that were not backed up out of the phase1 cache\n",
+		p1c.nforgot);
+	ret=0;
+end:
+	gzclose_fp(&rzp);
+	gzclose_fp(&wzp);
+	if(ret && newpath) unlink(newpath);
+	sbuf_free(&sb);
+	free_w(&newpath);
+	return ret;
+}
+
+// The backup worked, so the new cache describes what the server now has as
+// its current backup.
+int p1cache_commit(struct conf *conf)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *tokenpath=NULL;
+	char *tokentmp=NULL;
+
+	if(!p1c.built)
+	{
+		p1cache_abort();
+		return 0;
+	}
+	if(drop_forgotten(conf)
+	  || !(tokenpath=get_token_path(conf))
+	  || !(tokentmp=get_tmp_filename(tokenpath))
+	  || !(fp=open_file(tokentmp, "wb")))
+		goto end;
+	fprintf(fp, "%s\n", conf->phase1_cache_new);
+	if(close_fp(&fp))
+	{
+		logp("Error closing %s\n", tokentmp);
+		goto end;
+	}
+	// The old token must not be left with the new cache, in case the
+	// server did not manage to finish the backup. If this gets
+	// interrupted half way, there is no token, and the cache will be
+	// rebuilt.
+	if((unlink(tokenpath) && errno!=ENOENT)
+	  || do_rename(p1c.tmppath, conf->phase1_cache)
+	  || do_rename(tokentmp, tokenpath))
+		goto end;
+	ret=0;
+end:
+	close_fp(&fp);
+	free_w(&tokenpath);
+	free_w(&tokentmp);
+	p1cache_abort();
+	return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef _P1CACHE_CLIENT_H
+#define _P1CACHE_CLIENT_H
+
+extern int p1cache_open(struct conf *conf);
+extern int p1cache_entry(struct asfd *asfd, struct conf *conf,
+	struct sbuf *sb, enum cmd cmd, const char *path, const char *link);
+extern int p1cache_usable(void);
+extern int p1cache_has_dir(const char *dir);
+extern int p1cache_replay(struct asfd *asfd,
+	struct conf *conf, const char *dir);
+extern int p1cache_end(struct asfd *asfd);
+extern void p1cache_abort(void);
+extern int p1cache_forget(const char *path);
+extern int p1cache_commit(struct conf *conf);
+
+#endif
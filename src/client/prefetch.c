@@ -0,0 +1,583 @@
+#include "include.h"
+#include "../cmd.h"
+
+// In protocol 2 backups, the server asks for files well before the client
+// gets round to reading them. The files that are coming up next are opened
+// and the start of each is read while earlier ones are still being split
+// into blocks, so that lots of small files do not each have to wait for an
+// open, a read and a close in turn.
+// With io_uring, all of those are in flight at once, and a small file is
+// read whole and closed before it is needed. Otherwise, the files are
+// opened in turn, and the kernel is asked to start reading them.
+
+#ifndef HAVE_WIN32
+
+#if defined(HAVE_LINUX_OS) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#define PREFETCH_FILES_MAX	256
+#define PREFETCH_BUFSIZE	(128*1024)
+
+enum pf_state
+{
+	PF_OPENING=0,
+	PF_READING,
+	PF_READY
+};
+
+struct pf_ent
+{
+	char *path;
+	uint64_t index;
+	enum pf_state state;
+	uint8_t noatime;
+	int fd;
+	int err; // From the open, if it failed.
+	char *buf;
+	size_t len;
+	// The file that was read ahead, so that it can be checked that it is
+	// still the same one when it is wanted.
+	struct stat statp;
+	uint8_t stated;
+};
+
+#ifdef HAVE_IO_URING
+// The bits of an io_uring that are needed here, set up by hand because
+// liburing is not a dependency.
+struct uring
+{
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_tail_local;
+	unsigned to_submit;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+	// Operations that have not completed yet, not counting closes.
+	int inflight;
+};
+
+// user_data for closes, whose results are not needed.
+#define PF_UNTRACKED	((uint64_t)-1)
+#endif
+
+// The files being read ahead, in the order in which they will be wanted.
+struct prefetch
+{
+	struct pf_ent ent[PREFETCH_FILES_MAX];
+	int head;
+	int count;
+	int max;
+	uint64_t next_index; // Files before this have already been looked at.
+	uint64_t want; // The file that is being read now.
+	struct conf *conf;
+#ifdef HAVE_IO_URING
+	struct uring ring;
+#endif
+	unsigned long long files;
+	unsigned long long whole;
+	unsigned long long waits;
+};
+
+static struct prefetch pf;
+
+#ifdef HAVE_IO_URING
+static void *uring_mmap(int fd, size_t len, off_t off)
+{
+	void *p=mmap(NULL, len, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, fd, off);
+	return p==MAP_FAILED?NULL:p;
+}
+
+// Whether the kernel can do everything that is needed here.
+static int uring_has_ops(int fd)
+{
+	int ret=0;
+	size_t len;
+	struct io_uring_probe *probe;
+
+	len=sizeof(*probe)+256*sizeof(struct io_uring_probe_op);
+	if(!(probe=(struct io_uring_probe *)calloc_w(1, len, __func__)))
+		return 0;
+	if(syscall(__NR_io_uring_register, fd,
+		IORING_REGISTER_PROBE, probe, 256)>=0)
+	{
+		int ops[]={IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+		unsigned i;
+		ret=1;
+		for(i=0; i<sizeof(ops)/sizeof(ops[0]); i++)
+			if(ops[i]>probe->last_op
+			  || !(probe->ops[ops[i]].flags
+				& IO_URING_OP_SUPPORTED))
+					ret=0;
+	}
+	free_v((void **)&probe);
+	return ret;
+}
+
+static void uring_free(struct uring *r)
+{
+	if(r->sqes) munmap(r->sqes, r->sqes_len);
+	if(r->cq_ring) munmap(r->cq_ring, r->cq_ring_len);
+	if(r->sq_ring) munmap(r->sq_ring, r->sq_ring_len);
+	if(r->fd>=0) close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd=-1;
+}
+
+static int uring_setup(struct uring *r, unsigned entries)
+{
+	char *sq;
+	char *cq;
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if((r->fd=syscall(__NR_io_uring_setup, entries, &p))<0)
+		goto error;
+	if(!uring_has_ops(r->fd))
+		goto error;
+	r->sq_ring_len=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	r->cq_ring_len=p.cq_off.cqes
+		+p.cq_entries*sizeof(struct io_uring_cqe);
+	r->sqes_len=p.sq_entries*sizeof(struct io_uring_sqe);
+	if(!(r->sq_ring=uring_mmap(r->fd, r->sq_ring_len, IORING_OFF_SQ_RING))
+	  || !(r->cq_ring=uring_mmap(r->fd, r->cq_ring_len,
+		IORING_OFF_CQ_RING))
+	  || !(r->sqes=(struct io_uring_sqe *)uring_mmap(r->fd,
+		r->sqes_len, IORING_OFF_SQES)))
+			goto error;
+	sq=(char *)r->sq_ring;
+	cq=(char *)r->cq_ring;
+	r->sq_entries=p.sq_entries;
+	r->sq_head=(unsigned *)(sq+p.sq_off.head);
+	r->sq_tail=(unsigned *)(sq+p.sq_off.tail);
+	r->sq_mask=(unsigned *)(sq+p.sq_off.ring_mask);
+	r->sq_array=(unsigned *)(sq+p.sq_off.array);
+	r->sq_tail_local=*r->sq_tail;
+	r->cq_head=(unsigned *)(cq+p.cq_off.head);
+	r->cq_tail=(unsigned *)(cq+p.cq_off.tail);
+	r->cq_mask=(unsigned *)(cq+p.cq_off.ring_mask);
+	r->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+	return 0;
+error:
+	uring_free(r);
+	return -1;
+}
+
+// Submits anything queued, and waits for wait completions.
+static int uring_enter(struct uring *r, unsigned wait)
+{
+	int n;
+	if(!r->to_submit && !wait) return 0;
+	__atomic_store_n(r->sq_tail, r->sq_tail_local, __ATOMIC_RELEASE);
+	while((n=syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait,
+		wait?IORING_ENTER_GETEVENTS:0, NULL, 0))<0)
+	{
+		if(errno==EINTR) continue;
+		logp("io_uring_enter failed: %s\n", strerror(errno));
+		return -1;
+	}
+	r->to_submit-=n;
+	return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned i;
+	struct io_uring_sqe *sqe;
+
+	if(r->sq_tail_local-__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)
+		>=r->sq_entries)
+	{
+		if(uring_enter(r, 0)) return NULL;
+		if(r->sq_tail_local-__atomic_load_n(r->sq_head,
+			__ATOMIC_ACQUIRE)>=r->sq_entries)
+		{
+			logp("io_uring submission queue is full\n");
+			return NULL;
+		}
+	}
+	i=r->sq_tail_local & *r->sq_mask;
+	sqe=&r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[i]=i;
+	r->sq_tail_local++;
+	r->to_submit++;
+	return sqe;
+}
+
+static int submit_open(int slot)
+{
+	struct io_uring_sqe *sqe;
+	struct pf_ent *e=&pf.ent[slot];
+	if(!(sqe=uring_sqe(&pf.ring))) return -1;
+	sqe->opcode=IORING_OP_OPENAT;
+	sqe->fd=AT_FDCWD;
+	sqe->addr=(uint64_t)(uintptr_t)e->path;
+	sqe->open_flags=O_RDONLY|O_NOFOLLOW|(e->noatime?O_NOATIME:0);
+	sqe->user_data=slot;
+	pf.ring.inflight++;
+	return 0;
+}
+
+static int submit_read(int slot)
+{
+	struct io_uring_sqe *sqe;
+	struct pf_ent *e=&pf.ent[slot];
+	if(!(sqe=uring_sqe(&pf.ring))) return -1;
+	sqe->opcode=IORING_OP_READ;
+	sqe->fd=e->fd;
+	sqe->addr=(uint64_t)(uintptr_t)(e->buf+e->len);
+	sqe->len=PREFETCH_BUFSIZE-e->len;
+	sqe->off=e->len;
+	sqe->user_data=slot;
+	pf.ring.inflight++;
+	return 0;
+}
+
+static int submit_close(int fd)
+{
+	struct io_uring_sqe *sqe;
+	if(!(sqe=uring_sqe(&pf.ring))) return -1;
+	sqe->opcode=IORING_OP_CLOSE;
+	sqe->fd=fd;
+	sqe->user_data=PF_UNTRACKED;
+	return 0;
+}
+
+static int completed(int slot, int res)
+{
+	struct pf_ent *e=&pf.ent[slot];
+
+	pf.ring.inflight--;
+	switch(e->state)
+	{
+		case PF_OPENING:
+			// O_NOATIME is only allowed on things that we own.
+			if(res==-EPERM && e->noatime)
+			{
+				e->noatime=0;
+				return submit_open(slot);
+			}
+			if(res<0)
+			{
+				e->err=-res;
+				e->state=PF_READY;
+				return 0;
+			}
+			e->fd=res;
+			if(!(e->buf=(char *)malloc_w(PREFETCH_BUFSIZE,
+				__func__)))
+					return -1;
+			e->state=PF_READING;
+			return submit_read(slot);
+		case PF_READING:
+			if(res>0)
+			{
+				// Read until the buffer is full, or the end of
+				// the file turns up.
+				e->len+=res;
+				if(e->len<PREFETCH_BUFSIZE)
+					return submit_read(slot);
+			}
+			e->stated=!fstat(e->fd, &e->statp);
+			if(!res)
+			{
+				// Got all of it, so the file is not needed.
+				if(submit_close(e->fd)) return -1;
+				e->fd=-1;
+				pf.whole++;
+			}
+			// On an error, whatever reads from fd next will get
+			// it again and deal with it.
+			e->state=PF_READY;
+			return 0;
+		default:
+			logp("Unexpected io_uring completion for %s\n", e->path);
+			return -1;
+	}
+}
+
+static int uring_reap(struct uring *r)
+{
+	unsigned head=*r->cq_head;
+	while(head!=__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe *cqe=&r->cqes[head & *r->cq_mask];
+		uint64_t data=cqe->user_data;
+		int res=cqe->res;
+		__atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+		if(data==PF_UNTRACKED) continue;
+		if(completed((int)data, res)) return -1;
+	}
+	return 0;
+}
+#endif
+
+static int open_ahead(struct pf_ent *e)
+{
+	e->state=PF_READY;
+#ifdef O_NOATIME
+	if(e->noatime)
+		e->fd=open(e->path, O_RDONLY|O_NOFOLLOW|O_NOATIME);
+	if(e->fd<0)
+#endif
+		e->fd=open(e->path, O_RDONLY|O_NOFOLLOW);
+	if(e->fd<0)
+	{
+		e->err=errno;
+		return 0;
+	}
+	e->stated=!fstat(e->fd, &e->statp);
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(e->fd, 0, PREFETCH_BUFSIZE, POSIX_FADV_WILLNEED);
+#endif
+	return 0;
+}
+
+static void pf_ent_free_content(struct pf_ent *e)
+{
+	if(e->fd>=0) close(e->fd);
+	free_w(&e->buf);
+	free_w(&e->path);
+	memset(e, 0, sizeof(*e));
+	e->fd=-1;
+}
+
+static void pop(void)
+{
+	pf_ent_free_content(&pf.ent[pf.head]);
+	pf.head=(pf.head+1)%PREFETCH_FILES_MAX;
+	pf.count--;
+}
+
+// Whether a path is a fifo or block device that has been asked to be read,
+// which could block, or go on forever, if opened early.
+static int is_special(const char *path)
+{
+	struct strlist *l;
+	for(l=pf.conf->fifos; l; l=l->next)
+		if(!strcmp(l->path, path)) return 1;
+	for(l=pf.conf->blockdevs; l; l=l->next)
+		if(!strcmp(l->path, path)) return 1;
+	return 0;
+}
+
+static int add(struct sbuf *sb)
+{
+	int slot=(pf.head+pf.count)%PREFETCH_FILES_MAX;
+	struct pf_ent *e=&pf.ent[slot];
+
+	memset(e, 0, sizeof(*e));
+	e->fd=-1;
+	e->noatime=!pf.conf->atime;
+	if(!(e->path=strdup_w(sb->path.buf, __func__)))
+		return -1;
+	e->index=sb->burp2->index;
+	pf.count++;
+	pf.files++;
+#ifdef HAVE_IO_URING
+	if(pf.ring.fd>=0)
+		return submit_open(slot);
+#endif
+	return open_ahead(e);
+}
+
+int prefetch_init(struct conf *conf)
+{
+	memset(&pf, 0, sizeof(pf));
+#ifdef HAVE_IO_URING
+	pf.ring.fd=-1;
+#endif
+	if(conf->prefetch_files<=0) return 0;
+	if(conf->read_all_fifos || conf->read_all_blockdevs)
+	{
+		logp("Not reading files ahead with read_all_fifos or read_all_blockdevs set\n");
+		return 0;
+	}
+	pf.conf=conf;
+	pf.max=conf->prefetch_files;
+	if(pf.max>PREFETCH_FILES_MAX) pf.max=PREFETCH_FILES_MAX;
+#ifdef HAVE_IO_URING
+	// Room for an operation on each file, plus the closes.
+	if(!uring_setup(&pf.ring, pf.max*2))
+	{
+		logp("Reading up to %d files ahead with io_uring\n", pf.max);
+		return 0;
+	}
+#endif
+	logp("Opening up to %d files ahead\n", pf.max);
+	return 0;
+}
+
+// Read ahead the files from sb onwards, until there are as many on the go
+// as allowed. sb is the file that is being read now.
+int prefetch_fill(struct sbuf *sb)
+{
+	if(!pf.max) return 0;
+	if(sb) pf.want=sb->burp2->index;
+	for(; sb && pf.count<pf.max; sb=sb->next)
+	{
+		if(sb->burp2->index<pf.next_index) continue;
+		pf.next_index=sb->burp2->index+1;
+		if(sb->path.cmd!=CMD_FILE || is_special(sb->path.buf))
+			continue;
+		if(add(sb)) return -1;
+	}
+#ifdef HAVE_IO_URING
+	if(pf.ring.fd>=0
+	  && (uring_reap(&pf.ring) || uring_enter(&pf.ring, 0)))
+		return -1;
+#endif
+	return 0;
+}
+
+static int wait_ready(struct pf_ent *e)
+{
+#ifdef HAVE_IO_URING
+	if(e->state!=PF_READY) pf.waits++;
+	while(e->state!=PF_READY)
+	{
+		if(uring_enter(&pf.ring, 1)
+		  || uring_reap(&pf.ring))
+			return -1;
+	}
+#endif
+	return 0;
+}
+
+// Whether what was read ahead is from the file that is there now. The
+// attributes sent to the server come from an lstat() just before this, so
+// the data has to go with them.
+static int still_same(struct pf_ent *e, const char *fname)
+{
+	struct stat statp;
+	if(!e->stated || lstat(fname, &statp)) return 0;
+	return statp.st_dev==e->statp.st_dev
+	  && statp.st_ino==e->statp.st_ino
+	  && statp.st_size==e->statp.st_size
+	  && statp.st_mtime==e->statp.st_mtime
+	  && statp.st_ctime==e->statp.st_ctime;
+}
+
+// Used as the open_for_send() of the bfd of each file that the server asks
+// for. If the file has been read ahead, the bfd gets what has been read,
+// otherwise the file is opened as normal.
+int prefetch_open_for_send(BFILE *bfd, struct asfd *asfd,
+	const char *fname, int64_t winattr, int atime, struct conf *conf)
+{
+	struct pf_ent *e=NULL;
+
+	bfile_init(bfd, winattr, conf);
+	// Files before the one wanted were not needed after all. The ones
+	// after it are left alone, because the wanted one might not have
+	// been read ahead at all.
+	while(pf.count)
+	{
+		e=&pf.ent[pf.head];
+		if(e->index>pf.want)
+		{
+			e=NULL;
+			break;
+		}
+		if(wait_ready(e)) return -1;
+		if(e->index==pf.want && !strcmp(e->path, fname)) break;
+		pop();
+		e=NULL;
+	}
+	if(e && (e->fd>=0 || e->buf) && !still_same(e, fname))
+	{
+		logp("%s changed after it was read ahead\n", fname);
+		pop();
+		e=NULL;
+	}
+	if(!e || (e->fd<0 && !e->buf))
+	{
+		// Opening it again gives the same error the normal way.
+		if(e) pop();
+		return bfd->open_for_send(bfd, asfd, fname,
+			winattr, atime, conf);
+	}
+	if(bfile_set_read_ahead(bfd, fname, e->fd, e->buf, e->len))
+	{
+		e->fd=-1;
+		e->buf=NULL;
+		pop();
+		bfd->close(bfd, asfd);
+		return -1;
+	}
+	e->fd=-1;
+	e->buf=NULL;
+	pop();
+	return 0;
+}
+
+void prefetch_free(void)
+{
+#ifdef HAVE_IO_URING
+	// The kernel may still be reading into the buffers.
+	while(pf.ring.fd>=0 && pf.ring.inflight)
+	{
+		if(uring_enter(&pf.ring, 1)
+		  || uring_reap(&pf.ring))
+		{
+			// Better to leave them than to have them written to
+			// after being freed.
+			pf.count=0;
+			break;
+		}
+	}
+#endif
+	while(pf.count) pop();
+#ifdef HAVE_IO_URING
+	if(pf.ring.fd>=0) uring_free(&pf.ring);
+#endif
+	if(pf.files)
+		logp("Read ahead %llu files, %llu of them whole, waited for %llu\n",
+			pf.files, pf.whole, pf.waits);
+	memset(&pf, 0, sizeof(pf));
+}
+
+#else
+
+int prefetch_init(struct conf *conf)
+{
+	return 0;
+}
+
+int prefetch_fill(struct sbuf *sb)
+{
+	return 0;
+}
+
+int prefetch_open_for_send(BFILE *bfd, struct asfd *asfd,
+	const char *fname, int64_t winattr, int atime, struct conf *conf)
+{
+	bfile_init(bfd, winattr, conf);
+	return bfd->open_for_send(bfd, asfd, fname, winattr, atime, conf);
+}
+
+void prefetch_free(void)
+{
+}
+
+#endif
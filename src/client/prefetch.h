@@ -0,0 +1,10 @@
+#ifndef _PREFETCH_CLIENT_H
+#define _PREFETCH_CLIENT_H
+
+extern int prefetch_init(struct conf *conf);
+extern int prefetch_fill(struct sbuf *sb);
+extern int prefetch_open_for_send(BFILE *bfd, struct asfd *asfd,
+	const char *fname, int64_t winattr, int atime, struct conf *conf);
+extern void prefetch_free(void);
+
+#endif
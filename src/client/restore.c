@@ -80,7 +80,9 @@ static int make_link(struct asfd *asfd,
 			return -1;
 		}
 		//printf("%s -> %s\n", fname, flnk);
-		ret=link(flnk, fname);
+		// A restore worker might still be writing it.
+		if(!(ret=restore_writer_sync(asfd, flnk, conf)))
+			ret=link(flnk, fname);
 		free(flnk);
 	}
 	else if(cmd==CMD_SOFT_LINK)
@@ -133,6 +135,12 @@ enum ofr_e open_for_restore(struct asfd *asfd, BFILE *bfd, const char *path,
 #ifdef HAVE_WIN32
 	bfd->set_win32_api(bfd, vss_restore);
 #endif
+	switch(restore_writer_open(bfd, path, sb, conf))
+	{
+		case 0: break;
+		case 1: return OFR_OK; // A restore worker has it.
+		default: return OFR_ERROR;
+	}
 	if(S_ISDIR(sb->statp.st_mode))
 	{
 		// Windows directories are treated as having file data.
@@ -156,6 +164,9 @@ enum ofr_e open_for_restore(struct asfd *asfd, BFILE *bfd, const char *path,
 	// Add attributes to bfd so that they can be set when it is closed.
 	bfd->winattr=sb->winattr;
 	memcpy(&bfd->statp, &sb->statp, sizeof(struct stat));
+#ifndef HAVE_WIN32
+	bfd->sparse=conf->restore_sparse && S_ISREG(sb->statp.st_mode);
+#endif
 	return OFR_OK;
 }
 
@@ -270,7 +281,19 @@ int restore_dir(struct asfd *asfd,
 				goto end;
 			}
 		}
-		attribs_set(asfd, rpath, &(sb->statp), sb->winattr, conf);
+		switch(restore_writer_dir(rpath, &(sb->statp), sb->winattr))
+		{
+			case 0:
+				attribs_set(asfd, rpath,
+					&(sb->statp), sb->winattr, conf);
+				break;
+			case 1:
+				// Set at the end, once everything in it is there.
+				break;
+			default:
+				ret=-1;
+				goto end;
+		}
 		if(!ret) cntr_add(conf->cntr, sb->path.cmd, 1);
 	}
 	else cntr_add(conf->cntr, sb->path.cmd, 1);
@@ -575,6 +598,9 @@ int do_restore_client(struct asfd *asfd,
 	else
 		logp("Streaming restore direct\n");
 
+	if(act==ACTION_RESTORE && restore_writer_init(asfd, conf))
+		goto error;
+
 //	if(conf->send_client_cntr && cntr_recv(conf))
 //		goto error;
 
@@ -592,8 +618,12 @@ int do_restore_client(struct asfd *asfd,
 		switch(sbuf_fill_w(sb, asfd, blk, datpath, conf))
 		{
 			case 0: break;
-			case 1: if(asfd->write_str(asfd, CMD_GEN,
-				"restoreend_ok")) goto error;
+			case 1:
+				// Anything the workers have to say has to
+				// get to the server first.
+				if(restore_writer_end(asfd, conf)
+				  || asfd->write_str(asfd, CMD_GEN,
+					"restoreend_ok")) goto error;
 				goto end; // It was OK.
 			default:
 			case -1: goto error;
@@ -714,6 +744,7 @@ error:
 	// It is possible for a fd to still be open.
 	bfd->close(bfd, asfd);
 	bfile_free(&bfd);
+	if(restore_writer_end(asfd, conf)) ret=-1;
 
 	cntr_print_end(conf->cntr);
 	cntr_print(conf->cntr, act);
@@ -0,0 +1,636 @@
+#include "include.h"
+#include "../cmd.h"
+
+// Restoring lots of small files is mostly waiting for the file system to
+// create them, and to set their owners, modes and times. With more than one
+// restore worker, regular files are handed over to worker processes, which
+// do all of that while the main process carries on reading from the server.
+// A path always goes to the same worker, so that whatever happens to it
+// happens in order.
+// The workers set the attributes of the files that they have written in
+// batches. The attributes of directories are set at the very end, after
+// everything that goes in them has been written.
+// Whenever the main process waits for a worker, the worker tells it how many
+// files it has restored since last time, and what went wrong with any
+// others, so that the main process can count them and warn the server.
+
+#ifndef HAVE_WIN32
+
+#define RESTORE_WORKERS_MAX	32
+// How many files a worker writes before going back to set their attributes.
+#define RESTORE_BATCH		256
+// Lots of little messages go to and from the workers, so they are buffered.
+#define RW_BUFSIZE		(64*1024)
+
+enum rw_cmd
+{
+	RW_OPEN='o',
+	RW_WRITE='w',
+	RW_CLOSE='c',
+	RW_ABORT='a',
+	RW_SYNC='s'
+};
+
+struct rw_hdr
+{
+	char cmd;
+	size_t len;
+};
+
+// Comes before the path in an RW_OPEN.
+struct rw_open
+{
+	struct stat statp;
+	uint64_t winattr;
+	uint8_t sparse;
+	char cmd;
+};
+
+// What a worker sends back when it is waited for. The warnings come after
+// it, each ending with a '\0'.
+struct rw_reply
+{
+	uint64_t files;
+	uint64_t enc_files;
+	size_t len;
+};
+
+// What a worker has to send back next time.
+struct rw_state
+{
+	char cmd; // Of the file that is open.
+	uint64_t files;
+	uint64_t enc_files;
+	char *warn;
+	size_t wlen;
+	size_t walloc;
+};
+
+// Something that is waiting for its attributes to be set.
+struct rw_attr
+{
+	char *path;
+	struct stat statp;
+	uint64_t winattr;
+};
+
+static struct
+{
+	pid_t pid[RESTORE_WORKERS_MAX];
+	int fd[RESTORE_WORKERS_MAX];
+	char *obuf[RESTORE_WORKERS_MAX];
+	size_t olen[RESTORE_WORKERS_MAX];
+	int workers;
+	int cur; // The worker with the file that is open.
+	struct rw_attr *dirs;
+	size_t ndirs;
+	size_t dirs_alloc;
+	uint64_t files;
+} rw;
+
+struct rw_rbuf
+{
+	char buf[RW_BUFSIZE];
+	size_t len;
+	size_t pos;
+};
+
+static int rb_read_full(int fd, struct rw_rbuf *rb, void *buf, size_t len)
+{
+	size_t n;
+	ssize_t r;
+	char *b=(char *)buf;
+	while(len)
+	{
+		if(rb->pos==rb->len)
+		{
+			// Big things go straight where they are wanted.
+			if(len>=RW_BUFSIZE)
+				return fd_read_full(fd, b, len);
+			if((r=read(fd, rb->buf, RW_BUFSIZE))<0)
+			{
+				if(errno==EINTR) continue;
+				return -1;
+			}
+			if(!r) return -1;
+			rb->len=r;
+			rb->pos=0;
+		}
+		n=rb->len-rb->pos;
+		if(n>len) n=len;
+		memcpy(b, rb->buf+rb->pos, n);
+		rb->pos+=n;
+		b+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+// Logs a warning, and keeps it to send to the main process.
+static void rw_warn(struct rw_state *st, const char *fmt, ...)
+{
+	size_t len;
+	char buf[512]="";
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	logp("%s\n", buf);
+	len=strlen(buf)+1;
+	if(st->wlen+len>st->walloc)
+	{
+		char *tmp;
+		size_t want=(st->wlen+len)*2;
+		if(!(tmp=(char *)realloc_w(st->warn, want, __func__)))
+			return;
+		st->warn=tmp;
+		st->walloc=want;
+	}
+	memcpy(st->warn+st->wlen, buf, len);
+	st->wlen+=len;
+}
+
+static void rw_attr_set(struct rw_attr *attr, int n, struct rw_state *st,
+	struct conf *conf)
+{
+	int i;
+	for(i=0; i<n; i++)
+	{
+		if(attribs_set(NULL, attr[i].path,
+			&attr[i].statp, attr[i].winattr, conf))
+				rw_warn(st, "Could not set attributes of %s",
+					attr[i].path);
+		free_w(&attr[i].path);
+	}
+}
+
+static int rw_reply(int fd, struct rw_state *st)
+{
+	struct rw_reply reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.files=st->files;
+	reply.enc_files=st->enc_files;
+	reply.len=st->wlen;
+	if(fd_write_full(fd, &reply, sizeof(reply))
+	  || (st->wlen && fd_write_full(fd, st->warn, st->wlen)))
+		return -1;
+	st->files=0;
+	st->enc_files=0;
+	st->wlen=0;
+	return 0;
+}
+
+static int worker_open(BFILE *bfd, const char *buf, struct rw_state *st,
+	struct conf *conf)
+{
+	struct rw_open op;
+	const char *path=buf+sizeof(op);
+
+	memcpy(&op, buf, sizeof(op));
+	bfile_init(bfd, op.winattr, conf);
+	st->cmd=op.cmd;
+	if(bfd->open(bfd, NULL, path,
+		O_WRONLY|O_BINARY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR))
+	{
+		// Anything written to it gets dropped.
+		rw_warn(st, "Could not open for writing %s: %s",
+			path, strerror(errno));
+		return 0;
+	}
+	memcpy(&bfd->statp, &op.statp, sizeof(op.statp));
+	bfd->sparse=op.sparse;
+	bfd->no_attribs=1;
+	return 0;
+}
+
+static int worker_close(BFILE *bfd, struct rw_attr *attr, struct rw_state *st)
+{
+	if(bfd->mode==BF_CLOSED) return 0;
+	if(!(attr->path=strdup_w(bfd->path, __func__)))
+		return -1;
+	memcpy(&attr->statp, &bfd->statp, sizeof(attr->statp));
+	attr->winattr=bfd->winattr;
+	if(bfd->close(bfd, NULL))
+	{
+		rw_warn(st, "Could not close %s: %s",
+			attr->path, strerror(errno));
+		free_w(&attr->path);
+		return 0;
+	}
+	if(st->cmd==CMD_ENC_FILE) st->enc_files++;
+	else st->files++;
+	return 1;
+}
+
+static int rw_worker(int fd, struct conf *conf)
+{
+	int ret=-1;
+	int n=0;
+	size_t alloc=0;
+	char *buf=NULL;
+	BFILE bfd;
+	struct rw_hdr hdr;
+	struct rw_state st;
+	struct rw_attr attr[RESTORE_BATCH];
+	static struct rw_rbuf rb;
+
+	memset(&st, 0, sizeof(st));
+	bfile_init(&bfd, 0, conf);
+	// The main process closing its end tells us to finish.
+	while(!rb_read_full(fd, &rb, &hdr, sizeof(hdr)))
+	{
+		if(hdr.len+1>alloc)
+		{
+			char *tmp;
+			if(!(tmp=(char *)realloc_w(buf, hdr.len+1, __func__)))
+				goto end;
+			buf=tmp;
+			alloc=hdr.len+1;
+		}
+		if(rb_read_full(fd, &rb, buf, hdr.len))
+			goto end;
+		buf[hdr.len]='\0';
+		switch(hdr.cmd)
+		{
+			case RW_OPEN:
+				if(worker_open(&bfd, buf, &st, conf))
+					goto end;
+				break;
+			case RW_WRITE:
+				if(bfd.mode==BF_CLOSED
+				  || bfd.write(&bfd, buf, hdr.len)
+					==(ssize_t)hdr.len)
+						break;
+				rw_warn(&st, "Could not write to %s: %s",
+					bfd.path, strerror(errno));
+				bfd.close(&bfd, NULL);
+				break;
+			case RW_CLOSE:
+				switch(worker_close(&bfd, &attr[n], &st))
+				{
+					case 0: break;
+					case 1: n++; break;
+					default: goto end;
+				}
+				if(n<RESTORE_BATCH) break;
+				rw_attr_set(attr, n, &st, conf);
+				n=0;
+				break;
+			case RW_ABORT:
+				// The main process has already warned about
+				// it, and it does not get counted.
+				if(bfd.mode!=BF_CLOSED)
+					bfd.close(&bfd, NULL);
+				break;
+			case RW_SYNC:
+				rw_attr_set(attr, n, &st, conf);
+				n=0;
+				if(rw_reply(fd, &st))
+					goto end;
+				break;
+			default:
+				logp("unexpected restore worker command: %c\n",
+					hdr.cmd);
+				goto end;
+		}
+	}
+	if(bfd.mode!=BF_CLOSED)
+		bfd.close(&bfd, NULL);
+	rw_attr_set(attr, n, &st, conf);
+	n=0;
+	if(rw_reply(fd, &st))
+		goto end;
+	ret=0;
+end:
+	rw_attr_set(attr, n, &st, conf);
+	free_w(&st.warn);
+	free_w(&buf);
+	close(fd);
+	return ret;
+}
+
+static int rw_fork(int w, struct asfd *asfd, struct conf *conf)
+{
+	int i;
+	pid_t pid;
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		logp("could not socketpair for restore worker: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	switch((pid=fork()))
+	{
+		case -1:
+			logp("could not fork for restore worker: %s\n",
+				strerror(errno));
+			close(sv[0]);
+			close(sv[1]);
+			return -1;
+		case 0:
+			close(sv[0]);
+			if(asfd && asfd->fd>=0) close(asfd->fd);
+			for(i=0; i<w; i++)
+				close(rw.fd[i]);
+			exit(rw_worker(sv[1], conf)?1:0);
+		default:
+			break;
+	}
+	close(sv[1]);
+	if(!(rw.obuf[w]=(char *)malloc_w(RW_BUFSIZE, __func__)))
+	{
+		close(sv[0]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	rw.olen[w]=0;
+	rw.pid[w]=pid;
+	rw.fd[w]=sv[0];
+	rw.workers++;
+	return 0;
+}
+
+int restore_writer_init(struct asfd *asfd, struct conf *conf)
+{
+	int w;
+	int want=conf->restore_workers;
+
+	memset(&rw, 0, sizeof(rw));
+	rw.cur=-1;
+	if(want<=1) return 0;
+	if(want>RESTORE_WORKERS_MAX) want=RESTORE_WORKERS_MAX;
+	// Otherwise, both processes would write out anything still buffered.
+	fflush(NULL);
+	for(w=0; w<want; w++)
+		if(rw_fork(w, asfd, conf))
+			break;
+	if(rw.workers)
+		logp("Using %d restore worker%s\n",
+			rw.workers, rw.workers==1?"":"s");
+	return 0;
+}
+
+static int rw_worker_for(const char *path)
+{
+	uint32_t h=2166136261U;
+	for(; *path; path++)
+		h=(h^(uint8_t)*path)*16777619U;
+	return h%rw.workers;
+}
+
+static int rw_flush(int w)
+{
+	if(rw.olen[w] && fd_write_full(rw.fd[w], rw.obuf[w], rw.olen[w]))
+		return -1;
+	rw.olen[w]=0;
+	return 0;
+}
+
+static int rw_add(int w, const void *buf, size_t len)
+{
+	if(rw.olen[w]+len>RW_BUFSIZE && rw_flush(w))
+		return -1;
+	if(len>RW_BUFSIZE)
+		return fd_write_full(rw.fd[w], buf, len);
+	memcpy(rw.obuf[w]+rw.olen[w], buf, len);
+	rw.olen[w]+=len;
+	return 0;
+}
+
+static int rw_send(int w, char cmd,
+	const void *a, size_t alen, const void *b, size_t blen)
+{
+	struct rw_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.cmd=cmd;
+	hdr.len=alen+blen;
+	if(rw_add(w, &hdr, sizeof(hdr))
+	  || (alen && rw_add(w, a, alen))
+	  || (blen && rw_add(w, b, blen)))
+	{
+		logp("restore worker %d went away\n", w);
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t rw_write(BFILE *bfd, void *buf, size_t count)
+{
+	if(rw_send(rw.cur, RW_WRITE, buf, count, NULL, 0))
+		return -1;
+	return (ssize_t)count;
+}
+
+static int rw_finish(BFILE *bfd, char cmd)
+{
+	int ret=0;
+	if(!bfd || bfd->mode==BF_CLOSED) return 0;
+	if(rw_send(rw.cur, cmd, NULL, 0, NULL, 0))
+		ret=-1;
+	bfd->mode=BF_CLOSED;
+	free_w(&bfd->path);
+	rw.cur=-1;
+	return ret;
+}
+
+static int rw_close(BFILE *bfd, struct asfd *asfd)
+{
+	return rw_finish(bfd, RW_CLOSE);
+}
+
+// Hands a regular file over to a worker, which opens it and writes what
+// goes to bfd. Returns 1 if it did, and 0 if the caller should open it.
+int restore_writer_open(BFILE *bfd, const char *path,
+	struct sbuf *sb, struct conf *conf)
+{
+	struct rw_open op;
+
+	if(!rw.workers
+	  || !S_ISREG(sb->statp.st_mode)
+	  || (sb->path.cmd!=CMD_FILE && sb->path.cmd!=CMD_ENC_FILE))
+		return 0;
+	memset(&op, 0, sizeof(op));
+	memcpy(&op.statp, &sb->statp, sizeof(op.statp));
+	op.winattr=sb->winattr;
+	op.sparse=conf->restore_sparse;
+	op.cmd=sb->path.cmd;
+	rw.cur=rw_worker_for(path);
+	if(rw_send(rw.cur, RW_OPEN, &op, sizeof(op), path, strlen(path)))
+		return -1;
+	bfd->mode=BF_WRITE;
+	bfd->write=rw_write;
+	bfd->close=rw_close;
+	if(!(bfd->path=strdup_w(path, __func__)))
+		return -1;
+	rw.files++;
+	return 1;
+}
+
+// Whether the file that bfd was opened for went to a worker, which will set
+// its attributes and count it.
+int restore_writer_took(BFILE *bfd)
+{
+	return rw.workers && bfd->close==rw_close;
+}
+
+// Instead of closing bfd, when what was going to it did not all arrive.
+int restore_writer_abort(BFILE *bfd)
+{
+	return rw_finish(bfd, RW_ABORT);
+}
+
+// Counts the files that worker w has restored, and passes on its warnings.
+static int rw_reply_read(int w, struct asfd *asfd, struct conf *conf)
+{
+	int ret=-1;
+	uint64_t i;
+	char *cp;
+	char *buf=NULL;
+	struct rw_reply reply;
+
+	if(fd_read_full(rw.fd[w], &reply, sizeof(reply)))
+		goto end;
+	if(reply.len)
+	{
+		if(!(buf=(char *)malloc_w(reply.len, __func__)))
+			goto end;
+		if(fd_read_full(rw.fd[w], buf, reply.len))
+			goto end;
+		buf[reply.len-1]='\0';
+	}
+	for(i=0; i<reply.files; i++)
+		cntr_add(conf->cntr, CMD_FILE, 1);
+	for(i=0; i<reply.enc_files; i++)
+		cntr_add(conf->cntr, CMD_ENC_FILE, 1);
+	for(cp=buf; cp && cp<buf+reply.len; cp+=strlen(cp)+1)
+		if(logw(asfd, conf, "%s", cp))
+			goto end;
+	ret=0;
+end:
+	free_w(&buf);
+	return ret;
+}
+
+// Waits until whatever was handed over for path has been written, and has
+// had its attributes set, so that it can be linked to or added to.
+int restore_writer_sync(struct asfd *asfd, const char *path,
+	struct conf *conf)
+{
+	int w;
+
+	if(!rw.workers) return 0;
+	w=rw_worker_for(path);
+	if(rw_send(w, RW_SYNC, NULL, 0, NULL, 0)
+	  || rw_flush(w)
+	  || rw_reply_read(w, asfd, conf))
+	{
+		logp("restore worker %d went away\n", w);
+		return -1;
+	}
+	return 0;
+}
+
+// Keeps the attributes for a directory until the end. Returns 1 if it did,
+// and 0 if the caller should set them now.
+int restore_writer_dir(const char *path, struct stat *statp, uint64_t winattr)
+{
+	struct rw_attr *attr;
+	if(!rw.workers) return 0;
+	if(rw.ndirs==rw.dirs_alloc)
+	{
+		struct rw_attr *tmp;
+		size_t want=rw.dirs_alloc?rw.dirs_alloc*2:1024;
+		if(!(tmp=(struct rw_attr *)realloc_w(rw.dirs,
+			want*sizeof(*tmp), __func__)))
+				return -1;
+		rw.dirs=tmp;
+		rw.dirs_alloc=want;
+	}
+	attr=&rw.dirs[rw.ndirs];
+	if(!(attr->path=strdup_w(path, __func__)))
+		return -1;
+	memcpy(&attr->statp, statp, sizeof(attr->statp));
+	attr->winattr=winattr;
+	rw.ndirs++;
+	return 1;
+}
+
+// Lets the workers finish, then sets the attributes of the directories in
+// the order that they came in.
+int restore_writer_end(struct asfd *asfd, struct conf *conf)
+{
+	int w;
+	size_t i;
+	int ret=0;
+
+	if(!rw.workers) return 0;
+	for(w=0; w<rw.workers; w++)
+	{
+		if(rw_flush(w)
+		  || shutdown(rw.fd[w], SHUT_WR)
+		  || rw_reply_read(w, asfd, conf))
+		{
+			logp("restore worker %d went away\n", w);
+			ret=-1;
+		}
+		close(rw.fd[w]);
+		waitpid(rw.pid[w], NULL, 0);
+		free_w(&rw.obuf[w]);
+	}
+	// These warn the server themselves.
+	for(i=0; i<rw.ndirs; i++)
+	{
+		attribs_set(asfd, rw.dirs[i].path,
+			&rw.dirs[i].statp, rw.dirs[i].winattr, conf);
+		free_w(&rw.dirs[i].path);
+	}
+	free_v((void **)&rw.dirs);
+	logp("Restore workers wrote %llu files\n",
+		(unsigned long long)rw.files);
+	memset(&rw, 0, sizeof(rw));
+	return ret;
+}
+
+#else
+
+int restore_writer_init(struct asfd *asfd, struct conf *conf)
+{
+	return 0;
+}
+
+int restore_writer_open(BFILE *bfd, const char *path,
+	struct sbuf *sb, struct conf *conf)
+{
+	return 0;
+}
+
+int restore_writer_took(BFILE *bfd)
+{
+	return 0;
+}
+
+int restore_writer_abort(BFILE *bfd)
+{
+	return 0;
+}
+
+int restore_writer_sync(struct asfd *asfd, const char *path,
+	struct conf *conf)
+{
+	return 0;
+}
+
+int restore_writer_dir(const char *path, struct stat *statp, uint64_t winattr)
+{
+	return 0;
+}
+
+int restore_writer_end(struct asfd *asfd, struct conf *conf)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _RESTORE_WRITER_CLIENT_H
+#define _RESTORE_WRITER_CLIENT_H
+
+extern int restore_writer_init(struct asfd *asfd, struct conf *conf);
+extern int restore_writer_open(BFILE *bfd, const char *path,
+	struct sbuf *sb, struct conf *conf);
+extern int restore_writer_took(BFILE *bfd);
+extern int restore_writer_abort(BFILE *bfd);
+extern int restore_writer_sync(struct asfd *asfd, const char *path,
+	struct conf *conf);
+extern int restore_writer_dir(const char *path,
+	struct stat *statp, uint64_t winattr);
+extern int restore_writer_end(struct asfd *asfd, struct conf *conf);
+
+#endif
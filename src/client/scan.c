@@ -0,0 +1,543 @@
+#include "include.h"
+#include "../pathcmp.h"
+
+#ifndef HAVE_WIN32
+
+#include <poll.h>
+
+// Sending back lstat results for a directory bigger than this would cost
+// more memory than it is worth, so find_files() is left to read it itself.
+#define SCAN_ENTRIES_MAX	65536
+
+struct scan_hdr
+{
+	int err; // errno from opening the directory, or 0.
+	int count;
+};
+
+struct scan_rec
+{
+	struct scan_entry entry;
+	size_t namelen;
+};
+
+static int buf_append(char **buf, size_t *len, size_t *alloc,
+	const void *data, size_t dlen)
+{
+	if(*len+dlen>*alloc)
+	{
+		char *tmp;
+		size_t want=*alloc?*alloc:65536;
+		while(want<*len+dlen) want*=2;
+		if(!(tmp=(char *)realloc_w(*buf, want, __func__)))
+			return -1;
+		*buf=tmp;
+		*alloc=want;
+	}
+	memcpy(*buf+*len, data, dlen);
+	*len+=dlen;
+	return 0;
+}
+
+#ifndef HAVE_LINUX_OS
+static DIR *scan_opendir(const char *path, struct conf *conf)
+{
+	int dfd=-1;
+	DIR *directory=NULL;
+	if((dfd=dirlist_open(path, conf))<0) return NULL;
+	if(!(directory=fdopendir(dfd)))
+		close(dfd);
+	return directory;
+}
+#endif
+
+// Read a directory and lstat everything in it, in the same order that
+// find_files() goes through it.
+static int scan_read_dir(const char *path, char **buf, size_t *len,
+	struct conf *conf)
+{
+	int i;
+	int dfd=-1;
+	int ret=-1;
+	size_t alloc=0;
+	struct dirlist dl;
+	struct scan_hdr hdr;
+	struct scan_rec rec;
+#ifndef HAVE_LINUX_OS
+	DIR *directory=NULL;
+#endif
+
+	memset(&dl, 0, sizeof(dl));
+	memset(&hdr, 0, sizeof(hdr));
+	*len=0;
+	errno=0;
+#ifdef HAVE_LINUX_OS
+	if((dfd=dirlist_open(path, conf))<0)
+#else
+	if(!(directory=scan_opendir(path, conf)))
+#endif
+	{
+		hdr.err=errno?errno:EIO;
+		ret=buf_append(buf, len, &alloc, &hdr, sizeof(hdr));
+		goto end;
+	}
+#ifdef HAVE_LINUX_OS
+	if(dirlist_read(&dl, dfd))
+		goto end;
+#else
+	if(dirlist_read_dir(&dl, directory))
+		goto end;
+	dfd=dirfd(directory);
+#endif
+	if(dl.count>SCAN_ENTRIES_MAX)
+	{
+		hdr.err=E2BIG;
+		ret=buf_append(buf, len, &alloc, &hdr, sizeof(hdr));
+		goto end;
+	}
+
+	hdr.count=dl.count;
+	if(buf_append(buf, len, &alloc, &hdr, sizeof(hdr)))
+		goto end;
+	for(i=0; i<dl.count; i++)
+	{
+		const char *name=DIRLIST_NAME(&dl, i);
+		memset(&rec, 0, sizeof(rec));
+		rec.namelen=strlen(name);
+		// Relative to the directory, which saves the kernel from
+		// walking the whole path again.
+		rec.entry.stat_ok=!fstatat(dfd, name,
+			&rec.entry.statp, AT_SYMLINK_NOFOLLOW);
+		if(buf_append(buf, len, &alloc, &rec, sizeof(rec))
+		  || buf_append(buf, len, &alloc, name, rec.namelen))
+			goto end;
+	}
+	ret=0;
+end:
+#ifdef HAVE_LINUX_OS
+	close_fd(&dfd);
+#else
+	if(directory) closedir(directory);
+#endif
+	dirlist_free_content(&dl);
+	return ret;
+}
+
+static int scan_worker(int fd, struct conf *conf)
+{
+	int ret=-1;
+	size_t len=0;
+	size_t pathlen=0;
+	char *buf=NULL;
+	char *path=NULL;
+
+	while(1)
+	{
+		// The main process closing its end tells us to finish.
+		if(fd_read_full(fd, &pathlen, sizeof(pathlen)))
+			break;
+		if(!(path=(char *)malloc_w(pathlen+1, __func__))
+		  || fd_read_full(fd, path, pathlen))
+			goto end;
+		path[pathlen]='\0';
+		if(scan_read_dir(path, &buf, &len, conf)
+		  || fd_write_full(fd, &len, sizeof(len))
+		  || fd_write_full(fd, buf, len))
+			goto end;
+		free_w(&path);
+	}
+	ret=0;
+end:
+	free_w(&buf);
+	free_w(&path);
+	close(fd);
+	return ret;
+}
+
+static void scan_job_free(struct scan_job **job)
+{
+	if(!job || !*job) return;
+	free_w(&(*job)->path);
+	free_w(&(*job)->buf);
+	free_v((void **)job);
+}
+
+static void scan_job_remove(struct scan *scan, struct scan_job *job)
+{
+	struct scan_job **j;
+	for(j=&scan->jobs; *j; j=&(*j)->next)
+	{
+		if(*j!=job) continue;
+		*j=job->next;
+		scan->njobs--;
+		scan_job_free(&job);
+		return;
+	}
+}
+
+static void scan_worker_drop(struct scan *scan, int w)
+{
+	struct scan_worker *worker=&scan->w[w];
+	if(worker->fd<0) return;
+	logp("scan worker %d went away\n", w);
+	close(worker->fd);
+	worker->fd=-1;
+	if(worker->job)
+	{
+		worker->job->worker=-1;
+		worker->job->failed=1;
+		worker->job=NULL;
+	}
+	kill(worker->pid, SIGTERM);
+	waitpid(worker->pid, NULL, 0);
+	worker->pid=0;
+	scan->count--;
+}
+
+static int scan_fork(struct scan *scan, int w, struct asfd *asfd,
+	struct conf *conf)
+{
+	int i;
+	pid_t pid;
+	int sv[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		logp("could not socketpair for scan worker: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	switch((pid=fork()))
+	{
+		case -1:
+			logp("could not fork for scan worker: %s\n",
+				strerror(errno));
+			close(sv[0]);
+			close(sv[1]);
+			return -1;
+		case 0:
+			close(sv[0]);
+			if(asfd && asfd->fd>=0) close(asfd->fd);
+			for(i=0; i<w; i++)
+				if(scan->w[i].fd>=0)
+					close(scan->w[i].fd);
+			exit(scan_worker(sv[1], conf)?1:0);
+		default:
+			break;
+	}
+	close(sv[1]);
+	set_non_blocking(sv[0]);
+	scan->w[w].pid=pid;
+	scan->w[w].fd=sv[0];
+	scan->count++;
+	return 0;
+}
+
+struct scan *scan_alloc(struct asfd *asfd, struct conf *conf)
+{
+	int w;
+	struct scan *scan=NULL;
+
+	if(conf->scan_workers<=1) return NULL;
+	if(!(scan=(struct scan *)calloc_w(1, sizeof(struct scan), __func__)))
+		return NULL;
+	scan->workers=conf->scan_workers;
+	if(scan->workers>SCAN_WORKERS_MAX) scan->workers=SCAN_WORKERS_MAX;
+	// Enough to keep the workers busy while find_files() catches up,
+	// without holding too many directories in memory.
+	scan->window=scan->workers*4;
+	for(w=0; w<SCAN_WORKERS_MAX; w++)
+		scan->w[w].fd=-1;
+
+	// Otherwise, both processes would write out anything still buffered.
+	fflush(NULL);
+	for(w=0; w<scan->workers; w++)
+		if(scan_fork(scan, w, asfd, conf))
+			break;
+	if(!scan->count)
+	{
+		scan_free(&scan);
+		return NULL;
+	}
+	logp("Using %d scan worker%s\n",
+		scan->count, scan->count==1?"":"s");
+	return scan;
+}
+
+void scan_free(struct scan **scan)
+{
+	int w;
+	int i;
+	struct scan_job *job;
+	if(!scan || !*scan) return;
+	for(w=0; w<SCAN_WORKERS_MAX; w++)
+	{
+		if((*scan)->w[w].fd<0) continue;
+		close((*scan)->w[w].fd);
+		waitpid((*scan)->w[w].pid, NULL, 0);
+	}
+	while((job=(*scan)->jobs))
+	{
+		(*scan)->jobs=job->next;
+		scan_job_free(&job);
+	}
+	for(i=0; i<(*scan)->todo_len; i++)
+		free_w(&(*scan)->todo[i]);
+	free_v((void **)&(*scan)->todo);
+	free_v((void **)scan);
+}
+
+// Read whatever a worker has sent so far.
+static void scan_worker_read(struct scan *scan, int w)
+{
+	ssize_t r;
+	struct scan_worker *worker=&scan->w[w];
+	struct scan_job *job=worker->job;
+
+	while(1)
+	{
+		if(job->hgot<sizeof(job->len))
+			r=read(worker->fd, (char *)&job->len+job->hgot,
+				sizeof(job->len)-job->hgot);
+		else
+			r=read(worker->fd, job->buf+job->got,
+				job->len-job->got);
+		if(r<0)
+		{
+			if(errno==EINTR) continue;
+			if(errno==EAGAIN || errno==EWOULDBLOCK) return;
+			scan_worker_drop(scan, w);
+			return;
+		}
+		if(!r)
+		{
+			scan_worker_drop(scan, w);
+			return;
+		}
+		if(job->hgot<sizeof(job->len))
+		{
+			job->hgot+=r;
+			if(job->hgot<sizeof(job->len)) continue;
+			if(!(job->buf=(char *)malloc_w(job->len+1, __func__)))
+			{
+				scan_worker_drop(scan, w);
+				return;
+			}
+		}
+		else
+			job->got+=r;
+		if(job->hgot==sizeof(job->len) && job->got==job->len)
+			break;
+	}
+
+	worker->job=NULL;
+	job->worker=-1;
+	// Nobody wants it any more.
+	if(!job->path) scan_job_remove(scan, job);
+}
+
+static void scan_read(struct scan *scan, int block)
+{
+	int w;
+	int n=0;
+	struct pollfd pfd[SCAN_WORKERS_MAX];
+	int which[SCAN_WORKERS_MAX];
+
+	for(w=0; w<SCAN_WORKERS_MAX; w++)
+	{
+		if(scan->w[w].fd<0 || !scan->w[w].job) continue;
+		pfd[n].fd=scan->w[w].fd;
+		pfd[n].events=POLLIN;
+		pfd[n].revents=0;
+		which[n++]=w;
+	}
+	if(!n) return;
+	if(poll(pfd, n, block?-1:0)<=0) return;
+	for(w=0; w<n; w++)
+		if(pfd[w].revents)
+			scan_worker_read(scan, which[w]);
+}
+
+static int scan_worker_idle(struct scan *scan)
+{
+	int w;
+	for(w=0; w<SCAN_WORKERS_MAX; w++)
+		if(scan->w[w].fd>=0 && !scan->w[w].job)
+			return w;
+	return -1;
+}
+
+// Takes ownership of path.
+static struct scan_job *scan_job_start(struct scan *scan, int w, char *path)
+{
+	size_t pathlen=strlen(path);
+	struct scan_job *job;
+	struct scan_job **j;
+	struct scan_worker *worker=&scan->w[w];
+
+	if(!(job=(struct scan_job *)calloc_w(1,
+		sizeof(struct scan_job), __func__)))
+	{
+		free_w(&path);
+		return NULL;
+	}
+	job->path=path;
+	job->worker=w;
+	// Requests are small, so this should not block for long, even
+	// though the socket is non-blocking.
+	if(fd_write_full(worker->fd, &pathlen, sizeof(pathlen))
+	  || fd_write_full(worker->fd, path, pathlen))
+	{
+		scan_job_free(&job);
+		scan_worker_drop(scan, w);
+		return NULL;
+	}
+	worker->job=job;
+	for(j=&scan->jobs; *j; j=&(*j)->next) { }
+	*j=job;
+	scan->njobs++;
+	return job;
+}
+
+// Give out the directories that will be wanted soonest.
+static void scan_feed(struct scan *scan)
+{
+	int w;
+	while(scan->njobs<scan->window
+	  && scan->todo_len
+	  && (w=scan_worker_idle(scan))>=0)
+		scan_job_start(scan, w, scan->todo[--scan->todo_len]);
+}
+
+// Say that find_files() is going to want path. The last one added is the
+// first to be read.
+int scan_want(struct scan *scan, const char *path)
+{
+	if(scan->todo_len==scan->todo_alloc)
+	{
+		char **tmp;
+		int want=scan->todo_alloc?scan->todo_alloc*2:256;
+		if(!(tmp=(char **)realloc_w(scan->todo,
+			want*sizeof(*tmp), __func__)))
+				return -1;
+		scan->todo=tmp;
+		scan->todo_alloc=want;
+	}
+	if(!(scan->todo[scan->todo_len]=strdup_w(path, __func__)))
+		return -1;
+	scan->todo_len++;
+	return 0;
+}
+
+// Collect what the workers have finished and give them more to do.
+void scan_poll(struct scan *scan)
+{
+	scan_read(scan, 0);
+	scan_feed(scan);
+}
+
+static int scan_job_parse(struct scan_job *job, struct dirlist *dl)
+{
+	int i;
+	size_t off=sizeof(struct scan_hdr);
+	struct scan_hdr hdr;
+	struct scan_rec rec;
+
+	if(job->len<sizeof(hdr)) return 1;
+	memcpy(&hdr, job->buf, sizeof(hdr));
+	// Let find_files() open it itself, so that errors are dealt with
+	// in the usual way, and so that huge directories are not held in
+	// memory twice.
+	if(hdr.err) return 1;
+	if(!hdr.count) return 0;
+	if(!(dl->entries=(struct scan_entry *)calloc_w(hdr.count,
+		sizeof(*dl->entries), __func__)))
+			return -1;
+	// Already sorted by the worker.
+	for(i=0; i<hdr.count; i++)
+	{
+		if(off+sizeof(rec)>job->len) goto corrupt;
+		memcpy(&rec, job->buf+off, sizeof(rec));
+		off+=sizeof(rec);
+		if(off+rec.namelen>job->len) goto corrupt;
+		if(dirlist_add(dl, job->buf+off, rec.namelen))
+			return -1;
+		off+=rec.namelen;
+		dl->entries[i]=rec.entry;
+	}
+	return 0;
+corrupt:
+	logp("scan result for %s is corrupt\n", job->path);
+	return -1;
+}
+
+// Get the sorted contents of a directory, and lstat results for each
+// entry, from a worker. If it has not been given to a worker yet, give it
+// to the next one that is free.
+// Returns 1 if find_files() should read the directory itself.
+int scan_dir(struct scan *scan, const char *path, struct dirlist *dl)
+{
+	int i;
+	int ret=-1;
+	struct scan_job *job;
+
+	scan_read(scan, 0);
+	for(job=scan->jobs; job; job=job->next)
+		if(job->path && !strcmp(job->path, path))
+			break;
+	if(!job)
+	{
+		int w;
+		char *p;
+		for(i=scan->todo_len-1; i>=0; i--)
+		{
+			if(strcmp(scan->todo[i], path)) continue;
+			free_w(&scan->todo[i]);
+			memmove(scan->todo+i, scan->todo+i+1,
+				(scan->todo_len-i-1)*sizeof(*scan->todo));
+			scan->todo_len--;
+			break;
+		}
+		while((w=scan_worker_idle(scan))<0 && scan->count)
+			scan_read(scan, 1);
+		if(w<0) return 1;
+		if(!(p=strdup_w(path, __func__))) return -1;
+		if(!(job=scan_job_start(scan, w, p))) return 1;
+	}
+	scan_feed(scan);
+	while(job->worker>=0)
+	{
+		scan_read(scan, 1);
+		scan_feed(scan);
+	}
+
+	if(job->failed) ret=1;
+	else ret=scan_job_parse(job, dl);
+	if(ret) dirlist_free_content(dl);
+	scan_job_remove(scan, job);
+	scan_feed(scan);
+	return ret;
+}
+
+// Forget about anything under path that has not been asked for, because
+// find_files() has finished with it.
+void scan_done(struct scan *scan, const char *path)
+{
+	struct scan_job *job;
+	struct scan_job *next;
+
+	// Everything that was wanted from inside path was added after path
+	// itself, so it is all at the end.
+	while(scan->todo_len && is_subdir(path, scan->todo[scan->todo_len-1]))
+		free_w(&scan->todo[--scan->todo_len]);
+	for(job=scan->jobs; job; job=next)
+	{
+		next=job->next;
+		if(!job->path || !is_subdir(path, job->path)) continue;
+		if(job->worker<0) scan_job_remove(scan, job);
+		else free_w(&job->path);
+	}
+	scan_feed(scan);
+}
+
+#endif
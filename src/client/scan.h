@@ -0,0 +1,58 @@
+#ifndef _SCAN_CLIENT_H
+#define _SCAN_CLIENT_H
+
+#define SCAN_WORKERS_MAX	32
+
+// What a worker found out about an entry in a directory that it read.
+struct scan_entry
+{
+	uint8_t stat_ok;
+	struct stat statp;
+};
+
+// A directory that has been given to a worker. The worker sends back a
+// scan_hdr, then a scan_rec and name for each entry, in sorted order.
+struct scan_job
+{
+	char *path; // NULL once nobody is going to want the result.
+	int worker; // -1 once the whole result has been read.
+	uint8_t failed;
+	size_t len;
+	size_t hgot;
+	size_t got;
+	char *buf;
+	struct scan_job *next;
+};
+
+struct scan_worker
+{
+	pid_t pid;
+	int fd;
+	struct scan_job *job;
+};
+
+// Worker processes that read directories and lstat what is in them ahead
+// of find_files(), which still goes through everything in order.
+struct scan
+{
+	struct scan_worker w[SCAN_WORKERS_MAX];
+	int workers;
+	int count; // Workers that are still usable.
+	int window; // Most jobs to have outstanding at once.
+	int njobs;
+	struct scan_job *jobs;
+	// Directories that find_files() will want soon, the soonest last.
+	char **todo;
+	int todo_len;
+	int todo_alloc;
+};
+
+extern struct scan *scan_alloc(struct asfd *asfd, struct conf *conf);
+extern void scan_free(struct scan **scan);
+extern int scan_want(struct scan *scan, const char *path);
+extern void scan_poll(struct scan *scan);
+extern int scan_dir(struct scan *scan, const char *path,
+	struct dirlist *dl);
+extern void scan_done(struct scan *scan, const char *path);
+
+#endif
@@ -46,6 +46,12 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Warning"); break;
 		case CMD_END_FILE:
 			snprintf(buf, len, "End of file transmission"); break;
+		case CMD_EXT_FRAME:
+			snprintf(buf, len, "Extended frame header"); break;
+		case CMD_ZFRAME:
+			snprintf(buf, len, "Compressed frame header"); break;
+		case CMD_UNCHANGED:
+			snprintf(buf, len, "Run of unchanged entries"); break;
 		case CMD_ENC_METADATA:
 			snprintf(buf, len, "Encrypted meta data"); break;
 		case CMD_EFS_FILE:
@@ -75,6 +81,8 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Bytes received"); break;
 		case CMD_BYTES_SENT:
 			snprintf(buf, len, "Bytes sent"); break;
+		case CMD_LINK_TABLE:
+			snprintf(buf, len, "Hard link table"); break;
 
 		// Legacy.
 		case CMD_DATAPTH:
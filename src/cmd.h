@@ -38,6 +38,17 @@ enum cmd
 	CMD_END_FILE	='x',	/* End of file transmission - also appears at
 				   the end of the manifest and contains
 				   size/checksum info. */
+	CMD_EXT_FRAME	='H',	/* Network only - the next character is the
+				   real command, followed by an eight digit
+				   hex length. */
+	CMD_ZFRAME	='J',	/* Network only - the next character is the
+				   real command, followed by the eight digit
+				   hex lengths of the compressed data and of
+				   the data once it is decompressed. */
+	CMD_UNCHANGED	='K',	/* Phase1 only - the number of entries in a
+				   run that is the same as in the previous
+				   backup. The paths of the first and last
+				   entries of the run follow it. */
 
 /* CMD_FILE_UNCHANGED only used in counting stats on the client, for humans */
 	CMD_FILE_CHANGED='z',
@@ -59,6 +70,8 @@ enum cmd
 	CMD_BYTES_RECV	='P',
 	CMD_BYTES_SENT	='Q',
 	CMD_TIMESTAMP_END='E',
+	CMD_LINK_TABLE	='I',	/* Most hard linked files remembered at once
+				   during phase1. */
 
 // Legacy stuff
 	CMD_DATAPTH	='t',	/* Path to data on the server */
@@ -95,6 +95,8 @@ int cntr_init(struct cntr *cntr, const char *cname)
 		CMD_BYTES_RECV, "bytes_received", "Bytes received")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
 		CMD_BYTES, "bytes", "Bytes")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_LINK_TABLE, "hard_link_table", "Hard link table")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
 		CMD_BYTES_ESTIMATED, "bytes_estimated", "Bytes estimated")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
@@ -313,6 +315,11 @@ void cntr_add_val(struct cntr *c, char ch, unsigned long long val, int print)
 	incr_count_val(c, ch, val);
 }
 
+void cntr_set_val(struct cntr *c, char ch, unsigned long long val)
+{
+	if(c->ent[(uint8_t)ch]) c->ent[(uint8_t)ch]->count=val;
+}
+
 void cntr_add_same(struct cntr *c, char ch)
 {
 	incr_same(c, ch);
@@ -425,6 +432,8 @@ static void bottom_part(struct cntr *c, enum action act)
 	logc("\n");
 	logc("      Bytes estimated:   % 11llu", get_count(e, CMD_BYTES_ESTIMATED));
 	logc("%s\n", bytes_to_human(get_count(e, CMD_BYTES_ESTIMATED)));
+	if((l=get_count(e, CMD_LINK_TABLE)))
+		logc("      Hard link table:   % 11llu\n", l);
 
 	if(act==ACTION_ESTIMATE) return;
 
@@ -96,6 +96,8 @@ extern void cntr_add_phase1(struct cntr *c,
 	char ch, int print);
 extern void cntr_add_val(struct cntr *c,
 	char ch, unsigned long long val, int print);
+extern void cntr_set_val(struct cntr *c,
+	char ch, unsigned long long val);
 extern void cntr_add_same_val(struct cntr *c,
 	char ch, unsigned long long val);
 extern void cntr_add_changed_val(struct cntr *c,
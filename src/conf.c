@@ -73,15 +73,28 @@ void conf_init(struct conf *c)
 	c->password_check=1;
 	c->log_to_stdout=1;
 	c->network_timeout=60*60*2; // two hours
+	c->network_write_high=256*1024;
+	c->network_write_low=64*1024;
+#ifndef HAVE_WIN32
+	// The Windows EFS restore callback cannot take bigger frames.
+	c->network_ext_frames=1;
+#endif
 	// ext3 maximum number of subdirs is 32000, so leave a little room.
 	c->max_storage_subdirs=30000;
 	c->librsync=1;
 	c->compression=9;
 	c->ssl_compression=5;
+	c->ssl_session_timeout=7200;
 	c->version_warn=1;
 	c->path_length_warn=1;
 	c->umask=0022;
 	c->max_hardlinks=10000;
+	c->shuffle_workers=1;
+	c->max_network_streams=4;
+	c->checkpoint_interval=300;
+	c->delta_workers=1;
+	c->scan_workers=1;
+	c->restore_workers=1;
 
 	c->client_can|=CLIENT_CAN_DELETE;
 	c->client_can|=CLIENT_CAN_DIFF;
@@ -123,6 +136,11 @@ void conf_free_content(struct conf *c)
 	free_w(&c->ssl_ciphers);
 	free_w(&c->ssl_dhfile);
 	free_w(&c->ssl_peer_cn);
+	free_w(&c->ssl_session_file);
+	free_w(&c->phase1_cache);
+	free_w(&c->change_journal);
+	free_w(&c->phase1_cache_cur);
+	free_w(&c->phase1_cache_new);
 	free_w(&c->user);
 	free_w(&c->group);
 	free_w(&c->encryption_password);
@@ -506,8 +524,15 @@ static int load_conf_ints(struct conf *c,
 	gcv_uint8(f, v, "stdout", &(c->log_to_stdout));
 	gcv_uint8(f, v, "progress_counter", &(c->progress_counter));
 	gcv_uint8(f, v, "hardlinked_archive", &(c->hardlinked_archive));
+	gcv_uint8(f, v, "shuffle_changed_only", &(c->shuffle_changed_only));
+	gcv_int(f, v, "shuffle_workers", &(c->shuffle_workers));
+	gcv_int(f, v, "max_network_streams", &(c->max_network_streams));
+	gcv_int(f, v, "checkpoint_interval", &(c->checkpoint_interval));
+	gcv_int(f, v, "ssl_session_timeout", &(c->ssl_session_timeout));
+	gcv_uint8(f, v, "ssl_ktls", &(c->ssl_ktls));
 	gcv_int(f, v, "max_hardlinks", &(c->max_hardlinks));
 	gcv_uint8(f, v, "librsync", &(c->librsync));
+	gcv_uint8(f, v, "seekable_compression", &(c->seekable_compression));
 	gcv_uint8(f, v, "version_warn", &(c->version_warn));
 	gcv_uint8(f, v, "path_length_warn", &(c->path_length_warn));
 	gcv_uint8(f, v, "cross_all_filesystems", &(c->cross_all_filesystems));
@@ -527,13 +552,24 @@ static int load_conf_ints(struct conf *c,
 	gcv_uint8(f, v, "notify_success_changes_only",
 					&(c->n_success_changes_only));
 	gcv_int(f, v, "network_timeout", &(c->network_timeout));
+	gcv_int(f, v, "network_write_high", &(c->network_write_high));
+	gcv_int(f, v, "network_write_low", &(c->network_write_low));
+	gcv_int(f, v, "network_ext_frames", &(c->network_ext_frames));
+	gcv_int(f, v, "network_streams", &(c->network_streams));
+	gcv_int(f, v, "network_compression", &(c->network_compression));
 	gcv_int(f, v, "max_children", &(c->max_children));
 	gcv_int(f, v, "max_status_children", &(c->max_status_children));
+	gcv_int(f, v, "prefork_workers", &(c->prefork_workers));
 	gcv_int(f, v, "max_storage_subdirs", &(c->max_storage_subdirs));
 	gcv_uint8(f, v, "overwrite", &(c->overwrite));
 	gcv_uint8(f, v, "split_vss", &(c->split_vss));
 	gcv_uint8(f, v, "strip_vss", &(c->strip_vss));
 	gcv_uint8(f, v, "atime", &(c->atime));
+	gcv_uint8(f, v, "restore_sparse", &(c->restore_sparse));
+	gcv_int(f, v, "delta_workers", &(c->delta_workers));
+	gcv_int(f, v, "scan_workers", &(c->scan_workers));
+	gcv_int(f, v, "prefetch_files", &(c->prefetch_files));
+	gcv_int(f, v, "restore_workers", &(c->restore_workers));
 	gcv_int(f, v, "strip", &(c->strip));
 	gcv_int(f, v, "randomise", &(c->randomise));
 	gcv_uint8(f, v, "fork", &(c->forking));
@@ -578,6 +614,9 @@ static int load_conf_strings(struct conf *c,
 	  || gcv(f, v, "ssl_dhfile", &(c->ssl_dhfile))
 	  || gcv(f, v, "ssl_peer_cn", &(c->ssl_peer_cn))
 	  || gcv(f, v, "ssl_ciphers", &(c->ssl_ciphers))
+	  || gcv(f, v, "ssl_session_file", &(c->ssl_session_file))
+	  || gcv(f, v, "phase1_cache", &(c->phase1_cache))
+	  || gcv(f, v, "change_journal", &(c->change_journal))
 	  || gcv(f, v, "clientconfdir", &(c->clientconfdir))
 	  || gcv(f, v, "cname", &(c->cname))
 	  || gcv(f, v, "directory", &(c->directory))
@@ -665,6 +704,20 @@ static int get_compression(const char *v)
 	return -1;
 }
 
+static int get_ratelimit(const char *f, const char *v, float *dest)
+{
+	// User is specifying Mega bits per second.
+	// Need to convert to bytes per second.
+	float r=(atof(v)*1024*1024)/8;
+	if(!r)
+	{
+		logp("%s should be greater than zero\n", f);
+		return -1;
+	}
+	*dest=r;
+	return 0;
+}
+
 static int load_conf_field_and_value(struct conf *c,
 	const char *f, // field
 	const char *v, // value
@@ -708,17 +761,11 @@ static int load_conf_field_and_value(struct conf *c,
 	}
 	else if(!strcmp(f, "ratelimit"))
 	{
-		float f=0;
-		f=atof(v);
-		// User is specifying Mega bits per second.
-		// Need to convert to bytes per second.
-		f=(f*1024*1024)/8;
-		if(!f)
-		{
-			logp("ratelimit should be greater than zero\n");
-			return -1;
-		}
-		c->ratelimit=f;
+		if(get_ratelimit(f, v, &(c->ratelimit))) return -1;
+	}
+	else if(!strcmp(f, "global_ratelimit"))
+	{
+		if(get_ratelimit(f, v, &(c->global_ratelimit))) return -1;
 	}
 	else if(!strcmp(f, "min_file_size"))
 	{
@@ -1467,8 +1514,14 @@ static int conf_set_from_global(struct conf *globalc, struct conf *cc)
 	cc->client_can=globalc->client_can;
 	cc->server_can=globalc->server_can;
 	cc->hardlinked_archive=globalc->hardlinked_archive;
+	cc->shuffle_changed_only=globalc->shuffle_changed_only;
+	cc->shuffle_workers=globalc->shuffle_workers;
+	cc->ratelimit=globalc->ratelimit;
+	cc->max_network_streams=globalc->max_network_streams;
+	cc->checkpoint_interval=globalc->checkpoint_interval;
 	cc->librsync=globalc->librsync;
 	cc->compression=globalc->compression;
+	cc->seekable_compression=globalc->seekable_compression;
 	cc->version_warn=globalc->version_warn;
 	cc->hard_quota=globalc->hard_quota;
 	cc->soft_quota=globalc->soft_quota;
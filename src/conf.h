@@ -43,13 +43,23 @@ struct conf
 	char *ssl_peer_cn;
 	char *ssl_ciphers;
 	int ssl_compression;
+	uint8_t ssl_ktls;
+	char *ssl_session_file;
 	char *user;
 	char *group;
 	float ratelimit;
 	int network_timeout;
+	int network_write_high;
+	int network_write_low;
+	int network_ext_frames;
+	int network_streams;
+	int network_compression;
 
   // If the client tells us it is windows, this is set on the server side.
 	uint8_t client_is_windows;
+  // Set on the server side if the client can restore gzip files that are made
+  // up of several members, such as seekable gzip files.
+	uint8_t client_gzip_members;
 
 	char *peer_version;
 
@@ -65,8 +75,11 @@ struct conf
 	char *timestamp_format;
 	char *clientconfdir;
 	char *ssl_dhfile;
+	int ssl_session_timeout;
 	int max_children;
 	int max_status_children;
+	int prefork_workers;
+	float global_ratelimit;
 	char *client_lockdir;
 	mode_t umask;
 	int max_hardlinks;
@@ -93,6 +106,8 @@ struct conf
 	char *autoupgrade_dir; // also a server option
 	char *ca_csr_dir;
 	int randomise;
+	char *phase1_cache;
+	char *change_journal;
 
   // This block of client stuff is all to do with what files to backup.
 	struct strlist *startdir;
@@ -117,8 +132,13 @@ struct conf
 	uint8_t strip_vss;
 	char *vss_drives;
 	uint8_t atime;
+	int delta_workers;
+	int scan_workers;
+	int prefetch_files;
   // These are to do with restore.
 	uint8_t overwrite;
+	uint8_t restore_sparse;
+	int restore_workers;
 	int strip;
 	char *backup;
 	char *backup2; // For diffs.
@@ -167,6 +187,10 @@ struct conf
 // Client options on the server.
 // They can be set globally in the server config, or for each client.
 	uint8_t hardlinked_archive;
+	uint8_t shuffle_changed_only;
+	int shuffle_workers;
+	int max_network_streams;
+	int checkpoint_interval;
 
 	struct strlist *keep;
 
@@ -174,6 +198,7 @@ struct conf
 	uint8_t librsync;
 
 	uint8_t compression;
+	uint8_t seekable_compression;
 	uint8_t version_warn;
 	uint8_t path_length_warn;
 	ssize_t hard_quota;
@@ -212,6 +237,12 @@ struct conf
 // to an alternative client;
 	char *orig_client;
 
+// Identify the client phase1 cache. cur is what the server has for its
+// current backup, and is only set on the client. new is what the client is
+// building during this backup, and is set on both sides.
+	char *phase1_cache_cur;
+	char *phase1_cache_new;
+
 	struct cntr *cntr;
 };
 
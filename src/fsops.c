@@ -120,7 +120,9 @@ int mkpath(char **rpath, const char *limit)
 				logp("will not mkdir %s\n", *rpath);
 				goto end;
 			}
-			if(mkdir(*rpath, 0777))
+			// Somebody else, such as another shuffle worker, may
+			// have made it since the lstat.
+			if(mkdir(*rpath, 0777) && errno!=EEXIST)
 			{
 				logp("could not mkdir %s: %s\n", *rpath, strerror(errno));
 				goto end;
@@ -187,6 +187,45 @@ int set_blocking(int fd)
 	return fcntl(fd, F_SETFL, flags | ~O_NONBLOCK);
 }
 
+#ifndef HAVE_WIN32
+// For the socketpairs that the client uses to talk to its worker
+// processes. A worker that has gone away gives an error, not SIGPIPE.
+int fd_read_full(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+	char *b=(char *)buf;
+	while(len)
+	{
+		if((r=read(fd, b, len))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		if(!r) return -1;
+		b+=r;
+		len-=r;
+	}
+	return 0;
+}
+
+int fd_write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t w;
+	const char *b=(const char *)buf;
+	while(len)
+	{
+		if((w=send(fd, b, len, MSG_NOSIGNAL))<0)
+		{
+			if(errno==EINTR) continue;
+			return -1;
+		}
+		b+=w;
+		len-=w;
+	}
+	return 0;
+}
+#endif
+
 char *get_tmp_filename(const char *basis)
 {
 	return prepend(basis, ".tmp", strlen(".tmp"), 0 /* no slash */);
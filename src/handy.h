@@ -34,6 +34,8 @@ extern const char *time_taken(time_t d);
 extern int dpthl_is_compressed(int compressed, const char *datapath);
 #ifndef HAVE_WIN32
 extern void setup_signal(int sig, void handler(int sig));
+extern int fd_read_full(int fd, void *buf, size_t len);
+extern int fd_write_full(int fd, const void *buf, size_t len);
 #endif
 
 extern long version_to_long(const char *version);
@@ -34,6 +34,7 @@
 #include "sbuf.h"
 #include "ssl.h"
 #include "strlist.h"
+#include "tbucket.h"
 #include "version.h"
 #include "yajl_gen_w.h"
 
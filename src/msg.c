@@ -161,5 +161,9 @@ gzFile gzopen_file(const char *fname, const char *mode)
 		logp("could not open %s: %s\n", fname, strerror(errno));
 		return NULL; 
 	}
+#if ZLIB_VERNUM >= 0x1240
+	// Fewer, bigger reads and writes than the zlib default of 8k.
+	gzbuffer(fp, GZ_BUF_LEN);
+#endif
 	return fp;
 }
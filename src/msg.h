@@ -4,6 +4,9 @@
 #include <zlib.h>
 #include "bfile.h"
 
+// Size of the zlib buffers used by gzopen_file().
+#define GZ_BUF_LEN	(128*1024)
+
 extern int send_msg_fp(FILE *fp, enum cmd cmd, const char *buf, size_t s);
 extern int send_msg_zp(gzFile zp, enum cmd cmd, const char *buf, size_t s);
 extern int transfer_gzfile_in(struct asfd *asfd, const char *path, BFILE *bfd,
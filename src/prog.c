@@ -63,6 +63,9 @@ static void usage_client(void)
 	printf("                  delete: delete\n");
 	printf("                  d: diff\n");
 	printf("                  e: estimate\n");
+#ifdef HAVE_LINUX_OS
+	printf("                  j: keep the change journal\n");
+#endif
 	printf("                  l: list (this is the default when an action is not given)\n");
 	printf("                  L: long list\n");
 	printf("                  m: monitor interface\n");
@@ -184,6 +187,8 @@ static int parse_action(enum action *act, const char *optarg)
 		*act=ACTION_DIFF_LONG;
 	else if(!strncmp(optarg, "monitor", 1))
 		*act=ACTION_MONITOR;
+	else if(!strncmp(optarg, "journal", 1))
+		*act=ACTION_JOURNAL;
 	else
 	{
 		usage();
@@ -431,7 +436,8 @@ int main (int argc, char *argv[])
 		|| act==ACTION_DIFF_LONG
 		|| act==ACTION_STATUS
 		|| act==ACTION_STATUS_SNAPSHOT
-		|| act==ACTION_MONITOR))
+		|| act==ACTION_MONITOR
+		|| act==ACTION_JOURNAL))
 	{
 		// These client modes need to run without getting the lock.
 	}
@@ -118,8 +118,16 @@ static int do_backup_server(struct async *as, struct sdirs *sdirs,
 	if(resume)
 	{
 		if(sdirs_get_real_working_from_symlink(sdirs, cconf)
+		  || sdirs_get_real_manifest(sdirs, cconf)
 		  || open_log(asfd, sdirs, cconf))
 			goto error;
+
+		if(cconf->protocol==PROTO_BURP2
+		  && !(chfd=champ_chooser_connect(as, sdirs, cconf)))
+		{
+			logp("problem connecting to champ chooser\n");
+			goto error;
+		}
 	}
 	else
 	{
@@ -3,6 +3,142 @@
 
 #include "../burp1/sbufl.h"
 
+static void phase1_count(struct sbuf *sb, struct conf *conf)
+{
+	cntr_add_phase1(conf->cntr, sb->path.cmd, 0);
+
+	if(sb->path.cmd==CMD_FILE
+	  || sb->path.cmd==CMD_ENC_FILE
+	  || sb->path.cmd==CMD_METADATA
+	  || sb->path.cmd==CMD_ENC_METADATA
+	  || sb->path.cmd==CMD_EFS_FILE)
+	{
+		cntr_add_val(conf->cntr, CMD_BYTES_ESTIMATED,
+			(unsigned long long)sb->statp.st_size, 0);
+	}
+}
+
+// The entries from the previous manifest that a client phase1 cache run
+// covers. cb is the next manifest entry that has not been used yet.
+struct unchanged
+{
+	gzFile cmanfp;
+	struct sbuf *cb;
+	uint8_t eof;
+};
+
+static int unchanged_next(struct unchanged *uc, struct sdirs *sdirs,
+	struct conf *conf)
+{
+	int ars;
+	if(uc->cb->path.buf || uc->eof) return 0;
+	if(!uc->cmanfp && !(uc->cmanfp=gzopen_file(sdirs->cmanifest, "rb")))
+	{
+		uc->eof=1;
+		return 0;
+	}
+	if((ars=sbufl_fill(uc->cb, NULL, NULL, uc->cmanfp, conf->cntr))<0)
+		return -1;
+	if(ars>0) uc->eof=1;
+	return 0;
+}
+
+// The client cache does not match the previous backup, so stop offering it.
+// The next backup will then have everything sent.
+static void forget_phase1_cache(struct sdirs *sdirs)
+{
+	char *path=NULL;
+	if(!(path=prepend_s(sdirs->current, "phase1cache")))
+		return;
+	if(unlink(path) && errno!=ENOENT)
+		logp("Could not unlink %s: %s\n", path, strerror(errno));
+	free_w(&path);
+}
+
+// Copy the run of entries described by run (the count in attr, the first
+// entry in path and the last in link) from the previous manifest into the
+// phase1 file.
+static int unchanged_expand(struct asfd *asfd, struct unchanged *uc,
+	struct sbuf *run, gzFile p1zp, struct sdirs *sdirs, struct conf *conf)
+{
+	int c;
+	uint8_t started=0;
+	unsigned long long n=0;
+	unsigned long long count=strtoull(run->attr.buf, NULL, 10);
+	struct sbuf *cb=uc->cb;
+
+	if(conf->protocol!=PROTO_BURP1)
+	{
+		logp("Got a run of unchanged entries, but not using protocol 1\n");
+		return -1;
+	}
+	while(1)
+	{
+		if(unchanged_next(uc, sdirs, conf)) return -1;
+		if(uc->eof) break;
+		if(!started)
+		{
+			c=pathcmp(cb->path.buf, run->path.buf);
+			if(c<0 || (!c && cb->path.cmd!=run->path.cmd))
+			{
+				sbuf_free_content(cb);
+				continue;
+			}
+			if(c>0) break;
+			started=1;
+		}
+		if((c=pathcmp(cb->path.buf, run->link.buf))>0)
+			break;
+		// Only what the client sent in phase1.
+		iobuf_free_content(&cb->burp1->datapth);
+		if(sbufl_to_manifest_phase1(cb, NULL, p1zp))
+			return -1;
+		phase1_count(cb, conf);
+		n++;
+		if(!c && cb->path.cmd==run->link.cmd)
+		{
+			sbuf_free_content(cb);
+			break;
+		}
+		sbuf_free_content(cb);
+	}
+	if(n!=count)
+	{
+		// Entries would be missing from this backup, so it cannot
+		// carry on.
+		logp("Run of %llu unchanged entries from %s had %llu in the "
+			"previous manifest\n", count, run->path.buf, n);
+		forget_phase1_cache(sdirs);
+		log_and_send(asfd, "phase1 cache does not match the previous "
+			"backup - please try again");
+		return -1;
+	}
+	return 0;
+}
+
+// Remember which phase1 cache the client is building for this backup, so
+// that the next one can use it.
+static int write_phase1_cache_token(struct sdirs *sdirs, struct conf *conf)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *path=NULL;
+	if(!(path=prepend_s(sdirs->working, "phase1cache"))
+	  || !(fp=open_file(path, "wb")))
+		goto end;
+	fprintf(fp, "%s\n", conf->phase1_cache_new);
+	if(close_fp(&fp))
+	{
+		logp("error closing %s in %s\n", path, __func__);
+		goto end;
+	}
+	ret=0;
+end:
+	free_w(&path);
+	close_fp(&fp);
+	return ret;
+}
+
 int backup_phase1_server_all(struct async *as,
 	struct sdirs *sdirs, struct conf *conf)
 {
@@ -12,6 +148,9 @@ int backup_phase1_server_all(struct async *as,
 	gzFile p1zp=NULL;
 	char *phase1tmp=NULL;
 	struct asfd *asfd=as->asfd;
+	struct unchanged uc;
+
+	memset(&uc, 0, sizeof(uc));
 
 	logp("Begin phase1 (file system scan)\n");
 
@@ -19,7 +158,8 @@ int backup_phase1_server_all(struct async *as,
 		goto end;
 	if(!(p1zp=gzopen_file(phase1tmp, comp_level(conf))))
 		goto end;
-	if(!(sb=sbuf_alloc(conf)))
+	if(!(sb=sbuf_alloc(conf))
+	  || !(uc.cb=sbuf_alloc(conf)))
 		goto end;
 
 	while(1)
@@ -42,20 +182,17 @@ int backup_phase1_server_all(struct async *as,
 					goto end;
 			break;
 		}
-		if(write_status(CNTR_STATUS_SCANNING, sb->path.buf, conf)
-		  || sbufl_to_manifest_phase1(sb, NULL, p1zp))
+		if(write_status(CNTR_STATUS_SCANNING, sb->path.buf, conf))
 			goto end;
-		cntr_add_phase1(conf->cntr, sb->path.cmd, 0);
-
-		if(sb->path.cmd==CMD_FILE
-		  || sb->path.cmd==CMD_ENC_FILE
-		  || sb->path.cmd==CMD_METADATA
-		  || sb->path.cmd==CMD_ENC_METADATA
-		  || sb->path.cmd==CMD_EFS_FILE)
+		if(sb->attr.cmd==CMD_UNCHANGED)
 		{
-			cntr_add_val(conf->cntr, CMD_BYTES_ESTIMATED,
-				(unsigned long long)sb->statp.st_size, 0);
+			if(unchanged_expand(asfd, &uc, sb, p1zp, sdirs, conf))
+				goto end;
+			continue;
 		}
+		if(sbufl_to_manifest_phase1(sb, NULL, p1zp))
+			goto end;
+		phase1_count(sb, conf);
 	}
 
 	if(gzclose_fp(&p1zp))
@@ -67,6 +204,11 @@ int backup_phase1_server_all(struct async *as,
 	if(check_quota(as, conf))
 		goto end;
 
+	if(conf->phase1_cache_new
+	  && conf->protocol==PROTO_BURP1
+	  && write_phase1_cache_token(sdirs, conf))
+		goto end;
+
 	// Possible rename race condition is of no consequence here, because
 	// the working directory will always get deleted if phase1 is not
 	// complete.
@@ -80,6 +222,8 @@ int backup_phase1_server_all(struct async *as,
 end:
 	free(phase1tmp);
 	gzclose_fp(&p1zp);
+	gzclose_fp(&uc.cmanfp);
 	sbuf_free(&sb);
+	sbuf_free(&uc.cb);
 	return ret;
 }
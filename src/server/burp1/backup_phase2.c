@@ -145,7 +145,7 @@ static int process_changed_file(struct asfd *asfd,
 		return -1;
 	}
 	if(!(p1b->burp1->outfb=rs_filebuf_new(asfd, NULL, NULL, NULL,
-		asfd->fd, ASYNC_BUF_LEN, -1, cconf->cntr)))
+		asfd->fd, asfd->frame_len, -1, cconf->cntr)))
 	{
 		logp("could not rs_filebuf_new for in_outfb.\n");
 		return -1;
@@ -580,16 +580,54 @@ static int deal_with_filedata(struct asfd *asfd,
 	return 0;
 }
 
+// The data for the new file came in on one of the extra streams, so move it
+// to where it would have been written.
+static int deal_with_receive_spooled(struct asfd *asfd, struct sdirs *sdirs,
+	struct sbuf *rb, struct conf *cconf)
+{
+	int ret=-1;
+	char *spool=NULL;
+	char *rpath=NULL;
+	struct stat statp;
+	const char *name=asfd->rbuf->buf+strlen("spooled:");
+
+	if(rb->flags & SBUFL_RECV_DELTA || !stream_name_ok(name))
+	{
+		iobuf_log_unexpected(asfd->rbuf, __func__);
+		goto end;
+	}
+	if(!(spool=prepend_s(sdirs->streams, name))
+	  || !(rpath=prepend_s(sdirs->datadirtmp, rb->burp1->datapth.buf)))
+		goto end;
+	if(close_fp(&rb->burp1->fp)
+	  || lstat(spool, &statp)
+	  || do_rename(spool, rpath))
+	{
+		logp("could not move spooled %s to %s\n", spool, rpath);
+		goto end;
+	}
+	cntr_add_recvbytes(cconf->cntr, statp.st_size);
+	// Keep it open, so that the end of the file is dealt with as usual.
+	if(!(rb->burp1->fp=open_file(rpath, "ab")))
+		goto end;
+	ret=0;
+end:
+	free_w(&spool);
+	free_w(&rpath);
+	return ret;
+}
+
 // returns 1 for finished ok.
 static int do_stuff_to_receive(struct asfd *asfd,
 	struct sdirs *sdirs, struct conf *cconf,
-	struct sbuf *rb, FILE *chfp, struct dpthl *dpthl, char **last_requested)
+	struct sbuf *rb, FILE *chfp, struct dpthl *dpthl, char **last_requested,
+	int quick)
 {
 	struct iobuf *rbuf=asfd->rbuf;
 
 	iobuf_free_content(rbuf);
 	// This also attempts to write anything in the write buffer.
-	if(asfd->as->read_write(asfd->as))
+	if(quick?asfd->as->read_quick(asfd->as):asfd->as->read_write(asfd->as))
 	{
 		logp("error in %s\n", __func__);
 		return -1;
@@ -618,6 +656,15 @@ static int do_stuff_to_receive(struct asfd *asfd,
 					chfp, cconf, last_requested))
 						goto error;
 				return 0;
+			case CMD_GEN:
+				if(!strncmp_w(rbuf->buf, "spooled:"))
+				{
+					if(deal_with_receive_spooled(asfd,
+						sdirs, rb, cconf))
+							goto error;
+					return 0;
+				}
+				// Fall through.
 			default:
 				iobuf_log_unexpected(rbuf, __func__);
 				goto error;
@@ -784,6 +831,16 @@ int backup_phase2_server_burp1(struct async *as, struct sdirs *sdirs,
 	if(!(p1zp=gzopen_file(sdirs->phase1data, "rb")))
 		goto error;
 
+	// Somewhere for new files that the client sends over extra streams.
+	// Anything left from an interrupted backup is of no use.
+	if(cconf->max_network_streams>0
+	  && (recursive_delete(sdirs->streams, NULL, 1)
+		|| mkdir(sdirs->streams, 0777)))
+	{
+		logp("could not create %s\n", sdirs->streams);
+		goto error;
+	}
+
 	if(resume && do_resume(p1zp, sdirs, &dpthl, cconf))
 		goto error;
 
@@ -804,8 +861,12 @@ int backup_phase2_server_burp1(struct async *as, struct sdirs *sdirs,
 				goto error;
 		if(last_requested || !p1zp || asfd->writebuflen)
 		{
+			// If there is more to ask for, do not sit waiting for
+			// the client, which may be working on several deltas
+			// at once.
 			switch(do_stuff_to_receive(asfd, sdirs,
-				cconf, rb, chfp, &dpthl, &last_requested))
+				cconf, rb, chfp, &dpthl, &last_requested,
+				p1zp && !asfd->writebuflen))
 			{
 				case 0: break;
 				case 1: goto end; // Finished ok.
@@ -896,8 +957,10 @@ end:
 	sbuf_free(&rb);
 	gzclose_fp(&p1zp);
 	gzclose_fp(&cmanfp);
+	recursive_delete(sdirs->streams, NULL, 1);
 	if(!ret) unlink(sdirs->phase1data);
 
+	rs_filebuf_log_stats();
 	logp("End phase2 (receive file data)\n");
 
 	return ret;
@@ -4,23 +4,34 @@
 #include <netdb.h>
 #include <librsync.h>
 #include <dirent.h>
+#include <sys/wait.h>
+
+// Upper limit on the number of processes doing the atomic data jiggle.
+#define SHUFFLE_WORKERS_MAX	64
 
 // Also used by restore.c.
 // FIX THIS: This stuff is very similar to make_rev_delta, can maybe share
 // some code.
-int do_patch(struct asfd *asfd, const char *dst, const char *del,
+// If dstsgz is set, dst is a seekable gzip file that is read directly.
+int do_patch(struct asfd *asfd, const char *dst, bool dstsgz, const char *del,
 	const char *upd, bool gzupd, int compression, struct conf *cconf)
 {
 	FILE *dstp=NULL;
+	struct sgz *dstsp=NULL;
 	FILE *delfp=NULL;
 	gzFile delzp=NULL;
 	gzFile updp=NULL;
+	struct sgz *updsp=NULL;
 	FILE *updfp=NULL;
 	rs_result result=RS_IO_ERROR;
 
 	//logp("patching...\n");
 
-	if(!(dstp=open_file(dst, "rb"))) goto end;
+	if(dstsgz)
+	{
+		if(!(dstsp=sgz_open_r(dst))) goto end;
+	}
+	else if(!(dstp=open_file(dst, "rb"))) goto end;
 
 	if(dpthl_is_compressed(compression, del))
 		delzp=gzopen_file(del, "rb");
@@ -29,17 +40,20 @@ int do_patch(struct asfd *asfd, const char *dst, const char *del,
 
 	if(!delzp && !delfp) goto end;
 
-	if(gzupd)
+	if(gzupd && cconf->seekable_compression)
+		updsp=sgz_open_w(upd, cconf->compression);
+	else if(gzupd)
 		updp=gzopen(upd, comp_level(cconf));
 	else
 		updfp=fopen(upd, "wb");
 
-	if(!updp && !updfp) goto end;
+	if(!updp && !updfp && !updsp) goto end;
 
-	result=rs_patch_gzfile(asfd,
-		dstp, delfp, delzp, updfp, updp, NULL, cconf->cntr);
+	result=rs_patch_gzfile(asfd, dstp, dstsp,
+		delfp, delzp, updfp, updp, updsp, NULL, cconf->cntr);
 end:
 	close_fp(&dstp);
+	sgz_close(&dstsp);
 	gzclose_fp(&delzp);
 	close_fp(&delfp);
 	if(close_fp(&updfp))
@@ -52,6 +66,11 @@ end:
 		logp("error gzclosing %s in %s\n", upd, __func__);
 		result=RS_IO_ERROR;
 	}
+	if(sgz_close(&updsp))
+	{
+		logp("error closing %s in %s\n", upd, __func__);
+		result=RS_IO_ERROR;
+	}
 	return result;
 }
 
@@ -232,9 +251,48 @@ static int inflate_or_link_oldfile(const char *oldpath, const char *infpath,
 		1 /* allow overwrite of infpath */);
 }
 
+/* When the data directory of the previous backup has been moved into the
+   new backup, the previous version of a changed file is sitting at finpath.
+   Move it back to where it would be had the whole previous backup been
+   duplicated, so that the rest of the jiggle can carry on as normal. */
+static int move_back_changed(struct fdirs *fdirs, char **oldpath,
+	const char *newpath, const char *finpath, const char *deltafpath)
+{
+	struct stat statp;
+
+	// Already moved back, or there is nothing to move back.
+	if(!lstat(*oldpath, &statp)
+	  || lstat(finpath, &statp) || !S_ISREG(statp.st_mode))
+		return 0;
+
+	// Only files that got a forward delta or a fresh new file changed.
+	if((lstat(deltafpath, &statp) || !S_ISREG(statp.st_mode))
+	  && (lstat(newpath, &statp) || !S_ISREG(statp.st_mode)))
+		return 0;
+
+	if(mkpath(oldpath, fdirs->currentdupdata))
+	{
+		logp("could not create path for: %s\n", *oldpath);
+		return -1;
+	}
+	// Rename race condition is of no consequence, because once finpath
+	// has gone, the file is picked up from oldpath on the next run.
+	return do_rename(finpath, *oldpath);
+}
+
+// Paths that each shuffle worker needs to itself.
+struct jiggler
+{
+	char *sigpath;
+	char *infpath;
+	char *deletionsfile;
+	FILE *delfp;
+};
+
 static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
-	int hardlinked_current, const char *deltabdir, const char *deltafdir,
-	const char *sigpath, FILE **delfp, struct conf *cconf)
+	int hardlinked_current, int datamoved,
+	const char *deltabdir, const char *deltafdir,
+	struct jiggler *jiggler, struct conf *cconf)
 {
 	int ret=-1;
 	struct stat statp;
@@ -254,10 +312,16 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 	  || !(deltafpath=prepend_s(deltafdir, datapth)))
 		goto end;
 
+	if(datamoved && move_back_changed(fdirs,
+		&oldpath, newpath, finpath, deltafpath))
+			goto end;
+
 	if(!lstat(finpath, &statp) && S_ISREG(statp.st_mode))
 	{
 		// Looks like an interrupted jiggle
 		// did this file already.
+		// Or, if the previous data was moved in, the file is
+		// unchanged and is already where it needs to be.
 		static int donemsg=0;
 		if(!lstat(deltafpath, &statp) && S_ISREG(statp.st_mode))
 		{
@@ -265,7 +329,7 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 				deltafpath);
 			unlink(deltafpath);
 		}
-		if(!donemsg)
+		if(!donemsg && !datamoved)
 		{
 			logp("skipping already present file: %s\n", finpath);
 			logp("to save log space, skips of other already present files will not be logged\n");
@@ -285,29 +349,32 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 	else if(!lstat(deltafpath, &statp) && S_ISREG(statp.st_mode))
 	{
 		int lrs;
-		char *infpath=NULL;
+		int oldsgz=0;
+		const char *infpath=jiggler->infpath;
 
 		// Got a forward patch to do.
 		// First, need to gunzip the old file,
 		// otherwise the librsync patch will take
 		// forever, because it will be doing seeks
 		// all over the place, and gzseeks are slow.
-	  	if(!(infpath=prepend_s(deltafdir, "inflate")))
+		// Unless the old file is seekable gzip, in which case it can
+		// be used as it is.
+		if(dpthl_is_compressed(sb->compression, oldpath)
+		  && sgz_is_seekable(oldpath))
 		{
-			log_out_of_memory(__func__);
-			goto end;
+			oldsgz=1;
+			infpath=oldpath;
 		}
 
 		//logp("Fixing up: %s\n", datapth);
-		if(inflate_or_link_oldfile(oldpath, infpath,
+		if(!oldsgz && inflate_or_link_oldfile(oldpath, infpath,
 			sb->compression, cconf))
 		{
 			logp("error when inflating old file: %s\n", oldpath);
-			free(infpath);
 			goto end;
 		}
 
-		if((lrs=do_patch(NULL, infpath, deltafpath, newpath,
+		if((lrs=do_patch(NULL, infpath, oldsgz, deltafpath, newpath,
 			cconf->compression,
 			sb->compression /* from the manifest */, cconf)))
 		{
@@ -319,20 +386,20 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 			//ret=-1;
 			// Remove anything that got written.
 			unlink(newpath);
-			unlink(infpath);
-			free(infpath);
+			if(!oldsgz) unlink(infpath);
 
 			// First, note that we want to remove this entry from
 			// the manifest.
-			if(!*delfp
-			  && !(*delfp=open_file(fdirs->deletionsfile, "ab")))
+			if(!jiggler->delfp
+			  && !(jiggler->delfp=open_file(jiggler->deletionsfile,
+				"ab")))
 			{
 				// Could not mark this file as deleted. Fatal.
 				goto end;
 			}
-			if(sbufl_to_manifest(sb, *delfp, NULL))
+			if(sbufl_to_manifest(sb, jiggler->delfp, NULL))
 				goto end;
-			if(fflush(*delfp))
+			if(fflush(jiggler->delfp))
 			{
 				logp("error fflushing deletions file in %s: %s\n", __func__, strerror(errno));
 				goto end;
@@ -343,14 +410,13 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 		}
 
 		// Get rid of the inflated old file.
-		unlink(infpath);
-		free(infpath);
+		if(!oldsgz) unlink(infpath);
 
 		// Need to generate a reverse diff, unless we are keeping a
 		// hardlinked archive.
 		if(!hardlinked_current)
 		{
-			if(gen_rev_delta(sigpath, deltabdir,
+			if(gen_rev_delta(jiggler->sigpath, deltabdir,
 				oldpath, newpath, datapth, sb, cconf))
 					goto end;
 		}
@@ -464,6 +530,7 @@ static int need_hardlinked_archive(struct conf *cconf, unsigned long bno)
 }
 
 static int maybe_delete_files_from_manifest(const char *manifesttmp,
+	const char *deletionsfile, int count_warnings,
 	struct fdirs *fdirs, struct conf *cconf)
 {
 	int ars=0;
@@ -476,14 +543,14 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 	struct sbuf *mb=NULL;
 	struct stat statp;
 
-	if(lstat(fdirs->deletionsfile, &statp)) // No deletions, no problem.
+	if(lstat(deletionsfile, &statp)) // No deletions, no problem.
 		return 0;
 	logp("Performing deletions on manifest\n");
 
 	if(!(manifesttmp=get_tmp_filename(fdirs->manifest)))
 		goto end;
 
-        if(!(dfp=open_file(fdirs->deletionsfile, "rb"))
+        if(!(dfp=open_file(deletionsfile, "rb"))
 	  || !(omzp=gzopen_file(fdirs->manifest, "rb"))
 	  || !(nmzp=gzopen_file(manifesttmp, comp_level(cconf)))
 	  || !(db=sbuf_alloc(cconf))
@@ -523,6 +590,10 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 		else if(!(pcmp=sbuf_pathcmp(mb, db)))
 		{
 			// They were the same - do not write.
+			// Workers cannot update the counters of the parent,
+			// so count their warnings here.
+			if(count_warnings)
+				cntr_add(cconf->cntr, CMD_WARNING, 1);
 			sbuf_free_content(mb);
 			sbuf_free_content(db);
 		}
@@ -553,7 +624,7 @@ end:
 	sbuf_free(&mb);
 	if(!ret)
 	{
-		unlink(fdirs->deletionsfile);
+		unlink(deletionsfile);
 		// The rename race condition is not a problem here, as long
 		// as manifesttmp is the same path as that generated in the
 		// atomic data jiggle.
@@ -564,26 +635,309 @@ end:
 	return ret;
 }
 
+static int move_back_deleted_file(struct fdirs *fdirs, struct sbuf *sb)
+{
+	int ret=-1;
+	struct stat statp;
+	char *oldpath=NULL;
+	char *finpath=NULL;
+	const char *datapth=sb->burp1->datapth.buf;
+
+	if(!(oldpath=prepend_s(fdirs->currentdupdata, datapth))
+	  || !(finpath=prepend_s(fdirs->datadir, datapth)))
+		goto end;
+
+	// Already moved back on a previous run.
+	if(lstat(finpath, &statp) || !S_ISREG(statp.st_mode))
+	{
+		ret=0;
+		goto end;
+	}
+
+	if(mkpath(&oldpath, fdirs->currentdupdata))
+	{
+		logp("could not create path for: %s\n", oldpath);
+		goto end;
+	}
+	if(do_rename(finpath, oldpath))
+		goto end;
+
+	ret=0;
+end:
+	free_w(&oldpath);
+	free_w(&finpath);
+	return ret;
+}
+
+/* The data directory of the previous backup was moved into the new backup.
+   Anything that the new manifest no longer refers to has to go back to the
+   previous backup. */
+static int move_back_deleted(struct fdirs *fdirs, struct conf *cconf)
+{
+	int ars=0;
+	int ret=-1;
+	int pcmp=0;
+	gzFile omzp=NULL;
+	gzFile nmzp=NULL;
+	struct sbuf *ob=NULL;
+	struct sbuf *nb=NULL;
+
+	logp("Moving deleted files back to the previous backup\n");
+
+	if(!(omzp=gzopen_file(fdirs->currentdupmanifest, "rb"))
+	  || !(nmzp=gzopen_file(fdirs->manifest, "rb"))
+	  || !(ob=sbuf_alloc(cconf))
+	  || !(nb=sbuf_alloc(cconf)))
+		goto end;
+
+	while(omzp)
+	{
+		if(!ob->path.buf
+		  && (ars=sbufl_fill(ob, NULL, NULL, omzp, cconf->cntr)))
+		{
+			if(ars<0) goto end;
+			// ars==1 means it ended ok.
+			gzclose_fp(&omzp);
+			break;
+		}
+		if(nmzp && !nb->path.buf
+		  && (ars=sbufl_fill(nb, NULL, NULL, nmzp, cconf->cntr)))
+		{
+			if(ars<0) goto end;
+			// ars==1 means it ended ok.
+			gzclose_fp(&nmzp);
+		}
+
+		if(!ob->burp1->datapth.buf)
+		{
+			// Nothing stored for this entry.
+			sbuf_free_content(ob);
+			continue;
+		}
+
+		if(nb->path.buf && (pcmp=sbuf_pathcmp(ob, nb))>0)
+		{
+			// Behind in the new manifest.
+			sbuf_free_content(nb);
+			continue;
+		}
+
+		if(!nb->path.buf || pcmp
+		  || !nb->burp1->datapth.buf
+		  || strcmp(ob->burp1->datapth.buf, nb->burp1->datapth.buf))
+		{
+			if(write_status(CNTR_STATUS_SHUFFLING,
+				ob->burp1->datapth.buf, cconf)
+			  || move_back_deleted_file(fdirs, ob))
+				goto end;
+		}
+		sbuf_free_content(ob);
+	}
+
+	ret=0;
+end:
+	gzclose_fp(&omzp);
+	gzclose_fp(&nmzp);
+	sbuf_free(&ob);
+	sbuf_free(&nb);
+	return ret;
+}
+
+static void jiggler_free_content(struct jiggler *jiggler)
+{
+	close_fp(&jiggler->delfp);
+	free_w(&jiggler->sigpath);
+	free_w(&jiggler->infpath);
+	free_w(&jiggler->deletionsfile);
+}
+
+static int jiggler_init(struct jiggler *jiggler, struct fdirs *fdirs,
+	const char *deltafdir, int w, int workers)
+{
+	char suffix[16]="";
+	// A single worker uses the same paths as always, so that a backup
+	// interrupted by an older version can still be finished.
+	if(workers>1) snprintf(suffix, sizeof(suffix), ".%d", w);
+	if(!(jiggler->sigpath=prepend_s(fdirs->currentdup, "sig.tmp"))
+	  || astrcat(&jiggler->sigpath, suffix, __func__)
+	  || !(jiggler->infpath=prepend_s(deltafdir, "inflate"))
+	  || astrcat(&jiggler->infpath, suffix, __func__)
+	  || !(jiggler->deletionsfile=strdup_w(fdirs->deletionsfile, __func__))
+	  || astrcat(&jiggler->deletionsfile, suffix, __func__))
+		return -1;
+	return 0;
+}
+
+/* Returns 1 if the data path is in a different directory to the previous
+   one, remembering the new directory in 'lastdir'. */
+static int new_data_dir(const char *datapth, char **lastdir)
+{
+	size_t len;
+	const char *cp;
+	len=(cp=strrchr(datapth, '/'))?(size_t)(cp-datapth):0;
+	if(*lastdir && strlen(*lastdir)==len && !strncmp(*lastdir, datapth, len))
+		return 0;
+	free_w(lastdir);
+	if(!(*lastdir=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	memcpy(*lastdir, datapth, len);
+	(*lastdir)[len]='\0';
+	return 1;
+}
+
+/* Go through the manifest, jiggling every entry that belongs to worker 'w'
+   of 'workers'. Entries are shared out a data directory at a time, so that
+   workers do not keep making the same directories, and each worker writes
+   its deletions file in manifest order. */
+static int jiggle_manifest(struct sdirs *sdirs, struct fdirs *fdirs,
+	int hardlinked_current, int datamoved,
+	const char *deltabdir, const char *deltafdir,
+	struct jiggler *jiggler, int w, int workers, struct conf *cconf)
+{
+	int ret=-1;
+	int mine=0;
+	gzFile zp=NULL;
+	char *lastdir=NULL;
+	struct sbuf *sb=NULL;
+	unsigned long count=0;
+
+	if(!(zp=gzopen_file(fdirs->manifest, "rb"))
+	  || !(sb=sbuf_alloc(cconf)))
+		goto end;
+
+	while(1)
+	{
+		switch(sbufl_fill(sb, NULL, NULL, zp, cconf->cntr))
+		{
+			case 0: break;
+			case 1: goto ok;
+			default: goto end;
+		}
+		if(sb->burp1->datapth.buf && workers>1)
+		{
+			switch(new_data_dir(sb->burp1->datapth.buf, &lastdir))
+			{
+				case 0: break;
+				case 1: mine=((int)(count++%workers)==w); break;
+				default: goto end;
+			}
+		}
+		if(sb->burp1->datapth.buf
+		  && (workers==1 || mine))
+		{
+			// Only one process gets to talk to the status pipe.
+			if((workers==1 && write_status(CNTR_STATUS_SHUFFLING,
+				sb->burp1->datapth.buf, cconf))
+			  || jiggle(sdirs, fdirs, sb,
+				hardlinked_current, datamoved,
+				deltabdir, deltafdir,
+				jiggler, cconf))
+					goto end;
+		}
+		sbuf_free_content(sb);
+	}
+
+ok:
+	if(close_fp(&jiggler->delfp))
+	{
+		logp("error closing %s in %s\n",
+			jiggler->deletionsfile, __func__);
+		goto end;
+	}
+	rs_filebuf_log_stats();
+	ret=0;
+end:
+	gzclose_fp(&zp);
+	sbuf_free(&sb);
+	free_w(&lastdir);
+	return ret;
+}
+
+static int jiggle_in_workers(struct sdirs *sdirs, struct fdirs *fdirs,
+	int hardlinked_current, int datamoved,
+	const char *deltabdir, const char *deltafdir,
+	struct jiggler *jigglers, int workers, struct conf *cconf)
+{
+	int w;
+	int ret=0;
+	int status;
+	pid_t *pids=NULL;
+
+	if(!(pids=(pid_t *)calloc_w(workers, sizeof(pid_t), __func__)))
+		return -1;
+
+	logp("Shuffling with %d workers\n", workers);
+
+	// Do not let the children write out anything buffered by the parent.
+	fflush(NULL);
+
+	for(w=0; w<workers; w++)
+	{
+		switch((pids[w]=fork()))
+		{
+			case -1:
+				logp("fork failed in %s: %s\n",
+					__func__, strerror(errno));
+				ret=-1;
+				break;
+			case 0:
+				// Child.
+				exit(jiggle_manifest(sdirs, fdirs,
+					hardlinked_current, datamoved,
+					deltabdir, deltafdir,
+					&jigglers[w], w, workers, cconf)?1:0);
+			default:
+				continue;
+		}
+		break;
+	}
+
+	// Wait for everything that got started, even if there was an error.
+	for(w=0; w<workers; w++)
+	{
+		if(pids[w]<=0) continue;
+		if(waitpid(pids[w], &status, 0)<0)
+		{
+			logp("waitpid failed in %s: %s\n",
+				__func__, strerror(errno));
+			ret=-1;
+		}
+		else if(!WIFEXITED(status) || WEXITSTATUS(status))
+		{
+			logp("shuffle worker %d (pid %d) failed\n",
+				w, (int)pids[w]);
+			ret=-1;
+		}
+	}
+
+	free_v((void **)&pids);
+	return ret;
+}
+
 /* Need to make all the stuff that this does atomic so that existing backups
    never get broken, even if somebody turns the power off on the server. */ 
 static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
-	int hardlinked_current, struct conf *cconf, unsigned long bno)
+	int hardlinked_current, int datamoved,
+	struct conf *cconf, unsigned long bno)
 {
+	int w;
 	int ret=-1;
-	char *datapth=NULL;
+	int workers=1;
 	char *tmpman=NULL;
 	struct stat statp;
 
 	char *deltabdir=NULL;
 	char *deltafdir=NULL;
-	char *sigpath=NULL;
-	gzFile zp=NULL;
-	struct sbuf *sb=NULL;
-
-	FILE *delfp=NULL;
+	char *deletionsfile=NULL;
+	struct jiggler *jigglers=NULL;
 
 	logp("Doing the atomic data jiggle...\n");
 
+	if(cconf->shuffle_workers>1)
+		workers=cconf->shuffle_workers;
+	if(workers>SHUFFLE_WORKERS_MAX)
+		workers=SHUFFLE_WORKERS_MAX;
+
 	if(!(tmpman=get_tmp_filename(fdirs->manifest)))
 		goto error;
 	if(lstat(fdirs->manifest, &statp))
@@ -595,51 +949,51 @@ static int atomic_data_jiggle(struct sdirs *sdirs, struct fdirs *fdirs,
 		// already does not exist.
 		do_rename(tmpman, fdirs->manifest);
 	}
-	if(!(zp=gzopen_file(fdirs->manifest, "rb")))
-		goto error;
 
 	if(!(deltabdir=prepend_s(fdirs->currentdup, "deltas.reverse"))
 	  || !(deltafdir=prepend_s(sdirs->finishing, "deltas.forward"))
-	  || !(sigpath=prepend_s(fdirs->currentdup, "sig.tmp"))
-	  || !(sb=sbuf_alloc(cconf)))
+	  || !(jigglers=(struct jiggler *)
+		calloc_w(workers, sizeof(struct jiggler), __func__)))
 	{
 		log_out_of_memory(__func__);
 		goto error;
 	}
+	for(w=0; w<workers; w++)
+		if(jiggler_init(&jigglers[w], fdirs, deltafdir, w, workers))
+			goto error;
 
 	mkdir(fdirs->datadir, 0777);
 
-	while(1)
+	if(datamoved && move_back_deleted(fdirs, cconf))
+		goto error;
+
+	if(workers==1)
 	{
-		switch(sbufl_fill(sb, NULL, NULL, zp, cconf->cntr))
-		{
-			case 0: break;
-			case 1: goto end;
-			default: goto error;
-		}
-		if(sb->burp1->datapth.buf)
-		{
-			if(write_status(CNTR_STATUS_SHUFFLING,
-				sb->burp1->datapth.buf, cconf)
-			  || jiggle(sdirs, fdirs, sb, hardlinked_current,
-				deltabdir, deltafdir,
-				sigpath, &delfp, cconf))
-					goto error;
-		}
-		sbuf_free_content(sb);
+		if(jiggle_manifest(sdirs, fdirs, hardlinked_current, datamoved,
+			deltabdir, deltafdir, jigglers, 0, 1, cconf))
+				goto error;
 	}
-
-end:
-	if(close_fp(&delfp))
+	else if(jiggle_in_workers(sdirs, fdirs, hardlinked_current, datamoved,
+		deltabdir, deltafdir, jigglers, workers, cconf))
+			goto error;
+
+	if(maybe_delete_files_from_manifest(tmpman,
+		fdirs->deletionsfile, 0 /* already counted */, fdirs, cconf))
+			goto error;
+	// Each worker kept its own deletions file. Look for all of them, in
+	// case an interrupted run used a different number of workers.
+	for(w=0; w<SHUFFLE_WORKERS_MAX; w++)
 	{
-		logp("error closing %s in atomic_data_jiggle\n",
-			fdirs->deletionsfile);
-		goto error;
+		char suffix[16]="";
+		snprintf(suffix, sizeof(suffix), ".%d", w);
+		free_w(&deletionsfile);
+		if(!(deletionsfile=strdup_w(fdirs->deletionsfile, __func__))
+		  || astrcat(&deletionsfile, suffix, __func__)
+		  || maybe_delete_files_from_manifest(tmpman,
+			deletionsfile, 1, fdirs, cconf))
+				goto error;
 	}
 
-	if(maybe_delete_files_from_manifest(tmpman, fdirs, cconf))
-		goto error;
-
 	// Remove the temporary data directory, we have probably removed
 	// useful files from it.
 	sync(); // try to help CIFS
@@ -647,13 +1001,15 @@ end:
 
 	ret=0;
 error:
-	gzclose_fp(&zp);
-	close_fp(&delfp);
-	sbuf_free(&sb);
+	if(jigglers)
+	{
+		for(w=0; w<workers; w++)
+			jiggler_free_content(&jigglers[w]);
+		free_v((void **)&jigglers);
+	}
 	free_w(&deltabdir);
 	free_w(&deltafdir);
-	free_w(&sigpath);
-	free_w(&datapth);
+	free_w(&deletionsfile);
 	free_w(&tmpman);
 	return ret;
 }
@@ -666,6 +1022,7 @@ int backup_phase4_server_burp1(struct sdirs *sdirs, struct conf *cconf)
 	char realcurrent[256]="";
 	unsigned long bno=0;
 	int hardlinked_current=0;
+	int datamoved=0;
 	char tstmp[64]="";
 	int previous_backup=0;
 	struct fdirs *fdirs=NULL;
@@ -703,10 +1060,40 @@ int backup_phase4_server_burp1(struct sdirs *sdirs, struct conf *cconf)
 			logp(" will not generate reverse deltas\n");
 		}
 
+		// An interrupted run may have already moved the data of
+		// the previous backup into the new one.
+		if(!hardlinked_current && !lstat(fdirs->datamoved, &statp))
+			datamoved=1;
+
 		// If current was not a hardlinked_archive, need to duplicate
 		// it.
 		if(!hardlinked_current && lstat(fdirs->currentdup, &statp))
 		{
+			if(!datamoved && cconf->shuffle_changed_only)
+			{
+				// Leave a marker, so that an interrupted run
+				// knows where the previous data went.
+				FILE *mfp=NULL;
+				if(!(mfp=open_file(fdirs->datamoved, "wb")))
+					goto end;
+				if(close_fp(&mfp))
+				{
+					logp("error closing %s\n",
+						fdirs->datamoved);
+					goto end;
+				}
+				datamoved=1;
+			}
+			if(datamoved && !lstat(sdirs->currentdata, &statp))
+			{
+				// Instead of duplicating every file, move the
+				// whole data directory. Only the files that
+				// changed or were deleted get moved back.
+				logp("Moving current backup data.\n");
+				if(do_rename(sdirs->currentdata,
+					fdirs->datadir))
+						goto end;
+			}
 			// Have not duplicated the current backup yet.
 			if(!lstat(fdirs->currentduptmp, &statp))
 			{
@@ -761,7 +1148,8 @@ int backup_phase4_server_burp1(struct sdirs *sdirs, struct conf *cconf)
 	else
 		unlink(fdirs->hlinked);
 
-	if(atomic_data_jiggle(sdirs, fdirs, hardlinked_current, cconf, bno))
+	if(atomic_data_jiggle(sdirs, fdirs,
+		hardlinked_current, datamoved, cconf, bno))
 	{
 		logp("could not finish up backup.\n");
 		goto end;
@@ -784,6 +1172,11 @@ int backup_phase4_server_burp1(struct sdirs *sdirs, struct conf *cconf)
 	sync(); // try to help CIFS
 	recursive_delete(fdirs->currentdupdata, NULL, 0 /* do not del files */);
 
+	// The marker is no longer needed. If interrupted after this point,
+	// every file will be found already in place.
+	if(datamoved && unlink_w(fdirs->datamoved, __func__))
+		goto end;
+
 	// Rename the old current to something that we know to delete.
 	if(previous_backup && !hardlinked_current)
 	{
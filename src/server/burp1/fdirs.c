@@ -15,6 +15,9 @@ int fdirs_init(struct fdirs *fdirs,
 	 && (fdirs->currentdup=prepend_s(sdirs->finishing, "currentdup"))
 	 && (fdirs->currentduptmp=prepend_s(sdirs->finishing, "currentdup.tmp"))
 	 && (fdirs->currentdupdata=prepend_s(fdirs->currentdup, "data"))
+	 && (fdirs->currentdupmanifest=prepend_s(fdirs->currentdup,
+		"manifest.gz"))
+	 && (fdirs->datamoved=prepend_s(sdirs->finishing, "datamoved"))
 	 && (fdirs->timestamp=prepend_s(sdirs->finishing, "timestamp"))
 	 && (fdirs->fullrealcurrent=prepend_s(sdirs->client, realcurrent))
 	 && (fdirs->logpath=prepend_s(sdirs->finishing, "log"))
@@ -37,6 +40,8 @@ void fdirs_free(struct fdirs *fdirs)
 	free_w(&fdirs->currentdup);
 	free_w(&fdirs->currentduptmp);
 	free_w(&fdirs->currentdupdata);
+	free_w(&fdirs->currentdupmanifest);
+	free_w(&fdirs->datamoved);
 	free_w(&fdirs->timestamp);
 	free_w(&fdirs->fullrealcurrent);
 	free_w(&fdirs->logpath);
@@ -10,6 +10,8 @@ struct fdirs // Finishing directories.
 	char *currentdup;
 	char *currentduptmp;
 	char *currentdupdata;
+	char *currentdupmanifest;
+	char *datamoved;
 	char *timestamp;
 	char *fullrealcurrent;
 	char *logpath;
@@ -19,6 +19,7 @@
 #include "restore.h"
 #include "resume.h"
 #include "rubble.h"
+#include "streams.h"
 #include "zlibio.h"
 
 #endif
@@ -248,6 +248,7 @@ static int restore_file(struct asfd *asfd, struct bu *bu,
 		else
 		{
 			int patches=0;
+			int bestsgz=0;
 			struct stat dstatp;
 			const char *tmp=NULL;
 			const char *best=NULL;
@@ -277,7 +278,14 @@ static int restore_file(struct asfd *asfd, struct bu *bu,
 					continue;
 				}
 
-				if(!patches)
+				if(!patches
+				  && dpthl_is_compressed(sb->compression, best)
+				  && sgz_is_seekable(best))
+				{
+					// Seekable gzip can be patched directly.
+					bestsgz=1;
+				}
+				else if(!patches)
 				{
 					// Need to gunzip the first one.
 					if(inflate_or_link_oldfile(asfd,
@@ -294,7 +302,7 @@ static int restore_file(struct asfd *asfd, struct bu *bu,
 					else tmp=tmppath1;
 				}
 
-				if(do_patch(asfd, best, dpath, tmp,
+				if(do_patch(asfd, best, bestsgz, dpath, tmp,
 				  0 /* do not gzip the result */,
 				  sb->compression /* from the manifest */,
 				  cconf))
@@ -310,12 +318,32 @@ static int restore_file(struct asfd *asfd, struct bu *bu,
 				}
 
 				best=tmp;
+				bestsgz=0;
 				if(tmp==tmppath1) tmp=tmppath2;
 				else tmp=tmppath1;
 				unlink(tmp);
 				patches++;
 			}
 
+			// Older clients stop at the end of the first member of
+			// a seekable gzip file, so give them a plain one.
+			if(act==ACTION_RESTORE && !patches
+			  && !cconf->client_gzip_members
+			  && dpthl_is_compressed(sb->compression, best)
+			  && sgz_is_seekable(best))
+			{
+				if(inflate_or_link_oldfile(asfd, best, tmp,
+					cconf, sb->compression))
+				{
+					logp("error when inflating %s\n", best);
+					free(path);
+					return -1;
+				}
+				best=tmp;
+				// Gets compressed again during the send.
+				patches++;
+			}
+
 			if(act==ACTION_RESTORE)
 			{
 				if(send_file(asfd, sb,
@@ -1,6 +1,6 @@
 #include "include.h"
 
-static int incexc_matches(const char *fullrealwork, const char *incexc)
+int incexc_matches(const char *fullrealwork, const char *incexc)
 {
 	int ret=0;
 	int got=0;
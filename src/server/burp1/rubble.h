@@ -1,6 +1,7 @@
 #ifndef _RUBBLE_BURP1_H
 #define _RUBBLE_BURP1_H
 
+extern int incexc_matches(const char *fullrealwork, const char *incexc);
 extern int check_for_rubble_burp1(struct asfd *asfd,
 	struct sdirs *sdirs, const char *incexc,
 	int *resume, struct conf *cconf);
@@ -0,0 +1,130 @@
+#include "include.h"
+#include "../../cmd.h"
+
+// The client picks the names that files are spooled under, so make sure that
+// they stay inside the spool directory.
+int stream_name_ok(const char *name)
+{
+	return name && *name && *name!='.' && !strchr(name, '/');
+}
+
+static int stream_open(struct asfd *asfd, struct sdirs *sdirs,
+	const char *name, char **spool, char **part, FILE **fp)
+{
+	if(!stream_name_ok(name))
+	{
+		logp("bad spool name from client: %s\n", name);
+		return -1;
+	}
+	if(!(*spool=prepend_s(sdirs->streams, name))
+	  || !(*part=prepend(*spool, ".part", strlen(".part"), "")))
+		return -1;
+	if(!(*fp=open_file(*part, "wb")))
+	{
+		log_and_send(asfd, "make file failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void stream_forget(FILE **fp, char **spool, char **part)
+{
+	close_fp(fp);
+	if(*part) unlink(*part);
+	free_w(spool);
+	free_w(part);
+}
+
+// Receive whole new files on one of the extra connections that a client
+// opens during a backup. Each one is spooled, and then the main connection
+// tells the backup where it is.
+int run_stream_server(struct asfd *asfd,
+	struct sdirs *sdirs, struct conf *cconf)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *spool=NULL;
+	char *part=NULL;
+	struct stat statp;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	if(cconf->protocol!=PROTO_BURP1 || cconf->max_network_streams<1)
+	{
+		log_and_send(asfd, "extra streams are not allowed");
+		goto end;
+	}
+	// Do not just take the word of the client for it. The backup that the
+	// stream belongs to has to be running, and holding the client lock.
+	if(!lock_test(sdirs->lock->path))
+	{
+		log_and_send(asfd, "no backup is running for extra streams");
+		goto end;
+	}
+	// The backup creates the spool directory in phase2, and removes it
+	// at the end.
+	if(lstat(sdirs->streams, &statp) || !S_ISDIR(statp.st_mode))
+	{
+		log_and_send(asfd, "no backup is accepting extra streams");
+		goto end;
+	}
+	if(asfd->write_str(asfd, CMD_GEN, "stream ok"))
+		goto end;
+	logp("Receiving file data on extra stream\n");
+
+	while(1)
+	{
+		iobuf_free_content(rbuf);
+		if(asfd->read(asfd)) goto end;
+
+		switch(rbuf->cmd)
+		{
+			case CMD_DATAPTH:
+				if(fp) break;
+				if(stream_open(asfd, sdirs,
+					rbuf->buf, &spool, &part, &fp))
+						goto end;
+				continue;
+			case CMD_APPEND:
+				if(!fp) break;
+				if(fwrite(rbuf->buf, 1, rbuf->len, fp)
+					!=rbuf->len)
+				{
+					logp("error writing %s\n", part);
+					asfd->write_str(asfd,
+						CMD_ERROR, "write failed");
+					goto end;
+				}
+				continue;
+			case CMD_END_FILE:
+				if(!fp) break;
+				if(close_fp(&fp)
+				  || do_rename(part, spool))
+					goto end;
+				free_w(&spool);
+				free_w(&part);
+				// Tell the client that it is all here.
+				if(asfd->write(asfd, rbuf)) goto end;
+				continue;
+			case CMD_INTERRUPT:
+				stream_forget(&fp, &spool, &part);
+				continue;
+			case CMD_GEN:
+				if(fp || strcmp(rbuf->buf, "streamend"))
+					break;
+				if(asfd->write_str(asfd,
+					CMD_GEN, "streamend ok"))
+						goto end;
+				ret=0;
+				goto end;
+			default:
+				break;
+		}
+		iobuf_log_unexpected(rbuf, __func__);
+		goto end;
+	}
+
+end:
+	stream_forget(&fp, &spool, &part);
+	iobuf_free_content(rbuf);
+	return ret;
+}
@@ -0,0 +1,8 @@
+#ifndef _STREAMS_SERVER_BURP1_H
+#define _STREAMS_SERVER_BURP1_H
+
+extern int stream_name_ok(const char *name);
+extern int run_stream_server(struct asfd *asfd,
+	struct sdirs *sdirs, struct conf *cconf);
+
+#endif
@@ -403,7 +403,8 @@ static void get_wbuf_from_index(struct iobuf *wbuf, uint64_t index)
 static int sbuf_needs_data(struct sbuf *sb, struct asfd *asfd,
         struct asfd *chfd, struct manio *chmanio,
         struct slist *slist, struct blist *blist,
-        struct dpth *dpth, int backup_end, struct conf *conf)
+        struct dpth *dpth, struct checkpoint *cp, int backup_end,
+	struct conf *conf)
 {
 	struct blk *blk;
 	static struct iobuf *wbuf=NULL;
@@ -448,6 +449,7 @@ static int sbuf_needs_data(struct sbuf *sb, struct asfd *asfd,
 		{
 			slist->head=sb->next;
 			if(!(blist->head=sb->burp2->bstart)) blist->tail=NULL;
+			checkpoint_changed(cp, sb);
 			sanity_before_sbuf_free(slist, sb);
 			sbuf_free(&sb);
 			return 1;
@@ -470,9 +472,10 @@ error:
 }
 
 static int write_to_changed_file(struct asfd *asfd,
-	struct asfd *chfd, struct manio *chmanio,
+	struct asfd *chfd, struct manio *chmanio, struct manio *unmanio,
 	struct slist *slist, struct blist *blist,
-	struct dpth *dpth, int backup_end, struct conf *conf)
+	struct dpth *dpth, struct checkpoint *cp, int backup_end,
+	struct conf *conf)
 {
 	struct sbuf *sb;
 	if(!slist) return 0;
@@ -482,10 +485,10 @@ static int write_to_changed_file(struct asfd *asfd,
 		if(sb->flags & SBUF_NEED_DATA)
 		{
 			switch(sbuf_needs_data(sb, asfd, chfd, chmanio, slist,
-				blist, dpth, backup_end, conf))
+				blist, dpth, cp, backup_end, conf))
 			{
 				case 0: return 0;
-				case 1: continue;
+				case 1: break;
 				default: return -1;
 			}
 
@@ -498,9 +501,14 @@ static int write_to_changed_file(struct asfd *asfd,
 			// Move along.
 			slist->head=sb->next;
 
+			checkpoint_changed(cp, sb);
 			sanity_before_sbuf_free(slist, sb);
 			sbuf_free(&sb);
 		}
+
+		// Nothing is half written to the changed manifest here.
+		if(checkpoint_maybe_write(cp, chfd, chmanio, unmanio, dpth))
+			return -1;
 	}
 	return 0;
 }
@@ -517,11 +525,13 @@ static void dump_slist(struct slist *slist, const char *msg)
 
 static int maybe_add_from_scan(struct asfd *asfd,
 	struct manio *p1manio, struct manio *cmanio,
-	struct manio *unmanio, struct slist *slist, struct conf *conf)
+	struct manio *unmanio, struct slist *slist, struct checkpoint *cp,
+	struct conf *conf)
 {
 	int ret=-1;
 	static int ars;
 	static int ec=0;
+	int written=0;
 	struct sbuf *snew=NULL;
 
 	while(1)
@@ -540,9 +550,20 @@ static int maybe_add_from_scan(struct asfd *asfd,
 			asfd, snew, NULL, NULL, conf))<0) goto end;
 		else if(ars>0) return 0; // Finished.
 
-		if(!(ec=entry_changed(asfd, snew, cmanio, unmanio, conf)))
+		// On resume, skip what was finished before the interruption.
+		if(checkpoint_done(cp, snew))
+		{
+			sbuf_free(&snew);
+			continue;
+		}
+		written=checkpoint_unchanged_done(cp, snew);
+
+		if(!(ec=entry_changed(asfd, snew, cmanio,
+			written?NULL:unmanio, conf)))
 		{
 			// No change, no need to add to slist.
+			if(!written) checkpoint_unchanged(cp, snew);
+			sbuf_free(&snew);
 			continue;
 		}
 		else if(ec<0) goto end; // Error.
@@ -744,6 +765,7 @@ int backup_phase2_server_burp2(struct async *as, struct sdirs *sdirs,
 	struct manio *p1manio=NULL;	// phase1 scan manifest
 	struct manio *chmanio=NULL;	// changed manifest
 	struct manio *unmanio=NULL;	// unchanged manifest
+	struct checkpoint *cp=NULL;
 	// This is used to tell the client that a number of consecutive blocks
 	// have been found and can be freed.
 	uint64_t wrap_up=0;
@@ -766,16 +788,21 @@ int backup_phase2_server_burp2(struct async *as, struct sdirs *sdirs,
 	  || !(blist=blist_alloc())
 	  || !(wbuf=iobuf_alloc())
 	  || !(dpth=dpth_alloc(sdirs->data))
-	  || dpth_init(dpth))
+	  || dpth_init(dpth)
+	  || !(cp=checkpoint_alloc(sdirs, conf)))
 		goto end;
 
 	// The phase1 manifest looks the same as a burp1 one.
 	manio_set_protocol(p1manio, PROTO_BURP1);
 
+	if(resume && checkpoint_resume(cp, chfd, chmanio, unmanio,
+		sdirs, conf))
+			goto end;
+
 	while(!backup_end)
 	{
 		if(maybe_add_from_scan(asfd,
-			p1manio, cmanio, unmanio, slist, conf))
+			p1manio, cmanio, unmanio, slist, cp, conf))
 				goto end;
 
 		if(!wbuf->len)
@@ -820,8 +847,8 @@ int backup_phase2_server_burp2(struct async *as, struct sdirs *sdirs,
 			if(chfd->parse_readbuf(chfd)) goto end;
 		}
 
-		if(write_to_changed_file(asfd, chfd, chmanio,
-			slist, blist, dpth, backup_end, conf))
+		if(write_to_changed_file(asfd, chfd, chmanio, unmanio,
+			slist, blist, dpth, cp, backup_end, conf))
 				goto end;
 	}
 
@@ -832,8 +859,8 @@ int backup_phase2_server_burp2(struct async *as, struct sdirs *sdirs,
 	if(slist->head && slist->head->next)
 	{
 		slist->head=slist->head->next;
-		if(write_to_changed_file(asfd, chfd, chmanio,
-			slist, blist, dpth, backup_end, conf))
+		if(write_to_changed_file(asfd, chfd, chmanio, unmanio,
+			slist, blist, dpth, cp, backup_end, conf))
 				goto end;
 	}
 
@@ -857,6 +884,9 @@ int backup_phase2_server_burp2(struct async *as, struct sdirs *sdirs,
 	}
 	if(dpth_release_all(dpth)) goto end;
 
+	// Phase3 does not need the checkpoint.
+	if(checkpoint_remove(cp)) goto end;
+
 	ret=0;
 end:
 	logp("End backup\n");
@@ -873,5 +903,6 @@ end:
 	manio_free(&p1manio);
 	manio_free(&chmanio);
 	manio_free(&unmanio);
+	checkpoint_free(&cp);
 	return ret;
 }
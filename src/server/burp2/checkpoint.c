@@ -0,0 +1,460 @@
+#include "include.h"
+#include "../../cmd.h"
+
+// The checkpoint file is a list of 'key=value' messages, in the same format
+// as the manifests, so that paths with odd characters in them survive.
+
+struct checkpoint *checkpoint_alloc(struct sdirs *sdirs, struct conf *conf)
+{
+	struct checkpoint *cp;
+	if(!(cp=(struct checkpoint *)
+		calloc_w(1, sizeof(struct checkpoint), __func__)))
+			return NULL;
+	if(!(cp->path=prepend_s(sdirs->working, "checkpoint"))
+	  || !(cp->champlock=strdup_w(sdirs->champlock, __func__)))
+	{
+		checkpoint_free(&cp);
+		return NULL;
+	}
+	if(conf->checkpoint_interval>0)
+		cp->interval=conf->checkpoint_interval;
+	cp->last=time(NULL);
+	return cp;
+}
+
+void checkpoint_free(struct checkpoint **cp)
+{
+	if(!cp || !*cp) return;
+	free_w(&(*cp)->path);
+	free_w(&(*cp)->champlock);
+	free_w(&(*cp)->changed_path);
+	free_w(&(*cp)->unchanged_path);
+	free_w(&(*cp)->resume_changed_path);
+	free_w(&(*cp)->resume_unchanged_path);
+	free_v((void **)cp);
+}
+
+// Takes the path from an entry that has been completely written to the
+// changed manifest. The entry is about to be freed anyway.
+void checkpoint_changed(struct checkpoint *cp, struct sbuf *sb)
+{
+	if(!cp->interval) return;
+	free_w(&cp->changed_path);
+	cp->changed_path=sb->path.buf;
+	sb->path.buf=NULL;
+}
+
+void checkpoint_unchanged(struct checkpoint *cp, struct sbuf *sb)
+{
+	if(!cp->interval) return;
+	free_w(&cp->unchanged_path);
+	cp->unchanged_path=sb->path.buf;
+	sb->path.buf=NULL;
+}
+
+// Returns 1 if the interrupted backup had already finished with the entry
+// from the phase1 scan.
+int checkpoint_done(struct checkpoint *cp, struct sbuf *sb)
+{
+	return cp->resume_changed_path
+	  && pathcmp(sb->path.buf, cp->resume_changed_path)<=0;
+}
+
+// Returns 1 if the interrupted backup had already written the entry to the
+// unchanged manifest.
+int checkpoint_unchanged_done(struct checkpoint *cp, struct sbuf *sb)
+{
+	return cp->resume_unchanged_path
+	  && pathcmp(sb->path.buf, cp->resume_unchanged_path)<=0;
+}
+
+static int write_str(FILE *fp, const char *key, const char *value)
+{
+	int ret;
+	char *msg;
+	if(!(msg=prepend(key, value, strlen(value), "=")))
+		return -1;
+	ret=send_msg_fp(fp, CMD_GEN, msg, strlen(msg));
+	free_w(&msg);
+	return ret;
+}
+
+static int write_num(FILE *fp, const char *key, uint64_t value)
+{
+	char tmp[32]="";
+	snprintf(tmp, sizeof(tmp), "%"PRIu64, value);
+	return write_str(fp, key, tmp);
+}
+
+// Closes the manifest component that is being written, so that everything
+// up to here is on disk. A closed changed component is also a new dedup
+// candidate, in the same way as when it fills up by itself.
+static int close_component(struct manio *manio, struct asfd *chfd)
+{
+	struct iobuf wbuf;
+	if(!manio->zp) return 0;
+	if(manio_close(manio)) return -1;
+	manio->sig_count=0;
+	if(!chfd) return 0;
+	iobuf_from_str(&wbuf, CMD_MANIFEST, manio->fpath);
+	return chfd->write(chfd, &wbuf);
+}
+
+// Which champ chooser process is running, from its lock file. The pid is
+// not enough on its own, because it might get used again.
+static char *champ_id(const char *champlock)
+{
+	FILE *fp;
+	char buf[32]="";
+	char id[64]="";
+	struct stat statp;
+	if(lstat(champlock, &statp)
+	  || !(fp=fopen(champlock, "rb")))
+		return NULL;
+	if(!fgets(buf, sizeof(buf), fp)) *buf='\0';
+	fclose(fp);
+	buf[strcspn(buf, "\r\n")]='\0';
+	if(!*buf) return NULL;
+	snprintf(id, sizeof(id), "%s:%ld", buf, (long)statp.st_mtime);
+	return strdup_w(id, __func__);
+}
+
+static int checkpoint_write(struct checkpoint *cp, struct asfd *chfd,
+	struct manio *chmanio, struct manio *unmanio, struct dpth *dpth)
+{
+	int ret=-1;
+	FILE *fp=NULL;
+	char *tmp=NULL;
+	char *champ=NULL;
+	struct dpth_lock *l;
+
+	if(close_component(chmanio, chfd)
+	  || close_component(unmanio, NULL))
+		goto end;
+
+	// The blocks in the closed components have to be on disk.
+	if(dpth->fp && fflush(dpth->fp))
+	{
+		logp("Could not flush data file %s: %s\n",
+			dpth->head->save_path, strerror(errno));
+		goto end;
+	}
+
+	if(!(tmp=get_tmp_filename(cp->path))
+	  || !(fp=open_file(tmp, "wb")))
+		goto end;
+	if(write_num(fp, "changed", chmanio->fcount)
+	  || write_num(fp, "unchanged", unmanio->fcount)
+	  || write_str(fp, "changed_path", cp->changed_path)
+	  || (cp->unchanged_path
+		&& write_str(fp, "unchanged_path", cp->unchanged_path)))
+			goto end;
+	if((champ=champ_id(cp->champlock))
+	  && write_str(fp, "champ", champ))
+		goto end;
+	for(l=dpth->head; l; l=l->next)
+		if(write_str(fp, "lock", l->save_path))
+			goto end;
+	if(close_fp(&fp)
+	  || do_rename(tmp, cp->path))
+		goto end;
+
+	ret=0;
+end:
+	if(ret) logp("Could not write checkpoint %s\n", cp->path);
+	close_fp(&fp);
+	free_w(&tmp);
+	free_w(&champ);
+	return ret;
+}
+
+int checkpoint_maybe_write(struct checkpoint *cp, struct asfd *chfd,
+	struct manio *chmanio, struct manio *unmanio, struct dpth *dpth)
+{
+	time_t now;
+	if(!cp->interval || !cp->changed_path) return 0;
+	now=time(NULL);
+	if(now-cp->last<cp->interval) return 0;
+	cp->last=now;
+	return checkpoint_write(cp, chfd, chmanio, unmanio, dpth);
+}
+
+// Return 0 for OK, -1 for error, 1 for the end of the file.
+static int read_msg(FILE *fp, char **buf)
+{
+	char head[6]="";
+	unsigned int len=0;
+	if(fread(head, 1, 5, fp)!=5) return 1;
+	if(sscanf(head+1, "%04X", &len)!=1
+	  || head[0]!=CMD_GEN
+	  || !(*buf=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	if(fread(*buf, 1, len, fp)!=len
+	  || fgetc(fp)!='\n')
+	{
+		free_w(buf);
+		return -1;
+	}
+	(*buf)[len]='\0';
+	return 0;
+}
+
+static int component_exists(const char *dir, uint64_t n)
+{
+	int ret;
+	char *path=NULL;
+	char comp[32]="";
+	struct stat statp;
+	snprintf(comp, sizeof(comp), "%08"PRIX64, n);
+	if(!(path=prepend_s(dir, comp))) return -1;
+	ret=!lstat(path, &statp);
+	free_w(&path);
+	return ret;
+}
+
+// The changed manifest components that were finished after the checkpoint
+// have already gone to the champ chooser, which is shared with the rest of
+// the dedup group. So it may load them whenever it likes, and other
+// backups may already be using the blocks that they point to. They are
+// left in place, but emptied, so that their entries do not turn up in
+// this backup twice. Returns the number after the last one, which is where
+// the resumed backup carries on.
+static int empty_components(const char *dir, uint64_t from, uint64_t *next)
+{
+	int r;
+	char *path=NULL;
+	char *tmp=NULL;
+	char comp[32]="";
+	gzFile zp=NULL;
+
+	for(*next=from; (r=component_exists(dir, *next))>0; (*next)++)
+	{
+		snprintf(comp, sizeof(comp), "%08"PRIX64, *next);
+		// Renamed over, so anything reading it carries on with the
+		// old one.
+		if(!(path=prepend_s(dir, comp))
+		  || !(tmp=get_tmp_filename(path))
+		  || !(zp=gzopen_file(tmp, "wb"))
+		  || gzclose_fp(&zp)
+		  || do_rename(tmp, path))
+			r=-1;
+		free_w(&path);
+		free_w(&tmp);
+		if(r<0) break;
+	}
+	return r<0?-1:0;
+}
+
+// Gets rid of manifest components that were written after the checkpoint.
+static int remove_components(const char *dir, uint64_t from)
+{
+	char *path=NULL;
+	char comp[32]="";
+	for(; ; from++)
+	{
+		snprintf(comp, sizeof(comp), "%08"PRIX64, from);
+		if(!(path=prepend_s(dir, comp))) return -1;
+		if(unlink(path))
+		{
+			if(errno!=ENOENT)
+			{
+				logp("Could not unlink %s: %s\n",
+					path, strerror(errno));
+				free_w(&path);
+				return -1;
+			}
+			free_w(&path);
+			return 0;
+		}
+		free_w(&path);
+	}
+}
+
+// Tells the champ chooser about the changed manifest components that were
+// finished before the interruption, so that they can be deduplicated
+// against again. Only needed if it has been restarted since, otherwise it
+// has them already.
+static int add_candidates(struct asfd *chfd, const char *dir, uint64_t count,
+	const char *champlock, const char *champ)
+{
+	uint64_t i;
+	char *path=NULL;
+	char comp[32]="";
+	struct iobuf wbuf;
+	char *now=NULL;
+
+	if(champ && (now=champ_id(champlock)) && !strcmp(now, champ))
+	{
+		logp("Champ chooser still has the candidates\n");
+		free_w(&now);
+		return 0;
+	}
+	free_w(&now);
+	for(i=0; i<count; i++)
+	{
+		snprintf(comp, sizeof(comp), "%08"PRIX64, i);
+		if(!(path=prepend_s(dir, comp))) return -1;
+		iobuf_from_str(&wbuf, CMD_MANIFEST, path);
+		if(chfd->write(chfd, &wbuf))
+		{
+			free_w(&path);
+			return -1;
+		}
+		free_w(&path);
+	}
+	return 0;
+}
+
+static int remove_stale_lock(struct sdirs *sdirs, const char *save_path)
+{
+	char *p=NULL;
+	char *lockfile=NULL;
+	if(!(p=prepend_slash(sdirs->data, save_path, strlen(save_path)))
+	  || !(lockfile=prepend(p, ".lock", strlen(".lock"), "")))
+	{
+		free_w(&p);
+		return -1;
+	}
+	// Leave it alone if somebody else has got it now.
+	if(!lock_test(lockfile)) unlink(lockfile);
+	free_w(&p);
+	free_w(&lockfile);
+	return 0;
+}
+
+// The phase1 counters are normally set up during phase1, which does not get
+// run again on resume.
+static int read_phase1(struct sdirs *sdirs, struct conf *conf)
+{
+	int ars;
+	int ret=-1;
+	struct sbuf *sb=NULL;
+	struct manio *p1manio=NULL;
+
+	if(!(p1manio=manio_alloc())
+	  || manio_init_read(p1manio, sdirs->phase1data)
+	  || !(sb=sbuf_alloc(conf)))
+		goto end;
+	manio_set_protocol(p1manio, PROTO_BURP1);
+
+	while(!(ars=manio_sbuf_fill(p1manio, NULL, sb, NULL, NULL, conf)))
+	{
+		cntr_add_phase1(conf->cntr, sb->path.cmd, 0);
+		if(sb->path.cmd==CMD_FILE
+		  || sb->path.cmd==CMD_ENC_FILE
+		  || sb->path.cmd==CMD_METADATA
+		  || sb->path.cmd==CMD_ENC_METADATA
+		  || sb->path.cmd==CMD_EFS_FILE)
+			cntr_add_val(conf->cntr, CMD_BYTES_ESTIMATED,
+				(unsigned long long)sb->statp.st_size, 0);
+		sbuf_free_content(sb);
+	}
+	if(ars>0) ret=0;
+end:
+	sbuf_free(&sb);
+	manio_free(&p1manio);
+	return ret;
+}
+
+int checkpoint_resume(struct checkpoint *cp, struct asfd *chfd,
+	struct manio *chmanio, struct manio *unmanio,
+	struct sdirs *sdirs, struct conf *conf)
+{
+	int r;
+	int ret=-1;
+	FILE *fp=NULL;
+	char *buf=NULL;
+	char *value=NULL;
+	char *champ=NULL;
+	uint64_t changed=0;
+	uint64_t unchanged=0;
+	uint64_t next=0;
+
+	logp("Resuming from checkpoint %s\n", cp->path);
+	if(!(fp=open_file(cp->path, "rb")))
+		goto end;
+	while(!(r=read_msg(fp, &buf)))
+	{
+		if(!(value=strchr(buf, '=')))
+		{
+			logp("Bad line in %s: %s\n", cp->path, buf);
+			goto end;
+		}
+		*value++='\0';
+		if(!strcmp(buf, "changed"))
+			changed=strtoull(value, NULL, 10);
+		else if(!strcmp(buf, "unchanged"))
+			unchanged=strtoull(value, NULL, 10);
+		else if(!strcmp(buf, "changed_path"))
+		{
+			free_w(&cp->resume_changed_path);
+			if(!(cp->resume_changed_path=strdup_w(value, __func__)))
+				goto end;
+		}
+		else if(!strcmp(buf, "unchanged_path"))
+		{
+			free_w(&cp->resume_unchanged_path);
+			if(!(cp->resume_unchanged_path
+				=strdup_w(value, __func__)))
+					goto end;
+		}
+		else if(!strcmp(buf, "champ"))
+		{
+			free_w(&champ);
+			if(!(champ=strdup_w(value, __func__)))
+				goto end;
+		}
+		else if(!strcmp(buf, "lock"))
+		{
+			if(remove_stale_lock(sdirs, value))
+				goto end;
+		}
+		free_w(&buf);
+	}
+	if(r<0 || !cp->resume_changed_path)
+	{
+		logp("Could not read checkpoint %s\n", cp->path);
+		goto end;
+	}
+
+	// Anything written to the data files after the checkpoint is left
+	// there. Other backups may be using it, and new blocks go in a new
+	// data file anyway.
+	if(empty_components(sdirs->changed, changed, &next)
+	  || remove_components(sdirs->unchanged, unchanged))
+		goto end;
+	chmanio->fcount=next;
+	unmanio->fcount=unchanged;
+
+	if(add_candidates(chfd, sdirs->changed, changed,
+		cp->champlock, champ))
+			goto end;
+
+	// Until there is more progress, the next checkpoint is this one.
+	if(!(cp->changed_path=strdup_w(cp->resume_changed_path, __func__))
+	  || (cp->resume_unchanged_path
+		&& !(cp->unchanged_path
+			=strdup_w(cp->resume_unchanged_path, __func__))))
+				goto end;
+
+	logp("  changed:   %s\n", cp->resume_changed_path);
+	logp("  unchanged: %s\n", cp->resume_unchanged_path?
+		cp->resume_unchanged_path:"");
+
+	if(read_phase1(sdirs, conf)) goto end;
+	if(conf->send_client_cntr && cntr_send(conf->cntr)) goto end;
+
+	ret=0;
+end:
+	close_fp(&fp);
+	free_w(&buf);
+	free_w(&champ);
+	return ret;
+}
+
+int checkpoint_remove(struct checkpoint *cp)
+{
+	struct stat statp;
+	if(lstat(cp->path, &statp)) return 0;
+	return unlink_w(cp->path, __func__);
+}
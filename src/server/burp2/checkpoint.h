@@ -0,0 +1,37 @@
+#ifndef _CHECKPOINT_BURP2_H
+#define _CHECKPOINT_BURP2_H
+
+// Every so often during phase2, the changed and unchanged manifests are
+// closed at an entry boundary and the positions are written down, so that an
+// interrupted backup can carry on from there instead of starting again.
+struct checkpoint
+{
+	char *path;
+	char *champlock;
+	int interval;
+	time_t last;
+	// The last entries written to the changed and unchanged manifests.
+	char *changed_path;
+	char *unchanged_path;
+	// Where the interrupted backup had got to, when resuming.
+	char *resume_changed_path;
+	char *resume_unchanged_path;
+};
+
+extern struct checkpoint *checkpoint_alloc(struct sdirs *sdirs,
+	struct conf *conf);
+extern void checkpoint_free(struct checkpoint **cp);
+
+extern void checkpoint_changed(struct checkpoint *cp, struct sbuf *sb);
+extern void checkpoint_unchanged(struct checkpoint *cp, struct sbuf *sb);
+extern int checkpoint_done(struct checkpoint *cp, struct sbuf *sb);
+extern int checkpoint_unchanged_done(struct checkpoint *cp, struct sbuf *sb);
+
+extern int checkpoint_maybe_write(struct checkpoint *cp, struct asfd *chfd,
+	struct manio *chmanio, struct manio *unmanio, struct dpth *dpth);
+extern int checkpoint_resume(struct checkpoint *cp, struct asfd *chfd,
+	struct manio *chmanio, struct manio *unmanio,
+	struct sdirs *sdirs, struct conf *conf);
+extern int checkpoint_remove(struct checkpoint *cp);
+
+#endif
@@ -0,0 +1,267 @@
+#include "include.h"
+
+// How many directories to keep in memory. When there are more than this,
+// the bottom half of them get moved to the file.
+#define DIRSTACK_MEM	256
+
+// Each directory in the file is one of these, then the attr, path and link,
+// then the length and data of each of its blocks. Last comes the length of
+// all that, so that the stack can be popped from the end of the file.
+struct dirstack_hdr
+{
+	uint32_t attr_len;
+	uint32_t path_len;
+	uint32_t link_len;
+	uint32_t blks;
+	uint8_t attr_cmd;
+	uint8_t path_cmd;
+	uint8_t link_cmd;
+};
+
+struct dirstack *dirstack_alloc(const char *path, enum protocol protocol)
+{
+	struct dirstack *ds;
+	if(!(ds=(struct dirstack *)
+		calloc_w(1, sizeof(struct dirstack), __func__)))
+			return NULL;
+	if(!(ds->path=strdup_w(path, __func__)))
+	{
+		free_v((void **)&ds);
+		return NULL;
+	}
+	ds->protocol=protocol;
+	return ds;
+}
+
+static void dir_free(struct sbuf **sb)
+{
+	struct blk *b;
+	struct blk *n;
+	if((*sb)->burp2)
+	{
+		for(b=(*sb)->burp2->bstart; b; b=n)
+		{
+			n=b->next;
+			blk_free(&b);
+		}
+		(*sb)->burp2->bstart=(*sb)->burp2->bend=NULL;
+	}
+	sbuf_free(sb);
+}
+
+void dirstack_free(struct dirstack **ds)
+{
+	struct sbuf *sb;
+	if(!ds || !*ds) return;
+	while((sb=(*ds)->top))
+	{
+		(*ds)->top=sb->next;
+		dir_free(&sb);
+	}
+	if((*ds)->fp)
+	{
+		close_fp(&(*ds)->fp);
+		unlink((*ds)->path);
+	}
+	if((*ds)->spills)
+		logp("Directories were moved to disk %"PRIu64 " times\n",
+			(*ds)->spills);
+	free_w(&(*ds)->path);
+	free_v((void **)ds);
+}
+
+static int fp_write(FILE *fp, const void *buf, size_t len)
+{
+	return len && fwrite(buf, len, 1, fp)!=1;
+}
+
+static int fp_read(FILE *fp, void *buf, size_t len)
+{
+	return len && fread(buf, len, 1, fp)!=1;
+}
+
+static int write_dir(struct dirstack *ds, struct sbuf *sb)
+{
+	struct blk *b;
+	uint64_t reclen;
+	struct dirstack_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.attr_cmd=sb->attr.cmd;
+	hdr.attr_len=sb->attr.len;
+	hdr.path_cmd=sb->path.cmd;
+	hdr.path_len=sb->path.len;
+	hdr.link_cmd=sb->link.cmd;
+	hdr.link_len=sb->link.len;
+	for(b=sb->burp2->bstart; b; b=b->next) hdr.blks++;
+
+	if(fp_write(ds->fp, &hdr, sizeof(hdr))
+	  || fp_write(ds->fp, sb->attr.buf, hdr.attr_len)
+	  || fp_write(ds->fp, sb->path.buf, hdr.path_len)
+	  || fp_write(ds->fp, sb->link.buf, hdr.link_len))
+		return -1;
+	reclen=sizeof(hdr)+hdr.attr_len+hdr.path_len+hdr.link_len;
+
+	for(b=sb->burp2->bstart; b; b=b->next)
+	{
+		if(fp_write(ds->fp, &b->length, sizeof(b->length))
+		  || fp_write(ds->fp, b->data, b->length))
+			return -1;
+		reclen+=sizeof(b->length)+b->length;
+	}
+
+	if(fp_write(ds->fp, &reclen, sizeof(reclen)))
+		return -1;
+	ds->len+=reclen+sizeof(reclen);
+	ds->spilled++;
+	return 0;
+}
+
+// Moves the bottom half of the directories in memory to the end of the file.
+static int spill(struct dirstack *ds)
+{
+	int i;
+	struct sbuf *sb;
+	struct sbuf *rest;
+	struct sbuf *bottom=NULL;
+
+	for(i=1, sb=ds->top; i<DIRSTACK_MEM/2; i++) sb=sb->next;
+	rest=sb->next;
+	sb->next=NULL;
+
+	// The file has the bottom of the stack first, so turn them around.
+	while(rest)
+	{
+		sb=rest;
+		rest=rest->next;
+		sb->next=bottom;
+		bottom=sb;
+	}
+
+	if(!ds->fp && !(ds->fp=open_file(ds->path, "w+b")))
+		goto error;
+	if(fseeko(ds->fp, ds->len, SEEK_SET))
+		goto error_write;
+	while((sb=bottom))
+	{
+		if(write_dir(ds, sb))
+			goto error_write;
+		bottom=sb->next;
+		dir_free(&sb);
+		ds->count--;
+	}
+	if(fflush(ds->fp))
+		goto error_write;
+	ds->spills++;
+	return 0;
+error_write:
+	logp("Could not write directories to %s\n", ds->path);
+error:
+	while((sb=bottom))
+	{
+		bottom=sb->next;
+		dir_free(&sb);
+	}
+	return -1;
+}
+
+static int read_iobuf(FILE *fp, struct iobuf *iobuf, uint8_t cmd, uint32_t len)
+{
+	char *buf=NULL;
+	if(len)
+	{
+		if(!(buf=(char *)malloc_w(len+1, __func__)))
+			return -1;
+		if(fp_read(fp, buf, len))
+		{
+			free_w(&buf);
+			return -1;
+		}
+		buf[len]='\0';
+	}
+	iobuf_set(iobuf, (enum cmd)cmd, buf, len);
+	return 0;
+}
+
+// Moves the directory at the end of the file back into memory. The file is
+// not made shorter, the next spill just writes over what was there.
+static int read_dir(struct dirstack *ds)
+{
+	uint32_t i;
+	uint32_t len;
+	off_t start;
+	uint64_t reclen;
+	struct blk *b;
+	struct sbuf *sb=NULL;
+	struct dirstack_hdr hdr;
+
+	if(fseeko(ds->fp, ds->len-(off_t)sizeof(reclen), SEEK_SET)
+	  || fp_read(ds->fp, &reclen, sizeof(reclen)))
+		goto error;
+	start=ds->len-(off_t)sizeof(reclen)-(off_t)reclen;
+	if(fseeko(ds->fp, start, SEEK_SET)
+	  || fp_read(ds->fp, &hdr, sizeof(hdr)))
+		goto error;
+
+	if(!(sb=sbuf_alloc_protocol(ds->protocol)))
+		goto error;
+	if(read_iobuf(ds->fp, &sb->attr, hdr.attr_cmd, hdr.attr_len)
+	  || read_iobuf(ds->fp, &sb->path, hdr.path_cmd, hdr.path_len)
+	  || read_iobuf(ds->fp, &sb->link, hdr.link_cmd, hdr.link_len))
+		goto error;
+
+	for(i=0; i<hdr.blks; i++)
+	{
+		if(fp_read(ds->fp, &len, sizeof(len))
+		  || !(b=blk_alloc_with_data(len)))
+			goto error;
+		b->length=len;
+		if(!sb->burp2->bstart)
+			sb->burp2->bstart=sb->burp2->bend=b;
+		else
+		{
+			sb->burp2->bend->next=b;
+			sb->burp2->bend=b;
+		}
+		if(fp_read(ds->fp, b->data, len))
+			goto error;
+	}
+
+	ds->len=start;
+	ds->spilled--;
+	sb->next=ds->top;
+	ds->top=sb;
+	ds->count++;
+	return 0;
+error:
+	logp("Could not read directory back from %s\n", ds->path);
+	if(sb) dir_free(&sb);
+	return -1;
+}
+
+int dirstack_push(struct dirstack *ds, struct sbuf *sb)
+{
+	sb->next=ds->top;
+	ds->top=sb;
+	if(++ds->count>DIRSTACK_MEM)
+		return spill(ds);
+	return 0;
+}
+
+// Sets sb to the top of the stack, or NULL if the stack is empty.
+int dirstack_top(struct dirstack *ds, struct sbuf **sb)
+{
+	if(!ds->top && ds->spilled && read_dir(ds))
+		return -1;
+	*sb=ds->top;
+	return 0;
+}
+
+void dirstack_pop(struct dirstack *ds)
+{
+	struct sbuf *sb;
+	if(!(sb=ds->top)) return;
+	ds->top=sb->next;
+	ds->count--;
+	dir_free(&sb);
+}
@@ -0,0 +1,27 @@
+#ifndef _DIRSTACK_H
+#define _DIRSTACK_H
+
+// Directories that are waiting to be restored until everything in them has
+// been, so that their permissions and times come out right. Only the top of
+// the stack is kept in memory. The rest goes to a file, so that the memory
+// used stays the same however deep the tree is.
+struct dirstack
+{
+	struct sbuf *top; // The top of the stack first.
+	int count; // How many are in memory.
+	FILE *fp; // The rest, the bottom of the stack first.
+	char *path;
+	off_t len;
+	uint64_t spilled; // How many are in the file.
+	uint64_t spills;
+	enum protocol protocol;
+};
+
+extern struct dirstack *dirstack_alloc(const char *path,
+	enum protocol protocol);
+extern void dirstack_free(struct dirstack **ds);
+extern int dirstack_push(struct dirstack *ds, struct sbuf *sb);
+extern int dirstack_top(struct dirstack *ds, struct sbuf **sb);
+extern void dirstack_pop(struct dirstack *ds);
+
+#endif
@@ -5,6 +5,8 @@
 
 #include "backup_phase2.h"
 #include "backup_phase3.h"
+#include "checkpoint.h"
+#include "dirstack.h"
 #include "dpth.h"
 #include "rblk.h"
 #include "restore.h"
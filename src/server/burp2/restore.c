@@ -1,7 +1,6 @@
 #include "include.h"
 #include "../../cmd.h"
 #include "champ_chooser/hash.h"
-#include "../../burp2/slist.h"
 #include "../../server/burp1/restore.h"
 #include "../manio.h"
 #include "../sdirs.h"
@@ -54,7 +53,7 @@ static int restore_sbuf(struct asfd *asfd, struct sbuf *sb, enum action act,
 
 static int restore_ent(struct asfd *asfd,
 	struct sbuf **sb,
-	struct slist *slist,
+	struct dirstack *dirs,
 	enum action act,
 	enum cntr_status cntr_status,
 	struct conf *conf,
@@ -72,9 +71,10 @@ static int restore_ent(struct asfd *asfd,
 	//printf("want to restore: %s\n", (*sb)->path.buf);
 
 	// Check if we have any directories waiting to be restored.
-	while((xb=slist->head))
+	while(1)
 	{
-		if(is_subdir(xb->path.buf, (*sb)->path.buf))
+		if(dirstack_top(dirs, &xb)) goto end;
+		if(!xb || is_subdir(xb->path.buf, (*sb)->path.buf))
 		{
 			// We are still in a subdir.
 			break;
@@ -86,8 +86,7 @@ static int restore_ent(struct asfd *asfd,
 			// fiddling in a subdirectory.
 			if(restore_sbuf(asfd, xb, act, cntr_status,
 				conf, need_data)) goto end;
-			slist->head=xb->next;
-			sbuf_free(&xb);
+			dirstack_pop(dirs);
 		}
 	}
 
@@ -100,9 +99,13 @@ static int restore_ent(struct asfd *asfd,
 	// that goes with directories.
 	if(S_ISDIR((*sb)->statp.st_mode))
 	{
-		// Add to the head of the list instead of the tail.
-		(*sb)->next=slist->head;
-		slist->head=*sb;
+		// Only the innermost directories are kept in memory, so
+		// deep trees do not use up more of it.
+		if(dirstack_push(dirs, *sb))
+		{
+			*sb=NULL;
+			goto end;
+		}
 
 		*last_ent_was_dir=1;
 
@@ -121,18 +124,20 @@ end:
 }
 
 static int restore_remaining_dirs(struct asfd *asfd,
-	struct slist *slist, enum action act,
+	struct dirstack *dirs, enum action act,
 	enum cntr_status cntr_status, struct conf *conf, int *need_data)
 {
 	struct sbuf *sb;
-	// Restore any directories that are left in the list.
-	for(sb=slist->head; sb; sb=sb->next)
+	// Restore any directories that are left on the stack.
+	while(1)
 	{
+		if(dirstack_top(dirs, &sb)) return -1;
+		if(!sb) return 0;
 //printf("remaining dir: %s\n", sb->path.buf);
 		if(restore_sbuf(asfd, sb, act, cntr_status, conf, need_data))
 			return -1;
+		dirstack_pop(dirs);
 	}
-	return 0;
 }
 
 /* This function reads the manifest to determine whether it may be more
@@ -142,7 +147,7 @@ static int restore_remaining_dirs(struct asfd *asfd,
 static int maybe_copy_data_files_across(struct asfd *asfd,
 	const char *manifest,
 	const char *datadir, int srestore, regex_t *regex, struct conf *conf,
-	struct slist *slist,
+	struct dirstack *dirs,
 	enum action act, enum cntr_status cntr_status)
 {
 	int ars;
@@ -296,7 +301,7 @@ static int maybe_copy_data_files_across(struct asfd *asfd,
 		if((!srestore || check_srestore(conf, sb->path.buf))
 		  && check_regex(regex, sb->path.buf))
 		{
-			if(restore_ent(asfd, &sb, slist, act,
+			if(restore_ent(asfd, &sb, dirs, act,
 				cntr_status, conf,
 				&need_data, &last_ent_was_dir))
 					goto end;
@@ -315,7 +320,7 @@ end:
 }
 
 static int restore_stream(struct asfd *asfd,
-	const char *datadir, struct slist *slist,
+	const char *datadir, struct dirstack *dirs,
 	struct bu *bu, const char *manifest, regex_t *regex,
 	int srestore, struct conf *conf, enum action act,
 	enum cntr_status cntr_status)
@@ -406,7 +411,7 @@ static int restore_stream(struct asfd *asfd,
 					goto end;
 				nblk->length=blk->length;
 				memcpy(nblk->data, blk->data, blk->length);
-				xb=slist->head;
+				xb=dirs->top;
 				if(!xb->burp2->bstart)
 					xb->burp2->bstart=xb->burp2->bend=nblk;
 				else
@@ -437,7 +442,7 @@ static int restore_stream(struct asfd *asfd,
 		if((!srestore || check_srestore(conf, sb->path.buf))
 		  && check_regex(regex, sb->path.buf))
 		{
-			if(restore_ent(asfd, &sb, slist, act,
+			if(restore_ent(asfd, &sb, dirs, act,
 				cntr_status, conf,
 				&need_data, &last_ent_was_dir))
 					goto end;
@@ -465,21 +470,33 @@ int restore_burp2(struct asfd *asfd, struct bu *bu, const char *manifest,
 	// timestamps come out right:
 	// FIX THIS!
 //	int scount=0;
-	struct slist *slist=NULL;
+	struct dirstack *dirs=NULL;
 	int ret=-1;
 	int ars=0;
 	int need_data=0;
+	char *path=NULL;
+	char tmp[32]="";
 
-	if(!(slist=slist_alloc()))
+	// The client is locked, so anything already in here was left by a
+	// restore that did not finish.
+	if(recursive_delete(sdirs->restoretmp, NULL, 1)
+	  || mkdir(sdirs->restoretmp, 0777))
+	{
+		logp("could not create %s\n", sdirs->restoretmp);
+		goto end;
+	}
+	snprintf(tmp, sizeof(tmp), "restore_dirs.%d", (int)getpid());
+	if(!(path=prepend_s(sdirs->restoretmp, tmp))
+	  || !(dirs=dirstack_alloc(path, conf->protocol)))
 		goto end;
 
 	if(!(ars=maybe_copy_data_files_across(asfd, manifest, sdirs->data,
 		srestore, regex, conf,
-		slist, act, cntr_status)))
+		dirs, act, cntr_status)))
 	{
 		// Instead of copying all the blocks across, do it as a stream,
 		// in the style of burp-1.x.x.
-		if(restore_stream(asfd, sdirs->data, slist,
+		if(restore_stream(asfd, sdirs->data, dirs,
 			bu, manifest, regex,
 			srestore, conf, act, cntr_status)) 
 				goto end;
@@ -489,7 +506,7 @@ int restore_burp2(struct asfd *asfd, struct bu *bu, const char *manifest,
 	// Restore has nearly completed OK.
 
 	if(restore_remaining_dirs(asfd,
-		slist, act, cntr_status, conf, &need_data))
+		dirs, act, cntr_status, conf, &need_data))
 			goto end;
 
 	ret=restore_end(asfd, conf);
@@ -499,6 +516,8 @@ int restore_burp2(struct asfd *asfd, struct bu *bu, const char *manifest,
 
 	ret=0;
 end:
-	slist_free(&slist);
+	dirstack_free(&dirs);
+	free_w(&path);
+	recursive_delete(sdirs->restoretmp, NULL, 1);
 	return ret;
 }
@@ -1,9 +1,50 @@
 #include "include.h"
+#include "../burp1/rubble.h"
+
+// Return 1 if the interrupted backup can be carried on from its last
+// checkpoint, 0 if it cannot, -1 on error.
+static int can_resume(struct asfd *asfd, const char *real,
+	const char *incexc, struct conf *cconf)
+{
+	int ret=0;
+	struct stat statp;
+	char *checkpoint=NULL;
+
+	if(strcmp(cconf->recovery_method, "resume"))
+		return 0;
+	if(cconf->restore_client)
+	{
+		// This client is not the original client, resuming might cause
+		// all sorts of trouble.
+		log_and_send(asfd, "Found interrupted backup - not resuming because the connected client is not the original");
+		return -1;
+	}
+	if(!(checkpoint=prepend_s(real, "checkpoint")))
+		return -1;
+	if(lstat(checkpoint, &statp))
+	{
+		logp("Interrupted backup has no checkpoint to resume from.\n");
+		goto end;
+	}
+	switch((ret=incexc_matches(real, incexc)))
+	{
+		case 1:
+			logp("Will resume on the next backup request.\n");
+			break;
+		case 0:
+			logp("Includes/excludes changed since last backup.\n");
+			break;
+	}
+end:
+	free_w(&checkpoint);
+	return ret;
+}
 
 int check_for_rubble_burp2(struct asfd *asfd, struct sdirs *sdirs,
 	const char *incexc, int *resume, struct conf *cconf)
 {
-	// FIX THIS - currently just deletes the interrupted backup.
+	// FIX THIS - 'use' is not supported, so it deletes the interrupted
+	// backup unless it can be resumed.
 	ssize_t len=0;
 	char *real=NULL;
 	char lnk[32]="";
@@ -20,14 +61,30 @@ int check_for_rubble_burp2(struct asfd *asfd, struct sdirs *sdirs,
 		log_and_send_oom(asfd, __func__);
 		return -1;
 	}
+	logp("Found interrupted backup: %s\n", real);
+	switch(can_resume(asfd, real, incexc, cconf))
+	{
+		case 1:
+			*resume=1;
+			free_w(&real);
+			return 0;
+		case 0:
+			break;
+		default:
+			free_w(&real);
+			return -1;
+	}
+	logp("Deleting interrupted backup.\n");
 	if(recursive_delete(real, "", 1))
 	{
 		char msg[256]="";
 		snprintf(msg, sizeof(msg),
 			"Could not remove interrupted directory: %s", real);
 		log_and_send(asfd, msg);
+		free_w(&real);
 		return -1;
 	}
+	free_w(&real);
 	unlink(sdirs->working);
 	return 0;
 }
@@ -152,6 +152,15 @@ int child(struct async *as,
 		goto end;
 	}
 
+	// Extra streams are part of a backup that is already running, so
+	// do not run the scripts again.
+	if(as->asfd->rbuf->cmd==CMD_GEN
+	  && !strcmp(as->asfd->rbuf->buf, "stream"))
+	{
+		ret=run_action_server(as, incexc, srestore, &timer_ret, cconf);
+		goto end;
+	}
+
 	ret=0;
 
 	// FIX THIS: Make the script components part of a struct, and just
@@ -31,6 +31,29 @@ static char *get_restorepath(struct conf *cconf)
 	return restorepath;
 }
 
+// The phase1 cache token that was saved with the current backup, or "0" if
+// there is not one.
+static char *get_phase1_cache_token(struct conf *cconf)
+{
+	FILE *fp=NULL;
+	char *path=NULL;
+	char buf[128]="0";
+	if(!(path=prepend_s(cconf->directory, cconf->cname))
+	  || astrcat(&path, "/current/phase1cache", __func__))
+	{
+		free_w(&path);
+		return NULL;
+	}
+	if((fp=fopen(path, "rb")))
+	{
+		if(!fgets(buf, sizeof(buf), fp)) snprintf(buf, sizeof(buf), "0");
+		fclose(fp);
+	}
+	free_w(&path);
+	buf[strcspn(buf, "\r\n")]='\0';
+	return strdup_w(buf, __func__);
+}
+
 static int send_features(struct asfd *asfd, struct conf *cconf)
 {
 	int ret=-1;
@@ -46,7 +69,13 @@ static int send_features(struct asfd *asfd, struct conf *cconf)
 		   to restore from */
 	  || append_to_feat(&feat, "orig_client:")
 		/* clients can tell the server what kind of system they are. */
-          || append_to_feat(&feat, "uname:"))
+          || append_to_feat(&feat, "uname:")
+		/* clients can ask for frames longer than 16 bits allow */
+	  || append_to_feat(&feat, "extframes:")
+		/* clients can ask for data frames to be compressed */
+	  || append_to_feat(&feat, "zframes:")
+		/* clients can restore gzip files made of several members */
+	  || append_to_feat(&feat, "gzmembers:"))
 		goto end;
 
 	/* Clients can receive restore initiated from the server. */
@@ -64,6 +93,31 @@ static int send_features(struct asfd *asfd, struct conf *cconf)
 	  && append_to_feat(&feat, "sincexc:"))
 		goto end;
 
+	/* Protocol 1 clients can send runs of entries that have not changed
+	   since the backup with this phase1 cache token. */
+	if(cconf->protocol!=PROTO_BURP2)
+	{
+		char *token=NULL;
+		char msg[160]="";
+		if(!(token=get_phase1_cache_token(cconf)))
+			goto end;
+		snprintf(msg, sizeof(msg), "phase1cache=%s:", token);
+		free_w(&token);
+		if(append_to_feat(&feat, msg))
+			goto end;
+	}
+
+	/* Protocol 1 clients can send new files over this many extra
+	   connections. */
+	if(cconf->max_network_streams>0 && cconf->protocol!=PROTO_BURP2)
+	{
+		char streams[32]="";
+		snprintf(streams, sizeof(streams),
+			"streams=%d:", cconf->max_network_streams);
+		if(append_to_feat(&feat, streams))
+			goto end;
+	}
+
 	/* Clients can be sent cntrs on resume/verify/restore. */
 /* FIX THIS: Disabled until I rewrite a better protocol.
 	if(append_to_feat(&feat, "counters:"))
@@ -215,6 +269,42 @@ static int extra_comms_read(struct async *as,
 			if(!strncasecmp("Windows", uname, strlen("Windows")))
 				cconf->client_is_windows=1;
 		}
+		else if(!strcmp(rbuf->buf, "gzmembers"))
+		{
+			// Client can be sent seekable gzip files as they are.
+			cconf->client_gzip_members=1;
+		}
+		else if(!strcmp(rbuf->buf, "extframes"))
+		{
+			// Client can send and receive extended frames.
+			if(asfd_set_ext_frames(asfd)) goto end;
+			logp("Client is using extended frames.\n");
+		}
+		else if(!strncmp_w(rbuf->buf, "phase1cache=")
+		  && strlen(rbuf->buf)>strlen("phase1cache="))
+		{
+			// Client is building a phase1 cache, and wants
+			// it to be associated with this backup.
+			const char *t=rbuf->buf+strlen("phase1cache=");
+			if(strspn(t, "0123456789abcdef")!=strlen(t)
+			  || strlen(t)>64)
+			{
+				logp("Bad phase1cache token: %s\n", t);
+				goto end;
+			}
+			free_w(&cconf->phase1_cache_new);
+			if(!(cconf->phase1_cache_new=strdup_w(t, __func__)))
+				goto end;
+		}
+		else if(!strncmp_w(rbuf->buf, "zframes="))
+		{
+			// Client wants data frames compressed, going no
+			// higher than the level it gives.
+			int level=atoi(rbuf->buf+strlen("zframes="));
+			if(asfd_set_zframes(asfd, level)) goto end;
+			logp("Client is using compressed frames, up to level %d.\n",
+				asfd->zlevel_max);
+		}
 		else if(!strncmp_w(rbuf->buf, "orig_client=")
 		  && strlen(rbuf->buf)>strlen("orig_client="))
 		{
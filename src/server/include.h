@@ -17,6 +17,7 @@
 #include "list.h"
 #include "main.h"
 #include "manio.h"
+#include "prefork.h"
 #include "quota.h"
 #include "restore.h"
 #include "run_action.h"
@@ -2,6 +2,7 @@
 #include "monitor/status_server.h"
 
 #include <netdb.h>
+#include <sys/mman.h>
 
 // FIX THIS: Should be able to configure multiple addresses and ports.
 #define LISTEN_SOCKETS	32
@@ -21,6 +22,108 @@ enum serret
 	SERVER_ERROR=1
 };
 
+// How often the main process logs how the SSL handshakes went.
+#define HS_STATS_INTERVAL	60
+
+// SSL handshake counts and times, added to by the children and reported on
+// by the main process. It lives in shared memory, and the fields are only
+// changed with atomic operations.
+struct hs_stats
+{
+	volatile int64_t full;
+	volatile int64_t resumed;
+	volatile int64_t failed;
+	volatile int64_t usec;
+	volatile int64_t max_usec;
+};
+
+static struct hs_stats *hs_stats=NULL;
+static time_t hs_stats_logged=0;
+
+static int hs_stats_alloc(void)
+{
+	void *p;
+	if((p=mmap(NULL, sizeof(struct hs_stats), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+	{
+		logp("could not mmap handshake stats: %s\n", strerror(errno));
+		return -1;
+	}
+	hs_stats=(struct hs_stats *)p;
+	memset(hs_stats, 0, sizeof(struct hs_stats));
+	hs_stats_logged=time(NULL);
+	return 0;
+}
+
+static void hs_stats_free(void)
+{
+	if(!hs_stats) return;
+	munmap(hs_stats, sizeof(struct hs_stats));
+	hs_stats=NULL;
+}
+
+static void hs_stats_add(struct timeval *start, SSL *ssl, int ok)
+{
+	int64_t m;
+	int64_t usec;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	usec=(int64_t)(now.tv_sec-start->tv_sec)*1000000LL
+		+now.tv_usec-start->tv_usec;
+	if(ok) logp("SSL handshake took %.1fms\n", usec/1000.0);
+
+	if(!hs_stats) return;
+	if(!ok)
+		__sync_add_and_fetch(&hs_stats->failed, 1);
+	else if(SSL_session_reused(ssl))
+		__sync_add_and_fetch(&hs_stats->resumed, 1);
+	else
+		__sync_add_and_fetch(&hs_stats->full, 1);
+	__sync_add_and_fetch(&hs_stats->usec, usec);
+	while((m=hs_stats->max_usec)<usec)
+		if(__sync_bool_compare_and_swap(&hs_stats->max_usec, m, usec))
+			break;
+}
+
+static int64_t hs_stats_take(volatile int64_t *field)
+{
+	int64_t v=*field;
+	__sync_sub_and_fetch(field, v);
+	return v;
+}
+
+// Lets you see how big the bursts of new connections are, and how much
+// session resumption is saving.
+static void hs_stats_log(void)
+{
+	int64_t n;
+	int64_t m;
+	int64_t full;
+	int64_t resumed;
+	int64_t failed;
+	int64_t usec;
+	time_t now=time(NULL);
+
+	if(!hs_stats || now-hs_stats_logged<HS_STATS_INTERVAL) return;
+
+	full=hs_stats_take(&hs_stats->full);
+	resumed=hs_stats_take(&hs_stats->resumed);
+	failed=hs_stats_take(&hs_stats->failed);
+	usec=hs_stats_take(&hs_stats->usec);
+	do m=hs_stats->max_usec;
+	while(!__sync_bool_compare_and_swap(&hs_stats->max_usec, m, 0));
+
+	if((n=full+resumed+failed))
+		logp("SSL handshakes in the last %ds: %llu full, %llu resumed, %llu failed, average %.1fms, longest %.1fms\n",
+			(int)(now-hs_stats_logged),
+			(unsigned long long)full,
+			(unsigned long long)resumed,
+			(unsigned long long)failed,
+			usec/1000.0/n, m/1000.0);
+	hs_stats_logged=now;
+}
+
 static void huphandler(int sig)
 {
 	hupreload=1;
@@ -172,33 +275,44 @@ int setup_signals(int oldmax_children, int max_children,
 	return 0;
 }
 
+// Reload global config, in case things have changed. This means that the
+// server does not need to be restarted for most conf changes.
+static struct conf *child_conf_load(const char *conffile, int forking)
+{
+	struct conf *conf=NULL;
+	if(!(conf=conf_alloc())) return NULL;
+	conf_init(conf);
+	if(conf_load_global_only(conffile, conf))
+	{
+		conf_free(conf);
+		return NULL;
+	}
+	// Hack to keep forking turned off if it was specified as off on the
+	// command line.
+	if(!forking) conf->forking=0;
+	return conf;
+}
+
+// Frees conf when it is finished.
 static int run_child(int *cfd, SSL_CTX *ctx,
-	int status_wfd, int status_rfd, const char *conffile, int forking)
+	int status_wfd, int status_rfd, struct conf *conf)
 {
 	int ret=-1;
 	int ca_ret=0;
 	SSL *ssl=NULL;
 	BIO *sbio=NULL;
-	struct conf *conf=NULL;
+	struct timeval hs_start;
 	struct conf *cconf=NULL;
 	struct cntr *cntr=NULL;
 	struct async *as=NULL;
 
-	if(!(conf=conf_alloc())
+	if(!conf
 	  || !(cconf=conf_alloc()))
 		goto end;
 
 	set_peer_env_vars(*cfd);
 
-	// Reload global config, in case things have changed. This means that
-	// the server does not need to be restarted for most conf changes.
-	conf_init(conf);
 	conf_init(cconf);
-	if(conf_load_global_only(conffile, conf)) goto end;
-
-	// Hack to keep forking turned off if it was specified as off on the
-	// command line.
-	if(!forking) conf->forking=0;
 
 	if(!(sbio=BIO_new_socket(*cfd, BIO_NOCLOSE))
 	  || !(ssl=SSL_new(ctx)))
@@ -214,11 +328,14 @@ static int run_child(int *cfd, SSL_CTX *ctx,
 	SSL_set_verify(ssl, SSL_VERIFY_PEER
 		/* | SSL_VERIFY_FAIL_IF_NO_PEER_CERT */, 0);
 
+	gettimeofday(&hs_start, NULL);
 	if(SSL_accept(ssl)<=0)
 	{
 		logp_ssl_err("SSL_accept\n");
+		hs_stats_add(&hs_start, ssl, 0);
 		goto end;
 	}
+	hs_stats_add(&hs_start, ssl, 1);
 	if(!(as=async_alloc())
 	  || as->init(as, 0)
 	  || !setup_asfd(as, "main socket",
@@ -269,6 +386,10 @@ static int run_child(int *cfd, SSL_CTX *ctx,
 		goto end;
 	}
 
+	// The client configuration can change the rate limit.
+	if(asfd_set_ratelimit(as->asfd, cconf->ratelimit))
+		goto end;
+
 	if(status_rfd>=0 && !setup_asfd(as, "status server parent socket",
 		&status_rfd, NULL,
 		ASFD_STREAM_STANDARD, ASFD_FD_CHILD_PIPE_READ, -1, cconf))
@@ -324,6 +445,181 @@ static int chld_check_counts(struct conf *conf, struct asfd *asfd)
 	return 0;
 }
 
+// In a newly forked child, let go of everything that belongs to the main
+// process, apart from the fds that the child is going to use.
+static void child_setup(struct async **as, struct conf *conf,
+	int fd1, int fd2, int fd3)
+{
+	int p;
+	struct sigaction sa;
+
+	async_asfd_free_all(as);
+
+	// Close unnecessary file descriptors.
+	// Go up to FD_SETSIZE and hope for the best.
+	// FIX THIS: Now that async_asfd_free_all() is doing
+	// everything, double check whether this is needed.
+	for(p=3; p<(int)FD_SETSIZE; p++)
+	{
+		if(p!=fd1
+		  && p!=fd2
+		  && p!=fd3)
+			close(p);
+	}
+
+	// Set SIGCHLD back to default, so that I
+	// can get sensible returns from waitpid.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler=SIG_DFL;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	conf_free_content(conf);
+	conf_init(conf);
+}
+
+// A prefork worker gets ready everything that does not depend on the client,
+// then waits for the main process to give it a connection. It only serves
+// the one connection, because the child can switch to the user that the
+// client is configured with.
+static int prefork_worker(int sock, SSL_CTX *ctx, const char *conffile)
+{
+	int ret=-1;
+	int cfd=-1;
+	time_t idle=0;
+	time_t mtime=0;
+	time_t started=time(NULL);
+	struct stat statp;
+	struct conf *conf=NULL;
+
+	if(!stat(conffile, &statp)) mtime=statp.st_mtime;
+	// If this fails, it is tried again when there is a client, rather
+	// than the worker exiting and being forked again straight away.
+	conf=child_conf_load(conffile, 1);
+
+	if((cfd=prefork_recv_fd(sock))<0)
+	{
+		// The main process is shrinking the pool, or reloading.
+		ret=0;
+		goto end;
+	}
+	idle=time(NULL)-started;
+
+	// Pick up any changes to the config file since it was loaded.
+	if(!conf
+	  || stat(conffile, &statp)
+	  || statp.st_mtime!=mtime
+	  || mtime>=started)
+	{
+		if(conf) conf_free(conf);
+		if(!(conf=child_conf_load(conffile, 1)))
+			goto end;
+	}
+
+	ret=run_child(&cfd, ctx, sock, -1, conf);
+	conf=NULL;
+	logp("prefork worker was idle for %lds and busy for %lds\n",
+		(long)idle, (long)(time(NULL)-started-idle));
+end:
+	if(conf) conf_free(conf);
+	close_fd(&cfd);
+	return ret;
+}
+
+static int prefork_spawn(struct async *mainas, SSL_CTX *ctx,
+	const char *conffile, struct conf *conf)
+{
+	int sv[2];
+	pid_t childpid;
+
+	// The main process passes the connection over this, and the worker
+	// then uses it like the pipe that other children send status on.
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)<0)
+	{
+		logp("socketpair failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	switch((childpid=fork()))
+	{
+		case -1:
+			logp("fork failed: %s\n", strerror(errno));
+			close(sv[0]);
+			close(sv[1]);
+			return -1;
+		case 0:
+			// Child.
+			child_setup(&mainas, conf, sv[1], -1, -1);
+			exit(prefork_worker(sv[1], ctx, conffile));
+		default:
+			// Parent.
+			close(sv[1]);
+			if(!setup_asfd(mainas, "prefork worker",
+				&sv[0], NULL,
+				ASFD_STREAM_STANDARD,
+				ASFD_FD_SERVER_WORKER,
+				childpid,
+				conf)) return -1;
+			return 0;
+	}
+}
+
+// Keep prefork_workers idle workers ready for new connections. As they are
+// used up, more are forked to replace them. When there are too many, which
+// can happen after a reload, closing the socket makes the worker exit.
+static int prefork_top_up(struct async *mainas, SSL_CTX *ctx,
+	const char *conffile, struct conf *conf)
+{
+	int idle=0;
+	int want=0;
+	struct asfd *a;
+	struct asfd *next;
+
+	if(conf->forking && !gentleshutdown)
+		want=conf->prefork_workers;
+
+	for(a=mainas->asfd; a; a=next)
+	{
+		next=a->next;
+		if(a->fdtype!=ASFD_FD_SERVER_WORKER) continue;
+		if(idle<want)
+		{
+			idle++;
+			continue;
+		}
+		mainas->asfd_remove(mainas, a);
+		asfd_free(&a);
+	}
+	for(; idle<want; idle++)
+		if(prefork_spawn(mainas, ctx, conffile, conf))
+			return -1;
+	return 0;
+}
+
+// Give the connection to an idle prefork worker, if there is one. Returns 0
+// if it was given away.
+static int prefork_pass(struct async *mainas, int *cfd)
+{
+	struct asfd *a;
+	for(a=mainas->asfd; a; a=a->next)
+	{
+		if(a->fdtype!=ASFD_FD_SERVER_WORKER) continue;
+		if(prefork_send_fd(a->fd, *cfd))
+		{
+			// It has probably gone away. Fork a child for this
+			// connection instead.
+			mainas->asfd_remove(mainas, a);
+			asfd_free(&a);
+			return -1;
+		}
+		// From now on, it is treated like any other child.
+		a->fdtype=ASFD_FD_SERVER_PIPE_READ;
+		logp("passed connection to prefork worker: %d\n", a->pid);
+		close_fd(cfd);
+		return 0;
+	}
+	return -1;
+}
+
 static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 	const char *conffile, struct conf *conf)
 {
@@ -348,7 +644,8 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 	reuseaddr(cfd);
 
 	if(!conf->forking)
-		return run_child(&cfd, ctx, -1, -1, conffile, conf->forking);
+		return run_child(&cfd, ctx, -1, -1,
+			child_conf_load(conffile, conf->forking));
 
 	if(chld_check_counts(conf, asfd))
 	{
@@ -357,6 +654,10 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 		return 0;
 	}
 
+	if(fdtype==ASFD_FD_SERVER_LISTEN_MAIN
+	  && !prefork_pass(asfd->as, &cfd))
+		return 0;
+
 	if(pipe(pipe_rfd)<0 || pipe(pipe_wfd)<0)
 	{
 		logp("pipe failed: %s", strerror(errno));
@@ -371,40 +672,17 @@ static int process_incoming_client(struct asfd *asfd, SSL_CTX *ctx,
 			return -1;
 		case 0:
 		{
-			int p;
 			int ret;
 			// Child.
-			struct sigaction sa;
-
-			async_asfd_free_all(&asfd->as);
-
-			// Close unnecessary file descriptors.
-			// Go up to FD_SETSIZE and hope for the best.
-			// FIX THIS: Now that async_asfd_free_all() is doing
-			// everything, double check whether this is needed.
-			for(p=3; p<(int)FD_SETSIZE; p++)
-			{
-				if(p!=pipe_rfd[1]
-				  && p!=pipe_wfd[0]
-				  && p!=cfd)
-					close(p);
-			}
-
-			// Set SIGCHLD back to default, so that I
-			// can get sensible returns from waitpid.
-			memset(&sa, 0, sizeof(sa));
-			sa.sa_handler=SIG_DFL;
-			sigaction(SIGCHLD, &sa, NULL);
+			child_setup(&asfd->as, conf,
+				pipe_rfd[1], pipe_wfd[0], cfd);
 
 			close(pipe_rfd[0]); // close read end
 			close(pipe_wfd[1]); // close write end
 
-			conf_free_content(conf);
-			conf_init(conf);
-
 			ret=run_child(&cfd, ctx, pipe_rfd[1],
 			  fdtype==ASFD_FD_SERVER_LISTEN_STATUS?pipe_wfd[0]:-1,
-			  conffile, conf->forking);
+			  child_conf_load(conffile, conf->forking));
 
 			close(pipe_rfd[1]);
 			close(pipe_wfd[0]);
@@ -587,6 +865,11 @@ static int run_server(struct conf *conf, const char *conffile,
 		logp("error loading dh params\n");
 		goto end;
 	}
+	ssl_server_sessions(ctx, conf);
+
+	// Children share this, so it needs to exist before they are forked.
+	if(tbucket_global_set(conf->global_ratelimit))
+		goto end;
 
 	if(ports_changed(oldnet->address, conf->address)
 	  || ports_changed(oldnet->port, conf->port))
@@ -698,6 +981,11 @@ static int run_server(struct conf *conf, const char *conffile,
 			sigchld=0;
 		}
 
+		hs_stats_log();
+
+		if(prefork_top_up(mainas, ctx, conffile, conf))
+			goto end;
+
 		// Leave if we had a SIGUSR1 and there are no children running.
 		if(gentleshutdown)
 		{
@@ -757,6 +1045,8 @@ int server(struct conf *conf, const char *conffile,
 	}
 
 	ssl_load_globals();
+	if(hs_stats_alloc())
+		goto error;
 
 	while(!gentleshutdown)
 	{
@@ -784,6 +1074,7 @@ error:
 	close_fds(rfds);
 	close_fds(sfds);
 	oldnet_free_contents(&oldnet);
+	hs_stats_free();
 
 // FIX THIS: Have an enum for a return value, so that it is more obvious what
 // is happening, like client.c does.
@@ -0,0 +1,83 @@
+#include "include.h"
+
+#include <sys/socket.h>
+
+// Accepted client connections are passed from the main server process to
+// idle prefork workers over a unix socket, along with a single byte of data.
+
+union fd_control
+{
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+};
+
+int prefork_send_fd(int sock, int fd)
+{
+	char c=0;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union fd_control control;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base=&c;
+	iov.iov_len=1;
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=control.buf;
+	msg.msg_controllen=sizeof(control.buf);
+	cmsg=CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level=SOL_SOCKET;
+	cmsg->cmsg_type=SCM_RIGHTS;
+	cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	while(sendmsg(sock, &msg, 0)<0)
+	{
+		if(errno==EINTR) continue;
+		logp("could not pass connection to prefork worker: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Returns the fd, or -1 if the main process closed the socket instead.
+int prefork_recv_fd(int sock)
+{
+	int fd=-1;
+	char c=0;
+	ssize_t r;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	union fd_control control;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base=&c;
+	iov.iov_len=1;
+	msg.msg_iov=&iov;
+	msg.msg_iovlen=1;
+	msg.msg_control=control.buf;
+	msg.msg_controllen=sizeof(control.buf);
+
+	while((r=recvmsg(sock, &msg, 0))<0)
+	{
+		if(errno==EINTR) continue;
+		logp("prefork worker could not get connection: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	if(!r) return -1;
+	if(!(cmsg=CMSG_FIRSTHDR(&msg))
+	  || cmsg->cmsg_level!=SOL_SOCKET
+	  || cmsg->cmsg_type!=SCM_RIGHTS
+	  || cmsg->cmsg_len!=CMSG_LEN(sizeof(int)))
+	{
+		logp("prefork worker got a message without a connection\n");
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
@@ -0,0 +1,7 @@
+#ifndef _PREFORK_SERVER_H
+#define _PREFORK_SERVER_H
+
+extern int prefork_send_fd(int sock, int fd);
+extern int prefork_recv_fd(int sock);
+
+#endif
@@ -1,6 +1,7 @@
 #include "include.h"
 #include "../cmd.h"
 #include "burp1/rubble.h"
+#include "burp1/streams.h"
 #include "burp2/restore.h"
 #include "burp2/rubble.h"
 
@@ -342,6 +343,11 @@ int run_action_server_do(struct async *as, struct sdirs *sdirs,
 	if(!strncmp_w(rbuf->buf, "diff "))
 		return run_diff(as->asfd, sdirs, cconf);
 
+	// Extra streams belong to a backup that already has the lock, so
+	// run_stream_server() checks that it is held instead of taking it.
+	if(!strcmp(rbuf->buf, "stream"))
+		return run_stream_server(as->asfd, sdirs, cconf);
+
 	// -1 on error or 1 if the backup is still finalising.
 	if((ret=get_lock_sdirs(as->asfd, sdirs))<0)
 	{
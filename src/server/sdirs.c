@@ -127,7 +127,8 @@ static int do_burp1_dirs(struct sdirs *sdirs, struct conf *conf)
 	  || !(sdirs->datadirtmp=prepend_s(sdirs->working, "data.tmp"))
 	  || !(sdirs->cmanifest=prepend_s(sdirs->current, "manifest.gz"))
 	  || !(sdirs->cincexc=prepend_s(sdirs->current, "incexc"))
-	  || !(sdirs->deltmppath=prepend_s(sdirs->working, "deltmppath")))
+	  || !(sdirs->deltmppath=prepend_s(sdirs->working, "deltmppath"))
+	  || !(sdirs->streams=prepend_s(sdirs->working, "streams")))
 		return -1;
 	// sdirs->rworking gets set later.
 	// sdirs->treepath gets set later.
@@ -149,6 +150,7 @@ static int do_burp2_dirs(struct sdirs *sdirs, struct conf *conf)
 	  || !(sdirs->champlock=prepend_s(sdirs->data, "cc.lock"))
 	  || !(sdirs->champsock=prepend_s(sdirs->data, "cc.sock"))
 	  || !(sdirs->champlog=prepend_s(sdirs->data, "cc.log"))
+	  || !(sdirs->restoretmp=prepend_s(sdirs->client, "restoretmp"))
 	  || !(sdirs->manifest=prepend_s(sdirs->working, "manifest"))
 	  || !(sdirs->cmanifest=prepend_s(sdirs->current, "manifest")))
 		return -1;
@@ -201,6 +203,7 @@ void sdirs_free_content(struct sdirs *sdirs)
         free_w(&sdirs->current);
         free_w(&sdirs->currenttmp);
         free_w(&sdirs->deleteme);
+	free_w(&sdirs->restoretmp);
 
         free_w(&sdirs->timestamp);
         free_w(&sdirs->changed);
@@ -219,6 +222,7 @@ void sdirs_free_content(struct sdirs *sdirs)
 	free_w(&sdirs->cincexc);
 	free_w(&sdirs->deltmppath);
 	free_w(&sdirs->treepath);
+	free_w(&sdirs->streams);
 }
 
 void sdirs_free(struct sdirs **sdirs)
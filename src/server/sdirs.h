@@ -22,6 +22,7 @@ struct sdirs
 	char *current; // Symlink
 	char *currenttmp; // Temporary symlink
 	char *deleteme;
+	char *restoretmp; // Scratch space for restores.
 
 	char *timestamp;
 	char *changed;
@@ -40,6 +41,7 @@ struct sdirs
 	char *cincexc;
 	char *deltmppath;
 	char *treepath;
+	char *streams; // Spool for files sent over extra streams.
 };
 
 extern struct sdirs *sdirs_alloc(void);
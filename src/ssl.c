@@ -80,6 +80,26 @@ static int ssl_load_keys_and_certs(SSL_CTX *ctx, struct conf *conf)
 	return 0;
 }
 
+static int s_server_session_id_context=1;
+
+// Make the key exchange use elliptic curve Diffie-Hellman where both ends can
+// do it, which is a lot cheaper for the server than the classic kind when
+// many clients connect at once. Newer openssl does this by itself.
+static void ssl_set_ecdh(SSL_CTX *ctx)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#if defined(SSL_CTX_set_ecdh_auto)
+	SSL_CTX_set_ecdh_auto(ctx, 1);
+#elif !defined(OPENSSL_NO_ECDH)
+	EC_KEY *ecdh;
+	if(!(ecdh=EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)))
+		return;
+	SSL_CTX_set_tmp_ecdh(ctx, ecdh);
+	EC_KEY_free(ecdh);
+#endif
+#endif
+}
+
 SSL_CTX *ssl_initialise_ctx(struct conf *conf)
 {
 	SSL_CTX *ctx=NULL;
@@ -91,6 +111,12 @@ SSL_CTX *ssl_initialise_ctx(struct conf *conf)
 
 	if(ssl_load_keys_and_certs(ctx, conf)) return NULL;
 
+	// Needed for sessions to be resumed when the peer is verified.
+	SSL_CTX_set_session_id_context(ctx,
+		(const uint8_t *)&s_server_session_id_context,
+		sizeof(s_server_session_id_context));
+	ssl_set_ecdh(ctx);
+
 	if(conf->ssl_ciphers)
 		SSL_CTX_set_cipher_list(ctx, conf->ssl_ciphers);
 
@@ -100,11 +126,105 @@ SSL_CTX *ssl_initialise_ctx(struct conf *conf)
 		SSL_CTX_set_options(ctx, SSL_OP_NO_COMPRESSION);
 	// Default is zlib5, which needs no option set.
 
-	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3
+		|SSL_OP_CIPHER_SERVER_PREFERENCE
+		|SSL_OP_SINGLE_DH_USE|SSL_OP_SINGLE_ECDH_USE);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	// Let the kernel do the encryption, if it can. Openssl falls back
+	// to doing it itself if not.
+	if(conf->ssl_ktls)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
 
 	return ctx;
 }
 
+// Sessions are resumed with tickets, which the server encrypts with keys that
+// are made when its context is created. The children are forked from the
+// process that made the context, so they all share the keys, and a client
+// can resume with any of them. Nothing needs to be cached on the server side.
+void ssl_server_sessions(SSL_CTX *ctx, struct conf *conf)
+{
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	if(conf->ssl_session_timeout<=0)
+	{
+		SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		return;
+	}
+	SSL_CTX_set_timeout(ctx, conf->ssl_session_timeout);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	// The client only keeps the latest one.
+	SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+}
+
+static const char *session_file=NULL;
+
+// Called when the server gives the client a session. It is written out so
+// that the next connection, which will be from a different process, can
+// resume it.
+static int new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	int fd=-1;
+	FILE *fp=NULL;
+	char *tmp=NULL;
+	char suffix[32]="";
+
+	// Extra streams can be getting sessions at the same time.
+	snprintf(suffix, sizeof(suffix), ".%d", (int)getpid());
+	if(!(tmp=prepend(session_file, suffix, strlen(suffix), "")))
+		return 0;
+	// The session holds secrets, so keep it private.
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600))<0
+	  || !(fp=fdopen(fd, "w")))
+	{
+		logp("Could not open %s: %s\n", tmp, strerror(errno));
+		if(fd>=0) close(fd);
+		goto end;
+	}
+	if(!PEM_write_SSL_SESSION(fp, sess))
+	{
+		logp_ssl_err("Could not write SSL session to %s\n", tmp);
+		close_fp(&fp);
+		unlink(tmp);
+		goto end;
+	}
+	if(close_fp(&fp) || do_rename(tmp, session_file))
+		unlink(tmp);
+end:
+	free_w(&tmp);
+	// We did not keep a reference to the session.
+	return 0;
+}
+
+// Try to resume the session from the last connection, and save the new one
+// when the server gives it.
+void ssl_client_sessions(SSL_CTX *ctx, SSL *ssl, struct conf *conf)
+{
+	FILE *fp;
+	struct stat statp;
+	SSL_SESSION *sess;
+
+	// Without a certificate, this connection is going to ask the server
+	// to sign one, and the session would not have it in.
+	if(!conf->ssl_session_file
+	  || !conf->ssl_cert || lstat(conf->ssl_cert, &statp))
+		return;
+
+	session_file=conf->ssl_session_file;
+	SSL_CTX_set_session_cache_mode(ctx,
+		SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
+	if(!(fp=fopen(session_file, "r"))) return;
+	sess=PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if(!sess) return;
+	SSL_set_session(ssl, sess);
+	SSL_SESSION_free(sess);
+}
+
 void ssl_destroy_ctx(SSL_CTX *ctx)
 {
 	SSL_CTX_free(ctx);
@@ -218,6 +338,12 @@ int ssl_check_cert(SSL *ssl, struct conf *conf)
 	SSL_CIPHER_description(SSL_get_current_cipher(ssl),
 		tmpbuf, sizeof(tmpbuf));
 	logp("SSL is using cipher: %s\n", tmpbuf);
+	if(SSL_session_reused(ssl))
+		logp("SSL session was resumed\n");
+#ifdef SSL_OP_ENABLE_KTLS
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+		logp("SSL is using kernel TLS for sending\n");
+#endif
 	if(!(peer=SSL_get_peer_certificate(ssl)))
 	{
 		logp("Could not get peer certificate.\n");
@@ -9,5 +9,7 @@ extern void ssl_destroy_ctx(SSL_CTX *ctx);
 extern int ssl_load_dh_params(SSL_CTX *ctx, struct conf *conf);
 extern void ssl_load_globals(void);
 extern int ssl_check_cert(SSL *ssl, struct conf *conf);
+extern void ssl_server_sessions(SSL_CTX *ctx, struct conf *conf);
+extern void ssl_client_sessions(SSL_CTX *ctx, SSL *ssl, struct conf *conf);
 
 #endif
@@ -0,0 +1,143 @@
+#include "include.h"
+
+#ifndef HAVE_WIN32
+#include <sys/mman.h>
+#endif
+
+// Hold up to a tenth of a second worth of tokens, but always enough for a
+// few network writes.
+#define TBUCKET_BURST_DIV	10
+#define TBUCKET_BURST_MIN	65536
+// After this long without adding tokens, just fill the bucket back up.
+#define TBUCKET_IDLE_USEC	10000000LL
+
+struct tbucket *tbucket_global=NULL;
+
+static int64_t now_usec(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec*1000000LL+tv.tv_usec;
+}
+
+void tbucket_set_rate(struct tbucket *tb, float rate)
+{
+	int64_t burst=(int64_t)rate/TBUCKET_BURST_DIV;
+	if(burst<TBUCKET_BURST_MIN) burst=TBUCKET_BURST_MIN;
+	tb->burst=burst;
+	tb->rate=(int64_t)rate;
+	if(!tb->last)
+	{
+		tb->tokens=burst;
+		tb->last=now_usec();
+	}
+}
+
+struct tbucket *tbucket_alloc(float rate)
+{
+	struct tbucket *tb;
+	if(!(tb=(struct tbucket *)
+		calloc_w(1, sizeof(struct tbucket), __func__)))
+			return NULL;
+	tbucket_set_rate(tb, rate);
+	return tb;
+}
+
+void tbucket_free(struct tbucket **tb)
+{
+	if(!tb || !*tb) return;
+#ifndef HAVE_WIN32
+	if((*tb)->shared)
+	{
+		munmap(*tb, sizeof(struct tbucket));
+		*tb=NULL;
+		return;
+	}
+#endif
+	free_v((void **)tb);
+}
+
+// Add the tokens for the time since they were last added. When several
+// processes share the bucket, only the one that moves 'last' on gets to add
+// them. 'last' only moves on by the time that the whole tokens took, so
+// that calling this often does not lose the fractions.
+static void tbucket_refill(struct tbucket *tb)
+{
+	int64_t t;
+	int64_t add;
+	int64_t rate=tb->rate;
+	int64_t last=tb->last;
+	int64_t now=now_usec();
+	int64_t elapsed=now-last;
+
+	if(rate<=0) return;
+	if(elapsed<0 || elapsed>=TBUCKET_IDLE_USEC)
+	{
+		// Idle for a long time, or the clock went back in time.
+		if(__sync_bool_compare_and_swap(&tb->last, last, now))
+			tb->tokens=tb->burst;
+		return;
+	}
+	if((add=elapsed*rate/1000000)<=0) return;
+	if(!__sync_bool_compare_and_swap(&tb->last,
+		last, last+add*1000000/rate))
+			return;
+	__sync_add_and_fetch(&tb->tokens, add);
+	while((t=tb->tokens)>tb->burst)
+		if(__sync_bool_compare_and_swap(&tb->tokens, t, tb->burst))
+			break;
+}
+
+// How many bytes can be sent now. Can be zero or less.
+int64_t tbucket_tokens(struct tbucket *tb)
+{
+	if(tb->rate<=0) return tb->burst;
+	tbucket_refill(tb);
+	return tb->tokens;
+}
+
+// Returns 0 if sending is allowed now, otherwise how many microseconds until
+// it will be.
+long tbucket_wait(struct tbucket *tb)
+{
+	int64_t t;
+	if((t=tbucket_tokens(tb))>0) return 0;
+	return (long)((1-t)*1000000/tb->rate)+1;
+}
+
+void tbucket_take(struct tbucket *tb, size_t bytes)
+{
+	if(tb->rate<=0) return;
+	__sync_sub_and_fetch(&tb->tokens, (int64_t)bytes);
+}
+
+// Called by the main server process, before it forks any children, and again
+// after the configuration is reloaded. Children that are already running
+// pick up a new rate straight away. Also called by a client before it forks
+// its extra network streams.
+int tbucket_global_set(float rate)
+{
+#ifdef HAVE_WIN32
+	return 0;
+#else
+	void *p;
+	if(tbucket_global)
+	{
+		tbucket_set_rate(tbucket_global, rate);
+		return 0;
+	}
+	if(rate<=0) return 0;
+	if((p=mmap(NULL, sizeof(struct tbucket), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+	{
+		logp("could not mmap global rate limit: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	tbucket_global=(struct tbucket *)p;
+	memset(tbucket_global, 0, sizeof(struct tbucket));
+	tbucket_global->shared=1;
+	tbucket_set_rate(tbucket_global, rate);
+	return 0;
+#endif
+}
@@ -0,0 +1,33 @@
+#ifndef _TBUCKET_H
+#define _TBUCKET_H
+
+// Token bucket for rate limiting. Tokens are bytes, and they are added at
+// rate bytes per second, up to burst. Sending takes tokens, and is allowed
+// to go into debt, so that a write never has to be split up. The next write
+// then waits until the debt is paid off.
+// The fields are only changed with atomic operations, so that a bucket in
+// shared memory can be used by several processes at once.
+struct tbucket
+{
+	volatile int64_t rate;
+	volatile int64_t burst;
+	volatile int64_t tokens;
+	volatile int64_t last; // When tokens were last added, in microseconds.
+	uint8_t shared;
+};
+
+// A bucket shared by all the children of the server, or by all the
+// connections of a client backup, so that they can be held to a total rate
+// between them.
+extern struct tbucket *tbucket_global;
+
+extern struct tbucket *tbucket_alloc(float rate);
+extern void tbucket_free(struct tbucket **tb);
+extern void tbucket_set_rate(struct tbucket *tb, float rate);
+extern int64_t tbucket_tokens(struct tbucket *tb);
+extern long tbucket_wait(struct tbucket *tb);
+extern void tbucket_take(struct tbucket *tb, size_t bytes);
+
+extern int tbucket_global_set(float rate);
+
+#endif
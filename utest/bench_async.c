@@ -0,0 +1,169 @@
+// Time one call of as->read_write() with lots of asfds, some of which have
+// data waiting, for both the epoll and the select backends.
+// Only src/async.c is linked in, so the few things it needs from the rest of
+// burp are provided here.
+
+#include "../src/include.h"
+
+#include <sys/socket.h>
+
+#define DEFAULT_FDS	400
+#define DEFAULT_READY	8
+#define ITERATIONS	20000
+
+void logp(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+void *calloc_w(size_t nmem, size_t size, const char *func)
+{
+	return calloc(nmem, size);
+}
+
+void free_v(void **ptr)
+{
+	free(*ptr);
+	*ptr=NULL;
+}
+
+void close_fd(int *fd)
+{
+	if(*fd<0) return;
+	close(*fd);
+	*fd=-1;
+}
+
+void add_fd_to_sets(int fd, fd_set *read_set, fd_set *write_set,
+	fd_set *err_set, int *max_fd)
+{
+	if(read_set) FD_SET((unsigned int) fd, read_set);
+	if(write_set) FD_SET((unsigned int) fd, write_set);
+	if(err_set) FD_SET((unsigned int) fd, err_set);
+	if(fd > *max_fd) *max_fd = fd;
+}
+
+void asfd_free(struct asfd **asfd)
+{
+	free(*asfd);
+	*asfd=NULL;
+}
+
+// Nothing here is rate limited.
+long asfd_write_wait(struct asfd *asfd)
+{
+	return 0;
+}
+
+static int bench_parse_readbuf(struct asfd *asfd)
+{
+	return 0;
+}
+
+static int bench_do_read(struct asfd *asfd)
+{
+	char buf[64];
+	return read(asfd->fd, buf, sizeof(buf))<=0;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+static double run(struct async *as, int *peers, int nfds, int nready)
+{
+	int i;
+	int r;
+	double start;
+	double total=0;
+
+	for(i=0; i<ITERATIONS; i++)
+	{
+		for(r=0; r<nready; r++)
+			if(write(peers[random()%nfds], "x", 1)!=1)
+				return -1;
+		start=now();
+		if(as->read_write(as)) return -1;
+		total+=now()-start;
+		// Make sure nothing is left over for the next iteration.
+		while(as->read_quick(as)==0)
+		{
+			struct asfd *asfd;
+			for(asfd=as->asfd; asfd; asfd=asfd->next)
+				if(asfd->can_read) break;
+			if(!asfd) break;
+		}
+	}
+	return total/ITERATIONS;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int sv[2];
+	int maxfd=0;
+	int *peers;
+	double t;
+	struct asfd *asfd;
+	struct async *as;
+	int nfds=argc>1?atoi(argv[1]):DEFAULT_FDS;
+	int nready=argc>2?atoi(argv[2]):DEFAULT_READY;
+
+	if(!(peers=(int *)calloc(nfds, sizeof(int)))
+	  || !(as=async_alloc())
+	  || as->init(as, 0))
+		return 1;
+	as->settimers(as, 1, 0);
+
+	for(i=0; i<nfds; i++)
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		{
+			fprintf(stderr, "socketpair: %s\n", strerror(errno));
+			return 1;
+		}
+		if(!(asfd=(struct asfd *)calloc(1, sizeof(struct asfd)))
+		  || !(asfd->rbuf=(struct iobuf *)calloc(1,
+			sizeof(struct iobuf))))
+				return 1;
+		asfd->fd=sv[0];
+		asfd->as=as;
+		asfd->parse_readbuf=bench_parse_readbuf;
+		asfd->do_read=bench_do_read;
+		as->asfd_add(as, asfd);
+		peers[i]=sv[1];
+		if(sv[1]>maxfd) maxfd=sv[1];
+	}
+
+	printf("%d asfds, %d with data each time, %d iterations\n",
+		nfds, nready, ITERATIONS);
+
+	if(as->epfd>=0)
+	{
+		if((t=run(as, peers, nfds, nready))<0) return 1;
+		printf("epoll:  %8.2f microseconds per call\n", t*1000000);
+		// Switch this async over to select().
+		close_fd(&as->epfd);
+		for(asfd=as->asfd; asfd; asfd=asfd->next)
+			asfd->epoll_added=0;
+	}
+	else
+		printf("epoll:  not available\n");
+
+	if(maxfd<FD_SETSIZE)
+	{
+		if((t=run(as, peers, nfds, nready))<0) return 1;
+		printf("select: %8.2f microseconds per call\n", t*1000000);
+	}
+	else
+		printf("select: cannot handle fd %d (FD_SETSIZE is %d)\n",
+			maxfd, FD_SETSIZE);
+
+	return 0;
+}
@@ -0,0 +1,250 @@
+// linktable.c is included whole, so that the tests can pick inodes that hash
+// to the slots that they want. The few things that it needs from the rest of
+// burp are provided here.
+#include <check.h>
+#include <stdlib.h>
+#include "../src/client/linktable.c"
+
+void *calloc_w(size_t nmem, size_t size, const char *func)
+{
+	return calloc(nmem, size);
+}
+
+char *strdup_w(const char *s, const char *func)
+{
+	return strdup(s);
+}
+
+void free_v(void **ptr)
+{
+	free(*ptr);
+	*ptr=NULL;
+}
+
+void free_w(char **str)
+{
+	free_v((void **)str);
+}
+
+#define DEV	7
+
+// Finds the next inode after *ino that wants to go in slot.
+static ino_t ino_for_slot(struct linktable *lt, size_t slot, ino_t *ino)
+{
+	while(link_hash(lt, DEV, ++(*ino))!=slot) { }
+	return *ino;
+}
+
+static void add(struct linktable *lt, ino_t ino, nlink_t nlink)
+{
+	char name[32];
+	struct stat statp;
+	memset(&statp, 0, sizeof(statp));
+	statp.st_dev=DEV;
+	statp.st_ino=ino;
+	statp.st_nlink=nlink;
+	snprintf(name, sizeof(name), "%lu", (unsigned long)ino);
+	ck_assert_int_eq(linktable_add(lt, &statp, name), 0);
+}
+
+static struct link_ent *find(struct linktable *lt, ino_t ino)
+{
+	struct stat statp;
+	memset(&statp, 0, sizeof(statp));
+	statp.st_dev=DEV;
+	statp.st_ino=ino;
+	return linktable_find(lt, &statp);
+}
+
+static void assert_found(struct linktable *lt, ino_t ino)
+{
+	char name[32];
+	struct link_ent *ent;
+	snprintf(name, sizeof(name), "%lu", (unsigned long)ino);
+	ck_assert_msg((ent=find(lt, ino))!=NULL, "%s not found", name);
+	ck_assert_str_eq(ent->name, name);
+}
+
+static void seen(struct linktable *lt, ino_t ino)
+{
+	struct link_ent *ent;
+	ck_assert((ent=find(lt, ino))!=NULL);
+	linktable_seen(lt, ent);
+}
+
+START_TEST(test_linktable_add_find)
+{
+	ino_t i;
+	struct linktable *lt;
+
+	ck_assert((lt=linktable_alloc())!=NULL);
+	for(i=1; i<=100; i++) add(lt, i, 2);
+	ck_assert_int_eq(lt->count, 100);
+	for(i=1; i<=100; i++) assert_found(lt, i);
+	ck_assert(find(lt, 101)==NULL);
+	linktable_free(&lt);
+	ck_assert(lt==NULL);
+}
+END_TEST
+
+START_TEST(test_linktable_seen)
+{
+	struct linktable *lt;
+
+	ck_assert((lt=linktable_alloc())!=NULL);
+	// Two more links to come.
+	add(lt, 1, 3);
+	seen(lt, 1);
+	assert_found(lt, 1);
+	seen(lt, 1);
+	ck_assert(find(lt, 1)==NULL);
+	ck_assert_int_eq(lt->count, 0);
+	ck_assert_int_eq(lt->peak, 1);
+	linktable_free(&lt);
+}
+END_TEST
+
+// Five entries that all want the same slot end up in a run. Taking one out
+// of the middle has to move the later ones back, or they would not be found
+// past the gap.
+START_TEST(test_linktable_collisions)
+{
+	int i;
+	ino_t ino=0;
+	ino_t inos[5];
+	size_t home=100;
+	struct linktable *lt;
+
+	ck_assert((lt=linktable_alloc())!=NULL);
+	for(i=0; i<5; i++)
+	{
+		inos[i]=ino_for_slot(lt, home, &ino);
+		add(lt, inos[i], 2);
+	}
+	for(i=0; i<5; i++)
+	{
+		assert_found(lt, inos[i]);
+		ck_assert_int_eq(find(lt, inos[i])-lt->ent, home+i);
+	}
+
+	seen(lt, inos[2]);
+	ck_assert(find(lt, inos[2])==NULL);
+	ck_assert_int_eq(lt->count, 4);
+	for(i=0; i<5; i++) if(i!=2) assert_found(lt, inos[i]);
+	for(i=0; i<4; i++) ck_assert(lt->ent[home+i].name!=NULL);
+	ck_assert(lt->ent[home+4].name==NULL);
+
+	// The start of the run.
+	seen(lt, inos[0]);
+	for(i=1; i<5; i++) if(i!=2) assert_found(lt, inos[i]);
+	ck_assert(lt->ent[home+3].name==NULL);
+	linktable_free(&lt);
+}
+END_TEST
+
+// A run that starts in the last slot carries on from the first one, and an
+// entry that wants the first slot goes after it. Deleting has to move both
+// kinds back, across the end of the table.
+START_TEST(test_linktable_wraparound)
+{
+	int i;
+	ino_t ino=0;
+	ino_t inos[4];
+	ino_t zero;
+	size_t last;
+	struct linktable *lt;
+
+	ck_assert((lt=linktable_alloc())!=NULL);
+	last=lt->size-1;
+	for(i=0; i<4; i++)
+	{
+		inos[i]=ino_for_slot(lt, last, &ino);
+		add(lt, inos[i], 2);
+	}
+	ino=0;
+	zero=ino_for_slot(lt, 0, &ino);
+	add(lt, zero, 2);
+
+	ck_assert_int_eq(find(lt, inos[0])-lt->ent, last);
+	for(i=1; i<4; i++)
+		ck_assert_int_eq(find(lt, inos[i])-lt->ent, i-1);
+	ck_assert_int_eq(find(lt, zero)-lt->ent, 3);
+
+	seen(lt, inos[0]);
+	for(i=1; i<4; i++) assert_found(lt, inos[i]);
+	assert_found(lt, zero);
+	ck_assert_int_eq(find(lt, inos[1])-lt->ent, last);
+	ck_assert_int_eq(find(lt, zero)-lt->ent, 2);
+	ck_assert(lt->ent[3].name==NULL);
+
+	// Now the one that wants slot zero is in it.
+	seen(lt, inos[2]);
+	seen(lt, inos[3]);
+	ck_assert_int_eq(find(lt, zero)-lt->ent, 0);
+	assert_found(lt, inos[1]);
+	ck_assert_int_eq(lt->count, 2);
+	linktable_free(&lt);
+}
+END_TEST
+
+// Going over three quarters full doubles the table, and everything has to
+// be found in its new place.
+START_TEST(test_linktable_grow)
+{
+	ino_t i;
+	size_t size;
+	struct linktable *lt;
+
+	ck_assert((lt=linktable_alloc())!=NULL);
+	size=lt->size;
+	for(i=1; i<=size; i++) add(lt, i, 2);
+	ck_assert_int_eq(lt->size, size*2);
+	ck_assert_int_eq(lt->count, size);
+	ck_assert_int_eq(lt->peak, size);
+	for(i=1; i<=size; i++) assert_found(lt, i);
+
+	for(i=1; i<=size; i+=2) seen(lt, i);
+	ck_assert_int_eq(lt->count, size/2);
+	ck_assert_int_eq(lt->peak, size);
+	for(i=1; i<=size; i++)
+	{
+		if(i%2) ck_assert(find(lt, i)==NULL);
+		else assert_found(lt, i);
+	}
+	linktable_free(&lt);
+}
+END_TEST
+
+Suite *linktable_suite(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("linktable");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_linktable_add_find);
+	tcase_add_test(tc_core, test_linktable_seen);
+	tcase_add_test(tc_core, test_linktable_collisions);
+	tcase_add_test(tc_core, test_linktable_wraparound);
+	tcase_add_test(tc_core, test_linktable_grow);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
+
+int main(void)
+{
+	int number_failed;
+	Suite *s;
+	SRunner *sr;
+
+	s=linktable_suite();
+	sr=srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return number_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}